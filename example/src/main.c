@@ -1,25 +1,23 @@
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "pico/time.h"
+#include "hardware/watchdog.h"
 
+#include "pico_wifi_boot/boot_slots.h"
 #include "pico_wifi_boot/ota_server.h"
 #include "pico_wifi_boot/wifi_manager.h"
 
+// How long a newly flashed program keeps the bootloader's watchdog fed while it connects. If it is not
+// reachable by then, the watchdog resets it and the bootloader falls back to the previous program
+#define CONFIRM_DEADLINE_MS 60000
+
 bool wifi_init() {
     if (cyw43_arch_init() != 0) {
         printf("cyw43 init failed\n");
         return false;
     }
 
-    if (!wifi_manager_init(/*enable_powersave=*/ true)) {
-        return false;
-    }
-
-    if (!wifi_manager_connect(/*attempts=*/ 1)) {
-        return false;
-    }
-
-    return true;
+    return wifi_manager_init(/*enable_powersave=*/ true);
 }
 
 void blink_poll(int delay) {
@@ -46,7 +44,20 @@ int main() {
         while (1) tight_loop_contents();
     }
 
+    // Connecting can take longer than the watchdog allows (see boot_slots.h), so it is done from the
+    // main loop, which feeds the watchdog until the program is confirmed
+    bool confirmed = false;
     while (true) {
+        wifi_manager_connect_async();
+
+        if (!confirmed && wifi_manager_is_connected()) {
+            // Reachable for the next update, so keep this program installed
+            boot_slots_confirm();
+            confirmed = true;
+        } else if (!confirmed && to_ms_since_boot(get_absolute_time()) < CONFIRM_DEADLINE_MS) {
+            watchdog_update();
+        }
+
         cyw43_arch_poll();
         blink_poll(5000);
         cyw43_arch_wait_for_work_until(make_timeout_time_ms(1000));
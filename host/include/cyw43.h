@@ -0,0 +1,27 @@
+#ifndef __PICO_WIFI_BOOT_HOST_CYW43_H__
+#define __PICO_WIFI_BOOT_HOST_CYW43_H__
+
+#include <stdint.h>
+
+// Enough of the CYW43 driver for status queries, answered with fixed values
+
+#define HOST_WIFI_RSSI (-42)
+
+typedef struct _cyw43_t {
+    int itf_state;
+} cyw43_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern cyw43_t cyw43_state;
+
+// Sets rssi to HOST_WIFI_RSSI
+int cyw43_wifi_get_rssi(cyw43_t* self, int32_t* rssi);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __PICO_WIFI_BOOT_HOST_CYW43_CONFIG_H__
+#define __PICO_WIFI_BOOT_HOST_CYW43_CONFIG_H__
+
+// The host build is single-threaded, so there is no lwIP lock to take or check
+
+#define cyw43_arch_lwip_check()
+#define cyw43_thread_enter()
+#define cyw43_thread_exit()
+
+#endif
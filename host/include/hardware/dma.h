@@ -0,0 +1,66 @@
+#ifndef __PICO_WIFI_BOOT_HOST_HARDWARE_DMA_H__
+#define __PICO_WIFI_BOOT_HOST_HARDWARE_DMA_H__
+
+#include "pico.h"
+
+// Emulates just enough of the DMA to run the sniffer: transfers complete immediately, and feed the
+// sniffer with a software CRC-32 when it is attached to the transferring channel
+
+#define NUM_DMA_CHANNELS 12
+
+enum dma_channel_transfer_size {
+    DMA_SIZE_8 = 0,
+    DMA_SIZE_16 = 1,
+    DMA_SIZE_32 = 2,
+};
+
+typedef struct {
+    enum dma_channel_transfer_size transfer_data_size;
+    bool sniff_enable;
+} dma_channel_config;
+
+typedef struct {
+    uint32_t sniff_ctrl;
+    uint32_t sniff_data;
+} dma_hw_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern dma_hw_t* dma_hw;
+
+int dma_claim_unused_channel(bool required);
+
+void dma_channel_unclaim(uint channel);
+
+dma_channel_config dma_channel_get_default_config(uint channel);
+
+static inline void channel_config_set_transfer_data_size(dma_channel_config* c, enum dma_channel_transfer_size size) {
+    c->transfer_data_size = size;
+}
+
+static inline void channel_config_set_sniff_enable(dma_channel_config* c, bool sniff_enable) {
+    c->sniff_enable = sniff_enable;
+}
+
+void dma_channel_set_config(uint channel, const dma_channel_config* config, bool trigger);
+
+void dma_channel_set_write_addr(uint channel, volatile void* write_addr, bool trigger);
+
+void dma_channel_transfer_from_buffer_now(uint channel, const volatile void* read_addr, uint32_t transfer_count);
+
+static inline void dma_channel_wait_for_finish_blocking(uint channel) {
+    (void)channel;
+}
+
+// Only calculation mode 0x1 (CRC-32 over bit-reversed data) is emulated
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable);
+
+void dma_sniffer_disable(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __PICO_WIFI_BOOT_HOST_HARDWARE_FLASH_H__
+#define __PICO_WIFI_BOOT_HOST_HARDWARE_FLASH_H__
+
+#include "pico.h"
+
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define FLASH_BLOCK_SIZE (1u << 16)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Like NOR flash, erasing sets every bit and programming can only clear bits
+void flash_range_erase(uint32_t flash_offs, size_t count);
+
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
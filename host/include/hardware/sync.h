@@ -0,0 +1,16 @@
+#ifndef __PICO_WIFI_BOOT_HOST_HARDWARE_SYNC_H__
+#define __PICO_WIFI_BOOT_HOST_HARDWARE_SYNC_H__
+
+#include "pico.h"
+
+// Nothing interrupts the host build, so there is nothing to disable
+
+static inline uint32_t save_and_disable_interrupts(void) {
+    return 0;
+}
+
+static inline void restore_interrupts(uint32_t status) {
+    (void)status;
+}
+
+#endif
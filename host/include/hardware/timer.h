@@ -0,0 +1,10 @@
+#ifndef __PICO_WIFI_BOOT_HOST_HARDWARE_TIMER_H__
+#define __PICO_WIFI_BOOT_HOST_HARDWARE_TIMER_H__
+
+#include "pico/time.h"
+
+static inline uint32_t time_us_32(void) {
+    return (uint32_t)get_absolute_time();
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __PICO_WIFI_BOOT_HOST_HARDWARE_WATCHDOG_H__
+#define __PICO_WIFI_BOOT_HOST_HARDWARE_WATCHDOG_H__
+
+#include "pico.h"
+
+typedef struct {
+    uint32_t scratch[8];
+} watchdog_hw_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Scratch registers are kept in memory, and the watchdog never fires
+extern watchdog_hw_t* watchdog_hw;
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+
+void watchdog_disable(void);
+
+void watchdog_update(void);
+
+void watchdog_reboot(uint32_t pc, uint32_t sp, uint32_t delay_ms);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef __PICO_WIFI_BOOT_HOST_EMULATION_H__
+#define __PICO_WIFI_BOOT_HOST_EMULATION_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lwip/tcp.h"
+#include "lwip/udp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maps PICO_FLASH_SIZE_BYTES of emulated flash from the file at path, which is created erased if it
+// does not exist. A NULL path maps anonymous memory instead. Returns false if mapping fails
+bool host_flash_init(const char* path);
+
+void host_flash_deinit();
+
+// Counts of flash operations since host_flash_init, and bytes affected by them
+struct HostFlashStats {
+    uint32_t erase_count;
+    uint32_t erase_bytes;
+    uint32_t program_count;
+    uint32_t program_bytes;
+    // Time spent waiting on emulated flash latency (see host_flash_set_latency)
+    uint64_t busy_us;
+};
+
+void host_flash_get_stats(struct HostFlashStats* stats);
+
+// Time the chip is busy for each operation, during which the caller is blocked as it is on a Pico
+struct HostFlashLatency {
+    uint32_t sector_erase_us;
+    uint32_t block_erase_us;
+    uint32_t page_program_us;
+};
+
+// Typical timings of the W25Q16JV on the Pico W
+#define HOST_FLASH_TYPICAL_LATENCY {.sector_erase_us = 45000, .block_erase_us = 150000, .page_program_us = 400}
+
+// Makes flash operations take the given time from now on. NULL (the default) completes them immediately
+void host_flash_set_latency(const struct HostFlashLatency* latency);
+
+// Cuts power once the given number of further flash operations have completed: the operation it
+// happens in only takes effect on every other byte of its range, and any after it are dropped until
+// host_flash_restore_power. Code keeps running, so that what it left in flash can be inspected
+void host_flash_cut_power_after(uint32_t operations);
+
+void host_flash_restore_power();
+
+// False once power has been cut
+bool host_flash_has_power();
+
+// While set, async_context_add_when_pending_worker fails, as it does on the device when the context
+// cannot take another worker
+void host_async_refuse_workers(bool refuse);
+
+// Runs async context workers until none have work pending, and no at-time worker is due
+void host_poll();
+
+// Runs at-time workers which are due, then each async context worker with work pending once, as
+// happens between received segments when flash is slower than the network. Returns false if none ran
+bool host_poll_once();
+
+// Opens a loopback connection to the listener on port, as accepted by lwIP. Returns NULL if nothing
+// is listening there, or the listener rejected the connection
+struct tcp_pcb* host_tcp_connect(uint16_t port);
+
+// Delivers len bytes to the server, split into pbufs of at most segment_size bytes (as by TCP_MSS).
+// Returns false if the server closed the connection
+bool host_tcp_send(struct tcp_pcb* pcb, const void* data, uint32_t len, uint16_t segment_size);
+
+// Copies out up to len bytes which the server has written, returning the number of bytes copied
+uint32_t host_tcp_read(struct tcp_pcb* pcb, void* data, uint32_t len);
+
+// Closes the client side of the connection, which the server sees as a NULL pbuf
+void host_tcp_close(struct tcp_pcb* pcb);
+
+// Receive window the server is advertising: TCP_WND less the bytes it has not passed to tcp_recved
+uint32_t host_tcp_window(struct tcp_pcb* pcb);
+
+// True until the server closes or aborts the connection
+bool host_tcp_is_open(struct tcp_pcb* pcb);
+
+// Frees a connection once the host is done with it
+void host_tcp_release(struct tcp_pcb* pcb);
+
+// Address of the device's station interface (netif_default), and of the host on the same network
+#define HOST_DEVICE_ADDR "192.168.4.2"
+#define HOST_PEER_ADDR "192.168.4.1"
+
+// Delivers a datagram from HOST_PEER_ADDR:from_port to the device's socket bound to port, addressed
+// to dest (the device, the broadcast address or a multicast group). Returns false if nothing is bound
+// there, or dest is a group which the device has not joined
+bool host_udp_send(const char* dest, uint16_t port, uint16_t from_port, const void* data, uint32_t len);
+
+// Copies out up to len bytes of the oldest datagram which the device sent from its socket bound to
+// port, setting where it was sent. Returns the datagram's length, or 0 if none is waiting
+uint32_t host_udp_read(uint16_t port, void* data, uint32_t len, ip_addr_t* dest, uint16_t* dest_port);
+
+// True while the device is joined to the multicast group
+bool host_igmp_is_member(const char* group);
+
+// Number of times reboot() has been called, since the host process keeps running instead
+uint32_t host_reboot_count();
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
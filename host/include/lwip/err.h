@@ -0,0 +1,17 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_ERR_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_ERR_H__
+
+#include <stdint.h>
+
+typedef int8_t err_t;
+
+#define ERR_OK 0
+#define ERR_MEM -1
+#define ERR_VAL -6
+#define ERR_USE -8
+#define ERR_CONN -11
+#define ERR_ABRT -13
+#define ERR_RST -14
+#define ERR_ARG -16
+
+#endif
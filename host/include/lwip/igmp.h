@@ -0,0 +1,21 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_IGMP_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_IGMP_H__
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/netif.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Groups are counted per join, as in lwIP, and only delivered to while joined (see host_udp_send)
+err_t igmp_joingroup_netif(struct netif* netif, const ip4_addr_t* groupaddr);
+
+err_t igmp_leavegroup_netif(struct netif* netif, const ip4_addr_t* groupaddr);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_IP_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_IP_H__
+
+#include <stdint.h>
+
+#include "lwip/ip_addr.h"
+
+#define SOF_BROADCAST 0x20
+
+struct udp_pcb;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Only UDP sockets take options in the loopback, so this is a function rather than lwIP's macro
+void ip_set_option(struct udp_pcb* pcb, uint8_t option);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
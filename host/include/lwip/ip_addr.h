@@ -0,0 +1,36 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_IP_ADDR_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_IP_ADDR_H__
+
+#include <stdint.h>
+
+// IPv4 only, as in the example's lwipopts.h. Addresses are in network byte order
+
+#define IPADDR_TYPE_ANY 46
+
+typedef struct ip4_addr {
+    uint32_t addr;
+} ip4_addr_t;
+
+typedef ip4_addr_t ip_addr_t;
+
+#define ip_2_ip4(ipaddr) (ipaddr)
+#define ip4_addr_isany_val(addr4) ((addr4).addr == 0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const ip_addr_t ip_addr_any;
+extern const ip_addr_t ip_addr_broadcast;
+
+// Returns 0 if cp is not a dotted IPv4 address
+int ipaddr_aton(const char* cp, ip_addr_t* addr);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#define IP_ADDR_ANY (&ip_addr_any)
+#define IP_ADDR_BROADCAST (&ip_addr_broadcast)
+
+#endif
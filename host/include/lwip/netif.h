@@ -0,0 +1,31 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_NETIF_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_NETIF_H__
+
+#include <stdint.h>
+
+#include "lwip/ip_addr.h"
+
+#define NETIF_FLAG_UP 0x01
+#define NETIF_FLAG_LINK_UP 0x04
+
+// The station interface, which is up with an address unless the host says otherwise
+struct netif {
+    ip4_addr_t ip_addr;
+    uint8_t flags;
+};
+
+#define netif_is_up(netif) (((netif)->flags & NETIF_FLAG_UP) != 0)
+#define netif_is_link_up(netif) (((netif)->flags & NETIF_FLAG_LINK_UP) != 0)
+#define netif_ip4_addr(netif) ((const ip4_addr_t*)&(netif)->ip_addr)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern struct netif* netif_default;
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
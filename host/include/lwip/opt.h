@@ -0,0 +1,13 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_OPT_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_OPT_H__
+
+// UDP and IGMP are looped back too, so that discovery and multicast are built as on the device
+#define LWIP_UDP 1
+#define LWIP_IGMP 1
+
+// As in the example's lwipopts.h, so that the receive window is modelled to scale
+#define TCP_MSS 1460
+#define TCP_WND (8 * TCP_MSS)
+#define PBUF_POOL_SIZE 24
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_PBUF_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_PBUF_H__
+
+#include <stdint.h>
+
+typedef enum {
+    PBUF_TRANSPORT,
+} pbuf_layer;
+
+typedef enum {
+    PBUF_RAM,
+} pbuf_type;
+
+struct pbuf {
+    struct pbuf* next;
+    void* payload;
+    uint16_t tot_len;
+    uint16_t len;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Allocates a single pbuf with room for length bytes
+struct pbuf* pbuf_alloc(pbuf_layer layer, uint16_t length, pbuf_type type);
+
+// Frees the whole chain
+uint8_t pbuf_free(struct pbuf* p);
+
+uint16_t pbuf_copy_partial(const struct pbuf* p, void* dataptr, uint16_t len, uint16_t offset);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_TCP_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_TCP_H__
+
+// Loopback stand-in for the lwIP raw TCP API. Connections are driven in-process by the host through
+// host_emulation.h rather than by a network interface
+
+#include <stdint.h>
+
+#include "lwip/err.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+
+#define TCP_WRITE_FLAG_COPY 0x01
+
+struct tcp_pcb;
+
+typedef err_t (*tcp_accept_fn)(void* arg, struct tcp_pcb* newpcb, err_t err);
+typedef err_t (*tcp_recv_fn)(void* arg, struct tcp_pcb* tpcb, struct pbuf* p, err_t err);
+typedef err_t (*tcp_poll_fn)(void* arg, struct tcp_pcb* tpcb);
+typedef void (*tcp_err_fn)(void* arg, err_t err);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tcp_pcb* tcp_new_ip_type(uint8_t type);
+
+err_t tcp_bind(struct tcp_pcb* pcb, const ip_addr_t* ipaddr, uint16_t port);
+
+struct tcp_pcb* tcp_listen(struct tcp_pcb* pcb);
+
+void tcp_accept(struct tcp_pcb* pcb, tcp_accept_fn accept);
+
+void tcp_arg(struct tcp_pcb* pcb, void* arg);
+
+void tcp_recv(struct tcp_pcb* pcb, tcp_recv_fn recv);
+
+void tcp_err(struct tcp_pcb* pcb, tcp_err_fn err);
+
+void tcp_poll(struct tcp_pcb* pcb, tcp_poll_fn poll, uint8_t interval);
+
+void tcp_recved(struct tcp_pcb* pcb, uint16_t len);
+
+err_t tcp_write(struct tcp_pcb* pcb, const void* dataptr, uint16_t len, uint8_t apiflags);
+
+err_t tcp_output(struct tcp_pcb* pcb);
+
+err_t tcp_close(struct tcp_pcb* pcb);
+
+void tcp_abort(struct tcp_pcb* pcb);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __PICO_WIFI_BOOT_HOST_LWIP_UDP_H__
+#define __PICO_WIFI_BOOT_HOST_LWIP_UDP_H__
+
+// Loopback stand-in for the lwIP raw UDP API. Datagrams are exchanged in-process with the host through
+// host_emulation.h rather than a network interface
+
+#include <stdint.h>
+
+#include "lwip/err.h"
+#include "lwip/ip.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+
+struct udp_pcb;
+
+typedef void (*udp_recv_fn)(void* arg, struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* addr, uint16_t port);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct udp_pcb* udp_new_ip_type(uint8_t type);
+
+err_t udp_bind(struct udp_pcb* pcb, const ip_addr_t* ipaddr, uint16_t port);
+
+void udp_recv(struct udp_pcb* pcb, udp_recv_fn recv, void* recv_arg);
+
+err_t udp_sendto(struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* dst_ip, uint16_t dst_port);
+
+void udp_remove(struct udp_pcb* pcb);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef __PICO_WIFI_BOOT_HOST_PICO_H__
+#define __PICO_WIFI_BOOT_HOST_PICO_H__
+
+// Minimal stand-in for the Pico SDK platform header, enough to build pico_wifi_boot on a host
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef unsigned int uint;
+
+#ifndef MIN
+#define MIN(a, b) ((b) < (a) ? (b) : (a))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+#endif
+
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Emulated flash, mapped in place of the XIP window (see host_emulation.h)
+extern uint8_t* host_flash;
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+// There is no cache to bypass, so both XIP aliases read the mapping directly
+#define XIP_BASE ((uintptr_t)host_flash)
+#define XIP_NOCACHE_NOALLOC_BASE XIP_BASE
+
+#define SRAM_BASE 0x20000000u
+#define SRAM_END 0x20042000u
+
+static inline void tight_loop_contents(void) {}
+
+static inline uint get_core_num(void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __PICO_WIFI_BOOT_HOST_PICO_ASYNC_CONTEXT_H__
+#define __PICO_WIFI_BOOT_HOST_PICO_ASYNC_CONTEXT_H__
+
+#include "pico.h"
+#include "pico/time.h"
+
+typedef struct async_context async_context_t;
+
+typedef struct async_when_pending_worker {
+    struct async_when_pending_worker* next;
+    void (*do_work)(async_context_t* context, struct async_when_pending_worker* worker);
+    bool work_pending;
+    void* user_data;
+} async_when_pending_worker_t;
+
+typedef struct async_at_time_worker {
+    struct async_at_time_worker* next;
+    void (*do_work)(async_context_t* context, struct async_at_time_worker* worker);
+    absolute_time_t next_time;
+    void* user_data;
+} async_at_time_worker_t;
+
+struct async_context {
+    async_when_pending_worker_t* when_pending_list;
+    async_at_time_worker_t* at_time_list;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool async_context_add_when_pending_worker(async_context_t* context, async_when_pending_worker_t* worker);
+
+void async_context_set_work_pending(async_context_t* context, async_when_pending_worker_t* worker);
+
+// At-time workers run from host_poll once their time has passed, and are removed before they run
+bool async_context_add_at_time_worker_in_ms(async_context_t* context, async_at_time_worker_t* worker, uint32_t ms);
+
+bool async_context_remove_at_time_worker(async_context_t* context, async_at_time_worker_t* worker);
+
+async_context_t* cyw43_arch_async_context(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
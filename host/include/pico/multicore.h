@@ -0,0 +1,17 @@
+#ifndef __PICO_WIFI_BOOT_HOST_PICO_MULTICORE_H__
+#define __PICO_WIFI_BOOT_HOST_PICO_MULTICORE_H__
+
+#include "pico.h"
+
+// The host build runs on a single emulated core, so there is never another core to lock out
+
+static inline bool multicore_lockout_victim_is_initialized(uint core_num) {
+    (void)core_num;
+    return false;
+}
+
+static inline void multicore_lockout_start_blocking(void) {}
+
+static inline void multicore_lockout_end_blocking(void) {}
+
+#endif
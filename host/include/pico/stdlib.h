@@ -0,0 +1,7 @@
+#ifndef __PICO_WIFI_BOOT_HOST_PICO_STDLIB_H__
+#define __PICO_WIFI_BOOT_HOST_PICO_STDLIB_H__
+
+#include "pico.h"
+#include "pico/time.h"
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __PICO_WIFI_BOOT_HOST_PICO_TIME_H__
+#define __PICO_WIFI_BOOT_HOST_PICO_TIME_H__
+
+#include "pico.h"
+
+typedef uint64_t absolute_time_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Microseconds on the host's monotonic clock
+absolute_time_t get_absolute_time(void);
+
+static inline uint32_t to_ms_since_boot(absolute_time_t t) {
+    return (uint32_t)(t / 1000);
+}
+
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return get_absolute_time() + (uint64_t)ms * 1000;
+}
+
+void sleep_ms(uint32_t ms);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
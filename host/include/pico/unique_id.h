@@ -0,0 +1,23 @@
+#ifndef __PICO_WIFI_BOOT_HOST_PICO_UNIQUE_ID_H__
+#define __PICO_WIFI_BOOT_HOST_PICO_UNIQUE_ID_H__
+
+#include "pico.h"
+
+#define PICO_UNIQUE_BOARD_ID_SIZE_BYTES 8
+
+typedef struct {
+    uint8_t id[PICO_UNIQUE_BOARD_ID_SIZE_BYTES];
+} pico_unique_board_id_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The host always reports bytes 1 to 8
+void pico_get_unique_board_id(pico_unique_board_id_t* id_out);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,636 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "host_emulation.h"
+#include "lwip/opt.h"
+#include "pico_wifi_boot/boot_image.h"
+#include "pico_wifi_boot/delta_patch.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/image_writer.h"
+#include "pico_wifi_boot/lzss.h"
+#include "pico_wifi_boot/ota_server.h"
+
+#define OTA_RESPONSE_SIZE 5
+#define OTA_CHUNK_RESPONSE_SIZE 9
+#define OTA_CHUNK_HEADER_SIZE 12
+
+// Segments the network delivers in the time flash takes to commit a sector (about 50 KB at 1 MB/s)
+#define BENCH_LINK_SEGMENTS 34
+
+// Rate of the link in bench_link, about what a Pico W receives over TCP
+#define BENCH_LINK_BYTES_PER_S (1024 * 1024)
+
+// Plain bitwise CRC-32, independent of the emulated sniffer which the server uses
+uint32_t bench_crc32(const uint8_t* data, uint32_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+// Returns the error code of the server's next response, or -1 if it did not send one
+int bench_read_response(struct tcp_pcb* pcb) {
+    uint8_t response[OTA_RESPONSE_SIZE];
+    if (host_tcp_read(pcb, response, sizeof(response)) != sizeof(response)
+        || memcmp(response, "OTA\n", 4) != 0) {
+        return -1;
+    }
+    return response[4];
+}
+
+// Returns the error code of the server's next chunk acknowledgement, setting offset, or -1 if there was none
+int bench_read_chunk_response(struct tcp_pcb* pcb, uint32_t* offset) {
+    uint8_t response[OTA_CHUNK_RESPONSE_SIZE];
+    if (host_tcp_read(pcb, response, sizeof(response)) != sizeof(response)
+        || memcmp(response, "OTA\n", 4) != 0) {
+        return -1;
+    }
+    memcpy(offset, response + 5, sizeof(*offset));
+    return response[4];
+}
+
+void bench_report(
+    const char* name, const uint8_t* image, uint32_t image_size, struct HostFlashStats* before,
+    uint64_t elapsed_us, bool ok) {
+    struct HostFlashStats after;
+    host_flash_get_stats(&after);
+
+    bool image_ok = memcmp(host_flash + USER_PROGRAM_OFFSET, image, image_size) == 0;
+    printf(
+        "%-10s %8"PRIu64" us %10"PRIu64" bytes/s  %4"PRIu32" erases (%7"PRIu32" bytes)  %4"PRIu32" programs (%7"PRIu32" bytes)  %s\n",
+        name,
+        elapsed_us,
+        (uint64_t)image_size * 1000000 / elapsed_us,
+        after.erase_count - before->erase_count,
+        after.erase_bytes - before->erase_bytes,
+        after.program_count - before->program_count,
+        after.program_bytes - before->program_bytes,
+        ok && image_ok ? "ok" : "FAILED");
+}
+
+// Sends a request of the given type for the image, followed by its payload, committing sectors between
+// received segments as the device's async context would. Delta and compressed requests carry the
+// image size (and base image) after the checksum. Returns false if the upload did not succeed
+bool bench_upload_payload(
+    const char* name, char type, const uint8_t* image, uint32_t image_size, const uint8_t* payload,
+    uint32_t payload_size, const uint8_t* base, uint32_t base_size, uint16_t segment_size) {
+    struct HostFlashStats before;
+    host_flash_get_stats(&before);
+
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    if (!pcb) {
+        printf("%s: connection refused\n", name);
+        return false;
+    }
+
+    uint8_t request[24];
+    uint32_t request_size = 12;
+    uint32_t checksum = bench_crc32(image, image_size);
+    memcpy(request, "OTA", 3);
+    request[3] = type;
+    memcpy(request + 4, &payload_size, sizeof(payload_size));
+    memcpy(request + 8, &checksum, sizeof(checksum));
+    if (type == 'D' || type == 'Z') {
+        memcpy(request + request_size, &image_size, sizeof(image_size));
+        request_size += sizeof(image_size);
+    }
+    if (type == 'D') {
+        uint32_t base_checksum = bench_crc32(base, base_size);
+        memcpy(request + request_size, &base_size, sizeof(base_size));
+        memcpy(request + request_size + 4, &base_checksum, sizeof(base_checksum));
+        request_size += 8;
+    }
+
+    absolute_time_t start = get_absolute_time();
+
+    host_tcp_send(pcb, request, request_size, segment_size);
+    int error_code = bench_read_response(pcb);
+    if (error_code != 0) {
+        printf("%s: request refused with %d\n", name, error_code);
+        host_tcp_release(pcb);
+        return false;
+    }
+
+    for (uint32_t offset = 0; offset < payload_size && host_tcp_is_open(pcb); offset += segment_size) {
+        host_tcp_send(pcb, payload + offset, MIN(segment_size, payload_size - offset), segment_size);
+        host_poll();
+    }
+
+    error_code = bench_read_response(pcb);
+    uint64_t elapsed_us = MAX(get_absolute_time() - start, 1);
+
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+
+    bench_report(name, image, image_size, &before, elapsed_us, error_code == 0);
+    if (payload_size != image_size) {
+        printf("%-10s %"PRIu32" payload bytes\n", "", payload_size);
+    }
+    return error_code == 0 && memcmp(host_flash + USER_PROGRAM_OFFSET, image, image_size) == 0;
+}
+
+// Uploads a full image the way upload.js does
+bool bench_upload(const char* name, const uint8_t* image, uint32_t image_size, uint16_t segment_size) {
+    return bench_upload_payload(name, '\n', image, image_size, image, image_size, NULL, 0, segment_size);
+}
+
+uint32_t bench_put_varint(uint8_t* out, uint32_t value) {
+    uint32_t len = 0;
+    do {
+        out[len] = (value & 0x7F) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+        len++;
+    } while (value);
+    return len;
+}
+
+// Patches base (in place, and of the same size) into image, as runs of copied and inserted bytes.
+// Short unchanged runs are inserted, since a copy op would cost more than them. Returns the patch size
+uint32_t bench_encode_delta(const uint8_t* base, const uint8_t* image, uint32_t image_size, uint8_t* patch) {
+    uint32_t len = 0;
+    uint32_t pos = 0;
+    while (pos < image_size) {
+        uint32_t end = pos;
+        while (end < image_size && image[end] == base[end]) {
+            end++;
+        }
+        if (end - pos >= 8 || end == image_size) {
+            patch[len++] = DELTA_PATCH_COPY;
+            len += bench_put_varint(patch + len, 0);
+            len += bench_put_varint(patch + len, end - pos);
+            pos = end;
+            continue;
+        }
+
+        // Insert up to the next unchanged run worth copying
+        uint32_t same = 0;
+        while (end < image_size && same < 8) {
+            same = image[end] == base[end] ? same + 1 : 0;
+            end++;
+        }
+        if (same == 8) {
+            end -= same;
+        }
+        patch[len++] = DELTA_PATCH_INSERT;
+        len += bench_put_varint(patch + len, end - pos);
+        memcpy(patch + len, image + pos, end - pos);
+        len += end - pos;
+        pos = end;
+    }
+    return len;
+}
+
+// Compresses the image greedily, matching against the last position which started with the same
+// three bytes. Returns the compressed size, which is at most image_size + image_size / 8 + 1
+uint32_t bench_encode_lzss(const uint8_t* image, uint32_t image_size, uint8_t* out) {
+    static uint32_t last[1 << 16];
+    memset(last, 0xFF, sizeof(last));
+
+    uint32_t len = 0;
+    uint32_t flags_pos = 0;
+    uint32_t items = 8;
+    uint32_t pos = 0;
+    while (pos < image_size) {
+        if (items == 8) {
+            flags_pos = len++;
+            out[flags_pos] = 0;
+            items = 0;
+        }
+
+        uint32_t match_length = 0;
+        uint32_t match_distance = 0;
+        if (pos + LZSS_MIN_MATCH <= image_size) {
+            uint16_t hash = (image[pos] << 8 | image[pos + 1]) ^ (image[pos + 2] << 4);
+            uint32_t candidate = last[hash];
+            last[hash] = pos;
+            if (candidate != UINT32_MAX && pos - candidate <= LZSS_WINDOW_SIZE) {
+                while (pos + match_length < image_size && image[candidate + match_length] == image[pos + match_length]) {
+                    match_length++;
+                }
+                match_distance = pos - candidate;
+            }
+        }
+
+        if (match_length < LZSS_MIN_MATCH) {
+            out[flags_pos] |= 1 << items;
+            out[len++] = image[pos++];
+        } else {
+            uint32_t length_field = MIN(match_length - LZSS_MIN_MATCH, LZSS_LENGTH_FIELD_MAX);
+            uint16_t token = (length_field << LZSS_DISTANCE_BITS) | (match_distance - 1);
+            out[len++] = token & 0xFF;
+            out[len++] = token >> 8;
+            if (length_field == LZSS_LENGTH_FIELD_MAX) {
+                uint32_t extension = match_length - LZSS_MIN_MATCH - LZSS_LENGTH_FIELD_MAX;
+                while (extension >= 255) {
+                    out[len++] = 255;
+                    extension -= 255;
+                }
+                out[len++] = extension;
+            }
+            pos += match_length;
+        }
+        items++;
+    }
+    return len;
+}
+
+// Uploads a full image in checksummed chunks the way upload.js --chunked does, corrupting the chunk
+// at corrupt_offset (if within the image) the first time it is sent, so that it must be sent again
+bool bench_upload_chunked(
+    const char* name, const uint8_t* image, uint32_t image_size, uint16_t segment_size, uint32_t corrupt_offset) {
+    struct HostFlashStats before;
+    host_flash_get_stats(&before);
+
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    if (!pcb) {
+        printf("%s: connection refused\n", name);
+        return false;
+    }
+
+    uint8_t request[12];
+    uint32_t checksum = bench_crc32(image, image_size);
+    memcpy(request, "OTAC", 4);
+    memcpy(request + 4, &image_size, sizeof(image_size));
+    memcpy(request + 8, &checksum, sizeof(checksum));
+
+    absolute_time_t start = get_absolute_time();
+
+    host_tcp_send(pcb, request, sizeof(request), segment_size);
+    uint32_t offset;
+    int error_code = bench_read_chunk_response(pcb, &offset);
+    if (error_code != 0) {
+        printf("%s: request refused with %d\n", name, error_code);
+        host_tcp_release(pcb);
+        return false;
+    }
+
+    uint8_t chunk[OTA_CHUNK_HEADER_SIZE + FLASH_SECTOR_SIZE];
+    uint32_t resent = 0;
+    error_code = -1;
+    while (error_code < 0 && host_tcp_is_open(pcb)) {
+        if (offset < image_size) {
+            uint32_t length = MIN(FLASH_SECTOR_SIZE, image_size - offset);
+            uint32_t chunk_checksum = bench_crc32(image + offset, length);
+            memcpy(chunk, &offset, 4);
+            memcpy(chunk + 4, &length, 4);
+            memcpy(chunk + 8, &chunk_checksum, 4);
+            memcpy(chunk + OTA_CHUNK_HEADER_SIZE, image + offset, length);
+            if (offset == corrupt_offset) {
+                chunk[OTA_CHUNK_HEADER_SIZE] ^= 0xFF;
+                corrupt_offset = UINT32_MAX;
+            }
+
+            host_tcp_send(pcb, chunk, OTA_CHUNK_HEADER_SIZE + length, segment_size);
+            offset += length;
+        }
+        host_poll();
+
+        // Go back to a rejected chunk, and finish on the acknowledgement of the whole image
+        uint32_t acked;
+        int code;
+        while ((code = bench_read_chunk_response(pcb, &acked)) >= 0) {
+            if (acked == image_size) {
+                error_code = code;
+            } else if (code != 0) {
+                resent += offset - acked;
+                offset = acked;
+            }
+        }
+    }
+    uint64_t elapsed_us = MAX(get_absolute_time() - start, 1);
+
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+
+    bench_report(name, image, image_size, &before, elapsed_us, error_code == 0);
+    if (resent) {
+        printf("%-10s %"PRIu32" bytes sent again\n", "", resent);
+    }
+    return error_code == 0 && memcmp(host_flash + USER_PROGRAM_OFFSET, image, image_size) == 0;
+}
+
+// Uploads a full image over a link which is faster than flash: each round, up to BENCH_LINK_SEGMENTS
+// segments arrive, then one sector is committed. If honor_window is false, the sender ignores the
+// advertised window, as if the server acknowledged every segment straight away. A segment whose
+// processing had to commit a sector in-line stalls the receive path, and segments arriving behind it
+// in the same round wait in the PBUF_POOL, with any beyond it dropped and later retransmitted
+bool bench_flow(const char* name, const uint8_t* image, uint32_t image_size, uint16_t segment_size, bool honor_window) {
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    if (!pcb) {
+        printf("%s: connection refused\n", name);
+        return false;
+    }
+
+    uint8_t request[12];
+    uint32_t checksum = bench_crc32(image, image_size);
+    memcpy(request, "OTA\n", 4);
+    memcpy(request + 4, &image_size, sizeof(image_size));
+    memcpy(request + 8, &checksum, sizeof(checksum));
+
+    host_tcp_send(pcb, request, sizeof(request), segment_size);
+    if (bench_read_response(pcb) != 0) {
+        printf("%s: request refused\n", name);
+        host_tcp_release(pcb);
+        return false;
+    }
+
+    uint32_t rounds = 0;
+    uint32_t stalls = 0;
+    uint32_t max_waiting = 0;
+    uint32_t dropped = 0;
+    uint32_t offset = 0;
+    while (offset < image_size && host_tcp_is_open(pcb)) {
+        uint32_t waiting = 0;
+        bool stalled = false;
+        for (uint32_t segment = 0; segment < BENCH_LINK_SEGMENTS && offset < image_size; segment++) {
+            uint32_t len = MIN(segment_size, image_size - offset);
+            if (honor_window && host_tcp_window(pcb) < len) {
+                break;
+            }
+
+            struct HostFlashStats before;
+            struct HostFlashStats after;
+            host_flash_get_stats(&before);
+            host_tcp_send(pcb, image + offset, len, segment_size);
+            host_flash_get_stats(&after);
+            offset += len;
+
+            if (stalled) {
+                waiting++;
+            }
+            if (after.program_count != before.program_count || after.erase_count != before.erase_count) {
+                stalls++;
+                stalled = true;
+            }
+        }
+        max_waiting = MAX(max_waiting, waiting);
+        dropped += waiting > PBUF_POOL_SIZE ? waiting - PBUF_POOL_SIZE : 0;
+
+        host_poll_once();
+        rounds++;
+    }
+    host_poll();
+
+    int error_code = bench_read_response(pcb);
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+
+    bool ok = error_code == 0 && memcmp(host_flash + USER_PROGRAM_OFFSET, image, image_size) == 0;
+    // The window only closes while a full sector waits for the worker, which takes a second buffer
+    if (honor_window && IMAGE_WRITER_BUFFER_COUNT > 1) {
+        ok = ok && dropped == 0;
+    }
+    printf(
+        "%-10s %4"PRIu32" rounds  %4"PRIu32" receive stalls  %3"PRIu32" segments waiting at most  %4"PRIu32" dropped  %s\n",
+        name, rounds, stalls, max_waiting, dropped, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// Uploads a full image over a link of BENCH_LINK_BYTES_PER_S, in real time. Segments arrive as the
+// link delivers them, as far as the advertised window allows, and in between, the async context
+// commits a sector whenever one is waiting. As on the device, everything runs on one core, so while
+// flash is written nothing else runs, and the link can only keep delivering into the window. With
+// flash latency (-l), the time flash was busy and the time the link needs are printed alongside the
+// total, their overlap being how much of the commits were hidden behind receiving
+bool bench_link(const char* name, const uint8_t* image, uint32_t image_size, uint16_t segment_size) {
+    struct HostFlashStats before;
+    host_flash_get_stats(&before);
+
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    if (!pcb) {
+        printf("%s: connection refused\n", name);
+        return false;
+    }
+
+    uint8_t request[12];
+    uint32_t checksum = bench_crc32(image, image_size);
+    memcpy(request, "OTA\n", 4);
+    memcpy(request + 4, &image_size, sizeof(image_size));
+    memcpy(request + 8, &checksum, sizeof(checksum));
+
+    absolute_time_t start = get_absolute_time();
+    host_tcp_send(pcb, request, sizeof(request), segment_size);
+    if (bench_read_response(pcb) != 0) {
+        printf("%s: request refused\n", name);
+        host_tcp_release(pcb);
+        return false;
+    }
+
+    uint32_t offset = 0;
+    while (offset < image_size && host_tcp_is_open(pcb)) {
+        // Bytes the link could have delivered by now, if the window had let it
+        uint64_t delivered = (get_absolute_time() - start) * BENCH_LINK_BYTES_PER_S / 1000000;
+        while (offset < MIN(delivered, image_size) && host_tcp_is_open(pcb)) {
+            uint32_t len = MIN(segment_size, image_size - offset);
+            if (host_tcp_window(pcb) < len) {
+                break;
+            }
+            host_tcp_send(pcb, image + offset, len, segment_size);
+            offset += len;
+        }
+
+        host_poll_once();
+    }
+    host_poll();
+
+    int error_code = bench_read_response(pcb);
+    uint64_t elapsed_us = MAX(get_absolute_time() - start, 1);
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+
+    struct HostFlashStats after;
+    host_flash_get_stats(&after);
+    uint64_t link_us = (uint64_t)image_size * 1000000 / BENCH_LINK_BYTES_PER_S;
+    uint64_t busy_us = after.busy_us - before.busy_us;
+
+    bench_report(name, image, image_size, &before, elapsed_us, error_code == 0);
+    printf(
+        "%-10s %"PRIu32" sector buffers  flash busy %"PRIu64" us  link %"PRIu64" us  overlap %"PRId64" us\n",
+        "", (uint32_t)IMAGE_WRITER_BUFFER_COUNT, busy_us, link_us, (int64_t)(busy_us + link_us) - (int64_t)elapsed_us);
+    return error_code == 0 && memcmp(host_flash + USER_PROGRAM_OFFSET, image, image_size) == 0;
+}
+
+// Counts what the bootloader's check of a freshly uploaded image reads: all of it on the first boot,
+// and only its vector table after that. The time printed is only the host's CPU cost of the check.
+// On a device, the first boot's check is bound by reading the image through XIP, which is not
+// emulated, so it is not a measure of the time to reach the program's main()
+bool bench_boot_check(uint8_t* image, uint32_t image_size, uint16_t segment_size) {
+    // A plausible vector table: stack at the top of RAM, and reset handler just inside the image
+    uint32_t vectors[2] = {SRAM_END, (uint32_t)(XIP_BASE + USER_PROGRAM_OFFSET + 0x100) | 1};
+    memcpy(image, vectors, sizeof(vectors));
+    if (!bench_upload("boot image", image, image_size, segment_size)) {
+        return false;
+    }
+
+    bool ok = true;
+    const char* names[] = {"first boot", "next boot"};
+    uint32_t bytes_read[] = {image_size, 2 * sizeof(uint32_t)};
+    for (uint32_t boot = 0; boot < 2; boot++) {
+        absolute_time_t start = get_absolute_time();
+        bool valid = boot_image_check(0);
+        printf(
+            "%-10s %8"PRIu32" bytes read  %8"PRIu64" us host CPU  image check %s\n",
+            names[boot], bytes_read[boot], get_absolute_time() - start, valid ? "ok" : "FAILED");
+        ok = ok && valid;
+    }
+    return ok;
+}
+
+// Carries config over from the single config sector, as older versions wrote it, then counts the
+// flash operations taken by frequent small updates of the extra config, each of which used to erase
+bool bench_config() {
+    struct AppState {
+        uint32_t counter;
+        uint8_t data[60];
+    } state;
+    memset(&state, 0x5A, sizeof(state));
+    state.counter = 0;
+
+    uint8_t* legacy = host_flash + CONFIG_FLASH_OFFSET;
+    memset(legacy, 0xFF, FLASH_SECTOR_SIZE);
+    memcpy(legacy, CONFIG_MAGIC_CODE, CONFIG_MAGIC_CODE_LEN);
+    memset(legacy + CONFIG_MAGIC_CODE_LEN, 0, WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE);
+    strcpy((char*)legacy + CONFIG_MAGIC_CODE_LEN, "bench");
+    strcpy((char*)legacy + CONFIG_MAGIC_CODE_LEN + WIFI_CONFIG_SSID_SIZE, "password");
+    uint32_t crc = bench_crc32((uint8_t*)&state, sizeof(state));
+    memcpy(legacy + CONFIG_MAGIC_CODE_LEN + WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE, &crc, sizeof(crc));
+    memcpy(legacy + CONFIG_MAGIC_CODE_LEN + WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE + sizeof(crc), &state, sizeof(state));
+
+    char ssid[WIFI_CONFIG_SSID_SIZE];
+    char pass[WIFI_CONFIG_PASS_SIZE];
+    struct AppState stored;
+    bool ok = read_wifi_config(ssid, pass) && strcmp(ssid, "bench") == 0 && strcmp(pass, "password") == 0
+        && read_flash_config_extra(&stored, sizeof(stored)) && memcmp(&stored, &state, sizeof(state)) == 0;
+
+    struct HostFlashStats before;
+    host_flash_get_stats(&before);
+
+    const uint32_t writes = 1000;
+    for (uint32_t i = 0; i < writes; i++) {
+        state.counter++;
+        ok = ok && write_flash_config_extra(&state, sizeof(state))
+            && read_flash_config_extra(&stored, sizeof(stored)) && memcmp(&stored, &state, sizeof(state)) == 0;
+    }
+
+    struct HostFlashStats after;
+    host_flash_get_stats(&after);
+
+    // Nothing is written for an unchanged value
+    ok = ok && write_flash_config_extra(&state, sizeof(state)) && write_wifi_config("bench", "password");
+    struct HostFlashStats unchanged;
+    host_flash_get_stats(&unchanged);
+    ok = ok && unchanged.program_count == after.program_count && unchanged.erase_count == after.erase_count;
+
+    ok = ok && read_wifi_config(ssid, pass) && strcmp(ssid, "bench") == 0 && strcmp(pass, "password") == 0;
+    printf(
+        "config     %4"PRIu32" writes  %4"PRIu32" erases  %4"PRIu32" programs  %s\n",
+        writes, after.erase_count - before.erase_count, after.program_count - before.program_count,
+        ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    // -l gives flash operations the time they take on the Pico W's flash chip
+    bool flash_latency = argc > 1 && strcmp(argv[1], "-l") == 0;
+    if (flash_latency) {
+        argc--;
+        argv++;
+    }
+
+    uint32_t image_size = argc > 1 ? strtoul(argv[1], NULL, 0) : 512 * 1024;
+    uint16_t segment_size = argc > 2 ? strtoul(argv[2], NULL, 0) : 1460;
+    const char* flash_path = argc > 3 ? argv[3] : NULL;
+
+    if (image_size == 0 || image_size > USER_PROGRAM_MAX_SIZE || segment_size == 0) {
+        fprintf(stderr, "usage: %s [-l] [image_size] [segment_size] [flash_file]\n", argv[0]);
+        return 2;
+    }
+
+    if (!host_flash_init(flash_path)) {
+        fprintf(stderr, "failed to map emulated flash\n");
+        return 1;
+    }
+    if (flash_latency) {
+        struct HostFlashLatency latency = HOST_FLASH_TYPICAL_LATENCY;
+        host_flash_set_latency(&latency);
+    }
+
+    if (!ota_init(OTA_PORT)) {
+        return 1;
+    }
+
+    // Deterministic pseudo-random contents, so that runs are comparable
+    uint8_t* image = malloc(image_size);
+    uint32_t seed = 0x12345678;
+    for (uint32_t i = 0; i < image_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = seed >> 16;
+    }
+
+    bool ok = bench_upload("fresh", image, image_size, segment_size);
+    ok = bench_upload("unchanged", image, image_size, segment_size) && ok;
+
+    // Touch one byte per block, as a small change to a program would
+    for (uint32_t i = 0; i < image_size; i += FLASH_BLOCK_SIZE) {
+        image[i] ^= 0xFF;
+    }
+    ok = bench_upload("changed", image, image_size, segment_size) && ok;
+
+    // A patch changing a few bytes in every fourth sector, applied in place
+    uint8_t* base = malloc(image_size);
+    uint8_t* payload = malloc(image_size + image_size / 8 + 1);
+    memcpy(base, image, image_size);
+    for (uint32_t i = 0; i < image_size; i += 4 * FLASH_SECTOR_SIZE) {
+        memset(image + i + 100, 0x42, 16);
+    }
+    uint32_t payload_size = bench_encode_delta(base, image, image_size, payload);
+    ok = bench_upload_payload("delta", 'D', image, image_size, payload, payload_size, base, image_size, segment_size)
+        && ok;
+
+    // A compressed image, in which half of each page repeats the half before it as programs often do.
+    // The image itself is left as it was for the runs after this
+    uint8_t* compressible = base;
+    memcpy(compressible, image, image_size);
+    for (uint32_t i = FLASH_PAGE_SIZE / 2; i + FLASH_PAGE_SIZE / 2 <= image_size; i += FLASH_PAGE_SIZE) {
+        memcpy(compressible + i, compressible + i - FLASH_PAGE_SIZE / 2, FLASH_PAGE_SIZE / 2);
+    }
+    payload_size = bench_encode_lzss(compressible, image_size, payload);
+    ok = bench_upload_payload(
+        "compressed", 'Z', compressible, image_size, payload, payload_size, NULL, 0, segment_size) && ok;
+    free(payload);
+    free(base);
+
+    // Receive flow control, against a sender which ignores it as the server used to. Every sector
+    // changes each time, so that each commit has to write flash
+    for (uint32_t i = 0; i < image_size; i++) {
+        image[i] ^= 0xFF;
+    }
+    ok = bench_flow("no window", image, image_size, segment_size, false) && ok;
+    for (uint32_t i = 0; i < image_size; i++) {
+        image[i] ^= 0xFF;
+    }
+    ok = bench_flow("windowed", image, image_size, segment_size, true) && ok;
+    for (uint32_t i = 0; i < image_size; i++) {
+        image[i] ^= 0xFF;
+    }
+    ok = bench_link("link", image, image_size, segment_size) && ok;
+
+    // A chunk corrupted in transit costs only itself
+    image[0] ^= 0xFF;
+    ok = bench_upload_chunked("chunked", image, image_size, segment_size, image_size / 2 & ~(FLASH_SECTOR_SIZE - 1))
+        && ok;
+
+    ok = bench_boot_check(image, image_size, segment_size) && ok;
+    ok = bench_config() && ok;
+
+    free(image);
+    host_flash_deinit();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#include "hardware/dma.h"
+
+#include <stdlib.h>
+
+dma_hw_t host_dma_hw;
+dma_hw_t* dma_hw = &host_dma_hw;
+
+uint32_t host_dma_claimed;
+dma_channel_config host_dma_configs[NUM_DMA_CHANNELS];
+
+bool host_sniffer_enabled;
+uint host_sniffer_channel;
+
+uint32_t host_crc32_table[256];
+
+// Standard (reflected) CRC-32, without the initial and final inversion
+uint32_t host_crc32_update(uint32_t crc, const uint8_t* data, uint32_t len) {
+    if (!host_crc32_table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; bit++) {
+                c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            }
+            host_crc32_table[i] = c;
+        }
+    }
+
+    for (uint32_t i = 0; i < len; i++) {
+        crc = host_crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+uint32_t host_reverse_uint32(uint32_t n) {
+    uint32_t reversed = 0;
+    for (int bit = 0; bit < 32; bit++) {
+        reversed = (reversed << 1) | ((n >> bit) & 1);
+    }
+    return reversed;
+}
+
+int dma_claim_unused_channel(bool required) {
+    for (uint channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+        if (!(host_dma_claimed & (1u << channel))) {
+            host_dma_claimed |= 1u << channel;
+            return channel;
+        }
+    }
+
+    if (required) {
+        fprintf(stderr, "dma_claim_unused_channel: no channels available\n");
+        abort();
+    }
+    return -1;
+}
+
+void dma_channel_unclaim(uint channel) {
+    host_dma_claimed &= ~(1u << channel);
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel) {
+    (void)channel;
+    dma_channel_config config = {
+        .transfer_data_size = DMA_SIZE_32,
+        .sniff_enable = false,
+    };
+    return config;
+}
+
+void dma_channel_set_config(uint channel, const dma_channel_config* config, bool trigger) {
+    (void)trigger;
+    host_dma_configs[channel] = *config;
+}
+
+void dma_channel_set_write_addr(uint channel, volatile void* write_addr, bool trigger) {
+    (void)channel;
+    (void)write_addr;
+    (void)trigger;
+}
+
+void dma_channel_transfer_from_buffer_now(uint channel, const volatile void* read_addr, uint32_t transfer_count) {
+    if (!host_sniffer_enabled || host_sniffer_channel != channel || !host_dma_configs[channel].sniff_enable) {
+        return;
+    }
+
+    // The sniffer works on bit-reversed data, which is the standard CRC-32 register reversed
+    uint32_t len = transfer_count << host_dma_configs[channel].transfer_data_size;
+    uint32_t crc = host_reverse_uint32(dma_hw->sniff_data);
+    crc = host_crc32_update(crc, (const uint8_t*)read_addr, len);
+    dma_hw->sniff_data = host_reverse_uint32(crc);
+}
+
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable) {
+    if (mode != 0x1) {
+        fprintf(stderr, "dma_sniffer_enable: mode %u is not emulated\n", mode);
+        abort();
+    }
+
+    host_sniffer_enabled = true;
+    host_sniffer_channel = channel;
+    if (force_channel_enable) {
+        host_dma_configs[channel].sniff_enable = true;
+    }
+}
+
+void dma_sniffer_disable(void) {
+    host_sniffer_enabled = false;
+}
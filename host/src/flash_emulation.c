@@ -0,0 +1,168 @@
+#include "hardware/flash.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "host_emulation.h"
+#include "pico/time.h"
+
+uint8_t* host_flash = NULL;
+
+struct HostFlashStats host_flash_stats;
+struct HostFlashLatency host_flash_latency;
+
+// Operations which complete before power is cut, or UINT32_MAX if it stays on
+uint32_t host_flash_power_left = UINT32_MAX;
+bool host_flash_power_cut = false;
+
+bool host_flash_init(const char* path) {
+    memset(&host_flash_stats, 0, sizeof(host_flash_stats));
+
+    if (!path) {
+        void* map = mmap(NULL, PICO_FLASH_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        host_flash = map;
+        memset(host_flash, 0xFF, PICO_FLASH_SIZE_BYTES);
+        return true;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    bool created = fstat(fd, &st) == 0 && st.st_size == 0;
+    if (ftruncate(fd, PICO_FLASH_SIZE_BYTES) != 0) {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(NULL, PICO_FLASH_SIZE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    host_flash = map;
+
+    if (created) {
+        memset(host_flash, 0xFF, PICO_FLASH_SIZE_BYTES);
+    }
+    return true;
+}
+
+void host_flash_deinit() {
+    if (host_flash) {
+        munmap(host_flash, PICO_FLASH_SIZE_BYTES);
+        host_flash = NULL;
+    }
+}
+
+void host_flash_get_stats(struct HostFlashStats* stats) {
+    *stats = host_flash_stats;
+}
+
+void host_flash_set_latency(const struct HostFlashLatency* latency) {
+    if (latency) {
+        host_flash_latency = *latency;
+    } else {
+        memset(&host_flash_latency, 0, sizeof(host_flash_latency));
+    }
+}
+
+void host_flash_cut_power_after(uint32_t operations) {
+    host_flash_power_left = operations;
+}
+
+void host_flash_restore_power() {
+    host_flash_power_left = UINT32_MAX;
+    host_flash_power_cut = false;
+}
+
+bool host_flash_has_power() {
+    return !host_flash_power_cut;
+}
+
+// Blocks for as long as the chip would be busy, spinning rather than sleeping since page programs
+// are shorter than the scheduler's sleep granularity
+void host_flash_busy(uint64_t busy_us) {
+    if (!busy_us) {
+        return;
+    }
+
+    host_flash_stats.busy_us += busy_us;
+    absolute_time_t until = get_absolute_time() + busy_us;
+    while (get_absolute_time() < until) {
+    }
+}
+
+// Returns the step between bytes of an operation which take effect: every byte while there is power,
+// every other byte of the operation which is cut off, and none after it (0)
+size_t host_flash_powered_step() {
+    if (host_flash_power_cut) {
+        return 0;
+    }
+    if (host_flash_power_left == UINT32_MAX) {
+        return 1;
+    }
+    if (host_flash_power_left) {
+        host_flash_power_left--;
+        return 1;
+    }
+
+    host_flash_power_cut = true;
+    return 2;
+}
+
+// The SDK panics on misaligned or out of range operations, which would be bugs in the caller
+void host_flash_check_range(const char* op, uint32_t flash_offs, size_t count, uint32_t alignment) {
+    if (flash_offs % alignment != 0 || count % alignment != 0 || flash_offs + count > PICO_FLASH_SIZE_BYTES) {
+        fprintf(stderr, "%s: bad range 0x%"PRIx32" + 0x%zx\n", op, flash_offs, count);
+        abort();
+    }
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+    host_flash_check_range("flash_range_erase", flash_offs, count, FLASH_SECTOR_SIZE);
+
+    size_t step = host_flash_powered_step();
+    for (size_t i = 0; step && i < count; i += step) {
+        host_flash[flash_offs + i] = 0xFF;
+    }
+
+    host_flash_stats.erase_count++;
+    host_flash_stats.erase_bytes += count;
+
+    // As with the SDK, aligned 64 KB blocks are erased with the block command and the rest by sector
+    uint64_t busy_us = 0;
+    for (uint32_t offset = flash_offs; offset < flash_offs + count;) {
+        if (offset % FLASH_BLOCK_SIZE == 0 && offset + FLASH_BLOCK_SIZE <= flash_offs + count) {
+            busy_us += host_flash_latency.block_erase_us;
+            offset += FLASH_BLOCK_SIZE;
+        } else {
+            busy_us += host_flash_latency.sector_erase_us;
+            offset += FLASH_SECTOR_SIZE;
+        }
+    }
+    host_flash_busy(busy_us);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t* data, size_t count) {
+    host_flash_check_range("flash_range_program", flash_offs, count, FLASH_PAGE_SIZE);
+
+    // Programming can only clear bits, so anything not erased first ends up as a mix of both
+    size_t step = host_flash_powered_step();
+    for (size_t i = 0; step && i < count; i += step) {
+        host_flash[flash_offs + i] &= data[i];
+    }
+
+    host_flash_stats.program_count++;
+    host_flash_stats.program_bytes += count;
+    host_flash_busy((uint64_t)host_flash_latency.page_program_us * (count / FLASH_PAGE_SIZE));
+}
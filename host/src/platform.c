@@ -0,0 +1,161 @@
+#include <time.h>
+
+#include "cyw43.h"
+#include "hardware/watchdog.h"
+#include "pico/async_context.h"
+#include "pico/stdlib.h"
+#include "pico/unique_id.h"
+
+#include "host_emulation.h"
+#include "pico_wifi_boot/reboot.h"
+
+absolute_time_t get_absolute_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void sleep_ms(uint32_t ms) {
+    struct timespec delay = {
+        .tv_sec = ms / 1000,
+        .tv_nsec = (long)(ms % 1000) * 1000000,
+    };
+    nanosleep(&delay, NULL);
+}
+
+watchdog_hw_t host_watchdog_hw;
+watchdog_hw_t* watchdog_hw = &host_watchdog_hw;
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) {
+    (void)delay_ms;
+    (void)pause_on_debug;
+}
+
+void watchdog_disable(void) {}
+
+void watchdog_update(void) {}
+
+uint32_t host_reboots = 0;
+
+void watchdog_reboot(uint32_t pc, uint32_t sp, uint32_t delay_ms) {
+    (void)pc;
+    (void)sp;
+    (void)delay_ms;
+    host_reboots++;
+}
+
+uint32_t host_reboot_count() {
+    return host_reboots;
+}
+
+// The host plays the part of the bootloader, which is what accepts images
+bool running_in_bootloader() {
+    return true;
+}
+
+bool running_from_slot(uint8_t slot) {
+    (void)slot;
+    return false;
+}
+
+void pico_get_unique_board_id(pico_unique_board_id_t* id_out) {
+    for (uint32_t i = 0; i < PICO_UNIQUE_BOARD_ID_SIZE_BYTES; i++) {
+        id_out->id[i] = i + 1;
+    }
+}
+
+cyw43_t cyw43_state;
+
+int cyw43_wifi_get_rssi(cyw43_t* self, int32_t* rssi) {
+    (void)self;
+    *rssi = HOST_WIFI_RSSI;
+    return 0;
+}
+
+void reboot() {
+    watchdog_reboot(0, 0, 0);
+}
+
+void reboot_into_bootloader() {
+    reboot();
+}
+
+async_context_t host_async_context;
+
+async_context_t* cyw43_arch_async_context(void) {
+    return &host_async_context;
+}
+
+bool host_async_refusing_workers = false;
+
+void host_async_refuse_workers(bool refuse) {
+    host_async_refusing_workers = refuse;
+}
+
+bool async_context_add_when_pending_worker(async_context_t* context, async_when_pending_worker_t* worker) {
+    if (host_async_refusing_workers) {
+        return false;
+    }
+
+    worker->next = context->when_pending_list;
+    context->when_pending_list = worker;
+    return true;
+}
+
+void async_context_set_work_pending(async_context_t* context, async_when_pending_worker_t* worker) {
+    (void)context;
+    worker->work_pending = true;
+}
+
+bool async_context_remove_at_time_worker(async_context_t* context, async_at_time_worker_t* worker) {
+    async_at_time_worker_t** link = &context->at_time_list;
+    while (*link && *link != worker) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        return false;
+    }
+    *link = worker->next;
+    return true;
+}
+
+bool async_context_add_at_time_worker_in_ms(async_context_t* context, async_at_time_worker_t* worker, uint32_t ms) {
+    async_context_remove_at_time_worker(context, worker);
+    worker->next_time = make_timeout_time_ms(ms);
+    worker->next = context->at_time_list;
+    context->at_time_list = worker;
+    return true;
+}
+
+bool host_poll_once() {
+    bool worked = false;
+
+    // Workers may add themselves back, so take one due worker off the list at a time
+    absolute_time_t now = get_absolute_time();
+    async_at_time_worker_t* due;
+    do {
+        due = host_async_context.at_time_list;
+        while (due && due->next_time > now) {
+            due = due->next;
+        }
+        if (due) {
+            async_context_remove_at_time_worker(&host_async_context, due);
+            due->do_work(&host_async_context, due);
+            worked = true;
+        }
+    } while (due);
+
+    for (async_when_pending_worker_t* worker = host_async_context.when_pending_list; worker; worker = worker->next) {
+        if (worker->work_pending) {
+            worker->work_pending = false;
+            worker->do_work(&host_async_context, worker);
+            worked = true;
+        }
+    }
+    return worked;
+}
+
+void host_poll() {
+    while (host_poll_once()) {
+    }
+}
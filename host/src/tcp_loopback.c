@@ -0,0 +1,265 @@
+#include "lwip/tcp.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "lwip/opt.h"
+#include "pico.h"
+
+struct tcp_pcb {
+    struct tcp_pcb* next_listener;
+    uint16_t port;
+    bool listening;
+    // Set for connections opened by the host, which the host frees (see host_tcp_release)
+    bool connected;
+    // Cleared once the server closes or aborts the connection
+    bool open;
+    void* arg;
+    tcp_accept_fn accept;
+    tcp_recv_fn recv;
+    tcp_err_fn errf;
+    // Bytes delivered to the server which it has not acknowledged with tcp_recved, closing the window
+    uint32_t unacknowledged;
+    // Bytes written by the server which the host has not read yet
+    uint8_t* sent;
+    uint32_t sent_len;
+    uint32_t sent_capacity;
+};
+
+struct tcp_pcb* host_listeners = NULL;
+
+struct pbuf* pbuf_alloc(pbuf_layer layer, uint16_t length, pbuf_type type) {
+    (void)layer;
+    (void)type;
+    struct pbuf* pb = malloc(sizeof(struct pbuf) + length);
+    if (!pb) {
+        return NULL;
+    }
+    pb->next = NULL;
+    pb->payload = pb + 1;
+    pb->tot_len = length;
+    pb->len = length;
+    return pb;
+}
+
+uint8_t pbuf_free(struct pbuf* p) {
+    uint8_t count = 0;
+    while (p) {
+        struct pbuf* next = p->next;
+        free(p);
+        p = next;
+        count++;
+    }
+    return count;
+}
+
+uint16_t pbuf_copy_partial(const struct pbuf* p, void* dataptr, uint16_t len, uint16_t offset) {
+    uint16_t copied = 0;
+    for (; p && copied < len; p = p->next) {
+        if (offset >= p->len) {
+            offset -= p->len;
+            continue;
+        }
+
+        uint16_t chunk = MIN(p->len - offset, len - copied);
+        memcpy((uint8_t*)dataptr + copied, (uint8_t*)p->payload + offset, chunk);
+        copied += chunk;
+        offset = 0;
+    }
+    return copied;
+}
+
+struct tcp_pcb* tcp_new_ip_type(uint8_t type) {
+    (void)type;
+    return calloc(1, sizeof(struct tcp_pcb));
+}
+
+err_t tcp_bind(struct tcp_pcb* pcb, const ip_addr_t* ipaddr, uint16_t port) {
+    (void)ipaddr;
+    for (struct tcp_pcb* listener = host_listeners; listener; listener = listener->next_listener) {
+        if (listener->port == port) {
+            return ERR_USE;
+        }
+    }
+
+    pcb->port = port;
+    return ERR_OK;
+}
+
+struct tcp_pcb* tcp_listen(struct tcp_pcb* pcb) {
+    pcb->listening = true;
+    pcb->next_listener = host_listeners;
+    host_listeners = pcb;
+    return pcb;
+}
+
+void tcp_accept(struct tcp_pcb* pcb, tcp_accept_fn accept) {
+    pcb->accept = accept;
+}
+
+void tcp_arg(struct tcp_pcb* pcb, void* arg) {
+    pcb->arg = arg;
+}
+
+void tcp_recv(struct tcp_pcb* pcb, tcp_recv_fn recv) {
+    pcb->recv = recv;
+}
+
+void tcp_err(struct tcp_pcb* pcb, tcp_err_fn errf) {
+    pcb->errf = errf;
+}
+
+void tcp_poll(struct tcp_pcb* pcb, tcp_poll_fn poll, uint8_t interval) {
+    (void)pcb;
+    (void)poll;
+    (void)interval;
+}
+
+void tcp_recved(struct tcp_pcb* pcb, uint16_t len) {
+    pcb->unacknowledged -= MIN(len, pcb->unacknowledged);
+}
+
+err_t tcp_write(struct tcp_pcb* pcb, const void* dataptr, uint16_t len, uint8_t apiflags) {
+    (void)apiflags;
+    if (!pcb->open) {
+        return ERR_CONN;
+    }
+
+    if (pcb->sent_len + len > pcb->sent_capacity) {
+        uint32_t capacity = MAX(pcb->sent_capacity * 2, pcb->sent_len + len);
+        uint8_t* sent = realloc(pcb->sent, capacity);
+        if (!sent) {
+            return ERR_MEM;
+        }
+        pcb->sent = sent;
+        pcb->sent_capacity = capacity;
+    }
+
+    memcpy(pcb->sent + pcb->sent_len, dataptr, len);
+    pcb->sent_len += len;
+    return ERR_OK;
+}
+
+err_t tcp_output(struct tcp_pcb* pcb) {
+    (void)pcb;
+    return ERR_OK;
+}
+
+void host_tcp_remove_listener(struct tcp_pcb* pcb) {
+    struct tcp_pcb** link = &host_listeners;
+    while (*link && *link != pcb) {
+        link = &(*link)->next_listener;
+    }
+    if (*link) {
+        *link = pcb->next_listener;
+    }
+}
+
+err_t tcp_close(struct tcp_pcb* pcb) {
+    if (!pcb->connected) {
+        host_tcp_remove_listener(pcb);
+        free(pcb);
+    } else {
+        pcb->open = false;
+    }
+    return ERR_OK;
+}
+
+void tcp_abort(struct tcp_pcb* pcb) {
+    if (!pcb->connected) {
+        host_tcp_remove_listener(pcb);
+        free(pcb);
+        return;
+    }
+    if (!pcb->open) {
+        return;
+    }
+
+    // As in lwIP, the error callback hears about the abort. The host still holds the connection
+    pcb->open = false;
+    if (pcb->errf) {
+        pcb->errf(pcb->arg, ERR_ABRT);
+    }
+}
+
+struct tcp_pcb* host_tcp_connect(uint16_t port) {
+    struct tcp_pcb* listener = host_listeners;
+    while (listener && listener->port != port) {
+        listener = listener->next_listener;
+    }
+    if (!listener || !listener->accept) {
+        return NULL;
+    }
+
+    struct tcp_pcb* pcb = calloc(1, sizeof(struct tcp_pcb));
+    if (!pcb) {
+        return NULL;
+    }
+    pcb->port = port;
+    pcb->connected = true;
+    pcb->open = true;
+
+    if (listener->accept(listener->arg, pcb, ERR_OK) != ERR_OK) {
+        free(pcb);
+        return NULL;
+    }
+    return pcb;
+}
+
+bool host_tcp_send(struct tcp_pcb* pcb, const void* data, uint32_t len, uint16_t segment_size) {
+    uint32_t offset = 0;
+    while (offset < len && pcb->open) {
+        uint16_t segment_len = MIN(segment_size, len - offset);
+
+        struct pbuf* pb = pbuf_alloc(PBUF_TRANSPORT, segment_len, PBUF_RAM);
+        if (!pb) {
+            return false;
+        }
+        memcpy(pb->payload, (const uint8_t*)data + offset, segment_len);
+        offset += segment_len;
+        pcb->unacknowledged += segment_len;
+
+        // The receiver takes ownership of the pbuf
+        pcb->recv(pcb->arg, pcb, pb, ERR_OK);
+    }
+
+    return pcb->open;
+}
+
+uint32_t host_tcp_read(struct tcp_pcb* pcb, void* data, uint32_t len) {
+    len = MIN(len, pcb->sent_len);
+    memcpy(data, pcb->sent, len);
+    memmove(pcb->sent, pcb->sent + len, pcb->sent_len - len);
+    pcb->sent_len -= len;
+    return len;
+}
+
+void host_tcp_close(struct tcp_pcb* pcb) {
+    if (pcb->open) {
+        pcb->recv(pcb->arg, pcb, NULL, ERR_OK);
+    }
+}
+
+uint32_t host_tcp_window(struct tcp_pcb* pcb) {
+    return pcb->unacknowledged < TCP_WND ? TCP_WND - pcb->unacknowledged : 0;
+}
+
+bool host_tcp_is_open(struct tcp_pcb* pcb) {
+    return pcb->open;
+}
+
+void host_tcp_release(struct tcp_pcb* pcb) {
+    // Dropping a connection the server still holds looks like a reset to it
+    if (pcb->open) {
+        pcb->open = false;
+        if (pcb->errf) {
+            pcb->errf(pcb->arg, ERR_RST);
+        }
+    }
+
+    free(pcb->sent);
+    free(pcb);
+}
@@ -0,0 +1,227 @@
+#include "lwip/udp.h"
+
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "lwip/igmp.h"
+#include "lwip/netif.h"
+#include "pico.h"
+
+#define HOST_IGMP_MAX_GROUPS 4
+
+// A datagram sent by the device, waiting for the host to read it
+struct HostDatagram {
+    struct HostDatagram* next;
+    ip_addr_t dest;
+    uint16_t dest_port;
+    uint32_t len;
+    uint8_t data[];
+};
+
+struct udp_pcb {
+    struct udp_pcb* next;
+    uint16_t port;
+    bool bound;
+    uint8_t so_options;
+    udp_recv_fn recv;
+    void* recv_arg;
+    struct HostDatagram* sent;
+};
+
+struct HostGroup {
+    ip4_addr_t addr;
+    uint32_t joins;
+};
+
+const ip_addr_t ip_addr_any = {0};
+const ip_addr_t ip_addr_broadcast = {0xFFFFFFFF};
+
+struct netif host_netif = {.flags = NETIF_FLAG_UP | NETIF_FLAG_LINK_UP};
+struct netif* netif_default = &host_netif;
+
+struct udp_pcb* host_udp_pcbs = NULL;
+struct HostGroup host_groups[HOST_IGMP_MAX_GROUPS];
+
+int ipaddr_aton(const char* cp, ip_addr_t* addr) {
+    struct in_addr in;
+    if (inet_pton(AF_INET, cp, &in) != 1) {
+        return 0;
+    }
+    addr->addr = in.s_addr;
+    return 1;
+}
+
+// The interface is up with its address from the start, as once WiFi has connected
+__attribute__((constructor)) void host_netif_init() {
+    ipaddr_aton(HOST_DEVICE_ADDR, &host_netif.ip_addr);
+}
+
+void ip_set_option(struct udp_pcb* pcb, uint8_t option) {
+    pcb->so_options |= option;
+}
+
+struct udp_pcb* udp_new_ip_type(uint8_t type) {
+    (void)type;
+    struct udp_pcb* pcb = calloc(1, sizeof(struct udp_pcb));
+    if (!pcb) {
+        return NULL;
+    }
+
+    pcb->next = host_udp_pcbs;
+    host_udp_pcbs = pcb;
+    return pcb;
+}
+
+struct udp_pcb* host_udp_find(uint16_t port) {
+    struct udp_pcb* pcb = host_udp_pcbs;
+    while (pcb && !(pcb->bound && pcb->port == port)) {
+        pcb = pcb->next;
+    }
+    return pcb;
+}
+
+err_t udp_bind(struct udp_pcb* pcb, const ip_addr_t* ipaddr, uint16_t port) {
+    (void)ipaddr;
+    if (host_udp_find(port)) {
+        return ERR_USE;
+    }
+
+    pcb->port = port;
+    pcb->bound = true;
+    return ERR_OK;
+}
+
+void udp_recv(struct udp_pcb* pcb, udp_recv_fn recv, void* recv_arg) {
+    pcb->recv = recv;
+    pcb->recv_arg = recv_arg;
+}
+
+err_t udp_sendto(struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* dst_ip, uint16_t dst_port) {
+    // As in lwIP, broadcasts are only sent from sockets which allow them
+    if (dst_ip->addr == ip_addr_broadcast.addr && !(pcb->so_options & SOF_BROADCAST)) {
+        return ERR_VAL;
+    }
+
+    struct HostDatagram* datagram = malloc(sizeof(struct HostDatagram) + p->tot_len);
+    if (!datagram) {
+        return ERR_MEM;
+    }
+    datagram->next = NULL;
+    datagram->dest = *dst_ip;
+    datagram->dest_port = dst_port;
+    datagram->len = pbuf_copy_partial(p, datagram->data, p->tot_len, 0);
+
+    struct HostDatagram** link = &pcb->sent;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = datagram;
+    return ERR_OK;
+}
+
+void udp_remove(struct udp_pcb* pcb) {
+    struct udp_pcb** link = &host_udp_pcbs;
+    while (*link && *link != pcb) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = pcb->next;
+    }
+
+    while (pcb->sent) {
+        struct HostDatagram* next = pcb->sent->next;
+        free(pcb->sent);
+        pcb->sent = next;
+    }
+    free(pcb);
+}
+
+struct HostGroup* host_igmp_find(const ip4_addr_t* groupaddr) {
+    for (uint32_t i = 0; i < HOST_IGMP_MAX_GROUPS; i++) {
+        if (host_groups[i].joins && host_groups[i].addr.addr == groupaddr->addr) {
+            return &host_groups[i];
+        }
+    }
+    return NULL;
+}
+
+err_t igmp_joingroup_netif(struct netif* netif, const ip4_addr_t* groupaddr) {
+    if (!netif) {
+        return ERR_VAL;
+    }
+
+    struct HostGroup* group = host_igmp_find(groupaddr);
+    for (uint32_t i = 0; !group && i < HOST_IGMP_MAX_GROUPS; i++) {
+        if (!host_groups[i].joins) {
+            group = &host_groups[i];
+            group->addr = *groupaddr;
+        }
+    }
+    if (!group) {
+        return ERR_MEM;
+    }
+
+    group->joins++;
+    return ERR_OK;
+}
+
+err_t igmp_leavegroup_netif(struct netif* netif, const ip4_addr_t* groupaddr) {
+    struct HostGroup* group = host_igmp_find(groupaddr);
+    if (!netif || !group) {
+        return ERR_VAL;
+    }
+
+    group->joins--;
+    return ERR_OK;
+}
+
+bool host_igmp_is_member(const char* group) {
+    ip4_addr_t groupaddr;
+    return ipaddr_aton(group, &groupaddr) && host_igmp_find(&groupaddr);
+}
+
+bool host_udp_send(const char* dest, uint16_t port, uint16_t from_port, const void* data, uint32_t len) {
+    ip_addr_t dest_addr;
+    if (!ipaddr_aton(dest, &dest_addr)) {
+        return false;
+    }
+
+    // Multicast (224.0.0.0/4) only reaches groups which have been joined
+    bool is_multicast = (ntohl(dest_addr.addr) >> 28) == 0xE;
+    struct udp_pcb* pcb = host_udp_find(port);
+    if (!pcb || !pcb->recv || (is_multicast && !host_igmp_find(&dest_addr))) {
+        return false;
+    }
+
+    struct pbuf* pb = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+    if (!pb) {
+        return false;
+    }
+    memcpy(pb->payload, data, len);
+
+    // The receiver takes ownership of the pbuf
+    ip_addr_t from;
+    ipaddr_aton(HOST_PEER_ADDR, &from);
+    pcb->recv(pcb->recv_arg, pcb, pb, &from, from_port);
+    return true;
+}
+
+uint32_t host_udp_read(uint16_t port, void* data, uint32_t len, ip_addr_t* dest, uint16_t* dest_port) {
+    struct udp_pcb* pcb = host_udp_find(port);
+    if (!pcb || !pcb->sent) {
+        return 0;
+    }
+
+    struct HostDatagram* datagram = pcb->sent;
+    pcb->sent = datagram->next;
+
+    uint32_t datagram_len = datagram->len;
+    memcpy(data, datagram->data, MIN(len, datagram_len));
+    *dest = datagram->dest;
+    *dest_port = datagram->dest_port;
+    free(datagram);
+    return datagram_len;
+}
@@ -0,0 +1,95 @@
+#include "host_test.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "lwip/opt.h"
+#include "pico_wifi_boot/ota_server.h"
+
+uint32_t host_test_failures = 0;
+
+bool host_test_check(bool passed, const char* condition, const char* file, int line) {
+    if (!passed) {
+        printf("%s:%d: check failed: %s\n", file, line, condition);
+        host_test_failures++;
+    }
+    return passed;
+}
+
+int host_test_result() {
+    printf("%s (%"PRIu32" failed checks)\n", host_test_failures ? "FAILED" : "passed", host_test_failures);
+    return host_test_failures ? 1 : 0;
+}
+
+uint32_t host_test_crc32(const uint8_t* data, uint32_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+void host_test_fill(uint8_t* data, uint32_t len, uint32_t seed) {
+    for (uint32_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+}
+
+void host_test_send_request(
+    struct tcp_pcb* pcb, char type, uint32_t payload_size, uint32_t checksum, const uint32_t* extra,
+    uint32_t extra_count) {
+    uint8_t request[24];
+    memcpy(request, "OTA", 3);
+    request[3] = type;
+    memcpy(request + 4, &payload_size, sizeof(payload_size));
+    memcpy(request + 8, &checksum, sizeof(checksum));
+    if (extra_count) {
+        memcpy(request + 12, extra, extra_count * sizeof(uint32_t));
+    }
+
+    host_tcp_send(pcb, request, 12 + extra_count * sizeof(uint32_t), TCP_MSS);
+}
+
+int host_test_read_response(struct tcp_pcb* pcb) {
+    uint8_t response[OTA_RESPONSE_SIZE];
+    if (host_tcp_read(pcb, response, sizeof(response)) != sizeof(response)
+        || memcmp(response, "OTA\n", 4) != 0) {
+        return -1;
+    }
+    return response[4];
+}
+
+int host_test_read_resume_response(struct tcp_pcb* pcb, uint32_t* offset) {
+    uint8_t response[OTA_RESUME_RESPONSE_SIZE];
+    if (host_tcp_read(pcb, response, sizeof(response)) != sizeof(response)
+        || memcmp(response, "OTA\n", 4) != 0) {
+        return -1;
+    }
+    memcpy(offset, response + 5, sizeof(*offset));
+    return response[4];
+}
+
+int host_test_upload(const uint8_t* image, uint32_t image_size) {
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    if (!pcb) {
+        return -1;
+    }
+
+    host_test_send_request(pcb, '\n', image_size, host_test_crc32(image, image_size), NULL, 0);
+    int error_code = host_test_read_response(pcb);
+    if (error_code == 0) {
+        host_tcp_send(pcb, image, image_size, TCP_MSS);
+        host_poll();
+        error_code = host_test_read_response(pcb);
+    }
+
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+    return error_code;
+}
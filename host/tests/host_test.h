@@ -0,0 +1,53 @@
+#ifndef __PICO_WIFI_BOOT_HOST_TEST_H__
+#define __PICO_WIFI_BOOT_HOST_TEST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lwip/tcp.h"
+
+// Minimal harness for the host tests: each test program checks conditions with CHECK, and returns
+// host_test_result() from main, which ctest reads as pass or fail
+
+#define CHECK(condition) host_test_check((condition), #condition, __FILE__, __LINE__)
+
+#define OTA_RESPONSE_SIZE 5
+#define OTA_RESUME_RESPONSE_SIZE 9
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reports a failed condition. Returns passed, so that a test can stop early
+bool host_test_check(bool passed, const char* condition, const char* file, int line);
+
+// Returns 0 if every check passed, or 1 otherwise
+int host_test_result();
+
+// Plain bitwise CRC-32, independent of the emulated sniffer
+uint32_t host_test_crc32(const uint8_t* data, uint32_t len);
+
+// Fills data with deterministic pseudo-random bytes
+void host_test_fill(uint8_t* data, uint32_t len, uint32_t seed);
+
+// Sends an OTA request of the given type ("OTA" followed by the type character) with payload_size and
+// checksum, and any further fields for delta and compressed requests
+void host_test_send_request(
+    struct tcp_pcb* pcb, char type, uint32_t payload_size, uint32_t checksum, const uint32_t* extra,
+    uint32_t extra_count);
+
+// Returns the error code of the server's next response, or -1 if it did not send one
+int host_test_read_response(struct tcp_pcb* pcb);
+
+// Returns the error code of the server's next resume or chunk response, setting offset, or -1
+int host_test_read_resume_response(struct tcp_pcb* pcb, uint32_t* offset);
+
+// Sends a full image over a new connection (without the commits in between being awaited), and
+// returns the server's final response
+int host_test_upload(const uint8_t* image, uint32_t image_size);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,123 @@
+// Boot image records: an image is only booted once its upload completed, is checked in full on its
+// first boot, and records for both slots survive the log filling up
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "host_test.h"
+#include "pico_wifi_boot/boot_image.h"
+#include "pico_wifi_boot/flash.h"
+
+#define IMAGE_SIZE (5 * FLASH_SECTOR_SIZE + 300)
+
+// An image with a plausible vector table, written straight to slot 0
+uint32_t write_image(uint32_t seed) {
+    uint8_t* image = host_flash + USER_SLOT_OFFSET(0);
+    host_test_fill(image, IMAGE_SIZE, seed);
+    uint32_t vectors[2] = {SRAM_END, (uint32_t)(XIP_BASE + USER_SLOT_OFFSET(0) + 0x100) | 1};
+    memcpy(image, vectors, sizeof(vectors));
+    return host_test_crc32(image, IMAGE_SIZE);
+}
+
+void test_states() {
+    uint32_t size;
+    uint32_t checksum;
+
+    // Programs flashed other than through OTA have no record, and are booted as they are
+    CHECK(boot_image_check(0));
+    CHECK(!boot_image_installed(0, &size, &checksum));
+
+    // An upload under way is never booted
+    CHECK(boot_image_begin(0, IMAGE_SIZE));
+    uint32_t image_checksum = write_image(1);
+    CHECK(!boot_image_check(0));
+    CHECK(!boot_image_installed(0, &size, &checksum));
+
+    // A committed image is checked in full on its first boot, then only by its vector table
+    CHECK(boot_image_commit(0, IMAGE_SIZE, image_checksum));
+    CHECK(boot_image_installed(0, &size, &checksum) && size == IMAGE_SIZE && checksum == image_checksum);
+    struct HostFlashStats before;
+    struct HostFlashStats after;
+    host_flash_get_stats(&before);
+    CHECK(boot_image_check(0));
+    host_flash_get_stats(&after);
+    CHECK(after.program_count == before.program_count + 1);
+
+    host_flash_get_stats(&before);
+    CHECK(boot_image_check(0));
+    host_flash_get_stats(&after);
+    CHECK(after.program_count == before.program_count);
+    CHECK(boot_image_installed(0, &size, &checksum) && checksum == image_checksum);
+
+    // A corrupt vector table is still caught once validated
+    uint32_t* vectors = (uint32_t*)(host_flash + USER_SLOT_OFFSET(0));
+    vectors[0] = 0;
+    CHECK(!boot_image_check(0));
+    vectors[0] = SRAM_END;
+    CHECK(boot_image_check(0));
+
+    // Beginning the same upload again, as a resume does, adds no record
+    CHECK(boot_image_begin(0, IMAGE_SIZE));
+    host_flash_get_stats(&before);
+    CHECK(boot_image_begin(0, IMAGE_SIZE));
+    host_flash_get_stats(&after);
+    CHECK(after.program_count == before.program_count);
+}
+
+void test_corrupt() {
+    // An image which no longer matches its checksum fails its first boot, and keeps failing
+    CHECK(boot_image_begin(0, IMAGE_SIZE));
+    uint32_t image_checksum = write_image(2);
+    CHECK(boot_image_commit(0, IMAGE_SIZE, image_checksum));
+    host_flash[USER_SLOT_OFFSET(0) + 3 * FLASH_SECTOR_SIZE] ^= 0x10;
+    CHECK(!boot_image_check(0));
+    CHECK(!boot_image_check(0));
+
+    // As does a record of an image larger than a slot
+    CHECK(boot_image_commit(0, USER_PROGRAM_MAX_SIZE + FLASH_SECTOR_SIZE, image_checksum));
+    CHECK(!boot_image_check(0));
+}
+
+void test_power_loss() {
+    uint32_t image_checksum = write_image(3);
+    CHECK(boot_image_commit(0, IMAGE_SIZE, image_checksum));
+
+    // A record cut off by power loss is skipped, so the image stays as it was recorded before
+    host_flash_cut_power_after(0);
+    CHECK(!boot_image_begin(0, IMAGE_SIZE + 1));
+    host_flash_restore_power();
+
+    uint32_t size;
+    uint32_t checksum;
+    CHECK(boot_image_installed(0, &size, &checksum) && size == IMAGE_SIZE && checksum == image_checksum);
+    CHECK(boot_image_check(0));
+}
+
+void test_wrap() {
+    uint32_t size;
+    uint32_t checksum;
+    CHECK(boot_image_commit(1, 1000, 0xABCD));
+
+    // Slot 0's records fill the log many times over, and slot 1's record is carried over each time
+    uint32_t records = FLASH_SECTOR_SIZE / sizeof(struct BootImageRecord);
+    for (uint32_t i = 0; i < 3 * records; i++) {
+        CHECK(boot_image_begin(0, IMAGE_SIZE + (i & 1)));
+    }
+    CHECK(boot_image_installed(1, &size, &checksum) && size == 1000 && checksum == 0xABCD);
+    CHECK(!boot_image_installed(0, &size, &checksum));
+}
+
+int main() {
+    if (!host_flash_init(NULL)) {
+        return 1;
+    }
+
+    test_states();
+    test_corrupt();
+    test_power_loss();
+    test_wrap();
+
+    host_flash_deinit();
+    return host_test_result();
+}
@@ -0,0 +1,87 @@
+// Boot record: built with WIFI_BOOT_AB_SLOTS, the active slot survives the log filling up, and power
+// lost while making room for a record never loses the one before it
+
+#include "host_emulation.h"
+#include "host_test.h"
+#include "pico_wifi_boot/boot_slots.h"
+#include "pico_wifi_boot/flash.h"
+
+#define BOOT_RECORDS (FLASH_SECTOR_SIZE / sizeof(struct BootRecord))
+
+uint32_t record_count(uint32_t index) {
+    return flash_log_count(BOOT_RECORD_SECTOR_OFFSET(index), sizeof(struct BootRecord));
+}
+
+// Keeps installing slot until the given sector is full
+void fill_sector(uint32_t index, uint8_t slot) {
+    for (uint32_t i = 0; i < BOOT_RECORDS && record_count(index) < BOOT_RECORDS; i++) {
+        CHECK(boot_slots_activate(slot));
+    }
+    CHECK(record_count(index) == BOOT_RECORDS);
+}
+
+// Writes the record installing slot 0, with power cut after the given number of flash operations
+void cut_power_while_activating(uint32_t operations) {
+    host_flash_cut_power_after(operations);
+    CHECK(!boot_slots_activate(0));
+    host_flash_restore_power();
+}
+
+void test_states() {
+    // Programs flashed other than through OTA have no record, and run from slot 0
+    CHECK(boot_slots_active() == 0);
+    CHECK(boot_slots_target() == 1);
+
+    CHECK(boot_slots_activate(1));
+    CHECK(boot_slots_active() == 1);
+    CHECK(boot_slots_target() == 0);
+    CHECK(boot_slots_confirm());
+    CHECK(boot_slots_active() == 1);
+}
+
+void test_power_loss() {
+    // Fill the first sector with slot 1 installed, so the next record goes to the other sector
+    fill_sector(0, 1);
+    CHECK(record_count(1) == 0);
+
+    // Cut off while erasing the other sector, then while programming the record into it
+    cut_power_while_activating(0);
+    CHECK(boot_slots_active() == 1);
+    cut_power_while_activating(1);
+    CHECK(boot_slots_active() == 1);
+
+    CHECK(boot_slots_activate(0));
+    CHECK(boot_slots_active() == 0);
+    CHECK(record_count(1) == 1);
+
+    // Filling the second sector goes back to the first, which is erased once the new record is due
+    CHECK(boot_slots_confirm());
+    fill_sector(1, 0);
+    CHECK(boot_slots_activate(1));
+    CHECK(boot_slots_active() == 1);
+    CHECK(record_count(0) == 1);
+
+    // Then back again to the second, whose older records must not be mistaken for the current one
+    CHECK(boot_slots_confirm());
+    fill_sector(0, 1);
+    for (uint32_t operations = 0; operations < 2; operations++) {
+        cut_power_while_activating(operations);
+        CHECK(boot_slots_active() == 1);
+    }
+
+    CHECK(boot_slots_activate(0));
+    CHECK(boot_slots_active() == 0);
+    CHECK(record_count(1) == 1);
+}
+
+int main() {
+    if (!host_flash_init(NULL)) {
+        return 1;
+    }
+
+    test_states();
+    test_power_loss();
+
+    host_flash_deinit();
+    return host_test_result();
+}
@@ -0,0 +1,208 @@
+// Config store: values survive compaction and carry over from the single config sector, and power
+// lost at any point of a write leaves either the old or the new value current
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "host_test.h"
+#include "pico_wifi_boot/boot_image.h"
+#include "pico_wifi_boot/config_store.h"
+#include "pico_wifi_boot/flash.h"
+
+struct AppState {
+    uint32_t counter;
+    uint8_t data[60];
+};
+
+uint8_t* snapshot;
+
+void save_flash() {
+    memcpy(snapshot, host_flash, PICO_FLASH_SIZE_BYTES);
+}
+
+void restore_flash() {
+    memcpy(host_flash, snapshot, PICO_FLASH_SIZE_BYTES);
+}
+
+bool state_is(uint32_t counter) {
+    struct AppState stored;
+    return read_flash_config_extra(&stored, sizeof(stored)) && stored.counter == counter;
+}
+
+bool wifi_is(const char* ssid, const char* pass) {
+    char stored_ssid[WIFI_CONFIG_SSID_SIZE];
+    char stored_pass[WIFI_CONFIG_PASS_SIZE];
+    return read_wifi_config(stored_ssid, stored_pass) && strcmp(stored_ssid, ssid) == 0
+        && strcmp(stored_pass, pass) == 0;
+}
+
+bool write_state(uint32_t counter) {
+    struct AppState state;
+    memset(&state, 0x5A, sizeof(state));
+    state.counter = counter;
+    return write_flash_config_extra(&state, sizeof(state));
+}
+
+// Returns the flash operations which writing the counter takes, leaving flash as it was
+uint32_t count_operations(uint32_t counter, bool* erases) {
+    struct HostFlashStats before;
+    struct HostFlashStats after;
+    save_flash();
+    host_flash_get_stats(&before);
+    write_state(counter);
+    host_flash_get_stats(&after);
+    restore_flash();
+
+    *erases = after.erase_count != before.erase_count;
+    return after.erase_count - before.erase_count + after.program_count - before.program_count;
+}
+
+// Cuts power at each flash operation of writing the counter in turn, checking that either the old
+// or the new value is current, and that config can still be written after it
+void power_loss_sweep(uint32_t old_counter, uint32_t counter) {
+    bool erases;
+    uint32_t operations = count_operations(counter, &erases);
+    CHECK(operations > 0);
+
+    save_flash();
+    for (uint32_t cut = 0; cut < operations; cut++) {
+        restore_flash();
+        host_flash_cut_power_after(cut);
+        write_state(counter);
+        host_flash_restore_power();
+
+        if (!CHECK(state_is(old_counter) || state_is(counter))) {
+            printf("power cut after %"PRIu32" of %"PRIu32" operations\n", cut, operations);
+        }
+        CHECK(wifi_is("network", "password"));
+
+        CHECK(write_state(counter + 1) && state_is(counter + 1));
+        CHECK(wifi_is("network", "password"));
+    }
+    restore_flash();
+}
+
+// Writes the single config sector which older versions wrote, with extra config stored after the
+// credentials with its checksum in front
+void write_legacy_config(uint32_t counter) {
+    struct AppState state;
+    memset(&state, 0x5A, sizeof(state));
+    state.counter = counter;
+
+    uint8_t* legacy = host_flash + CONFIG_FLASH_OFFSET;
+    memset(legacy, 0xFF, FLASH_SECTOR_SIZE);
+    memcpy(legacy, CONFIG_MAGIC_CODE, CONFIG_MAGIC_CODE_LEN);
+    memset(legacy + CONFIG_MAGIC_CODE_LEN, 0, WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE);
+    strcpy((char*)legacy + CONFIG_MAGIC_CODE_LEN, "network");
+    strcpy((char*)legacy + CONFIG_MAGIC_CODE_LEN + WIFI_CONFIG_SSID_SIZE, "password");
+    uint8_t* extra = legacy + CONFIG_MAGIC_CODE_LEN + WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE;
+    uint32_t crc = host_test_crc32((uint8_t*)&state, sizeof(state));
+    memcpy(extra, &crc, sizeof(crc));
+    memcpy(extra + sizeof(crc), &state, sizeof(state));
+}
+
+void test_legacy() {
+    write_legacy_config(1);
+    CHECK(wifi_is("network", "password"));
+    CHECK(state_is(1));
+
+    // The first write carries the single config sector over into the log
+    power_loss_sweep(1, 2);
+    CHECK(write_state(2) && state_is(2) && wifi_is("network", "password"));
+}
+
+void test_covered_spare() {
+    save_flash();
+    write_legacy_config(1);
+
+    // A program installed before the spare sectors were taken from the user program region runs
+    // into them, and without a record of its size, the first write cannot tell where it ends
+    uint32_t program_size = CONFIG_SECTOR_OFFSET(1) + FLASH_SECTOR_SIZE - USER_PROGRAM_OFFSET;
+    host_test_fill(host_flash + USER_PROGRAM_OFFSET, program_size, 5);
+    uint32_t checksum = host_test_crc32(host_flash + USER_PROGRAM_OFFSET, program_size);
+    CHECK(!write_state(2));
+    CHECK(state_is(1) && wifi_is("network", "password"));
+
+    // Its record shows that it covers the sector
+    CHECK(boot_image_commit(0, program_size, checksum));
+    CHECK(!write_state(2));
+    CHECK(host_test_crc32(host_flash + USER_PROGRAM_OFFSET, program_size) == checksum);
+
+    // Once a program which ends before it is uploaded, the sector is free
+    CHECK(boot_image_commit(0, FLASH_SECTOR_SIZE, 0));
+    CHECK(write_state(2) && state_is(2) && wifi_is("network", "password"));
+
+    restore_flash();
+}
+
+void test_unchanged() {
+    struct HostFlashStats before;
+    struct HostFlashStats after;
+    host_flash_get_stats(&before);
+    CHECK(write_state(2) && write_wifi_config("network", "password"));
+    host_flash_get_stats(&after);
+    CHECK(after.erase_count == before.erase_count && after.program_count == before.program_count);
+}
+
+void test_append_and_compact() {
+    uint32_t counter = 2;
+    bool swept_append = false;
+    bool swept_compaction = false;
+
+    // Go round every config sector, sweeping the first append and the first compaction
+    for (uint32_t i = 0; i < 3 * CONFIG_FLASH_SECTORS * FLASH_SECTOR_SIZE / sizeof(struct AppState); i++) {
+        bool erases;
+        count_operations(counter + 1, &erases);
+        if (!erases && !swept_append) {
+            power_loss_sweep(counter, counter + 1);
+            swept_append = true;
+        } else if (erases && !swept_compaction) {
+            power_loss_sweep(counter, counter + 1);
+            swept_compaction = true;
+        }
+
+        counter++;
+        CHECK(write_state(counter) && state_is(counter));
+    }
+
+    CHECK(swept_append && swept_compaction);
+    CHECK(wifi_is("network", "password"));
+}
+
+void test_sizes() {
+    // The largest extra config fits, and anything larger is refused without being written
+    uint8_t* extra = malloc(FLASH_CONFIG_EXTRA_MAX_SIZE + 1);
+    uint8_t* stored = malloc(FLASH_CONFIG_EXTRA_MAX_SIZE + 1);
+    host_test_fill(extra, FLASH_CONFIG_EXTRA_MAX_SIZE + 1, 4);
+
+    CHECK(write_flash_config_extra(extra, FLASH_CONFIG_EXTRA_MAX_SIZE));
+    CHECK(read_flash_config_extra(stored, FLASH_CONFIG_EXTRA_MAX_SIZE));
+    CHECK(memcmp(stored, extra, FLASH_CONFIG_EXTRA_MAX_SIZE) == 0);
+    CHECK(!write_flash_config_extra(extra, FLASH_CONFIG_EXTRA_MAX_SIZE + 1));
+    CHECK(!read_flash_config_extra(stored, FLASH_CONFIG_EXTRA_MAX_SIZE + 1));
+
+    // A different size than was stored is not read back
+    CHECK(!read_flash_config_extra(stored, FLASH_CONFIG_EXTRA_MAX_SIZE - 1));
+    CHECK(wifi_is("network", "password"));
+
+    free(extra);
+    free(stored);
+}
+
+int main() {
+    if (!host_flash_init(NULL)) {
+        return 1;
+    }
+    snapshot = malloc(PICO_FLASH_SIZE_BYTES);
+
+    test_covered_spare();
+    test_legacy();
+    test_unchanged();
+    test_append_and_compact();
+    test_sizes();
+
+    free(snapshot);
+    host_flash_deinit();
+    return host_test_result();
+}
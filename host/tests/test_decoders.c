@@ -0,0 +1,182 @@
+// Delta patch and LZSS decoders: well-formed streams decode however they are split, and malformed
+// ones are rejected rather than written
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "host_test.h"
+#include "pico_wifi_boot/delta_patch.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/image_writer.h"
+#include "pico_wifi_boot/lzss.h"
+
+struct ImageWriter writer;
+struct LzssDecoder lzss;
+struct DeltaPatch patch;
+uint8_t history[DELTA_PATCH_HISTORY_SECTORS * FLASH_SECTOR_SIZE];
+
+void commit_all() {
+    while (image_writer_commit_next(&writer)) {
+    }
+}
+
+// Decodes the stream, split into pieces of at most piece bytes. Returns false if the decoder rejects it
+bool lzss_run(const uint8_t* stream, uint32_t len, uint32_t image_size, uint32_t piece) {
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, image_size);
+    lzss_init(&lzss);
+
+    for (uint32_t offset = 0; offset < len; offset += piece) {
+        if (!lzss_decode(&lzss, &writer, stream + offset, MIN(piece, len - offset))) {
+            return false;
+        }
+        commit_all();
+    }
+    return true;
+}
+
+void test_lzss() {
+    // "abc" then a match of 9 from 3 back, which overlaps its own output
+    uint16_t token = ((9 - LZSS_MIN_MATCH) << LZSS_DISTANCE_BITS) | (3 - 1);
+    uint8_t overlap[] = {0x07, 'a', 'b', 'c', token & 0xFF, token >> 8};
+    for (uint32_t piece = 1; piece <= sizeof(overlap); piece++) {
+        CHECK(lzss_run(overlap, sizeof(overlap), 12, piece));
+        CHECK(lzss_is_idle(&lzss) && image_writer_is_complete(&writer));
+        CHECK(memcmp(host_flash + USER_PROGRAM_OFFSET, "abcabcabcabc", 12) == 0);
+    }
+
+    // A match too long for the token is extended, here to 300 bytes: 31 + 255 + 11 + LZSS_MIN_MATCH
+    uint8_t expected[301];
+    memset(expected, 'x', sizeof(expected));
+    token = (LZSS_LENGTH_FIELD_MAX << LZSS_DISTANCE_BITS) | 0;
+    uint8_t extended[] = {0x01, 'x', token & 0xFF, token >> 8, 255, 11};
+    for (uint32_t piece = 1; piece <= sizeof(extended); piece++) {
+        CHECK(lzss_run(extended, sizeof(extended), sizeof(expected), piece));
+        CHECK(lzss_is_idle(&lzss) && image_writer_is_complete(&writer));
+        CHECK(memcmp(host_flash + USER_PROGRAM_OFFSET, expected, sizeof(expected)) == 0);
+    }
+
+    // A match reaching back before the start of the output
+    token = ((4 - LZSS_MIN_MATCH) << LZSS_DISTANCE_BITS) | (2 - 1);
+    uint8_t too_far[] = {0x01, 'a', token & 0xFF, token >> 8};
+    CHECK(!lzss_run(too_far, sizeof(too_far), 5, sizeof(too_far)));
+
+    // Output beyond the image size
+    CHECK(!lzss_run(overlap, sizeof(overlap), 8, sizeof(overlap)));
+
+    // A stream cut off within a match token, or its extension, does not end cleanly
+    CHECK(lzss_run(overlap, sizeof(overlap) - 1, 12, sizeof(overlap)) && !lzss_is_idle(&lzss));
+    CHECK(lzss_run(extended, sizeof(extended) - 2, sizeof(expected), sizeof(extended)) && !lzss_is_idle(&lzss));
+}
+
+uint32_t put_varint(uint8_t* out, uint32_t value) {
+    uint32_t len = 0;
+    do {
+        out[len] = (value & 0x7F) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+        len++;
+    } while (value);
+    return len;
+}
+
+uint32_t put_copy(uint8_t* out, int32_t src_delta, uint32_t len) {
+    uint32_t pos = 0;
+    out[pos++] = DELTA_PATCH_COPY;
+    pos += put_varint(out + pos, ((uint32_t)src_delta << 1) ^ (uint32_t)(src_delta >> 31));
+    pos += put_varint(out + pos, len);
+    return pos;
+}
+
+uint32_t put_insert(uint8_t* out, const uint8_t* data, uint32_t len) {
+    uint32_t pos = 0;
+    out[pos++] = DELTA_PATCH_INSERT;
+    pos += put_varint(out + pos, len);
+    memcpy(out + pos, data, len);
+    return pos + len;
+}
+
+// Applies the patch in-place over the image in flash, split into pieces of at most piece bytes.
+// Returns false if the patch is rejected
+bool delta_run(const uint8_t* base, uint32_t base_size, const uint8_t* data, uint32_t len, uint32_t image_size, uint32_t piece) {
+    memcpy(host_flash + USER_PROGRAM_OFFSET, base, base_size);
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, image_size);
+    image_writer_set_history(&writer, history, DELTA_PATCH_HISTORY_SECTORS);
+    delta_patch_init(&patch, base_size);
+
+    for (uint32_t offset = 0; offset < len; offset += piece) {
+        if (!delta_patch_apply(&patch, &writer, data + offset, MIN(piece, len - offset))) {
+            return false;
+        }
+        commit_all();
+    }
+    return true;
+}
+
+void test_delta() {
+    const uint32_t base_size = 8 * FLASH_SECTOR_SIZE;
+    uint8_t* base = malloc(base_size);
+    uint8_t* expected = malloc(base_size);
+    uint8_t* data = malloc(2 * FLASH_SECTOR_SIZE);
+    host_test_fill(base, base_size, 3);
+
+    // Keep the first sector, replace 100 bytes, then move the second sector to the end. The final copy
+    // reads a sector which has already been overwritten, from the history
+    memcpy(expected, base, base_size);
+    memset(expected + FLASH_SECTOR_SIZE, 0x42, 100);
+    memcpy(expected + 4 * FLASH_SECTOR_SIZE, base + FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    uint32_t len = 0;
+    len += put_copy(data + len, 0, FLASH_SECTOR_SIZE);
+    len += put_insert(data + len, expected + FLASH_SECTOR_SIZE, 100);
+    len += put_copy(data + len, 0, 3 * FLASH_SECTOR_SIZE - 100);
+    len += put_copy(data + len, -3 * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    len += put_copy(data + len, 3 * FLASH_SECTOR_SIZE, 3 * FLASH_SECTOR_SIZE);
+
+    for (uint32_t piece = 1; piece <= len; piece = piece * 3 + 1) {
+        CHECK(delta_run(base, base_size, data, len, base_size, piece));
+        CHECK(delta_patch_is_idle(&patch) && image_writer_is_complete(&writer));
+        CHECK(memcmp(host_flash + USER_PROGRAM_OFFSET, expected, base_size) == 0);
+    }
+
+    // Reading a sector overwritten too long ago to still be in the history
+    len = put_copy(data, 0, 7 * FLASH_SECTOR_SIZE);
+    len += put_copy(data + len, -7 * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    CHECK(!delta_run(base, base_size, data, len, base_size, len));
+
+    // Reading beyond the base image
+    len = put_copy(data, 0, base_size + 1);
+    CHECK(!delta_run(base, base_size, data, len, base_size + 1, len));
+    len = put_copy(data, -1, 10);
+    CHECK(!delta_run(base, base_size, data, len, 10, len));
+
+    // Output beyond the image size
+    len = put_insert(data, base, 20);
+    CHECK(!delta_run(base, base_size, data, len, 10, len));
+
+    // Unknown ops, and varints which do not fit in 32 bits
+    data[0] = 7;
+    CHECK(!delta_run(base, base_size, data, 1, 10, 1));
+    uint8_t overlong[] = {DELTA_PATCH_INSERT, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F};
+    CHECK(!delta_run(base, base_size, overlong, sizeof(overlong), 10, sizeof(overlong)));
+
+    // A patch cut off within an op does not end cleanly
+    len = put_insert(data, base, 20);
+    CHECK(delta_run(base, base_size, data, len - 5, 20, len) && !delta_patch_is_idle(&patch));
+    len = put_copy(data, 0, 300);
+    CHECK(delta_run(base, base_size, data, len - 1, 300, len) && !delta_patch_is_idle(&patch));
+
+    free(base);
+    free(expected);
+    free(data);
+}
+
+int main() {
+    if (!host_flash_init(NULL)) {
+        return 1;
+    }
+
+    test_lzss();
+    test_delta();
+
+    host_flash_deinit();
+    return host_test_result();
+}
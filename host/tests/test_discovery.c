@@ -0,0 +1,90 @@
+// Discovery: the device broadcasts that it is ready once the OTA server starts, and answers queries
+// with what it has installed
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cyw43.h"
+#include "host_emulation.h"
+#include "host_test.h"
+#include "pico/stdlib.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/ota_discovery.h"
+#include "pico_wifi_boot/ota_server.h"
+
+#define IMAGE_SIZE (2 * FLASH_SECTOR_SIZE + 10)
+#define TOOL_PORT 40001
+
+struct __attribute__((__packed__)) DiscoveryInfo {
+    uint8_t magic_code[4];
+    uint8_t board_id[8];
+    uint16_t ota_port;
+    uint8_t in_bootloader;
+    uint8_t active_slot;
+    uint8_t target_slot;
+    int8_t rssi;
+    uint8_t reserved[2];
+    uint32_t image_size;
+    uint32_t image_checksum;
+    uint32_t max_image_size;
+};
+
+bool query(struct DiscoveryInfo* info) {
+    if (!host_udp_send(HOST_DEVICE_ADDR, OTA_DISCOVERY_PORT, TOOL_PORT, "OTDQ", 4)) {
+        return false;
+    }
+
+    ip_addr_t dest;
+    uint16_t dest_port;
+    ip_addr_t peer;
+    ipaddr_aton(HOST_PEER_ADDR, &peer);
+    return host_udp_read(OTA_DISCOVERY_PORT, info, sizeof(*info), &dest, &dest_port) == sizeof(*info)
+        && memcmp(info->magic_code, "OTDI", 4) == 0 && dest.addr == peer.addr && dest_port == TOOL_PORT;
+}
+
+int main() {
+    if (!host_flash_init(NULL) || !ota_init(OTA_PORT)) {
+        return 1;
+    }
+
+    // The first beacon goes out straight away, and the rest follow on a timer
+    host_poll();
+    uint8_t beacon[16];
+    ip_addr_t dest;
+    uint16_t dest_port;
+    CHECK(host_udp_read(OTA_DISCOVERY_PORT, beacon, sizeof(beacon), &dest, &dest_port) == 7);
+    CHECK(memcmp(beacon, "OTDR", 4) == 0);
+    CHECK(dest.addr == IP_ADDR_BROADCAST->addr && dest_port == OTA_DISCOVERY_PORT);
+    uint16_t ota_port;
+    memcpy(&ota_port, beacon + 4, sizeof(ota_port));
+    CHECK(ota_port == OTA_PORT && beacon[6] == 1);
+    CHECK(host_udp_read(OTA_DISCOVERY_PORT, beacon, sizeof(beacon), &dest, &dest_port) == 0);
+
+    sleep_ms(OTA_BEACON_INTERVAL_MS);
+    host_poll();
+    CHECK(host_udp_read(OTA_DISCOVERY_PORT, beacon, sizeof(beacon), &dest, &dest_port) == 7);
+
+    // Beacons from other devices are not answered
+    CHECK(host_udp_send(HOST_DEVICE_ADDR, OTA_DISCOVERY_PORT, TOOL_PORT, beacon, 7));
+    CHECK(host_udp_read(OTA_DISCOVERY_PORT, beacon, sizeof(beacon), &dest, &dest_port) == 0);
+
+    // Nothing is reported installed until an image has been flashed through OTA
+    struct DiscoveryInfo info;
+    CHECK(query(&info));
+    CHECK(info.board_id[0] == 1 && info.board_id[7] == 8);
+    CHECK(info.ota_port == OTA_PORT && info.in_bootloader == 1);
+    CHECK(info.active_slot == 0 && info.target_slot == 0);
+    CHECK(info.rssi == HOST_WIFI_RSSI);
+    CHECK(info.image_size == 0 && info.image_checksum == 0);
+    CHECK(info.max_image_size == USER_PROGRAM_MAX_SIZE);
+
+    uint8_t* image = malloc(IMAGE_SIZE);
+    host_test_fill(image, IMAGE_SIZE, 6);
+    CHECK(host_test_upload(image, IMAGE_SIZE) == 0);
+    CHECK(query(&info));
+    CHECK(info.image_size == IMAGE_SIZE && info.image_checksum == host_test_crc32(image, IMAGE_SIZE));
+
+    free(image);
+    host_flash_deinit();
+    return host_test_result();
+}
@@ -0,0 +1,188 @@
+// Image writer: unchanged sectors are skipped, interrupted images resume, and bad sectors are caught
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "host_test.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/image_writer.h"
+
+// Three blocks and a partial sector
+#define IMAGE_SIZE (3 * FLASH_BLOCK_SIZE + 10000)
+#define IMAGE_SECTORS ((IMAGE_SIZE + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE)
+
+struct ImageWriter writer;
+
+// Feeds the image from offset until the writer has taken count bytes, in pieces which do not line up
+// with sectors, committing one sector between pieces as the commit worker would
+void feed(const uint8_t* image, uint32_t offset, uint32_t count) {
+    while (count) {
+        uint32_t available;
+        uint8_t* dest = image_writer_reserve(&writer, &available);
+        if (!CHECK(dest != NULL)) {
+            return;
+        }
+        available = MIN(MIN(available, count), 1000);
+        memcpy(dest, image + offset, available);
+        image_writer_advance(&writer, available);
+        offset += available;
+        count -= available;
+
+        image_writer_commit_next(&writer);
+    }
+
+    while (image_writer_commit_next(&writer)) {
+    }
+}
+
+bool flash_matches(const uint8_t* image) {
+    return memcmp(host_flash + USER_PROGRAM_OFFSET, image, IMAGE_SIZE) == 0;
+}
+
+void test_fresh(const uint8_t* image) {
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, IMAGE_SIZE);
+    feed(image, 0, IMAGE_SIZE);
+
+    CHECK(image_writer_is_complete(&writer));
+    CHECK(!writer.write_failed);
+    CHECK(flash_matches(image));
+    CHECK(writer.image_crc == host_test_crc32(image, IMAGE_SIZE));
+    CHECK(writer.sectors_written == IMAGE_SECTORS);
+    // Blocks entirely within the image are erased ahead, the partial ones around them are not
+    uint32_t first_block = (USER_PROGRAM_OFFSET + FLASH_BLOCK_SIZE - 1) / FLASH_BLOCK_SIZE * FLASH_BLOCK_SIZE;
+    CHECK(writer.blocks_erased == (USER_PROGRAM_OFFSET + IMAGE_SIZE - first_block) / FLASH_BLOCK_SIZE);
+    CHECK(image_writer_find_corrupt_sector(&writer) == -1);
+
+    // The final sector is padded to match erased flash
+    uint8_t* tail = host_flash + USER_PROGRAM_OFFSET + IMAGE_SIZE;
+    bool erased = true;
+    for (uint32_t i = 0; i < IMAGE_SECTORS * FLASH_SECTOR_SIZE - IMAGE_SIZE; i++) {
+        erased = erased && tail[i] == 0xFF;
+    }
+    CHECK(erased);
+}
+
+void test_unchanged(const uint8_t* image) {
+    struct HostFlashStats before;
+    struct HostFlashStats after;
+    host_flash_get_stats(&before);
+
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, IMAGE_SIZE);
+    feed(image, 0, IMAGE_SIZE);
+
+    host_flash_get_stats(&after);
+    CHECK(after.erase_count == before.erase_count && after.program_count == before.program_count);
+    CHECK(writer.sectors_skipped == IMAGE_SECTORS && writer.sectors_written == 0);
+    CHECK(writer.image_crc == host_test_crc32(image, IMAGE_SIZE));
+}
+
+void test_changed_sector(uint8_t* image) {
+    image[5 * FLASH_SECTOR_SIZE + 1] ^= 0xFF;
+
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, IMAGE_SIZE);
+    feed(image, 0, IMAGE_SIZE);
+
+    // A change within a block only rewrites its sector
+    CHECK(flash_matches(image));
+    CHECK(writer.sectors_written == 1 && writer.blocks_erased == 0);
+    CHECK(writer.sectors_skipped == IMAGE_SECTORS - 1);
+}
+
+void test_changed_block_starts(uint8_t* image) {
+    uint32_t first_block = (USER_PROGRAM_OFFSET + FLASH_BLOCK_SIZE - 1) / FLASH_BLOCK_SIZE * FLASH_BLOCK_SIZE;
+    uint32_t blocks = (USER_PROGRAM_OFFSET + IMAGE_SIZE - first_block) / FLASH_BLOCK_SIZE;
+    for (uint32_t block = 0; block < blocks; block++) {
+        image[first_block - USER_PROGRAM_OFFSET + block * FLASH_BLOCK_SIZE] ^= 0xFF;
+    }
+
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, IMAGE_SIZE);
+    feed(image, 0, IMAGE_SIZE);
+
+    // A changed first sector alone does not justify erasing the rest of its block
+    CHECK(flash_matches(image));
+    CHECK(writer.sectors_written == blocks && writer.blocks_erased == 0);
+}
+
+void test_changed_tail(uint8_t* image) {
+    // Everything after the first sector of the first whole block changes
+    uint32_t first_block = (USER_PROGRAM_OFFSET + FLASH_BLOCK_SIZE - 1) / FLASH_BLOCK_SIZE * FLASH_BLOCK_SIZE;
+    uint32_t unchanged = (first_block - USER_PROGRAM_OFFSET) / FLASH_SECTOR_SIZE + 1;
+    for (uint32_t i = unchanged * FLASH_SECTOR_SIZE; i < IMAGE_SIZE; i++) {
+        image[i] ^= 0x3C;
+    }
+
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, IMAGE_SIZE);
+    feed(image, 0, IMAGE_SIZE);
+
+    // The first block is judged by the unchanged sectors before it and rewritten sector by sector,
+    // the later ones by the changed sectors before them and erased whole
+    CHECK(flash_matches(image));
+    CHECK(writer.sectors_skipped == unchanged);
+    CHECK(writer.blocks_erased == (USER_PROGRAM_OFFSET + IMAGE_SIZE - first_block) / FLASH_BLOCK_SIZE - 1);
+}
+
+void test_resume(uint8_t* image) {
+    for (uint32_t i = 0; i < IMAGE_SIZE; i++) {
+        image[i] ^= 0x5A;
+    }
+
+    // The first upload is cut off after ten sectors
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, IMAGE_SIZE);
+    feed(image, 0, 10 * FLASH_SECTOR_SIZE);
+    CHECK(writer.bytes_committed == 10 * FLASH_SECTOR_SIZE);
+
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, IMAGE_SIZE);
+    image_writer_resume(&writer, 10 * FLASH_SECTOR_SIZE);
+    feed(image, 10 * FLASH_SECTOR_SIZE, IMAGE_SIZE - 10 * FLASH_SECTOR_SIZE);
+
+    CHECK(image_writer_is_complete(&writer));
+    CHECK(flash_matches(image));
+    // Checksums of the sectors written before the resume are taken from flash
+    CHECK(writer.image_crc == host_test_crc32(image, IMAGE_SIZE));
+    CHECK(writer.sector_crcs[0] == host_test_crc32(image, FLASH_SECTOR_SIZE));
+    CHECK(image_writer_find_corrupt_sector(&writer) == -1);
+
+    // Flash which changes after it was written is traced to its sector
+    host_flash[USER_PROGRAM_OFFSET + 7 * FLASH_SECTOR_SIZE + 3] ^= 0x01;
+    CHECK(image_writer_find_corrupt_sector(&writer) == 7);
+    host_flash[USER_PROGRAM_OFFSET + 7 * FLASH_SECTOR_SIZE + 3] ^= 0x01;
+}
+
+void test_write_failure(uint8_t* image) {
+    for (uint32_t i = 0; i < IMAGE_SIZE; i++) {
+        image[i] ^= 0xFF;
+    }
+
+    // Flash stops responding partway through, after which nothing more is written
+    image_writer_init(&writer, USER_PROGRAM_OFFSET, IMAGE_SIZE);
+    host_flash_cut_power_after(20);
+    feed(image, 0, IMAGE_SIZE);
+    host_flash_restore_power();
+
+    CHECK(image_writer_is_complete(&writer));
+    CHECK(writer.write_failed);
+    CHECK(writer.failed_sector < IMAGE_SECTORS);
+    CHECK(!flash_matches(image));
+}
+
+int main() {
+    if (!host_flash_init(NULL)) {
+        return 1;
+    }
+
+    uint8_t* image = malloc(IMAGE_SIZE);
+    host_test_fill(image, IMAGE_SIZE, 2);
+
+    test_fresh(image);
+    test_unchanged(image);
+    test_changed_sector(image);
+    test_changed_block_starts(image);
+    test_changed_tail(image);
+    test_resume(image);
+    test_write_failure(image);
+
+    free(image);
+    host_flash_deinit();
+    return host_test_result();
+}
@@ -0,0 +1,87 @@
+// OTA journal: the last intact record describes the interrupted upload, and a record cut off by
+// power loss is never trusted
+
+#include "host_emulation.h"
+#include "host_test.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/ota_journal.h"
+
+#define JOURNAL_RECORDS (FLASH_SECTOR_SIZE / sizeof(struct OtaJournalRecord))
+
+void test_find() {
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 100000, 0x1234) == 0);
+
+    CHECK(ota_journal_append(USER_PROGRAM_OFFSET, 100000, 0x1234, FLASH_SECTOR_SIZE));
+    CHECK(ota_journal_append(USER_PROGRAM_OFFSET, 100000, 0x1234, 2 * FLASH_SECTOR_SIZE));
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 100000, 0x1234) == 2 * FLASH_SECTOR_SIZE);
+
+    // Only the same image can be resumed
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 100000, 0x4321) == 0);
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 100001, 0x1234) == 0);
+
+    // Nor can it be resumed into another slot, as once an A/B upload boots and the target changes
+    CHECK(ota_journal_find(USER_SLOT_OFFSET(1), 100000, 0x1234) == 0);
+
+    ota_journal_clear();
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 100000, 0x1234) == 0);
+
+    // Clearing an empty journal does not erase it again
+    struct HostFlashStats before;
+    struct HostFlashStats after;
+    host_flash_get_stats(&before);
+    ota_journal_clear();
+    host_flash_get_stats(&after);
+    CHECK(after.erase_count == before.erase_count);
+}
+
+void test_wrap() {
+    // Filling the sector erases it and starts over, so the latest record is still found
+    for (uint32_t i = 1; i <= JOURNAL_RECORDS + 10; i++) {
+        CHECK(ota_journal_append(USER_PROGRAM_OFFSET, 200000, 0x5678, i * FLASH_SECTOR_SIZE));
+    }
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 200000, 0x5678) == (JOURNAL_RECORDS + 10) * FLASH_SECTOR_SIZE);
+    ota_journal_clear();
+}
+
+void test_power_loss() {
+    CHECK(ota_journal_append(USER_PROGRAM_OFFSET, 300000, 0x9ABC, FLASH_SECTOR_SIZE));
+
+    // Every record position within a page, so that both halves of a page are cut off at some point
+    for (uint32_t i = 2; i < 2 + FLASH_PAGE_SIZE / sizeof(struct OtaJournalRecord); i++) {
+        host_flash_cut_power_after(0);
+        CHECK(!ota_journal_append(USER_PROGRAM_OFFSET, 300000, 0x9ABC, i * FLASH_SECTOR_SIZE));
+        host_flash_restore_power();
+
+        // The cut off record is not trusted, which at worst restarts the upload
+        CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 300000, 0x9ABC) == 0);
+
+        // Later records are still found after it
+        CHECK(ota_journal_append(USER_PROGRAM_OFFSET, 300000, 0x9ABC, i * FLASH_SECTOR_SIZE));
+        CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 300000, 0x9ABC) == i * FLASH_SECTOR_SIZE);
+    }
+
+    // Power lost while erasing a full journal leaves nothing to resume
+    ota_journal_clear();
+    for (uint32_t i = 0; i < JOURNAL_RECORDS; i++) {
+        ota_journal_append(USER_PROGRAM_OFFSET, 300000, 0x9ABC, FLASH_SECTOR_SIZE);
+    }
+    host_flash_cut_power_after(0);
+    CHECK(!ota_journal_append(USER_PROGRAM_OFFSET, 300000, 0x9ABC, 2 * FLASH_SECTOR_SIZE));
+    host_flash_restore_power();
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 300000, 0x9ABC) == 0);
+    CHECK(ota_journal_append(USER_PROGRAM_OFFSET, 300000, 0x9ABC, 3 * FLASH_SECTOR_SIZE));
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, 300000, 0x9ABC) == 3 * FLASH_SECTOR_SIZE);
+}
+
+int main() {
+    if (!host_flash_init(NULL)) {
+        return 1;
+    }
+
+    test_find();
+    test_wrap();
+    test_power_loss();
+
+    host_flash_deinit();
+    return host_test_result();
+}
@@ -0,0 +1,143 @@
+// Multicast sessions: a device joined over TCP assembles the image from the group, reports the
+// sectors it is missing, and only reboots into a complete image
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "host_test.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/ota_journal.h"
+#include "pico_wifi_boot/ota_multicast.h"
+#include "pico_wifi_boot/ota_server.h"
+
+#define IMAGE_SIZE (6 * FLASH_SECTOR_SIZE + 1500)
+#define IMAGE_SECTORS ((IMAGE_SIZE + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE)
+#define UPLOADER_PORT 40000
+
+uint8_t packet[12 + OTA_MULTICAST_CHUNK_SIZE];
+
+void send_header(char type, uint32_t checksum) {
+    memcpy(packet, "OTM", 3);
+    packet[3] = type;
+    memcpy(packet + 4, &checksum, sizeof(checksum));
+}
+
+bool send_sector(const uint8_t* image, uint32_t checksum, uint16_t sector) {
+    bool delivered = true;
+    uint32_t sector_len = MIN(FLASH_SECTOR_SIZE, IMAGE_SIZE - sector * FLASH_SECTOR_SIZE);
+    for (uint8_t chunk = 0; chunk * OTA_MULTICAST_CHUNK_SIZE < sector_len; chunk++) {
+        uint32_t chunk_len = MIN(OTA_MULTICAST_CHUNK_SIZE, sector_len - chunk * OTA_MULTICAST_CHUNK_SIZE);
+        send_header('D', checksum);
+        memcpy(packet + 8, &sector, sizeof(sector));
+        packet[10] = chunk;
+        packet[11] = 0;
+        memcpy(packet + 12, image + sector * FLASH_SECTOR_SIZE + chunk * OTA_MULTICAST_CHUNK_SIZE, chunk_len);
+        delivered = host_udp_send(OTA_MULTICAST_GROUP, OTA_MULTICAST_PORT, UPLOADER_PORT, packet, 12 + chunk_len)
+            && delivered;
+    }
+
+    // Let the sector be committed before the next arrives
+    host_poll();
+    return delivered;
+}
+
+// Queries the group, returning the device's status and setting the missing sector bitmap
+int query(uint32_t checksum, uint16_t* missing_count, uint8_t* missing) {
+    send_header('Q', checksum);
+    if (!host_udp_send(OTA_MULTICAST_GROUP, OTA_MULTICAST_PORT, UPLOADER_PORT, packet, 8)) {
+        return -1;
+    }
+
+    uint8_t status[64];
+    ip_addr_t dest;
+    uint16_t dest_port;
+    uint32_t len = host_udp_read(OTA_MULTICAST_PORT, status, sizeof(status), &dest, &dest_port);
+    ip_addr_t peer;
+    ipaddr_aton(HOST_PEER_ADDR, &peer);
+    if (len < 11 || memcmp(status, "OTMS", 4) != 0 || dest.addr != peer.addr || dest_port != UPLOADER_PORT) {
+        return -1;
+    }
+
+    memcpy(missing_count, status + 9, sizeof(*missing_count));
+    memcpy(missing, status + 11, len - 11);
+    return status[8];
+}
+
+int main() {
+    if (!host_flash_init(NULL) || !ota_init(OTA_PORT)) {
+        return 1;
+    }
+
+    uint8_t* image = malloc(IMAGE_SIZE);
+    host_test_fill(image, IMAGE_SIZE, 5);
+    uint32_t checksum = host_test_crc32(image, IMAGE_SIZE);
+
+    // Nothing is received from the group before joining it
+    CHECK(!host_igmp_is_member(OTA_MULTICAST_GROUP));
+    CHECK(!send_sector(image, checksum, 0));
+
+    // Nor if the commit worker cannot be added, in which case the group is left again
+    host_async_refuse_workers(true);
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, 'M', IMAGE_SIZE, checksum, NULL, 0);
+    CHECK(host_test_read_response(pcb) == 7);
+    CHECK(!host_igmp_is_member(OTA_MULTICAST_GROUP));
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+    host_async_refuse_workers(false);
+
+    // Joining overwrites the slot, so a later 'R' or 'C' must not resume an upload journaled before
+    CHECK(ota_journal_append(USER_PROGRAM_OFFSET, IMAGE_SIZE, checksum, 2 * FLASH_SECTOR_SIZE));
+    pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, 'M', IMAGE_SIZE, checksum, NULL, 0);
+    CHECK(host_test_read_response(pcb) == 0);
+    CHECK(host_igmp_is_member(OTA_MULTICAST_GROUP));
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, IMAGE_SIZE, checksum) == 0);
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+
+    // Uploads over TCP would write the same slot, so they wait for the session
+    uint32_t offset;
+    pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, 'R', IMAGE_SIZE, checksum, NULL, 0);
+    CHECK(host_test_read_resume_response(pcb, &offset) == 8);
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+
+    // The first round loses sector 2, and packets of another session are ignored
+    for (uint16_t sector = 0; sector < IMAGE_SECTORS; sector++) {
+        if (sector != 2) {
+            CHECK(send_sector(image, checksum, sector));
+        }
+    }
+    uint8_t* other = malloc(IMAGE_SIZE);
+    memset(other, 0, IMAGE_SIZE);
+    send_sector(other, checksum ^ 1, 2);
+    free(other);
+
+    uint16_t missing_count;
+    uint8_t missing[8];
+    CHECK(query(checksum, &missing_count, missing) == 0);
+    CHECK(missing_count == 1 && missing[0] == 1 << 2);
+
+    // Finishing does not reboot into an incomplete image
+    uint32_t reboots = host_reboot_count();
+    send_header('F', checksum);
+    host_udp_send(OTA_MULTICAST_GROUP, OTA_MULTICAST_PORT, UPLOADER_PORT, packet, 8);
+    CHECK(host_reboot_count() == reboots);
+
+    // The next round only resends what was missing
+    CHECK(send_sector(image, checksum, 2));
+    CHECK(query(checksum, &missing_count, missing) == 1);
+    CHECK(missing_count == 0);
+    CHECK(memcmp(host_flash + USER_PROGRAM_OFFSET, image, IMAGE_SIZE) == 0);
+
+    send_header('F', checksum);
+    host_udp_send(OTA_MULTICAST_GROUP, OTA_MULTICAST_PORT, UPLOADER_PORT, packet, 8);
+    CHECK(host_reboot_count() == reboots + 1);
+
+    free(image);
+    host_flash_deinit();
+    return host_test_result();
+}
@@ -0,0 +1,256 @@
+// Request parsing: headers must be recognized however TCP splits them, and anything malformed drops
+// the connection without touching flash
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_emulation.h"
+#include "host_test.h"
+#include "lwip/opt.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/ota_journal.h"
+#include "pico_wifi_boot/ota_server.h"
+#include "pico_wifi_boot/ota_stats.h"
+
+#define IMAGE_SIZE (3 * FLASH_SECTOR_SIZE + 100)
+
+void test_bad_magic() {
+    struct HostFlashStats before;
+    struct HostFlashStats after;
+    host_flash_get_stats(&before);
+
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    uint8_t request[12] = "XYZ\n";
+    host_tcp_send(pcb, request, sizeof(request), TCP_MSS);
+    CHECK(!host_tcp_is_open(pcb));
+    host_tcp_release(pcb);
+
+    // A known prefix with an unknown request type is just as bad
+    pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, 'q', IMAGE_SIZE, 0, NULL, 0);
+    CHECK(!host_tcp_is_open(pcb));
+    host_tcp_release(pcb);
+
+    host_flash_get_stats(&after);
+    CHECK(after.erase_count == before.erase_count && after.program_count == before.program_count);
+}
+
+void test_oversize() {
+    // More bytes than the request structure before any response
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    uint8_t request[40];
+    memset(request, 0, sizeof(request));
+    memcpy(request, "OTA\n", 4);
+    host_tcp_send(pcb, request, sizeof(request), TCP_MSS);
+    CHECK(!host_tcp_is_open(pcb));
+    host_tcp_release(pcb);
+
+    // An image which does not fit is refused with a response
+    pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, '\n', USER_PROGRAM_MAX_SIZE + 1, 0, NULL, 0);
+    CHECK(host_test_read_response(pcb) == 1);
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+
+    // So is a patch against a base which could not be installed
+    pcb = host_tcp_connect(OTA_PORT);
+    uint32_t delta_fields[] = {IMAGE_SIZE, USER_PROGRAM_MAX_SIZE + 1, 0};
+    host_test_send_request(pcb, 'D', 16, 0, delta_fields, 3);
+    CHECK(host_test_read_response(pcb) == 1);
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+}
+
+void test_split_header(uint8_t* image) {
+    uint8_t request[12];
+    uint32_t image_size = IMAGE_SIZE;
+    uint32_t checksum = host_test_crc32(image, IMAGE_SIZE);
+    memcpy(request, "OTA\n", 4);
+    memcpy(request + 4, &image_size, sizeof(image_size));
+    memcpy(request + 8, &checksum, sizeof(checksum));
+
+    // One byte per segment, including within the magic code
+    for (uint16_t segment_size = 1; segment_size <= 5; segment_size += 2) {
+        image[0] = segment_size;
+        checksum = host_test_crc32(image, IMAGE_SIZE);
+        memcpy(request + 8, &checksum, sizeof(checksum));
+
+        struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+        host_tcp_send(pcb, request, sizeof(request), segment_size);
+        CHECK(host_tcp_is_open(pcb));
+        CHECK(host_test_read_response(pcb) == 0);
+
+        host_tcp_send(pcb, image, IMAGE_SIZE, TCP_MSS);
+        host_poll();
+        CHECK(host_test_read_response(pcb) == 0);
+        CHECK(memcmp(host_flash + USER_PROGRAM_OFFSET, image, IMAGE_SIZE) == 0);
+        host_tcp_close(pcb);
+        host_tcp_release(pcb);
+    }
+
+    // Info requests are answered however they arrive, and leave the connection open for another
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    memcpy(request, "OTAI", 4);
+    host_tcp_send(pcb, request, 7, TCP_MSS);
+    uint8_t response[14];
+    CHECK(host_tcp_read(pcb, response, sizeof(response)) == 0);
+    host_tcp_send(pcb, request + 7, 5, TCP_MSS);
+    CHECK(host_tcp_read(pcb, response, sizeof(response)) == sizeof(response));
+    CHECK(memcmp(response, "OTA\n", 4) == 0 && response[4] == 0);
+
+    uint32_t installed_checksum;
+    memcpy(&installed_checksum, response + 9, sizeof(installed_checksum));
+    CHECK(installed_checksum == checksum);
+
+    host_tcp_send(pcb, request, sizeof(request), TCP_MSS);
+    CHECK(host_tcp_read(pcb, response, sizeof(response)) == sizeof(response));
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+}
+
+void test_payload_overrun(uint8_t* image) {
+    // Payload bytes beyond the announced size drop the connection
+    image[0] ^= 0xFF;
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, '\n', IMAGE_SIZE, host_test_crc32(image, IMAGE_SIZE), NULL, 0);
+    CHECK(host_test_read_response(pcb) == 0);
+
+    uint8_t* overrun = malloc(IMAGE_SIZE + 10);
+    memcpy(overrun, image, IMAGE_SIZE);
+    host_tcp_send(pcb, overrun, IMAGE_SIZE + 10, IMAGE_SIZE + 10);
+    CHECK(!host_tcp_is_open(pcb));
+    host_tcp_release(pcb);
+    free(overrun);
+    host_poll();
+}
+
+void test_busy(uint8_t* image) {
+    image[0] ^= 0x5A;
+    uint32_t checksum = host_test_crc32(image, IMAGE_SIZE);
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, 'R', IMAGE_SIZE, checksum, NULL, 0);
+    uint32_t offset;
+    CHECK(host_test_read_resume_response(pcb, &offset) == 0 && offset == 0);
+    host_tcp_send(pcb, image, FLASH_SECTOR_SIZE + 100, TCP_MSS);
+    host_poll();
+
+    // Other uploads and multicast sessions are refused while it is in progress
+    struct tcp_pcb* other = host_tcp_connect(OTA_PORT);
+    host_test_send_request(other, '\n', IMAGE_SIZE, checksum ^ 1, NULL, 0);
+    CHECK(host_test_read_response(other) == 8);
+    host_tcp_close(other);
+    host_tcp_release(other);
+
+    other = host_tcp_connect(OTA_PORT);
+    host_test_send_request(other, 'M', IMAGE_SIZE, checksum, NULL, 0);
+    CHECK(host_test_read_response(other) == 8);
+    host_tcp_close(other);
+    host_tcp_release(other);
+
+    // A resume of the same image takes over from the connection it replaces, which is dropped
+    other = host_tcp_connect(OTA_PORT);
+    host_test_send_request(other, 'R', IMAGE_SIZE, checksum, NULL, 0);
+    CHECK(host_test_read_resume_response(other, &offset) == 0 && offset == FLASH_SECTOR_SIZE);
+    CHECK(!host_tcp_is_open(pcb));
+    host_tcp_release(pcb);
+
+    host_tcp_send(other, image + offset, IMAGE_SIZE - offset, TCP_MSS);
+    host_poll();
+    CHECK(host_test_read_response(other) == 0);
+    CHECK(memcmp(host_flash + USER_PROGRAM_OFFSET, image, IMAGE_SIZE) == 0);
+    host_tcp_close(other);
+    host_tcp_release(other);
+    host_poll();
+}
+
+void test_network_wait() {
+    uint32_t image_size = 16 * FLASH_SECTOR_SIZE;
+    uint8_t* image = malloc(image_size);
+    host_test_fill(image, image_size, 3);
+
+    struct HostFlashLatency latency = HOST_FLASH_TYPICAL_LATENCY;
+    host_flash_set_latency(&latency);
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, '\n', image_size, host_test_crc32(image, image_size), NULL, 0);
+    CHECK(host_test_read_response(pcb) == 0);
+
+    // The sender fills the window as soon as it opens, so any time spent waiting for it is the
+    // sector commits
+    uint32_t offset = 0;
+    while (offset < image_size && host_tcp_is_open(pcb)) {
+        uint32_t len = MIN(host_tcp_window(pcb), image_size - offset);
+        if (len) {
+            host_tcp_send(pcb, image + offset, len, TCP_MSS);
+            offset += len;
+        } else {
+            host_poll_once();
+        }
+    }
+    host_poll();
+    CHECK(host_test_read_response(pcb) == 0);
+    host_flash_set_latency(NULL);
+
+    // Which is not counted as waiting for the network
+    const struct OtaStats* stats = ota_stats_get();
+    CHECK(stats->phase_us[OTA_STATS_ERASE] >= 8 * 45000);
+    CHECK(stats->phase_us[OTA_STATS_NETWORK_WAIT] < 45000);
+
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+    host_poll();
+    free(image);
+}
+
+void test_journal_progress() {
+    uint32_t image_size = 16 * FLASH_SECTOR_SIZE;
+    uint8_t* image = malloc(image_size);
+    host_test_fill(image, image_size, 4);
+    uint32_t checksum = host_test_crc32(image, image_size);
+
+    // Sectors committed in-line, for a sender which ignores the window, are journaled too
+    struct tcp_pcb* pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, 'R', image_size, checksum, NULL, 0);
+    uint32_t offset;
+    CHECK(host_test_read_resume_response(pcb, &offset) == 0 && offset == 0);
+    host_tcp_send(pcb, image, 10 * FLASH_SECTOR_SIZE, TCP_MSS);
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, image_size, checksum) >= 8 * FLASH_SECTOR_SIZE);
+    host_tcp_send(pcb, image + 10 * FLASH_SECTOR_SIZE, image_size - 10 * FLASH_SECTOR_SIZE, TCP_MSS);
+    host_poll();
+    CHECK(host_test_read_response(pcb) == 0);
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+    host_poll();
+
+    // Sending the same image again writes nothing, so there is nothing to journal
+    pcb = host_tcp_connect(OTA_PORT);
+    host_test_send_request(pcb, 'R', image_size, checksum, NULL, 0);
+    CHECK(host_test_read_resume_response(pcb, &offset) == 0 && offset == 0);
+    host_tcp_send(pcb, image, 10 * FLASH_SECTOR_SIZE, TCP_MSS);
+    host_poll();
+    CHECK(ota_journal_find(USER_PROGRAM_OFFSET, image_size, checksum) == 0);
+    host_tcp_close(pcb);
+    host_tcp_release(pcb);
+    host_poll();
+    free(image);
+}
+
+int main() {
+    if (!host_flash_init(NULL) || !ota_init(OTA_PORT)) {
+        return 1;
+    }
+
+    uint8_t* image = malloc(IMAGE_SIZE);
+    host_test_fill(image, IMAGE_SIZE, 1);
+
+    test_bad_magic();
+    test_oversize();
+    test_split_header(image);
+    test_payload_overrun(image);
+    test_busy(image);
+    test_network_wait();
+    test_journal_progress();
+
+    free(image);
+    host_flash_deinit();
+    return host_test_result();
+}
@@ -0,0 +1,69 @@
+#ifndef __PICO_WIFI_BOOT_BOOT_IMAGE_H__
+#define __PICO_WIFI_BOOT_BOOT_IMAGE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Check user programs at boot against the size and checksum recorded when they were flashed
+#ifndef BOOT_IMAGE_CHECK
+#define BOOT_IMAGE_CHECK 1
+#endif
+
+enum BootImageState {
+    // An upload to the slot has started, so whatever is there cannot be trusted
+    BOOT_IMAGE_WRITING = 1,
+    // An upload completed, but the image has not been checked at boot yet
+    BOOT_IMAGE_COMMITTED = 2,
+    // The whole image matched its checksum at boot, so later boots only check its vector table
+    BOOT_IMAGE_VALIDATED = 3,
+    // A staged image (see WIFI_BOOT_STAGING) has been copied into slot 0, whose own record now
+    // stands for it
+    BOOT_IMAGE_INSTALLED = 4,
+};
+
+// The image record sector is a record log (see flash.h), the last record for each slot being current
+struct BootImageRecord {
+    // Image sizes are well below 0xFFFFFFFF, so records never look erased
+    uint32_t image_size;
+    uint32_t image_checksum;
+    uint8_t slot;
+    uint8_t state;
+    uint8_t reserved[2];
+    // CRC of the fields above, so that a record interrupted by power loss is not trusted
+    uint32_t record_crc;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Records that an image of image_size bytes is about to be written to the slot. Returns false if
+// the record could not be written
+bool boot_image_begin(uint8_t slot, uint32_t image_size);
+
+// Records the checksum of an image written to the slot and verified, to be checked again on the
+// next boot. Returns false if the record could not be written
+bool boot_image_commit(uint8_t slot, uint32_t image_size, uint32_t image_checksum);
+
+// Reads the size and checksum recorded for the complete image in the slot. Returns false if an upload
+// to the slot is under way, or it was flashed other than through OTA
+bool boot_image_installed(uint8_t slot, uint32_t* image_size, uint32_t* image_checksum);
+
+// Called by the bootloader before choosing the program to start. With WIFI_BOOT_STAGING, an image
+// committed to BOOT_STAGING_SLOT is checked against its checksum and copied into slot 0, only
+// writing sectors which differ. Slot 0 is recorded as being written until the copy completes, and
+// the staged image stays committed until then, so a copy interrupted by power loss starts over on
+// the next boot
+void boot_image_install_staged();
+
+// Called by the bootloader before starting the program in the slot. A newly committed image is
+// checksummed in full, and marked validated if it matches. Returns false if the image was not
+// completely written, or does not match its checksum. Images flashed other than through OTA have
+// no record, and are assumed to be good
+bool boot_image_check(uint8_t slot);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef __PICO_WIFI_BOOT_BOOT_SLOTS_H__
+#define __PICO_WIFI_BOOT_BOOT_SLOTS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_wifi_boot/flash.h"
+
+// A newly flashed program runs under the watchdog until it calls boot_slots_confirm(). If the
+// watchdog fires first, the bootloader falls back to the previous slot.
+// Note: the RP2040 watchdog cannot be set beyond about 8.3 seconds; programs which need longer to
+// judge their health must call watchdog_update() meanwhile
+#ifndef BOOT_CONFIRM_TIMEOUT_MS
+#define BOOT_CONFIRM_TIMEOUT_MS 8000
+#endif
+
+#define BOOT_RECORD_MAGIC 0x544F4F42 // "BOOT"
+
+// Each boot record sector is a record log (see flash.h). Records are appended to one sector until it
+// is full, then the other is erased and takes over, so the current record (the valid one with the
+// highest sequence) is left intact until a newer one has been written
+struct BootRecord {
+    uint32_t magic;
+    uint8_t active_slot;
+    bool confirmed;
+    // Slot to return to if the active slot is not confirmed
+    uint8_t fallback_slot;
+    uint8_t reserved;
+    // One more than the record it replaces
+    uint32_t sequence;
+    // CRC of the fields above, so that a record interrupted by power loss is not trusted
+    uint32_t record_crc;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Slot holding the installed program. Always 0 without WIFI_BOOT_AB_SLOTS
+uint8_t boot_slots_active();
+
+// Slot which OTA should write, leaving the installed program intact where possible. This is
+// BOOT_STAGING_SLOT with WIFI_BOOT_STAGING
+uint8_t boot_slots_target();
+
+// Slot which programs written to the target slot must be built to run from. Staged programs are
+// installed into slot 0 before they run
+uint8_t boot_slots_target_link();
+
+// True if the program in the slot was built to run from there (see wifi_boot_user_program_bin)
+bool boot_slots_image_valid(uint8_t slot);
+
+// Makes a freshly written slot active, on trial until confirmed. Returns false if the boot record
+// could not be written. Without WIFI_BOOT_AB_SLOTS there is nothing to record, a staged program
+// being installed once its image is committed (see boot_image.h)
+bool boot_slots_activate(uint8_t slot);
+
+// Chooses the slot to boot, falling back if the active program failed to confirm itself on its
+// previous boot, and arms the watchdog for a program on trial. Returns false if there is no valid
+// program to boot
+bool boot_slots_select(uint8_t* slot);
+
+// Called by the bootloader when the program in the selected slot fails its image check (see
+// boot_image.h). A program on trial is given up on like one which failed to confirm itself, and
+// slot is set to the previous one. Returns false if there is nothing to fall back to
+bool boot_slots_fall_back(uint8_t* slot);
+
+// Called by the user program once it is running well, to keep it installed.
+// Stops the watchdog armed by the bootloader for its trial. Returns false if the boot record could
+// not be written
+bool boot_slots_confirm();
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __PICO_WIFI_BOOT_CONFIG_STORE_H__
+#define __PICO_WIFI_BOOT_CONFIG_STORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Config is kept as a log of keyed records over CONFIG_FLASH_SECTORS sectors (see flash.h). Writing
+// a value appends a record to the current sector, programming only the pages it covers, and the last
+// record for each key is current. Once the sector is full, the current values are compacted into the
+// next sector in turn, so that erases are spread over all of them
+enum ConfigKey {
+    // WiFi credentials, WIFI_CONFIG_SSID_SIZE bytes of SSID followed by WIFI_CONFIG_PASS_SIZE of password
+    CONFIG_KEY_WIFI = 1,
+    // User-defined config (see write_flash_config_extra)
+    CONFIG_KEY_EXTRA = 2,
+    // User-defined config carried over from the single config sector, whose size was not stored: its
+    // checksum followed by the data, with trailing 0xFF trimmed
+    CONFIG_KEY_LEGACY_EXTRA = 3,
+    // The AP and DHCP lease from the last connection, to reconnect quickly (see wifi_manager.h)
+    CONFIG_KEY_WIFI_LINK = 4,
+    // Credentials of further networks, laid out as for CONFIG_KEY_WIFI. Network i (from 1) has key
+    // CONFIG_KEY_WIFI_PROFILE + i - 1, up to WIFI_PROFILE_COUNT (see flash.h)
+    CONFIG_KEY_WIFI_PROFILE = 16,
+};
+
+// Starts each config sector in use. The header is programmed after the sector's records, so a sector
+// only becomes current once compaction into it completes
+struct ConfigSectorHeader {
+    char magic[4];
+    // Incremented with each compaction, the sector with the highest sequence being current
+    uint32_t sequence;
+    // CRC of the fields above
+    uint32_t header_crc;
+};
+
+// Precedes each record's data, which is padded to a multiple of 4 bytes
+struct ConfigRecordHeader {
+    // Keys are below 0xFFFF, so records never look erased
+    uint16_t key;
+    uint16_t length;
+    // CRC of the fields above and the data, so that a record interrupted by power loss is not trusted
+    uint32_t record_crc;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Copies up to size bytes of the current value for key, setting length to the stored length. Before
+// anything is logged, values are read from the single config sector which older versions wrote.
+// Returns false if there is no value for key
+bool config_store_read(uint16_t key, void* value, uint16_t size, uint16_t* length);
+
+// Records a new value for key, unless it matches the current one. Existing config in the single
+// config sector is carried over with it. Returns false if the value does not fit alongside the other
+// current values, or buffer allocation or the flash write fails, in which case the previous value
+// remains current. Also returns false rather than compacting into a spare sector which an installed
+// program may still cover: its image record shows that it does, or without a record, the sector
+// holds neither config nor erased flash. The program must be uploaded again, which records it, or
+// made small enough to leave the sector free
+
+bool config_store_write(uint16_t key, const void* value, uint16_t length);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
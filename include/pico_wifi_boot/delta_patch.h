@@ -0,0 +1,56 @@
+#ifndef __PICO_WIFI_BOOT_DELTA_PATCH_H__
+#define __PICO_WIFI_BOOT_DELTA_PATCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_wifi_boot/image_writer.h"
+
+// Patches are applied in-place, so copies may only read from sectors which have not been overwritten
+// yet, or from this many of the most recently overwritten sectors (kept in RAM).
+// Note: this needs to match the upload tool, which generates patches within this limit
+#define DELTA_PATCH_HISTORY_SECTORS 4
+
+// A patch is a sequence of ops, each an op byte followed by LEB128 varint fields:
+//   COPY:   zigzag src_delta, len   copies len bytes of the original image from src_cursor + src_delta
+//   INSERT: len, <len bytes>        inserts literal bytes
+// After each op, src_cursor points just past the original bytes which the op replaced
+enum DeltaPatchOp {
+    DELTA_PATCH_COPY = 0,
+    DELTA_PATCH_INSERT = 1,
+};
+
+#define DELTA_PATCH_MAX_FIELDS 2
+
+struct DeltaPatch {
+    uint32_t base_size;
+    uint32_t src_cursor;
+    // Op currently being decoded, and the varint field being read
+    bool has_op;
+    uint8_t op;
+    uint8_t field;
+    uint8_t shift;
+    uint32_t fields[DELTA_PATCH_MAX_FIELDS];
+    // Output bytes left for the current op, once its fields are complete
+    uint32_t remaining;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Prepares to apply a patch against an original image of base_size bytes
+void delta_patch_init(struct DeltaPatch* patch, uint32_t base_size);
+
+// Applies a chunk of patch data, writing the patched image to writer (which must target the region
+// holding the original image). Returns false if the patch is malformed or reads unavailable data
+bool delta_patch_apply(struct DeltaPatch* patch, struct ImageWriter* writer, const uint8_t* data, uint32_t len);
+
+// True if the patch ended cleanly between ops
+bool delta_patch_is_idle(struct DeltaPatch* patch);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -6,6 +6,8 @@
 
 #include "hardware/flash.h"
 
+#include "pico_wifi_boot/version.h"
+
 // Config is placed just before flash bank, or at the end of flash
 #ifdef PICO_FLASH_BANK_STORAGE_OFFSET
 #define CONFIG_FLASH_END_OFFSET PICO_FLASH_BANK_STORAGE_OFFSET
@@ -14,42 +16,168 @@ _Static_assert(CONFIG_FLASH_END_OFFSET % FLASH_SECTOR_SIZE == 0, "PICO_FLASH_BAN
 #define CONFIG_FLASH_END_OFFSET PICO_FLASH_SIZE_BYTES
 #endif
 
-// Config flash is one sector in size, at a sector-aligned offset
+// Config is a record log over CONFIG_FLASH_SECTORS sectors (see config_store.h). The first is the
+// last sector before the end offset, where config was kept in a single sector before it was logged
+#ifndef CONFIG_FLASH_SECTORS
+#define CONFIG_FLASH_SECTORS 4
+#endif
+_Static_assert(CONFIG_FLASH_SECTORS >= 2, "CONFIG_FLASH_SECTORS must leave a sector to compact into");
 #define CONFIG_FLASH_OFFSET (CONFIG_FLASH_END_OFFSET - FLASH_SECTOR_SIZE)
+// Starts the single config sector, which is only read to carry its contents over into the log
 #define CONFIG_MAGIC_CODE "CNF\n"
 #define CONFIG_MAGIC_CODE_LEN 4
+// Starts each logged config sector
+#define CONFIG_LOG_MAGIC_CODE "CNL\n"
 #define WIFI_CONFIG_SSID_SIZE 32
 #define WIFI_CONFIG_PASS_SIZE 64
-#define FLASH_CONFIG_EXTRA_MAX_SIZE (FLASH_SECTOR_SIZE - CONFIG_MAGIC_CODE_LEN - WIFI_CONFIG_SSID_SIZE - WIFI_CONFIG_SSID_SIZE - sizeof(uint32_t))
+// Networks which can be configured, the first being the one read_wifi_config returns
+#ifndef WIFI_PROFILE_COUNT
+#define WIFI_PROFILE_COUNT 4
+#endif
+// Leaves room in a sector for the credentials and further appends, so that compaction stays rare.
+// Before version 2, extra config could fill the rest of the single config sector (about 3.9 KB)
+#define FLASH_CONFIG_EXTRA_MAX_SIZE 2048
 
-// Note: this needs to match the linker script offset to build user programs
+// Progress of an interrupted image upload is journaled in the sector before config (see ota_journal.h)
+#define OTA_JOURNAL_FLASH_OFFSET (CONFIG_FLASH_OFFSET - FLASH_SECTOR_SIZE)
+
+// Note: this needs to match wifi_boot_user_slot_region in CMakeLists.txt, which links user programs
 #define BOOTLOADER_RESERVED_FLASH_SIZE (352 * 1024) // Sector aligned
 #define USER_PROGRAM_OFFSET BOOTLOADER_RESERVED_FLASH_SIZE
-#define USER_PROGRAM_MAX_SIZE (CONFIG_FLASH_OFFSET - USER_PROGRAM_OFFSET)
+
+// Optionally split the user program region into two slots, A at USER_PROGRAM_OFFSET and B after it.
+// OTA writes the slot which is not running, and the bootloader falls back to the previous slot if a
+// new program does not confirm itself (see boot_slots.h)
+#ifndef WIFI_BOOT_AB_SLOTS
+#define WIFI_BOOT_AB_SLOTS 0
+#endif
+
+// Optionally split the user program region in two without A/B slots: uploads are staged in the second
+// half, and the bootloader copies a staged image over the program in the first on the next boot.
+// This lets user programs receive an update while they keep running (see boot_image.h)
+#ifndef WIFI_BOOT_STAGING
+#define WIFI_BOOT_STAGING 0
+#endif
+#if WIFI_BOOT_AB_SLOTS && WIFI_BOOT_STAGING
+#error "WIFI_BOOT_STAGING is redundant with WIFI_BOOT_AB_SLOTS, where user programs write the other slot directly"
+#endif
+
+#if WIFI_BOOT_AB_SLOTS
+// The active slot is recorded in the two sectors before the OTA journal, which take turns so that
+// erasing one to make room never loses the current record (see boot_slots.h)
+#define BOOT_RECORD_FLASH_OFFSET (OTA_JOURNAL_FLASH_OFFSET - FLASH_SECTOR_SIZE)
+#define BOOT_RECORD_SECTORS 2
+#define BOOT_RECORD_SECTOR_OFFSET(index) (BOOT_RECORD_FLASH_OFFSET - (index) * FLASH_SECTOR_SIZE)
+// Sizes and checksums of flashed images are recorded in the sector before those (see boot_image.h)
+#define IMAGE_RECORD_FLASH_OFFSET (BOOT_RECORD_FLASH_OFFSET - BOOT_RECORD_SECTORS * FLASH_SECTOR_SIZE)
+#else
+// Sizes and checksums of flashed images are recorded in the sector before the OTA journal
+#define IMAGE_RECORD_FLASH_OFFSET (OTA_JOURNAL_FLASH_OFFSET - FLASH_SECTOR_SIZE)
+#endif
+
+// The rest of the config sectors are placed before the image records, so that nothing else moves.
+// They were the end of the user program region before version 2, so a program installed by an
+// older version may still cover them (see config_store.h)
+#define CONFIG_SPARE_FLASH_OFFSET (IMAGE_RECORD_FLASH_OFFSET - (CONFIG_FLASH_SECTORS - 1) * FLASH_SECTOR_SIZE)
+#define CONFIG_SECTOR_OFFSET(index) \
+    ((index) ? CONFIG_SPARE_FLASH_OFFSET + ((index) - 1) * FLASH_SECTOR_SIZE : CONFIG_FLASH_OFFSET)
+
+#if WIFI_BOOT_AB_SLOTS || WIFI_BOOT_STAGING
+#define USER_PROGRAM_MAX_SIZE \
+    ((CONFIG_SPARE_FLASH_OFFSET - USER_PROGRAM_OFFSET) / 2 / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE)
+#else
+#define USER_PROGRAM_MAX_SIZE (CONFIG_SPARE_FLASH_OFFSET - USER_PROGRAM_OFFSET)
+#endif
+
+#define USER_SLOT_OFFSET(slot) (USER_PROGRAM_OFFSET + (slot) * USER_PROGRAM_MAX_SIZE)
+
+// User programs are linked for the slot they run from (see wifi_boot_user_program_bin)
+#ifdef WIFI_BOOT_LINKED_SLOT_SIZE
+_Static_assert(
+    WIFI_BOOT_LINKED_SLOT_ORIGIN == XIP_BASE + USER_PROGRAM_OFFSET && WIFI_BOOT_LINKED_SLOT_SIZE == USER_PROGRAM_MAX_SIZE,
+    "user program slots in CMakeLists.txt must match the flash layout");
+#endif
+
+// With WIFI_BOOT_STAGING, the second slot holds uploads until the bootloader installs them
+#define BOOT_STAGING_SLOT 1
+
+// Attempts to erase, program and verify a sector before giving up on it
+#ifndef FLASH_WRITE_MAX_ATTEMPTS
+#define FLASH_WRITE_MAX_ATTEMPTS 3
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-// Writes a full (aligned) flash sector, with write-verify-retry loop
-void write_flash_sector(uint32_t sector_offset, uint8_t* data);
+// True if the stored contents of a full (aligned) flash sector match data, as judged by comparing
+// CRCs from the DMA sniffer. Reads through the non-caching XIP alias, leaving the XIP cache untouched
+bool flash_sector_matches(uint32_t sector_offset, uint8_t* data);
+
+// Writes a full (aligned) flash sector, with write-verify-retry loop. Trailing pages of 0xFF (such as
+// the padding after the end of an image) are left erased rather than programmed.
+// Returns false if the sector still did not verify after FLASH_WRITE_MAX_ATTEMPTS
+bool write_flash_sector(uint32_t sector_offset, uint8_t* data);
+
+// Erases a full (aligned) 64 KB flash block. This takes about 150 ms, against about 45 ms per sector
+// erase, so it only pays off when several of its sectors are rewritten
+void erase_flash_block(uint32_t block_offset);
+
+// Erases a full (aligned) flash sector without writing it
+void erase_flash_sector(uint32_t sector_offset);
+
+// Programs a full (aligned) flash page. Only bits which are set in flash can be cleared, so bytes of
+// 0xFF leave the stored contents as they are, allowing a page to be filled in over several calls
+void program_flash_page(uint32_t page_offset, uint8_t* data);
+
+// Record logs fill a sector with fixed-size records in order, the last one written being current.
+// Appending only programs the page holding the new record, so the sector is only erased once it is
+// full. Record sizes must divide FLASH_PAGE_SIZE, and records must not start with 0xFFFFFFFF, which
+// marks erased slots
+
+// Returns the number of records written to the log, which are followed by erased slots
+uint32_t flash_log_count(uint32_t sector_offset, uint32_t record_size);
+
+// Returns false if the record could not be written
+bool flash_log_append(uint32_t sector_offset, const void* record, uint32_t record_size);
+
+// Erases the log, only if any records have been written
+void flash_log_clear(uint32_t sector_offset, uint32_t record_size);
+
+// Programs a full (aligned) flash sector which is already erased, except for trailing pages of 0xFF, falling back to write_flash_sector
+// if the programmed contents do not verify. Returns false if the sector could not be written
+bool program_flash_sector(uint32_t sector_offset, uint8_t* data);
+
+// Writes a full (aligned) flash sector only if the stored contents differ (see flash_sector_matches),
+// setting written accordingly. Returns false if the sector needed writing but could not be written
+bool write_flash_sector_if_changed(uint32_t sector_offset, uint8_t* data, bool* written);
 
 // Reads previously stored wifi credentials from flash, failing if config is not recognized.
 // Provided buffers must be at least WIFI_CONFIG_SSID_SIZE, WIFI_CONFIG_PASS_SIZE bytes
 // respectively, regardless of stored credential length
 bool read_wifi_config(char* ssid, char* pass);
 
-// Writes wifi credentials to flash, limited to WIFI_CONFIG_SSID_SIZE / WIFI_CONFIG_PASS_SIZE
-// Returns false if buffer allocation fails
+// Writes wifi credentials to flash, limited to WIFI_CONFIG_SSID_SIZE / WIFI_CONFIG_PASS_SIZE.
+// Unchanged credentials are not written again (see config_store.h).
+// Returns false if buffer allocation or the flash write fails
 bool write_wifi_config(char *ssid, char* pass);
 
-// Writes user-defined config to flash.
-// Returns false if size > FLASH_CONFIG_EXTRA_MAX_SIZE or buffer allocation fails
+// Reads the credentials of a configured network, as read_wifi_config does for the first (index 0).
+// Returns false if index >= WIFI_PROFILE_COUNT, or nothing is stored for it
+bool read_wifi_profile(uint32_t index, char* ssid, char* pass);
+
+// Writes the credentials of a configured network, as write_wifi_config does for the first (index 0).
+// An empty ssid leaves the network unconfigured. Returns false if index >= WIFI_PROFILE_COUNT, or
+// buffer allocation or the flash write fails
+bool write_wifi_profile(uint32_t index, char* ssid, char* pass);
+
+// Writes user-defined config to flash. Unchanged config is not written again (see config_store.h).
+// Returns false if size > FLASH_CONFIG_EXTRA_MAX_SIZE, or buffer allocation or the flash write fails
 bool write_flash_config_extra(void *extra, uint16_t size);
 
 // Reads previously stored user-defined config from flash.
 // Returns false if flash config is not recognized, size > FLASH_CONFIG_EXTRA_MAX_SIZE,
-// or if the stored data does not match the stored checksum
+// or if size does not match the stored config
 bool read_flash_config_extra(void *extra, uint16_t size);
 
 #ifdef __cplusplus
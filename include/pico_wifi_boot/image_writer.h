@@ -0,0 +1,131 @@
+#ifndef __PICO_WIFI_BOOT_IMAGE_WRITER_H__
+#define __PICO_WIFI_BOOT_IMAGE_WRITER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hardware/flash.h"
+
+#include "pico_wifi_boot/flash.h"
+
+// Number of sector buffers. Commits run on the same core as lwIP, and writing flash stalls it, so no
+// sector is filled while another is being written. What overlaps a commit is the sender transmitting
+// into the advertised window, with one buffer as with two. A second buffer lets a full sector wait
+// for the commit worker, so that the receive callback returns instead of writing flash in-line,
+// and only commits from the worker are journaled and acknowledged (see ota_bench's link run).
+// Receive flow control (withholding acknowledgements while a sector waits) relies on that second
+// buffer: with one, every full sector is committed in-line, and ota_bench's windowed run is no better
+// than ignoring the window (11 rounds and 79 of its segments dropped, against none with two buffers).
+// The second buffer costs 4 KB and does not make uploads faster, but saves those retransmissions
+#ifndef IMAGE_WRITER_BUFFER_COUNT
+#define IMAGE_WRITER_BUFFER_COUNT 2
+#endif
+
+// Skip erasing and programming sectors whose stored contents already match
+#ifndef IMAGE_WRITER_SKIP_UNCHANGED
+#define IMAGE_WRITER_SKIP_UNCHANGED 1
+#endif
+
+// Erase whole 64 KB blocks ahead of the write cursor, so that their sectors only need programming
+#ifndef IMAGE_WRITER_ERASE_AHEAD
+#define IMAGE_WRITER_ERASE_AHEAD 1
+#endif
+
+// A block erase takes about 150 ms and leaves all of its sectors to be programmed, where erasing and
+// programming a single sector takes about 50 ms, so a block is only erased ahead if at least this many
+// of its sectors are expected to change. Sectors not yet received are expected to change at the rate
+// seen over the last block's worth of sectors compared with flash
+#ifndef IMAGE_WRITER_ERASE_AHEAD_MIN_CHANGED
+#define IMAGE_WRITER_ERASE_AHEAD_MIN_CHANGED 5
+#endif
+
+#define IMAGE_WRITER_BLOCK_SECTORS (FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE)
+
+// Images are at most the size of the user program region
+#define IMAGE_WRITER_MAX_SECTORS ((USER_PROGRAM_MAX_SIZE + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE)
+
+// Streams an image into flash one sector at a time, through a ring of sector buffers
+struct ImageWriter {
+    uint32_t flash_offset;
+    // Region holding the original image, which is the target region unless set otherwise
+    uint32_t base_offset;
+    uint32_t image_size;
+    uint8_t buffers[IMAGE_WRITER_BUFFER_COUNT][FLASH_SECTOR_SIZE];
+    // Oldest full buffer, and the number of full buffers waiting to be committed
+    uint32_t commit_index;
+    uint32_t pending_count;
+    // Bytes in the buffer currently being filled (the one after the pending buffers)
+    uint32_t fill_bytes;
+    uint32_t bytes_received;
+    uint32_t bytes_committed;
+    // Committed sectors which were actually erased and programmed, or found to be up to date
+    uint32_t sectors_written;
+    uint32_t sectors_skipped;
+    uint32_t blocks_erased;
+    // Set if a sector could not be written and verified, after which no more are written
+    bool write_failed;
+    uint32_t failed_sector;
+    // Flash below this offset (within the image) has been erased ahead of being programmed
+    bool erase_ahead;
+    uint32_t erased_until;
+    // One bit per sector, most recent lowest, for the last sectors compared with flash (those not in
+    // an erased block), set if the sector had changed
+    uint32_t recent_changed;
+    uint32_t recent_sectors;
+    // Running checksum of the image as committed to flash, and the checksum of the data received for
+    // each sector, so that a bad image can be traced to a specific sector
+    uint32_t image_crc;
+    uint32_t sector_crcs[IMAGE_WRITER_MAX_SECTORS];
+    // Optional ring of the original contents of the most recently overwritten sectors
+    uint8_t* history;
+    uint32_t history_sectors;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Prepares to write image_size bytes (at most USER_PROGRAM_MAX_SIZE) at the (sector-aligned) flash offset
+void image_writer_init(struct ImageWriter* writer, uint32_t flash_offset, uint32_t image_size);
+
+// Continues an image whose first bytes_committed bytes (a multiple of FLASH_SECTOR_SIZE, less than the
+// image size) are already in flash, so that only the rest needs to be received
+void image_writer_resume(struct ImageWriter* writer, uint32_t bytes_committed);
+
+// Reads the original image from another (sector-aligned) region, which is left intact while writing
+void image_writer_set_base(struct ImageWriter* writer, uint32_t base_offset);
+
+// Keeps the original contents of the last history_sectors overwritten sectors in the provided buffer
+// (history_sectors * FLASH_SECTOR_SIZE bytes), so they can still be read back while writing in-place.
+// This disables erase-ahead, which would destroy original contents before they are overwritten
+void image_writer_set_history(struct ImageWriter* writer, uint8_t* history, uint32_t history_sectors);
+
+// Returns free space in the buffer being filled, setting len to the number of bytes available.
+// If every buffer is waiting to be committed, the oldest is committed in-line to make room.
+// Returns NULL once the whole image has been received
+uint8_t* image_writer_reserve(struct ImageWriter* writer, uint32_t* len);
+
+// Marks len bytes of the space returned by image_writer_reserve as filled
+void image_writer_advance(struct ImageWriter* writer, uint32_t len);
+
+bool image_writer_has_pending(struct ImageWriter* writer);
+
+// Writes the oldest full buffer to flash. Returns false if no buffer was waiting
+bool image_writer_commit_next(struct ImageWriter* writer);
+
+// True once every byte of the image has been written to flash
+bool image_writer_is_complete(struct ImageWriter* writer);
+
+// Returns the index of the first committed sector whose contents in flash no longer match the data
+// received for it, or -1 if all match
+int32_t image_writer_find_corrupt_sector(struct ImageWriter* writer);
+
+// Reads bytes of the target region as they were before this image started being written.
+// Returns false if part of the range was overwritten and is no longer held in the history
+bool image_writer_read_original(struct ImageWriter* writer, uint32_t offset, uint8_t* dest, uint32_t len);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
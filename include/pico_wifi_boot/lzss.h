@@ -0,0 +1,53 @@
+#ifndef __PICO_WIFI_BOOT_LZSS_H__
+#define __PICO_WIFI_BOOT_LZSS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico_wifi_boot/image_writer.h"
+
+// Compressed streams are groups of a flag byte followed by up to 8 items, described by the flag bits
+// starting from the least significant bit:
+//   1: literal byte
+//   0: match, as a little-endian uint16 token: distance - 1 in the low LZSS_DISTANCE_BITS bits and
+//      length - LZSS_MIN_MATCH in the rest. If the length field is all ones, extension bytes follow,
+//      each added to the length, until one is less than 255
+// Note: these need to match the upload tools, which compress with the same format
+#define LZSS_DISTANCE_BITS 11
+#define LZSS_WINDOW_SIZE (1 << LZSS_DISTANCE_BITS)
+#define LZSS_MIN_MATCH 3
+#define LZSS_LENGTH_FIELD_MAX ((1 << (16 - LZSS_DISTANCE_BITS)) - 1)
+
+struct LzssDecoder {
+    uint8_t window[LZSS_WINDOW_SIZE];
+    uint32_t bytes_out;
+    uint8_t flags;
+    uint8_t items_left;
+    // Match token being read, then any length extension bytes
+    uint8_t token_bytes;
+    uint8_t token;
+    bool extending;
+    uint32_t match_distance;
+    uint32_t match_length;
+    // Bytes of the match left to output
+    uint32_t match_remaining;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void lzss_init(struct LzssDecoder* decoder);
+
+// Decompresses a chunk of the stream into writer. Returns false if the stream is malformed,
+// or decompresses to more than the image size
+bool lzss_decode(struct LzssDecoder* decoder, struct ImageWriter* writer, const uint8_t* data, uint32_t len);
+
+// True if the stream ended cleanly between items
+bool lzss_is_idle(struct LzssDecoder* decoder);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __PICO_WIFI_BOOT_OTA_DISCOVERY_H__
+#define __PICO_WIFI_BOOT_OTA_DISCOVERY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Devices announce themselves to upload tools over UDP, started along with the OTA server:
+//   READY: broadcast once the OTA server is listening, so that tools waiting for the device to
+//          reboot into the bootloader can connect as soon as it is back, rather than retrying
+//          blindly. Sent OTA_BEACON_COUNT times, starting once WiFi has an address
+//   QUERY: sent by tools, often to the broadcast address, to take inventory of the fleet
+//   INFO:  the answer to QUERY, with the board ID, the installed image's size and checksum, the
+//          largest image the device takes and its WiFi signal strength. Tools skip devices which
+//          already run the image they are about to send
+// Note: these need to match the upload tool
+#define OTA_DISCOVERY_PORT 2224
+
+#ifndef OTA_BEACON_COUNT
+#define OTA_BEACON_COUNT 3
+#endif
+
+#ifndef OTA_BEACON_INTERVAL_MS
+#define OTA_BEACON_INTERVAL_MS 500
+#endif
+
+// Requires LWIP_UDP, otherwise nothing is sent or answered
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Starts broadcasting READY beacons for the OTA server on the given port, and answering queries.
+// Returns false if the discovery port could not be opened
+bool ota_discovery_start(uint16_t ota_port);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
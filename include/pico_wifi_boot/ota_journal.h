@@ -0,0 +1,40 @@
+#ifndef __PICO_WIFI_BOOT_OTA_JOURNAL_H__
+#define __PICO_WIFI_BOOT_OTA_JOURNAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The journal sector is a record log (see flash.h), the last record describing the current upload
+struct OtaJournalRecord {
+    // Image sizes are well below 0xFFFFFFFF, so records never look erased
+    uint32_t image_size;
+    uint32_t image_checksum;
+    uint32_t bytes_committed;
+    // Where the image is written, since the target slot changes once an A/B upload boots
+    uint32_t flash_offset;
+    // Pads records to a size which divides a flash page
+    uint32_t reserved[3];
+    // CRC of the fields above, so that a record interrupted by power loss is not trusted
+    uint32_t record_crc;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns the number of bytes of the given image already committed at flash_offset by an earlier
+// upload, or 0 if the journal is empty or describes a different image or target
+uint32_t ota_journal_find(uint32_t flash_offset, uint32_t image_size, uint32_t image_checksum);
+
+// Records that bytes_committed bytes of the given image are in flash at flash_offset. Returns false if
+// the record could not be written
+bool ota_journal_append(uint32_t flash_offset, uint32_t image_size, uint32_t image_checksum, uint32_t bytes_committed);
+
+// Forgets any journaled upload, erasing the journal sector only if it is in use
+void ota_journal_clear(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
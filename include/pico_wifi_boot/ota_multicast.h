@@ -0,0 +1,43 @@
+#ifndef __PICO_WIFI_BOOT_OTA_MULTICAST_H__
+#define __PICO_WIFI_BOOT_OTA_MULTICAST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Fleet flashing sends an image once to a multicast group, rather than once per device. Devices are
+// told to join over TCP (see ota_server.c), then the uploader runs rounds over UDP:
+//   DATA:   one chunk of a sector, sent to the group
+//   QUERY:  sent to the group at the end of a round, answered by each device with STATUS
+//   STATUS: sent back to the uploader, with a bitmap of the sectors the device is still missing
+//   FINISH: sent to the group once every device is done, so that complete devices reboot
+// Later rounds only resend sectors which some device reported missing.
+// Note: these need to match the upload tool
+#define OTA_MULTICAST_GROUP "239.255.22.22"
+#define OTA_MULTICAST_PORT 2223
+#define OTA_MULTICAST_CHUNK_SIZE 1024
+
+// A session which hears nothing from its uploader for this long is abandoned, and no longer holds
+// off uploads over TCP
+#ifndef OTA_MULTICAST_IDLE_TIMEOUT_MS
+#define OTA_MULTICAST_IDLE_TIMEOUT_MS 30000
+#endif
+
+// Requires LWIP_IGMP, otherwise joining always fails
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Starts receiving the given image from the multicast group, into the slot OTA would write.
+// Joining the session already in progress keeps its progress. Returns false if the group could not
+// be joined
+bool ota_multicast_join(uint32_t image_size, uint32_t image_checksum);
+
+// True while a joined session is receiving its image, or waiting to finish once complete, unless it
+// was abandoned. Uploads over TCP are refused meanwhile, since they would write the same slot
+bool ota_multicast_in_progress();
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -9,6 +9,17 @@
 #define OTA_PORT 2222
 #endif
 
+// Connections are served from a fixed pool, so the server's RAM use is known up front. Connections
+// beyond this are rejected. Each is small, since the buffers of the one upload at a time are shared
+#ifndef OTA_MAX_CONNECTIONS
+#define OTA_MAX_CONNECTIONS 2
+#endif
+
+// Connections which receive nothing for this long are dropped, so stuck clients free their slot
+#ifndef OTA_IDLE_TIMEOUT_MS
+#define OTA_IDLE_TIMEOUT_MS 30000
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
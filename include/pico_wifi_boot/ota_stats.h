@@ -0,0 +1,67 @@
+#ifndef __PICO_WIFI_BOOT_OTA_STATS_H__
+#define __PICO_WIFI_BOOT_OTA_STATS_H__
+
+#include <stdint.h>
+
+// Keep counters of where upload time goes, which clients can query after an upload
+#ifndef OTA_STATS
+#define OTA_STATS 1
+#endif
+
+// Phases of an upload which time is attributed to
+enum OtaStatsPhase {
+    // Waiting between payload segments
+    OTA_STATS_NETWORK_WAIT,
+    // Copying or decoding payload segments into sector buffers (including sectors committed in-line)
+    OTA_STATS_RECEIVE,
+    OTA_STATS_ERASE,
+    OTA_STATS_PROGRAM,
+    // Comparing flash contents against sector data, whether to skip a sector or verify it
+    OTA_STATS_VERIFY,
+    // Checksums of sector data and of the image in flash
+    OTA_STATS_CHECKSUM,
+    OTA_STATS_PHASE_COUNT,
+};
+
+// Sector commit latency buckets: under 1 ms, then doubling up to 64 ms and over
+#define OTA_STATS_LATENCY_BUCKETS 8
+// Payload segment size buckets of 256 bytes, the last holding anything larger
+#define OTA_STATS_SEGMENT_BUCKETS 8
+#define OTA_STATS_SEGMENT_BUCKET_SIZE 256
+
+// Counters for the latest upload, sent as they are in response to a stats request
+struct __attribute__((__packed__)) OtaStats {
+    uint32_t phase_us[OTA_STATS_PHASE_COUNT];
+    uint32_t commit_latency[OTA_STATS_LATENCY_BUCKETS];
+    uint32_t segment_sizes[OTA_STATS_SEGMENT_BUCKETS];
+    // Sector writes which did not verify and were attempted again
+    uint32_t verify_retries;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Clears the counters, as each upload begins
+void ota_stats_reset();
+
+// Current time in microseconds, to be passed back to ota_stats_add once a phase ends
+uint32_t ota_stats_now();
+
+// Attributes the time since start_us (from ota_stats_now) to the phase
+void ota_stats_add(enum OtaStatsPhase phase, uint32_t start_us);
+
+// Records how long a sector took to commit, since start_us
+void ota_stats_commit(uint32_t start_us);
+
+void ota_stats_segment(uint32_t len);
+
+void ota_stats_verify_retry();
+
+const struct OtaStats* ota_stats_get();
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -2,6 +2,7 @@
 #define __PICO_WIFI_BOOT_REBOOT_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifndef BOOT_OVERRIDE_PIN
 #define BOOT_OVERRIDE_PIN 15
@@ -19,8 +20,14 @@ void reboot_into_bootloader();
 
 bool running_in_bootloader();
 
+// True if the running program was linked into the slot, so that OTA cannot write the slot without
+// rebooting into the bootloader first. Always false in the bootloader
+bool running_from_slot(uint8_t slot);
+
 bool validate_bootloader_size();
 
+// Jumps into the user program in the active slot. Only returns if there is no valid program to run
+// (which is only checked with WIFI_BOOT_AB_SLOTS)
 void load_user_program();
 
 #ifdef __cplusplus
@@ -7,8 +7,13 @@
 extern "C" {
 #endif
 
+// CRC-32 of len bytes. If len is not a multiple of 4, the data is treated as padded with zeros
 uint32_t sniffer_crc32(uint8_t* aligned_addr, uint32_t len);
 
+// Continues a standard CRC-32 over another len bytes (pass crc = 0 to start a new checksum),
+// so that a checksum can be accumulated across separate chunks of data
+uint32_t sniffer_crc32_update(uint32_t crc, const uint8_t* addr, uint32_t len);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,9 @@
+#ifndef __PICO_WIFI_BOOT_VERSION_H__
+#define __PICO_WIFI_BOOT_VERSION_H__
+
+// The major version changes when the flash layout or config API changes in a way that devices or
+// user programs built for the previous one need to take into account (see "Upgrading" in README.md)
+#define PICO_WIFI_BOOT_VERSION_MAJOR 2
+#define PICO_WIFI_BOOT_VERSION_MINOR 0
+
+#endif
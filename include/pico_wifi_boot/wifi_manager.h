@@ -1,8 +1,62 @@
 #ifndef __PICO_WIFI_BOOT_WIFI_MANAGER_H__
 #define __PICO_WIFI_BOOT_WIFI_MANAGER_H__
 
+#include <stdint.h>
 #include <stdbool.h>
 
+// Reconnect to the AP last connected to without scanning, reusing its DHCP lease (if no other host
+// answers an ARP probe for its address) until DHCP confirms it, before falling back to a full connect.
+// This matters most across the reboots of an OTA update
+#ifndef WIFI_FAST_CONNECT
+#define WIFI_FAST_CONNECT 1
+#endif
+
+// Time allowed to join the last AP directly before falling back to a full connect
+#ifndef WIFI_FAST_CONNECT_TIMEOUT_MS
+#define WIFI_FAST_CONNECT_TIMEOUT_MS 3000
+#endif
+
+// Time allowed for each configured network to connect, once a fast connect has failed
+#ifndef WIFI_CONNECT_TIMEOUT_MS
+#define WIFI_CONNECT_TIMEOUT_MS 30000
+#endif
+
+// Delay before trying again once every configured network has failed, doubling with each failure
+#ifndef WIFI_RETRY_MIN_MS
+#define WIFI_RETRY_MIN_MS 1000
+#endif
+#ifndef WIFI_RETRY_MAX_MS
+#define WIFI_RETRY_MAX_MS 60000
+#endif
+
+// Recorded in the config store (see config_store.h) once DHCP has supplied an address
+struct WifiLinkRecord {
+    uint8_t bssid[6];
+    uint16_t channel;
+    // IPv4 config from the DHCP lease, in network byte order
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gateway;
+    // Index of the configured network (see read_wifi_profile), which the next boot tries first
+    uint8_t profile;
+    uint8_t reserved[3];
+};
+
+// Connect time buckets: under 250 ms, then doubling up to 16 s and over
+#define WIFI_CONNECT_BUCKETS 8
+
+// Counts of connections since boot, and how long they took from starting to connect until an address
+// was assigned
+struct WifiConnectStats {
+    // Directly joining the last AP, whether or not its lease was reused
+    uint32_t fast_time[WIFI_CONNECT_BUCKETS];
+    // Scanning for the configured networks and joining the strongest, including after a fast connect failed
+    uint32_t full_time[WIFI_CONNECT_BUCKETS];
+    uint32_t fast_failures;
+    // Configured networks which did not connect in turn
+    uint32_t network_failures;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,8 +65,12 @@ void print_current_ipv4();
 
 bool wifi_manager_init(bool enable_powersave);
 
+// Keeps the connection up, to be called regularly from the main loop. Connecting first tries the
+// network last connected to, then scans once and tries each configured network from the strongest
+// signal down, backing off between rounds
 void wifi_manager_connect_async();
 
+// Connects as wifi_manager_connect_async does, blocking for up to the given number of rounds
 bool wifi_manager_connect(int attempts);
 
 bool wifi_manager_is_connected();
@@ -21,6 +79,8 @@ bool wifi_manager_attempt_configure();
 
 void wifi_manager_configure();
 
+const struct WifiConnectStats* wifi_manager_connect_stats();
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,172 @@
+#include "pico_wifi_boot/boot_image.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/sniffer_crc32.h"
+
+#define BOOT_IMAGE_RECORDS (FLASH_SECTOR_SIZE / sizeof(struct BootImageRecord))
+
+uint32_t boot_image_record_crc(struct BootImageRecord* record) {
+    return sniffer_crc32_update(0, (uint8_t*)record, offsetof(struct BootImageRecord, record_crc));
+}
+
+bool read_boot_image_record(uint8_t slot, struct BootImageRecord* record) {
+    // Skip back past records for the other slot, and any interrupted by power loss
+    uint32_t count = flash_log_count(IMAGE_RECORD_FLASH_OFFSET, sizeof(*record));
+    while (count) {
+        count--;
+
+        // Read through the non-caching XIP alias, so that freshly programmed records are seen
+        memcpy(
+            record,
+            (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + IMAGE_RECORD_FLASH_OFFSET + count * sizeof(*record),
+            sizeof(*record));
+
+        if (record->slot == slot && record->record_crc == boot_image_record_crc(record)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool append_boot_image_record(struct BootImageRecord* record) {
+    record->record_crc = boot_image_record_crc(record);
+
+    // The log is erased once full, so carry over the other slot's record rather than lose it
+    if (flash_log_count(IMAGE_RECORD_FLASH_OFFSET, sizeof(*record)) == BOOT_IMAGE_RECORDS) {
+        struct BootImageRecord other;
+        bool has_other = read_boot_image_record(record->slot ^ 1, &other);
+        flash_log_clear(IMAGE_RECORD_FLASH_OFFSET, sizeof(*record));
+        if (has_other && !flash_log_append(IMAGE_RECORD_FLASH_OFFSET, &other, sizeof(other))) {
+            return false;
+        }
+    }
+
+    return flash_log_append(IMAGE_RECORD_FLASH_OFFSET, record, sizeof(*record));
+}
+
+bool write_boot_image_record(uint8_t slot, uint8_t state, uint32_t image_size, uint32_t image_checksum) {
+    struct BootImageRecord record;
+    memset(&record, 0, sizeof(record));
+    record.image_size = image_size;
+    record.image_checksum = image_checksum;
+    record.slot = slot;
+    record.state = state;
+
+    return append_boot_image_record(&record);
+}
+
+bool boot_image_begin(uint8_t slot, uint32_t image_size) {
+    // A resumed upload of the same image is already recorded
+    struct BootImageRecord record;
+    if (read_boot_image_record(slot, &record)
+        && record.state == BOOT_IMAGE_WRITING && record.image_size == image_size) {
+        return true;
+    }
+
+    return write_boot_image_record(slot, BOOT_IMAGE_WRITING, image_size, 0);
+}
+
+bool boot_image_commit(uint8_t slot, uint32_t image_size, uint32_t image_checksum) {
+    return write_boot_image_record(slot, BOOT_IMAGE_COMMITTED, image_size, image_checksum);
+}
+
+bool boot_image_installed(uint8_t slot, uint32_t* image_size, uint32_t* image_checksum) {
+    struct BootImageRecord record;
+    if (!read_boot_image_record(slot, &record)
+        || (record.state != BOOT_IMAGE_COMMITTED && record.state != BOOT_IMAGE_VALIDATED)) {
+        return false;
+    }
+
+    *image_size = record.image_size;
+    *image_checksum = record.image_checksum;
+    return true;
+}
+
+void boot_image_install_staged() {
+#if WIFI_BOOT_STAGING
+    struct BootImageRecord staged;
+    if (!read_boot_image_record(BOOT_STAGING_SLOT, &staged) || staged.state != BOOT_IMAGE_COMMITTED) {
+        return;
+    }
+
+    uint8_t* staged_image = (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + USER_SLOT_OFFSET(BOOT_STAGING_SLOT);
+    if (staged.image_size > USER_PROGRAM_MAX_SIZE
+        || sniffer_crc32_update(0, staged_image, staged.image_size) != staged.image_checksum) {
+        // Keep the installed program, rather than check the staged image again on every boot
+        write_boot_image_record(BOOT_STAGING_SLOT, BOOT_IMAGE_WRITING, staged.image_size, 0);
+        return;
+    }
+
+    // Get space on the heap to avoid large stack vars
+    uint8_t* sector = malloc(FLASH_SECTOR_SIZE);
+    if (!sector) {
+        return;
+    }
+
+    // The program being overwritten must not be booted until the copy is complete
+    bool copied = boot_image_begin(0, staged.image_size);
+    for (uint32_t offset = 0; copied && offset < staged.image_size; offset += FLASH_SECTOR_SIZE) {
+        // Flash cannot be read while it is being written, so copy through RAM
+        memcpy(sector, staged_image + offset, FLASH_SECTOR_SIZE);
+
+        bool written;
+        copied = write_flash_sector_if_changed(USER_SLOT_OFFSET(0) + offset, sector, &written);
+    }
+    free(sector);
+
+    // Should this fail, the staged image is simply installed again on the next boot
+    if (copied && boot_image_commit(0, staged.image_size, staged.image_checksum)) {
+        write_boot_image_record(
+            BOOT_STAGING_SLOT, BOOT_IMAGE_INSTALLED, staged.image_size, staged.image_checksum);
+    }
+#endif
+}
+
+// Quick check of the program's vector table: the initial stack pointer must be in RAM and the reset
+// handler within the image
+bool boot_image_vectors_valid(uint8_t slot, uint32_t image_size) {
+    uint32_t* vt = (uint32_t*)(XIP_BASE + USER_SLOT_OFFSET(slot));
+    uint32_t stack_end = vt[0];
+    uint32_t reset_handler = vt[1] & ~1;
+    uint32_t image_start = (uint32_t)(XIP_BASE + USER_SLOT_OFFSET(slot));
+
+    return image_size >= 2 * sizeof(uint32_t)
+        && stack_end > SRAM_BASE && stack_end <= SRAM_END
+        && reset_handler - image_start < image_size;
+}
+
+bool boot_image_check(uint8_t slot) {
+#if BOOT_IMAGE_CHECK
+    struct BootImageRecord record;
+    if (!read_boot_image_record(slot, &record)) {
+        return true;
+    }
+
+    switch (record.state) {
+    case BOOT_IMAGE_VALIDATED:
+        return boot_image_vectors_valid(slot, record.image_size);
+    case BOOT_IMAGE_COMMITTED:
+        // Only the first boot after an update pays for reading the whole image
+        if (record.image_size > USER_PROGRAM_MAX_SIZE
+            || sniffer_crc32_update(
+                0, (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + USER_SLOT_OFFSET(slot), record.image_size)
+                != record.image_checksum
+            || !boot_image_vectors_valid(slot, record.image_size)) {
+            return false;
+        }
+
+        // Booting anyway if this cannot be written only costs another check next time
+        write_boot_image_record(slot, BOOT_IMAGE_VALIDATED, record.image_size, record.image_checksum);
+        return true;
+    default:
+        return false;
+    }
+#else
+    return true;
+#endif
+}
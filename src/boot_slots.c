@@ -0,0 +1,218 @@
+#include "pico_wifi_boot/boot_slots.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "hardware/watchdog.h"
+
+#include "pico_wifi_boot/sniffer_crc32.h"
+
+// Set in watchdog scratch registers (which survive watchdog resets) while a program is on trial
+#define BOOT_TRIAL_MAGIC 0x7E57B007
+
+#if WIFI_BOOT_AB_SLOTS
+uint32_t boot_record_crc(struct BootRecord* record) {
+    return sniffer_crc32_update(0, (uint8_t*)record, offsetof(struct BootRecord, record_crc));
+}
+
+// Reads the last valid record logged in a boot record sector
+bool read_boot_record_sector(uint32_t sector_offset, struct BootRecord* record) {
+    // Skip back past any record interrupted by power loss
+    uint32_t count = flash_log_count(sector_offset, sizeof(*record));
+    while (count) {
+        count--;
+
+        // Read through the non-caching XIP alias, so that freshly programmed records are seen
+        memcpy(record, (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + sector_offset + count * sizeof(*record), sizeof(*record));
+
+        if (record->magic == BOOT_RECORD_MAGIC && record->record_crc == boot_record_crc(record)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Returns the index of the boot record sector holding the current record, or -1 if there is none
+int32_t find_boot_record(struct BootRecord* record) {
+    int32_t current = -1;
+    for (uint32_t index = 0; index < BOOT_RECORD_SECTORS; index++) {
+        struct BootRecord candidate;
+        if (read_boot_record_sector(BOOT_RECORD_SECTOR_OFFSET(index), &candidate)
+            && (current < 0 || (int32_t)(candidate.sequence - record->sequence) > 0)) {
+            *record = candidate;
+            current = index;
+        }
+    }
+    return current;
+}
+
+bool read_boot_record(struct BootRecord* record) {
+    return find_boot_record(record) >= 0;
+}
+
+bool write_boot_record(uint8_t active_slot, bool confirmed, uint8_t fallback_slot) {
+    struct BootRecord current;
+    int32_t index = find_boot_record(&current);
+
+    struct BootRecord record;
+    memset(&record, 0, sizeof(record));
+    record.magic = BOOT_RECORD_MAGIC;
+    record.active_slot = active_slot;
+    record.confirmed = confirmed;
+    record.fallback_slot = fallback_slot;
+    record.sequence = index < 0 ? 0 : current.sequence + 1;
+    record.record_crc = boot_record_crc(&record);
+
+    uint32_t sector_index = index < 0 ? 0 : index;
+    if (flash_log_count(BOOT_RECORD_SECTOR_OFFSET(sector_index), sizeof(record)) == FLASH_SECTOR_SIZE / sizeof(record)) {
+        // Rather than erasing the only copy of the current record, start over in the other sector
+        sector_index ^= 1;
+        erase_flash_sector(BOOT_RECORD_SECTOR_OFFSET(sector_index));
+    }
+
+    uint32_t sector_offset = BOOT_RECORD_SECTOR_OFFSET(sector_index);
+
+    return flash_log_append(sector_offset, &record, sizeof(record));
+}
+
+bool boot_trial_started(uint8_t slot) {
+    return watchdog_hw->scratch[2] == BOOT_TRIAL_MAGIC && watchdog_hw->scratch[3] == slot;
+}
+
+void set_boot_trial(uint8_t slot) {
+    watchdog_hw->scratch[2] = BOOT_TRIAL_MAGIC;
+    watchdog_hw->scratch[3] = slot;
+}
+
+void clear_boot_trial() {
+    watchdog_hw->scratch[2] = 0;
+    watchdog_hw->scratch[3] = 0;
+}
+#endif
+
+uint8_t boot_slots_active() {
+#if WIFI_BOOT_AB_SLOTS
+    struct BootRecord record;
+    return read_boot_record(&record) ? record.active_slot : 0;
+#else
+    return 0;
+#endif
+}
+
+uint8_t boot_slots_target() {
+#if WIFI_BOOT_AB_SLOTS
+    return boot_slots_active() ^ 1;
+#elif WIFI_BOOT_STAGING
+    return BOOT_STAGING_SLOT;
+#else
+    return 0;
+#endif
+}
+
+uint8_t boot_slots_target_link() {
+#if WIFI_BOOT_STAGING
+    return 0;
+#else
+    return boot_slots_target();
+#endif
+}
+
+bool boot_slots_image_valid(uint8_t slot) {
+#if WIFI_BOOT_AB_SLOTS
+    // User programs start with their vector table, so check the initial stack pointer and reset handler
+    uint32_t* vt = (uint32_t*)(XIP_BASE + USER_SLOT_OFFSET(slot));
+    uint32_t stack_end = vt[0];
+    uint32_t reset_handler = vt[1] & ~1;
+
+    return stack_end > SRAM_BASE && stack_end <= SRAM_END
+        && reset_handler >= XIP_BASE + USER_SLOT_OFFSET(slot)
+        && reset_handler < XIP_BASE + USER_SLOT_OFFSET(slot) + USER_PROGRAM_MAX_SIZE;
+#else
+    return true;
+#endif
+}
+
+bool boot_slots_activate(uint8_t slot) {
+#if WIFI_BOOT_AB_SLOTS
+    uint8_t fallback_slot = boot_slots_active();
+    if (fallback_slot == slot) {
+        // Overwritten in place, so there is nothing to fall back to
+        return write_boot_record(slot, /*confirmed=*/ true, slot);
+    }
+
+    clear_boot_trial();
+    return write_boot_record(slot, /*confirmed=*/ false, fallback_slot);
+#else
+    return true;
+#endif
+}
+
+bool boot_slots_select(uint8_t* slot) {
+#if WIFI_BOOT_AB_SLOTS
+    struct BootRecord record;
+    if (!read_boot_record(&record)) {
+        // Nothing has been flashed through OTA yet
+        *slot = 0;
+        return boot_slots_image_valid(*slot);
+    }
+
+    if (record.confirmed) {
+        clear_boot_trial();
+        *slot = record.active_slot;
+        return boot_slots_image_valid(*slot);
+    }
+
+    if (boot_trial_started(record.active_slot) || !boot_slots_image_valid(record.active_slot)) {
+        // The program did not confirm itself in time on its last boot, so go back to the previous one
+        clear_boot_trial();
+        write_boot_record(record.fallback_slot, /*confirmed=*/ true, record.active_slot);
+        *slot = record.fallback_slot;
+        return boot_slots_image_valid(*slot);
+    }
+
+    set_boot_trial(record.active_slot);
+    watchdog_enable(BOOT_CONFIRM_TIMEOUT_MS, /*pause_on_debug=*/ true);
+    *slot = record.active_slot;
+    return true;
+#else
+    *slot = 0;
+    return true;
+#endif
+}
+
+bool boot_slots_fall_back(uint8_t* slot) {
+#if WIFI_BOOT_AB_SLOTS
+    struct BootRecord record;
+    if (!read_boot_record(&record) || record.confirmed || record.active_slot != *slot
+        || record.fallback_slot == record.active_slot) {
+        return false;
+    }
+
+    // The trial armed by boot_slots_select() is over before it started
+    clear_boot_trial();
+    watchdog_disable();
+    write_boot_record(record.fallback_slot, /*confirmed=*/ true, record.active_slot);
+    *slot = record.fallback_slot;
+    return boot_slots_image_valid(*slot);
+#else
+    return false;
+#endif
+}
+
+bool boot_slots_confirm() {
+#if WIFI_BOOT_AB_SLOTS
+    struct BootRecord record;
+    if (!read_boot_record(&record) || record.confirmed) {
+        return true;
+    }
+
+    if (!write_boot_record(record.active_slot, /*confirmed=*/ true, record.fallback_slot)) {
+        return false;
+    }
+
+    clear_boot_trial();
+    watchdog_disable();
+#endif
+    return true;
+}
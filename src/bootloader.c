@@ -1,5 +1,6 @@
 #include <stdio.h>
 
+#include "hardware/watchdog.h"
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 
@@ -62,10 +63,13 @@ int main() {
     sleep_ms(1);
 
     if (!bootloader_requested()) {
+        // Only returns if there is no valid program, in which case one needs to be flashed
         load_user_program();
-        return 0;
     }
 
+    // A program on trial may have rebooted into the bootloader before confirming itself
+    watchdog_disable();
+
     stdio_init_all();
 
     if (!wifi_init()) {
@@ -0,0 +1,345 @@
+#include "pico_wifi_boot/config_store.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico_wifi_boot/boot_image.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/sniffer_crc32.h"
+
+#define CONFIG_RECORD_SIZE(length) ((sizeof(struct ConfigRecordHeader) + (length) + 3) & ~3)
+
+// Where config is logged, as found at the start of each read or write
+struct ConfigLog {
+    // CONFIG_FLASH_SECTORS if nothing has been logged yet
+    uint32_t sector;
+    uint32_t sequence;
+    // Offset of the erased space after the records, or FLASH_SECTOR_SIZE if nothing can be appended
+    uint32_t end;
+};
+
+// Reads through the non-caching XIP alias, so that freshly programmed records are seen
+uint8_t* config_sector(uint32_t index) {
+    return (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + CONFIG_SECTOR_OFFSET(index);
+}
+
+uint32_t config_header_crc(struct ConfigSectorHeader* header) {
+    return sniffer_crc32_update(0, (uint8_t*)header, offsetof(struct ConfigSectorHeader, header_crc));
+}
+
+uint32_t config_record_crc(struct ConfigRecordHeader* header, const uint8_t* data) {
+    uint32_t crc = sniffer_crc32_update(0, (uint8_t*)header, offsetof(struct ConfigRecordHeader, record_crc));
+    return sniffer_crc32_update(crc, data, header->length);
+}
+
+// Reads the header of the record at pos, returning false at the end of the records, or at a record
+// which was interrupted by power loss
+bool config_record_at(uint8_t* sector, uint32_t pos, struct ConfigRecordHeader* header) {
+    if (pos + sizeof(*header) > FLASH_SECTOR_SIZE) {
+        return false;
+    }
+    memcpy(header, sector + pos, sizeof(*header));
+
+    return header->key != 0xFFFF
+        && pos + CONFIG_RECORD_SIZE(header->length) <= FLASH_SECTOR_SIZE
+        && header->record_crc == config_record_crc(header, sector + pos + sizeof(*header));
+}
+
+void config_log_find(struct ConfigLog* log) {
+    log->sector = CONFIG_FLASH_SECTORS;
+    log->sequence = 0;
+    log->end = FLASH_SECTOR_SIZE;
+
+    for (uint32_t i = 0; i < CONFIG_FLASH_SECTORS; i++) {
+        struct ConfigSectorHeader header;
+        memcpy(&header, config_sector(i), sizeof(header));
+
+        if (memcmp(header.magic, CONFIG_LOG_MAGIC_CODE, sizeof(header.magic)) == 0
+            && header.header_crc == config_header_crc(&header)
+            && (log->sector == CONFIG_FLASH_SECTORS || (int32_t)(header.sequence - log->sequence) > 0)) {
+            log->sector = i;
+            log->sequence = header.sequence;
+        }
+    }
+
+    if (log->sector == CONFIG_FLASH_SECTORS) {
+        return;
+    }
+
+    uint8_t* sector = config_sector(log->sector);
+    uint32_t pos = sizeof(struct ConfigSectorHeader);
+    struct ConfigRecordHeader header;
+    while (config_record_at(sector, pos, &header)) {
+        pos += CONFIG_RECORD_SIZE(header.length);
+    }
+
+    // Space after a record interrupted by power loss may not be erased, so the next write compacts
+    uint32_t next_word = 0;
+    if (pos + sizeof(next_word) <= FLASH_SECTOR_SIZE) {
+        memcpy(&next_word, sector + pos, sizeof(next_word));
+    }
+    log->end = next_word == 0xFFFFFFFF ? pos : FLASH_SECTOR_SIZE;
+}
+
+// Values in the single config sector which older versions wrote
+const uint8_t* config_legacy_lookup(uint16_t key, uint16_t* length) {
+    uint8_t* legacy = (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + CONFIG_FLASH_OFFSET;
+    if (memcmp(legacy, CONFIG_MAGIC_CODE, CONFIG_MAGIC_CODE_LEN) != 0) {
+        return NULL;
+    }
+
+    uint8_t* wifi = legacy + CONFIG_MAGIC_CODE_LEN;
+    uint8_t* extra = wifi + WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE;
+    uint32_t extra_len = legacy + FLASH_SECTOR_SIZE - extra;
+
+    switch (key) {
+    case CONFIG_KEY_WIFI:
+        *length = WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE;
+        return wifi;
+    case CONFIG_KEY_LEGACY_EXTRA:
+        // The rest of the sector was left erased after the extra config
+        while (extra_len && extra[extra_len - 1] == 0xFF) {
+            extra_len--;
+        }
+
+        // Extra config larger than is now allowed could not be read back, so rather than carry over a
+        // truncated copy, it is dropped
+        if (!extra_len || extra_len > sizeof(uint32_t) + FLASH_CONFIG_EXTRA_MAX_SIZE) {
+            return NULL;
+        }
+        *length = extra_len;
+        return extra;
+    default:
+        return NULL;
+    }
+}
+
+// Returns the current value for key, setting length, or NULL if there is none
+const uint8_t* config_lookup(struct ConfigLog* log, uint16_t key, uint16_t* length) {
+    if (log->sector == CONFIG_FLASH_SECTORS) {
+        return config_legacy_lookup(key, length);
+    }
+
+    uint8_t* sector = config_sector(log->sector);
+    const uint8_t* value = NULL;
+    uint32_t pos = sizeof(struct ConfigSectorHeader);
+    struct ConfigRecordHeader header;
+    while (config_record_at(sector, pos, &header)) {
+        if (header.key == key) {
+            value = sector + pos + sizeof(header);
+            *length = header.length;
+        }
+        pos += CONFIG_RECORD_SIZE(header.length);
+    }
+    return value;
+}
+
+// Fills in CONFIG_RECORD_SIZE(length) bytes at record
+void config_record_init(uint8_t* record, uint16_t key, const void* value, uint16_t length) {
+    struct ConfigRecordHeader header;
+    header.key = key;
+    header.length = length;
+    header.record_crc = config_record_crc(&header, value);
+
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), value, length);
+    memset(record + sizeof(header) + length, 0, CONFIG_RECORD_SIZE(length) - sizeof(header) - length);
+}
+
+bool config_log_append(struct ConfigLog* log, uint16_t key, const void* value, uint16_t length) {
+    // Get space on the heap to avoid large stack vars
+    uint32_t record_size = CONFIG_RECORD_SIZE(length);
+    uint8_t* record = malloc(record_size);
+    if (!record) {
+        return false;
+    }
+    config_record_init(record, key, value, length);
+
+    // Only the record's bytes are programmed, the rest of each page is left as it is
+    uint32_t sector_offset = CONFIG_SECTOR_OFFSET(log->sector);
+    uint32_t record_end = log->end + record_size;
+    uint8_t page[FLASH_PAGE_SIZE];
+    for (uint32_t page_pos = log->end / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE; page_pos < record_end; page_pos += FLASH_PAGE_SIZE) {
+        uint32_t from = MAX(page_pos, log->end);
+        uint32_t to = MIN(page_pos + FLASH_PAGE_SIZE, record_end);
+        memset(page, 0xFF, sizeof(page));
+        memcpy(page + from - page_pos, record + from - log->end, to - from);
+        program_flash_page(sector_offset + page_pos, page);
+    }
+
+    // A record which did not take is not trusted, and the next write compacts past it
+    bool success = memcmp(config_sector(log->sector) + log->end, record, record_size) == 0;
+
+    free(record);
+    return success;
+}
+
+// Removes any record for key from a sector being compacted, which has records up to end
+void config_compact_remove(uint8_t* sector, uint32_t* end, uint16_t key) {
+    uint32_t pos = sizeof(struct ConfigSectorHeader);
+    while (pos < *end) {
+        struct ConfigRecordHeader header;
+        memcpy(&header, sector + pos, sizeof(header));
+        uint32_t record_size = CONFIG_RECORD_SIZE(header.length);
+
+        if (header.key == key) {
+            memmove(sector + pos, sector + pos + record_size, *end - pos - record_size);
+            *end -= record_size;
+            memset(sector + *end, 0xFF, record_size);
+            return;
+        }
+        pos += record_size;
+    }
+}
+
+// Adds a record to a sector being compacted, replacing any earlier one for key. Returns false if it
+// does not fit
+bool config_compact_put(uint8_t* sector, uint32_t* end, uint16_t key, const void* value, uint16_t length) {
+    config_compact_remove(sector, end, key);
+    if (*end + CONFIG_RECORD_SIZE(length) > FLASH_SECTOR_SIZE) {
+        return false;
+    }
+
+    config_record_init(sector + *end, key, value, length);
+    *end += CONFIG_RECORD_SIZE(length);
+    return true;
+}
+
+// True if no installed program covers the config sector, which is about to be compacted into with
+// the given sequence. Only spare sectors can be covered, by a program which an older version
+// installed before they were taken from the user program region
+bool config_sector_free(uint32_t index, uint32_t sequence) {
+    // Sectors are first compacted into in order, sector i (from 1) with sequence i, after which they
+    // hold config for good
+    if (index == 0 || sequence > index) {
+        return true;
+    }
+
+    // A program installed before the region was split into slots may run on past its slot too
+#if WIFI_BOOT_AB_SLOTS || WIFI_BOOT_STAGING
+    uint8_t slot_count = 2;
+#else
+    uint8_t slot_count = 1;
+#endif
+    bool recorded = true;
+    for (uint8_t slot = 0; slot < slot_count; slot++) {
+        uint32_t image_size;
+        uint32_t image_checksum;
+        if (!boot_image_installed(slot, &image_size, &image_checksum)) {
+            recorded = false;
+        } else if (USER_SLOT_OFFSET(slot) + image_size > CONFIG_SECTOR_OFFSET(index)) {
+            return false;
+        }
+    }
+    if (recorded) {
+        return true;
+    }
+
+    // Without a record, the sector is only known to be free if it starts erased, or with the magic
+    // code at most partly programmed by a compaction into it which was interrupted
+    uint8_t* sector = config_sector(index);
+    for (uint32_t i = 0; i < CONFIG_MAGIC_CODE_LEN; i++) {
+        uint8_t magic = CONFIG_LOG_MAGIC_CODE[i];
+        if ((sector[i] & magic) != magic) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes the current values, with the new one for key, to the next sector
+bool config_log_compact(struct ConfigLog* log, uint16_t key, const void* value, uint16_t length) {
+    // Get space on the heap to avoid large stack vars
+    uint8_t* sector = malloc(FLASH_SECTOR_SIZE);
+    if (!sector) {
+        return false;
+    }
+    memset(sector, 0xFF, FLASH_SECTOR_SIZE);
+
+    // The header is left erased for now, so the sector is not current until its records are in place
+    uint32_t end = sizeof(struct ConfigSectorHeader);
+    bool fits = true;
+    const uint8_t* current;
+    uint16_t current_length;
+
+    if (log->sector == CONFIG_FLASH_SECTORS) {
+        // Carry over the single config sector, which later records can replace like any other
+        const uint16_t legacy_keys[] = {CONFIG_KEY_WIFI, CONFIG_KEY_LEGACY_EXTRA};
+        for (uint32_t i = 0; i < sizeof(legacy_keys) / sizeof(legacy_keys[0]); i++) {
+            current = config_legacy_lookup(legacy_keys[i], &current_length);
+            if (current) {
+                fits = fits && config_compact_put(sector, &end, legacy_keys[i], current, current_length);
+            }
+        }
+    } else {
+        // Keys this version does not know about are carried over too, in case the other of the
+        // bootloader and user program does
+        uint8_t* from = config_sector(log->sector);
+        uint32_t pos = sizeof(struct ConfigSectorHeader);
+        struct ConfigRecordHeader header;
+        while (config_record_at(from, pos, &header)) {
+            if (header.key != key) {
+                fits = fits && config_compact_put(sector, &end, header.key, from + pos + sizeof(header), header.length);
+            }
+            pos += CONFIG_RECORD_SIZE(header.length);
+        }
+    }
+
+    // Extra config written since it was carried over replaces the carried over copy
+    if (key == CONFIG_KEY_EXTRA) {
+        config_compact_remove(sector, &end, CONFIG_KEY_LEGACY_EXTRA);
+    }
+    fits = fits && config_compact_put(sector, &end, key, value, length);
+
+    // Sector 0 still holds the single config sector until something has been logged
+    uint32_t next = log->sector == CONFIG_FLASH_SECTORS ? 1 : (log->sector + 1) % CONFIG_FLASH_SECTORS;
+    uint32_t next_offset = CONFIG_SECTOR_OFFSET(next);
+    bool success = fits && config_sector_free(next, log->sequence + 1) && write_flash_sector(next_offset, sector);
+
+    if (success) {
+        struct ConfigSectorHeader header;
+        memcpy(header.magic, CONFIG_LOG_MAGIC_CODE, sizeof(header.magic));
+        header.sequence = log->sequence + 1;
+        header.header_crc = config_header_crc(&header);
+
+        memset(sector, 0xFF, FLASH_PAGE_SIZE);
+        memcpy(sector, &header, sizeof(header));
+        program_flash_page(next_offset, sector);
+        success = memcmp(config_sector(next), &header, sizeof(header)) == 0;
+    }
+
+    free(sector);
+    return success;
+}
+
+bool config_store_read(uint16_t key, void* value, uint16_t size, uint16_t* length) {
+    struct ConfigLog log;
+    config_log_find(&log);
+
+    const uint8_t* current = config_lookup(&log, key, length);
+    if (!current) {
+        return false;
+    }
+
+    memcpy(value, current, MIN(size, *length));
+    return true;
+}
+
+bool config_store_write(uint16_t key, const void* value, uint16_t length) {
+    struct ConfigLog log;
+    config_log_find(&log);
+
+    uint16_t current_length;
+    const uint8_t* current = config_lookup(&log, key, &current_length);
+    if (current && current_length == length && memcmp(current, value, length) == 0) {
+        return true;
+    }
+
+    // Most writes fit after the current records, and only program the pages they cover
+    if (log.end + CONFIG_RECORD_SIZE(length) <= FLASH_SECTOR_SIZE && config_log_append(&log, key, value, length)) {
+        return true;
+    }
+
+    return config_log_compact(&log, key, value, length);
+}
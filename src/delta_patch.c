@@ -0,0 +1,128 @@
+#include "pico_wifi_boot/delta_patch.h"
+
+#include <string.h>
+
+void delta_patch_init(struct DeltaPatch* patch, uint32_t base_size) {
+    memset(patch, 0, sizeof(*patch));
+    patch->base_size = base_size;
+}
+
+uint8_t delta_patch_field_count(uint8_t op) {
+    return op == DELTA_PATCH_COPY ? 2 : 1;
+}
+
+bool delta_patch_begin_body(struct DeltaPatch* patch) {
+    if (patch->op == DELTA_PATCH_COPY) {
+        // Zigzag-decode the signed offset from the cursor
+        int64_t src_delta = (int64_t)(patch->fields[0] >> 1) ^ -(int64_t)(patch->fields[0] & 1);
+        int64_t src = (int64_t)patch->src_cursor + src_delta;
+        uint32_t len = patch->fields[1];
+
+        if (src < 0 || src > patch->base_size || len > patch->base_size - src) {
+            return false;
+        }
+
+        patch->src_cursor = (uint32_t)src;
+        patch->remaining = len;
+    } else {
+        patch->remaining = patch->fields[0];
+    }
+
+    patch->has_op = patch->remaining > 0;
+    return true;
+}
+
+bool delta_patch_copy(struct DeltaPatch* patch, struct ImageWriter* writer) {
+    while (patch->remaining) {
+        uint32_t available;
+        uint8_t* dest = image_writer_reserve(writer, &available);
+        if (!dest) {
+            // Patch output exceeds the image size
+            return false;
+        }
+        available = MIN(available, patch->remaining);
+
+        if (!image_writer_read_original(writer, patch->src_cursor, dest, available)) {
+            return false;
+        }
+        image_writer_advance(writer, available);
+
+        patch->src_cursor += available;
+        patch->remaining -= available;
+    }
+
+    patch->has_op = false;
+    return true;
+}
+
+bool delta_patch_apply(struct DeltaPatch* patch, struct ImageWriter* writer, const uint8_t* data, uint32_t len) {
+    while (true) {
+        bool in_body = patch->has_op && patch->field == delta_patch_field_count(patch->op);
+
+        // Copies consume no patch data, so finish them before looking at the input
+        if (in_body && patch->op == DELTA_PATCH_COPY) {
+            if (!delta_patch_copy(patch, writer)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (!len) {
+            return true;
+        }
+
+        if (!patch->has_op) {
+            patch->op = *data++;
+            len--;
+
+            if (patch->op != DELTA_PATCH_COPY && patch->op != DELTA_PATCH_INSERT) {
+                return false;
+            }
+
+            patch->has_op = true;
+            patch->field = 0;
+            patch->shift = 0;
+            memset(patch->fields, 0, sizeof(patch->fields));
+        } else if (!in_body) {
+            uint8_t byte = *data++;
+            len--;
+
+            if (patch->shift > 28 || (patch->shift == 28 && (byte & 0x70))) {
+                // Varint does not fit in 32 bits
+                return false;
+            }
+            patch->fields[patch->field] |= (uint32_t)(byte & 0x7F) << patch->shift;
+            patch->shift += 7;
+
+            if (!(byte & 0x80)) {
+                patch->field++;
+                patch->shift = 0;
+
+                if (patch->field == delta_patch_field_count(patch->op) && !delta_patch_begin_body(patch)) {
+                    return false;
+                }
+            }
+        } else {
+            // Insert literal bytes straight from the patch data
+            uint32_t available;
+            uint8_t* dest = image_writer_reserve(writer, &available);
+            if (!dest) {
+                return false;
+            }
+            available = MIN(available, MIN(patch->remaining, len));
+
+            memcpy(dest, data, available);
+            image_writer_advance(writer, available);
+            data += available;
+            len -= available;
+
+            patch->src_cursor += available;
+            patch->remaining -= available;
+            patch->has_op = patch->remaining > 0;
+        }
+    }
+}
+
+bool delta_patch_is_idle(struct DeltaPatch* patch) {
+    return !patch->has_op;
+}
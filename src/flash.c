@@ -7,9 +7,11 @@
 #include "hardware/sync.h"
 #include "pico/multicore.h"
 
+#include "pico_wifi_boot/config_store.h"
+#include "pico_wifi_boot/ota_stats.h"
 #include "pico_wifi_boot/sniffer_crc32.h"
 
-void write_flash_sector(uint32_t sector_offset, uint8_t* data) {
+bool flash_lockout_begin() {
     // If both cores are running, the other core must be locked out to prevent flash XIP access
     // Note: multicore_lockout_victim_init() must have been called on the other core in this case
     uint other_core_num = get_core_num() ? 0 : 1;
@@ -17,123 +19,256 @@ void write_flash_sector(uint32_t sector_offset, uint8_t* data) {
     if (core_lockout_available) {
         multicore_lockout_start_blocking();
     }
+    return core_lockout_available;
+}
+
+void flash_lockout_end(bool core_lockout_available) {
+    if (core_lockout_available) {
+        multicore_lockout_end_blocking();
+    }
+}
+
+bool flash_sector_matches(uint32_t sector_offset, uint8_t* data) {
+    uint32_t start_us = ota_stats_now();
+
+    // Read through the non-caching XIP alias, to avoid evicting anything useful from the cache
+    uint32_t stored_crc = sniffer_crc32((uint8_t*)XIP_NOCACHE_NOALLOC_BASE + sector_offset, FLASH_SECTOR_SIZE);
+    bool matches = stored_crc == sniffer_crc32(data, FLASH_SECTOR_SIZE);
+
+    ota_stats_add(OTA_STATS_VERIFY, start_us);
+    return matches;
+}
+
+// Returns the length of the sector data up to the end of the last page which is not all 0xFF. Pages
+// after it are left erased, which already matches them, so they need not be programmed
+uint32_t flash_sector_programmed_len(uint8_t* data) {
+    uint32_t len = FLASH_SECTOR_SIZE;
+    while (len) {
+        // Data may not be word-aligned
+        uint32_t word;
+        memcpy(&word, data + len - sizeof(word), sizeof(word));
+        if (word != 0xFFFFFFFF) {
+            break;
+        }
+        len -= sizeof(word);
+    }
+    return (len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+}
+
+bool write_flash_sector(uint32_t sector_offset, uint8_t* data) {
+    uint32_t programmed_len = flash_sector_programmed_len(data);
+
+    for (uint32_t attempt = 0; attempt < FLASH_WRITE_MAX_ATTEMPTS; attempt++) {
+        if (attempt) {
+            ota_stats_verify_retry();
+        }
+
+        bool core_lockout_available = flash_lockout_begin();
 
-    do {
         // Disable interrupts to avoid flash XIP access
         uint32_t saved = save_and_disable_interrupts();
+        uint32_t start_us = ota_stats_now();
         flash_range_erase(sector_offset, FLASH_SECTOR_SIZE);
-        flash_range_program(sector_offset, data, FLASH_SECTOR_SIZE);
+        ota_stats_add(OTA_STATS_ERASE, start_us);
+
+        start_us = ota_stats_now();
+        if (programmed_len) {
+            flash_range_program(sector_offset, data, programmed_len);
+        }
+        ota_stats_add(OTA_STATS_PROGRAM, start_us);
         restore_interrupts(saved);
-    } while (memcmp(data, (uint8_t*)XIP_BASE + sector_offset, FLASH_SECTOR_SIZE) != 0);
 
-    if (core_lockout_available) {
-        multicore_lockout_end_blocking();
+        flash_lockout_end(core_lockout_available);
+
+        if (flash_sector_matches(sector_offset, data)) {
+            return true;
+        }
     }
+
+    return false;
 }
 
-bool read_wifi_config(char* ssid, char* pass) {
-    uint8_t* read_from = (uint8_t*)XIP_BASE + CONFIG_FLASH_OFFSET;
+void erase_flash_block(uint32_t block_offset) {
+    bool core_lockout_available = flash_lockout_begin();
 
-    if (memcmp(read_from, CONFIG_MAGIC_CODE, CONFIG_MAGIC_CODE_LEN) != 0) {
-        return false;
-    }
-    read_from += CONFIG_MAGIC_CODE_LEN;
+    // Disable interrupts to avoid flash XIP access
+    uint32_t saved = save_and_disable_interrupts();
+    uint32_t start_us = ota_stats_now();
+    flash_range_erase(block_offset, FLASH_BLOCK_SIZE);
+    ota_stats_add(OTA_STATS_ERASE, start_us);
+    restore_interrupts(saved);
 
-    memcpy(ssid, read_from, WIFI_CONFIG_SSID_SIZE);
-    read_from += WIFI_CONFIG_SSID_SIZE;
+    flash_lockout_end(core_lockout_available);
+}
 
-    memcpy(pass, read_from, WIFI_CONFIG_PASS_SIZE);
-    read_from += WIFI_CONFIG_PASS_SIZE;
+void erase_flash_sector(uint32_t sector_offset) {
+    bool core_lockout_available = flash_lockout_begin();
 
-    return true;
+    // Disable interrupts to avoid flash XIP access
+    uint32_t saved = save_and_disable_interrupts();
+    uint32_t start_us = ota_stats_now();
+    flash_range_erase(sector_offset, FLASH_SECTOR_SIZE);
+    ota_stats_add(OTA_STATS_ERASE, start_us);
+    restore_interrupts(saved);
+
+    flash_lockout_end(core_lockout_available);
 }
 
-bool read_flash_config_extra(void* extra, uint16_t size) {
-    if (size > FLASH_CONFIG_EXTRA_MAX_SIZE) {
-        return false;
-    }
+void program_flash_page(uint32_t page_offset, uint8_t* data) {
+    bool core_lockout_available = flash_lockout_begin();
 
-    uint8_t* read_from = (uint8_t*)XIP_BASE + CONFIG_FLASH_OFFSET;
+    // Disable interrupts to avoid flash XIP access
+    uint32_t saved = save_and_disable_interrupts();
+    uint32_t start_us = ota_stats_now();
+    flash_range_program(page_offset, data, FLASH_PAGE_SIZE);
+    ota_stats_add(OTA_STATS_PROGRAM, start_us);
+    restore_interrupts(saved);
 
-    if (memcmp(read_from, CONFIG_MAGIC_CODE, CONFIG_MAGIC_CODE_LEN) != 0) {
-        return false;
-    }
-    read_from += CONFIG_MAGIC_CODE_LEN;
+    flash_lockout_end(core_lockout_available);
+}
 
-    read_from += WIFI_CONFIG_SSID_SIZE;
-    read_from += WIFI_CONFIG_PASS_SIZE;
+uint32_t flash_log_count(uint32_t sector_offset, uint32_t record_size) {
+    // Read through the non-caching XIP alias, so that freshly programmed records are seen
+    uint8_t* records = (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + sector_offset;
 
-    uint32_t stored_crc;
-    memcpy(&stored_crc, read_from, sizeof(stored_crc));
-    read_from += sizeof(stored_crc);
+    uint32_t count = 0;
+    while (count < FLASH_SECTOR_SIZE / record_size && *(uint32_t*)(records + count * record_size) != 0xFFFFFFFF) {
+        count++;
+    }
+    return count;
+}
 
-    if (stored_crc != sniffer_crc32(read_from, size)) {
-        return false;
+bool flash_log_append(uint32_t sector_offset, const void* record, uint32_t record_size) {
+    uint32_t slot = flash_log_count(sector_offset, record_size);
+    if (slot == FLASH_SECTOR_SIZE / record_size) {
+        erase_flash_sector(sector_offset);
+        slot = 0;
     }
 
-    memcpy(extra, read_from, size);
-    read_from += size;
+    // Only the new record's bytes are programmed, the rest of the page is left as it is
+    uint32_t record_pos = slot * record_size;
+    uint32_t page_pos = record_pos / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+    uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page + record_pos - page_pos, record, record_size);
+    program_flash_page(sector_offset + page_pos, page);
 
-    return true;
+    return memcmp((uint8_t*)XIP_NOCACHE_NOALLOC_BASE + sector_offset + record_pos, record, record_size) == 0;
 }
 
-uint8_t *init_write_buffer(uint8_t* sector) {
-    memcpy(sector, (uint8_t*)XIP_BASE + CONFIG_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+void flash_log_clear(uint32_t sector_offset, uint32_t record_size) {
+    if (flash_log_count(sector_offset, record_size)) {
+        erase_flash_sector(sector_offset);
+    }
+}
+
+bool program_flash_sector(uint32_t sector_offset, uint8_t* data) {
+    uint32_t programmed_len = flash_sector_programmed_len(data);
+    if (programmed_len) {
+        bool core_lockout_available = flash_lockout_begin();
+
+        // Disable interrupts to avoid flash XIP access
+        uint32_t saved = save_and_disable_interrupts();
+        uint32_t start_us = ota_stats_now();
+        flash_range_program(sector_offset, data, programmed_len);
+        ota_stats_add(OTA_STATS_PROGRAM, start_us);
+        restore_interrupts(saved);
 
-    if (memcmp(sector, CONFIG_MAGIC_CODE, CONFIG_MAGIC_CODE_LEN) != 0) {
-        memset(sector, 0, sizeof(sector));
-        memcpy(sector, CONFIG_MAGIC_CODE, CONFIG_MAGIC_CODE_LEN);
+        flash_lockout_end(core_lockout_available);
     }
 
-    return sector + CONFIG_MAGIC_CODE_LEN;
+    if (flash_sector_matches(sector_offset, data)) {
+        return true;
+    }
+
+    // Fall back to erasing and writing again if programming did not take
+    ota_stats_verify_retry();
+    return write_flash_sector(sector_offset, data);
 }
 
-bool write_wifi_config(char *ssid, char* pass) {
-    // Get space on the heap to avoid large stack vars
-    uint8_t* sector = malloc(FLASH_SECTOR_SIZE);
-    if (!sector) {
-        return false;
-    }
+bool write_flash_sector_if_changed(uint32_t sector_offset, uint8_t* data, bool* written) {
+    *written = !flash_sector_matches(sector_offset, data);
+    return !*written || write_flash_sector(sector_offset, data);
+}
 
-    uint8_t *write_to = init_write_buffer(sector);
+uint16_t wifi_profile_key(uint32_t index) {
+    return index ? CONFIG_KEY_WIFI_PROFILE + index - 1 : CONFIG_KEY_WIFI;
+}
 
-    memcpy(write_to, ssid, MIN(strlen(ssid) + 1, WIFI_CONFIG_SSID_SIZE));
-    write_to += WIFI_CONFIG_SSID_SIZE;
+bool read_wifi_profile(uint32_t index, char* ssid, char* pass) {
+    if (index >= WIFI_PROFILE_COUNT) {
+        return false;
+    }
 
-    memcpy(write_to, pass, MIN(strlen(pass) + 1, WIFI_CONFIG_PASS_SIZE));
-    write_to += WIFI_CONFIG_PASS_SIZE;
+    uint8_t wifi[WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE];
+    uint16_t length;
+    if (!config_store_read(wifi_profile_key(index), wifi, sizeof(wifi), &length) || length != sizeof(wifi)) {
+        return false;
+    }
 
-    write_flash_sector(CONFIG_FLASH_OFFSET, sector);
+    memcpy(ssid, wifi, WIFI_CONFIG_SSID_SIZE);
+    memcpy(pass, wifi + WIFI_CONFIG_SSID_SIZE, WIFI_CONFIG_PASS_SIZE);
 
-    free(sector);
     return true;
 }
 
-bool write_flash_config_extra(void *extra, uint16_t size) {
+bool read_wifi_config(char* ssid, char* pass) {
+    return read_wifi_profile(0, ssid, pass);
+}
+
+bool read_flash_config_extra(void* extra, uint16_t size) {
     if (size > FLASH_CONFIG_EXTRA_MAX_SIZE) {
         return false;
     }
 
-    // Get space on the heap to avoid large stack vars
-    uint8_t* sector = malloc(FLASH_SECTOR_SIZE);
-    if (!sector) {
+    uint16_t length;
+    if (config_store_read(CONFIG_KEY_EXTRA, extra, size, &length)) {
+        return length == size;
+    }
+
+    // Extra config carried over from the single config sector has its checksum stored in front, with
+    // trailing 0xFF trimmed
+    uint8_t* legacy = malloc(sizeof(uint32_t) + FLASH_CONFIG_EXTRA_MAX_SIZE);
+    if (!legacy) {
         return false;
     }
+    memset(legacy, 0xFF, sizeof(uint32_t) + FLASH_CONFIG_EXTRA_MAX_SIZE);
+
+    bool success = false;
+    if (config_store_read(CONFIG_KEY_LEGACY_EXTRA, legacy, sizeof(uint32_t) + size, &length)) {
+        uint32_t stored_crc;
+        memcpy(&stored_crc, legacy, sizeof(stored_crc));
+        success = stored_crc == sniffer_crc32_update(0, legacy + sizeof(stored_crc), size);
+        if (success) {
+            memcpy(extra, legacy + sizeof(stored_crc), size);
+        }
+    }
 
-    uint8_t *write_to = init_write_buffer(sector);
+    free(legacy);
+    return success;
+}
 
-    write_to += WIFI_CONFIG_SSID_SIZE;
-    write_to += WIFI_CONFIG_PASS_SIZE;
+bool write_wifi_profile(uint32_t index, char* ssid, char* pass) {
+    if (index >= WIFI_PROFILE_COUNT) {
+        return false;
+    }
 
-    uint32_t crc32 = sniffer_crc32(extra, size);
-    memcpy(write_to, &crc32, sizeof(crc32));
-    write_to += sizeof(crc32);
+    uint8_t wifi[WIFI_CONFIG_SSID_SIZE + WIFI_CONFIG_PASS_SIZE];
+    memset(wifi, 0, sizeof(wifi));
+    memcpy(wifi, ssid, MIN(strlen(ssid) + 1, WIFI_CONFIG_SSID_SIZE));
+    memcpy(wifi + WIFI_CONFIG_SSID_SIZE, pass, MIN(strlen(pass) + 1, WIFI_CONFIG_PASS_SIZE));
 
-    memcpy(write_to, extra, size);
-    write_to += size;
+    return config_store_write(wifi_profile_key(index), wifi, sizeof(wifi));
+}
 
-    write_flash_sector(CONFIG_FLASH_OFFSET, sector);
+bool write_wifi_config(char *ssid, char* pass) {
+    return write_wifi_profile(0, ssid, pass);
+}
 
-    free(sector);
-    return true;
+bool write_flash_config_extra(void *extra, uint16_t size) {
+    if (size > FLASH_CONFIG_EXTRA_MAX_SIZE) {
+        return false;
+    }
+
+    return config_store_write(CONFIG_KEY_EXTRA, extra, size);
 }
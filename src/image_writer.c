@@ -0,0 +1,252 @@
+#include "pico_wifi_boot/image_writer.h"
+
+#include <string.h>
+
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/ota_stats.h"
+#include "pico_wifi_boot/sniffer_crc32.h"
+
+void image_writer_init(struct ImageWriter* writer, uint32_t flash_offset, uint32_t image_size) {
+    writer->flash_offset = flash_offset;
+    writer->base_offset = flash_offset;
+    writer->image_size = image_size;
+    writer->commit_index = 0;
+    writer->pending_count = 0;
+    writer->fill_bytes = 0;
+    writer->bytes_received = 0;
+    writer->bytes_committed = 0;
+    writer->sectors_written = 0;
+    writer->sectors_skipped = 0;
+    writer->blocks_erased = 0;
+    writer->erase_ahead = IMAGE_WRITER_ERASE_AHEAD;
+    writer->erased_until = flash_offset;
+    writer->recent_changed = 0;
+    writer->recent_sectors = 0;
+    writer->write_failed = false;
+    writer->failed_sector = 0;
+    writer->image_crc = 0;
+    writer->history = NULL;
+    writer->history_sectors = 0;
+}
+
+void image_writer_resume(struct ImageWriter* writer, uint32_t bytes_committed) {
+    writer->bytes_received = bytes_committed;
+    writer->bytes_committed = bytes_committed;
+    writer->erased_until = writer->flash_offset + bytes_committed;
+
+    // Checksums of the sectors already in flash are taken from flash itself
+    for (uint32_t offset = 0; offset < bytes_committed; offset += FLASH_SECTOR_SIZE) {
+        uint8_t* sector = (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + writer->flash_offset + offset;
+        writer->sector_crcs[offset / FLASH_SECTOR_SIZE] = sniffer_crc32_update(0, sector, FLASH_SECTOR_SIZE);
+        writer->image_crc = sniffer_crc32_update(writer->image_crc, sector, FLASH_SECTOR_SIZE);
+    }
+}
+
+void image_writer_set_base(struct ImageWriter* writer, uint32_t base_offset) {
+    writer->base_offset = base_offset;
+}
+
+void image_writer_set_history(struct ImageWriter* writer, uint8_t* history, uint32_t history_sectors) {
+    writer->history = history;
+    writer->history_sectors = history_sectors;
+    writer->erase_ahead = false;
+}
+
+uint8_t* image_writer_reserve(struct ImageWriter* writer, uint32_t* len) {
+    if (writer->bytes_received == writer->image_size) {
+        *len = 0;
+        return NULL;
+    }
+
+    if (writer->pending_count == IMAGE_WRITER_BUFFER_COUNT) {
+        image_writer_commit_next(writer);
+    }
+
+    uint32_t fill_index = (writer->commit_index + writer->pending_count) % IMAGE_WRITER_BUFFER_COUNT;
+    *len = MIN(FLASH_SECTOR_SIZE - writer->fill_bytes, writer->image_size - writer->bytes_received);
+
+    return writer->buffers[fill_index] + writer->fill_bytes;
+}
+
+void image_writer_advance(struct ImageWriter* writer, uint32_t len) {
+    writer->fill_bytes += len;
+    writer->bytes_received += len;
+
+    // The final sector may be partial
+    if (writer->fill_bytes == FLASH_SECTOR_SIZE || writer->bytes_received == writer->image_size) {
+        // Pad to match erased flash, so an unchanged partial sector is recognized as such
+        uint32_t fill_index = (writer->commit_index + writer->pending_count) % IMAGE_WRITER_BUFFER_COUNT;
+        memset(writer->buffers[fill_index] + writer->fill_bytes, 0xFF, FLASH_SECTOR_SIZE - writer->fill_bytes);
+
+        writer->pending_count++;
+        writer->fill_bytes = 0;
+    }
+}
+
+bool image_writer_has_pending(struct ImageWriter* writer) {
+    return writer->pending_count > 0;
+}
+
+bool image_writer_should_erase_block(struct ImageWriter* writer, uint32_t sector_offset) {
+    // Only erase blocks which lie entirely within the image
+    if (!writer->erase_ahead
+        || sector_offset % FLASH_BLOCK_SIZE != 0
+        || sector_offset + FLASH_BLOCK_SIZE > writer->flash_offset + writer->image_size) {
+        return false;
+    }
+
+#if IMAGE_WRITER_SKIP_UNCHANGED
+    // Compare the sectors of the block which have already been received
+    uint32_t seen = writer->pending_count;
+    uint32_t seen_changed = 0;
+    for (uint32_t i = 0; i < seen; i++) {
+        uint8_t* data = writer->buffers[(writer->commit_index + i) % IMAGE_WRITER_BUFFER_COUNT];
+        if (!flash_sector_matches(sector_offset + i * FLASH_SECTOR_SIZE, data)) {
+            seen_changed++;
+        }
+    }
+
+    // Expect the rest to change at the recent rate, or at the rate just seen if there is none yet
+    uint32_t rate_changed = seen_changed;
+    uint32_t rate_sectors = seen;
+    if (writer->recent_sectors) {
+        rate_changed = 0;
+        for (uint32_t i = 0; i < writer->recent_sectors; i++) {
+            rate_changed += (writer->recent_changed >> i) & 1;
+        }
+        rate_sectors = writer->recent_sectors;
+    }
+
+    uint32_t unseen = IMAGE_WRITER_BLOCK_SECTORS - seen;
+    return seen_changed * rate_sectors + unseen * rate_changed
+        >= IMAGE_WRITER_ERASE_AHEAD_MIN_CHANGED * rate_sectors;
+#else
+    return true;
+#endif
+}
+
+bool image_writer_commit_next(struct ImageWriter* writer) {
+    if (!writer->pending_count) {
+        return false;
+    }
+
+    uint32_t start_us = ota_stats_now();
+
+    // The final sector is padded with 0xFF, so only the pages it actually uses are programmed
+    uint32_t sector_offset = writer->flash_offset + writer->bytes_committed;
+    uint32_t sector_index = writer->bytes_committed / FLASH_SECTOR_SIZE;
+    uint32_t sector_len = MIN(FLASH_SECTOR_SIZE, writer->image_size - writer->bytes_committed);
+    uint8_t* data = writer->buffers[writer->commit_index];
+
+    uint32_t checksum_start_us = ota_stats_now();
+    writer->sector_crcs[sector_index] = sniffer_crc32_update(0, data, sector_len);
+    ota_stats_add(OTA_STATS_CHECKSUM, checksum_start_us);
+
+    if (writer->history) {
+        uint32_t slot = sector_index % writer->history_sectors;
+        memcpy(
+            writer->history + slot * FLASH_SECTOR_SIZE,
+            (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + sector_offset,
+            FLASH_SECTOR_SIZE);
+    }
+
+    bool write_ok;
+    bool written = true;
+    if (writer->write_failed) {
+        // Drain the remaining sectors without touching flash, since the image cannot be valid
+        write_ok = false;
+        written = false;
+    } else if (sector_offset < writer->erased_until) {
+        // Already erased along with the rest of its block
+        write_ok = program_flash_sector(sector_offset, data);
+    } else if (image_writer_should_erase_block(writer, sector_offset)) {
+        erase_flash_block(sector_offset);
+        writer->erased_until = sector_offset + FLASH_BLOCK_SIZE;
+        writer->blocks_erased++;
+
+        write_ok = program_flash_sector(sector_offset, data);
+    } else {
+#if IMAGE_WRITER_SKIP_UNCHANGED
+        write_ok = write_flash_sector_if_changed(sector_offset, data, &written);
+#else
+        write_ok = write_flash_sector(sector_offset, data);
+#endif
+    }
+
+    if (!write_ok && !writer->write_failed) {
+        writer->write_failed = true;
+        writer->failed_sector = sector_index;
+    }
+    if (written) {
+        writer->sectors_written++;
+    } else if (write_ok) {
+        writer->sectors_skipped++;
+    }
+    // Sectors programmed into an erased block were not compared, so they say nothing about the rate
+    if (write_ok && sector_offset >= writer->erased_until) {
+        uint32_t mask = (1u << IMAGE_WRITER_BLOCK_SECTORS) - 1;
+        writer->recent_changed = ((writer->recent_changed << 1) | written) & mask;
+        writer->recent_sectors = MIN(writer->recent_sectors + 1, IMAGE_WRITER_BLOCK_SECTORS);
+    }
+
+    // Continue the image checksum from what actually landed in flash, so that it is ready as soon as
+    // the last sector is committed
+    checksum_start_us = ota_stats_now();
+    writer->image_crc = sniffer_crc32_update(
+        writer->image_crc, (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + sector_offset, sector_len);
+    ota_stats_add(OTA_STATS_CHECKSUM, checksum_start_us);
+
+    writer->bytes_committed += sector_len;
+    writer->commit_index = (writer->commit_index + 1) % IMAGE_WRITER_BUFFER_COUNT;
+    writer->pending_count--;
+
+    ota_stats_commit(start_us);
+    return true;
+}
+
+bool image_writer_is_complete(struct ImageWriter* writer) {
+    return writer->bytes_committed == writer->image_size;
+}
+
+int32_t image_writer_find_corrupt_sector(struct ImageWriter* writer) {
+    uint32_t committed_sectors = (writer->bytes_committed + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+
+    for (uint32_t sector = 0; sector < committed_sectors; sector++) {
+        uint32_t offset = sector * FLASH_SECTOR_SIZE;
+        uint32_t sector_len = MIN(FLASH_SECTOR_SIZE, writer->image_size - offset);
+        uint32_t flash_crc = sniffer_crc32_update(
+            0, (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + writer->flash_offset + offset, sector_len);
+
+        if (flash_crc != writer->sector_crcs[sector]) {
+            return sector;
+        }
+    }
+
+    return -1;
+}
+
+bool image_writer_read_original(struct ImageWriter* writer, uint32_t offset, uint8_t* dest, uint32_t len) {
+    uint32_t overwritten_sectors = (writer->bytes_committed + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+
+    while (len) {
+        uint32_t sector = offset / FLASH_SECTOR_SIZE;
+        uint32_t sector_pos = offset % FLASH_SECTOR_SIZE;
+        uint32_t chunk = MIN(len, FLASH_SECTOR_SIZE - sector_pos);
+
+        const uint8_t* src;
+        if (writer->base_offset != writer->flash_offset || sector >= overwritten_sectors) {
+            src = (uint8_t*)XIP_BASE + writer->base_offset + offset;
+        } else if (writer->history && sector + writer->history_sectors >= overwritten_sectors) {
+            src = writer->history + (sector % writer->history_sectors) * FLASH_SECTOR_SIZE + sector_pos;
+        } else {
+            return false;
+        }
+
+        memcpy(dest, src, chunk);
+        dest += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
@@ -0,0 +1,104 @@
+#include "pico_wifi_boot/lzss.h"
+
+#include <string.h>
+
+void lzss_init(struct LzssDecoder* decoder) {
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+bool lzss_output_match(struct LzssDecoder* decoder, struct ImageWriter* writer) {
+    while (decoder->match_remaining) {
+        uint32_t available;
+        uint8_t* dest = image_writer_reserve(writer, &available);
+        if (!dest) {
+            return false;
+        }
+        available = MIN(available, decoder->match_remaining);
+
+        // Byte by byte, since the match may overlap the bytes it produces
+        for (uint32_t i = 0; i < available; i++) {
+            uint8_t byte = decoder->window[(decoder->bytes_out - decoder->match_distance) % LZSS_WINDOW_SIZE];
+            decoder->window[decoder->bytes_out % LZSS_WINDOW_SIZE] = byte;
+            dest[i] = byte;
+            decoder->bytes_out++;
+        }
+        image_writer_advance(writer, available);
+
+        decoder->match_remaining -= available;
+    }
+
+    return true;
+}
+
+bool lzss_begin_match(struct LzssDecoder* decoder) {
+    if (decoder->match_distance > decoder->bytes_out) {
+        return false;
+    }
+
+    decoder->match_remaining = decoder->match_length;
+    return true;
+}
+
+bool lzss_decode(struct LzssDecoder* decoder, struct ImageWriter* writer, const uint8_t* data, uint32_t len) {
+    while (true) {
+        // Matches consume no input, so finish them before reading more
+        if (decoder->match_remaining && !lzss_output_match(decoder, writer)) {
+            return false;
+        }
+
+        if (!len) {
+            return true;
+        }
+
+        uint8_t byte = *data++;
+        len--;
+
+        if (decoder->extending) {
+            decoder->match_length += byte;
+            decoder->extending = byte == 255;
+
+            if (!decoder->extending && !lzss_begin_match(decoder)) {
+                return false;
+            }
+        } else if (decoder->token_bytes) {
+            uint16_t token = decoder->token | ((uint16_t)byte << 8);
+            decoder->token_bytes = 0;
+
+            uint32_t length_field = token >> LZSS_DISTANCE_BITS;
+            decoder->match_distance = (token & (LZSS_WINDOW_SIZE - 1)) + 1;
+            decoder->match_length = length_field + LZSS_MIN_MATCH;
+            decoder->extending = length_field == LZSS_LENGTH_FIELD_MAX;
+
+            if (!decoder->extending && !lzss_begin_match(decoder)) {
+                return false;
+            }
+        } else if (!decoder->items_left) {
+            decoder->flags = byte;
+            decoder->items_left = 8;
+        } else {
+            bool is_literal = decoder->flags & 1;
+            decoder->flags >>= 1;
+            decoder->items_left--;
+
+            if (is_literal) {
+                uint32_t available;
+                uint8_t* dest = image_writer_reserve(writer, &available);
+                if (!dest) {
+                    return false;
+                }
+
+                *dest = byte;
+                decoder->window[decoder->bytes_out % LZSS_WINDOW_SIZE] = byte;
+                decoder->bytes_out++;
+                image_writer_advance(writer, 1);
+            } else {
+                decoder->token = byte;
+                decoder->token_bytes = 1;
+            }
+        }
+    }
+}
+
+bool lzss_is_idle(struct LzssDecoder* decoder) {
+    return !decoder->token_bytes && !decoder->extending && !decoder->match_remaining;
+}
@@ -0,0 +1,190 @@
+#include "pico_wifi_boot/ota_discovery.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lwip/opt.h"
+
+#if LWIP_UDP
+#include "cyw43.h"
+#include "cyw43_config.h"
+#include "lwip/ip.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "pico/async_context.h"
+#include "pico/unique_id.h"
+
+#include "pico_wifi_boot/boot_image.h"
+#include "pico_wifi_boot/boot_slots.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/reboot.h"
+
+#define OTA_DISCOVERY_MAGIC_PREFIX "OTD"
+#define OTA_DISCOVERY_MAGIC_PREFIX_LEN 3
+
+// Forward-declare from pico_cyw43_arch, since we do not know the required arch type to include pico/cyw43_arch.h
+async_context_t* cyw43_arch_async_context(void);
+
+enum OtaDiscoveryPacketType {
+    OTA_DISCOVERY_READY = 'R',
+    OTA_DISCOVERY_QUERY = 'Q',
+    OTA_DISCOVERY_INFO = 'I',
+};
+
+struct __attribute__((__packed__)) OtaBeacon {
+    uint8_t magic_code[4]; // "OTD" followed by the packet type
+    uint16_t ota_port;
+    // Set by the bootloader, so that tools waiting for a device to reboot into it can tell
+    uint8_t in_bootloader;
+};
+
+struct __attribute__((__packed__)) OtaDiscoveryInfo {
+    uint8_t magic_code[4]; // "OTD" followed by the packet type
+    uint8_t board_id[PICO_UNIQUE_BOARD_ID_SIZE_BYTES];
+    uint16_t ota_port;
+    uint8_t in_bootloader;
+    // Slot the installed image runs from, and slot which the next image must be built for
+    uint8_t active_slot;
+    uint8_t target_slot;
+    // Signal strength of the AP in dBm, or 0 if it could not be read
+    int8_t rssi;
+    uint8_t reserved[2];
+    // Both 0 if the installed image was flashed other than through OTA
+    uint32_t image_size;
+    uint32_t image_checksum;
+    // Largest image which the device can take
+    uint32_t max_image_size;
+};
+
+struct udp_pcb* ota_discovery_pcb = NULL;
+uint16_t ota_beacon_port;
+uint32_t ota_beacons_sent;
+async_at_time_worker_t ota_beacon_worker;
+
+void ota_beacon_send() {
+    struct pbuf* pb = pbuf_alloc(PBUF_TRANSPORT, sizeof(struct OtaBeacon), PBUF_RAM);
+    if (!pb) {
+        printf("OTA discovery: failed to allocate beacon\n");
+        return;
+    }
+
+    struct OtaBeacon* beacon = pb->payload;
+    memcpy(beacon->magic_code, OTA_DISCOVERY_MAGIC_PREFIX, OTA_DISCOVERY_MAGIC_PREFIX_LEN);
+    beacon->magic_code[OTA_DISCOVERY_MAGIC_PREFIX_LEN] = OTA_DISCOVERY_READY;
+    beacon->ota_port = ota_beacon_port;
+    beacon->in_bootloader = running_in_bootloader();
+
+    if (udp_sendto(ota_discovery_pcb, pb, IP_ADDR_BROADCAST, OTA_DISCOVERY_PORT) != ERR_OK) {
+        printf("OTA discovery: failed to send beacon\n");
+    }
+    pbuf_free(pb);
+}
+
+void ota_discovery_send_info(const ip_addr_t* addr, uint16_t port) {
+    struct pbuf* pb = pbuf_alloc(PBUF_TRANSPORT, sizeof(struct OtaDiscoveryInfo), PBUF_RAM);
+    if (!pb) {
+        printf("OTA discovery: failed to allocate info\n");
+        return;
+    }
+
+    struct OtaDiscoveryInfo* info = pb->payload;
+    memset(info, 0, sizeof(*info));
+    memcpy(info->magic_code, OTA_DISCOVERY_MAGIC_PREFIX, OTA_DISCOVERY_MAGIC_PREFIX_LEN);
+    info->magic_code[OTA_DISCOVERY_MAGIC_PREFIX_LEN] = OTA_DISCOVERY_INFO;
+
+    pico_unique_board_id_t board_id;
+    pico_get_unique_board_id(&board_id);
+    memcpy(info->board_id, board_id.id, sizeof(info->board_id));
+
+    info->ota_port = ota_beacon_port;
+    info->in_bootloader = running_in_bootloader();
+    info->active_slot = boot_slots_active();
+    info->target_slot = boot_slots_target_link();
+    info->max_image_size = USER_PROGRAM_MAX_SIZE;
+
+    uint32_t image_size;
+    uint32_t image_checksum;
+    if (boot_image_installed(info->active_slot, &image_size, &image_checksum)) {
+        info->image_size = image_size;
+        info->image_checksum = image_checksum;
+    }
+
+    int32_t rssi;
+    if (cyw43_wifi_get_rssi(&cyw43_state, &rssi) == 0) {
+        info->rssi = rssi;
+    }
+
+    if (udp_sendto(ota_discovery_pcb, pb, addr, port) != ERR_OK) {
+        printf("OTA discovery: failed to send info\n");
+    }
+    pbuf_free(pb);
+}
+
+void on_ota_discovery_recv(void* arg, struct udp_pcb* pcb, struct pbuf* pb, const ip_addr_t* addr, uint16_t port) {
+    uint8_t magic_code[4];
+    if (pbuf_copy_partial(pb, magic_code, sizeof(magic_code), 0) == sizeof(magic_code)
+        && memcmp(magic_code, OTA_DISCOVERY_MAGIC_PREFIX, OTA_DISCOVERY_MAGIC_PREFIX_LEN) == 0
+        && magic_code[OTA_DISCOVERY_MAGIC_PREFIX_LEN] == OTA_DISCOVERY_QUERY) {
+        ota_discovery_send_info(addr, port);
+    }
+
+    // Beacons from other devices arrive here too, and are ignored
+    pbuf_free(pb);
+}
+
+// Beacons are only counted once there is an address to send them from, since user programs may
+// start the OTA server before WiFi connects
+void ota_beacon_work(async_context_t* context, async_at_time_worker_t* worker) {
+    struct netif* netif = netif_default;
+    if (netif && netif_is_up(netif) && netif_is_link_up(netif) && !ip4_addr_isany_val(*netif_ip4_addr(netif))) {
+        ota_beacon_send();
+        ota_beacons_sent++;
+    }
+
+    if (ota_beacons_sent < OTA_BEACON_COUNT) {
+        async_context_add_at_time_worker_in_ms(context, worker, OTA_BEACON_INTERVAL_MS);
+    }
+}
+
+bool ota_discovery_open() {
+    if (ota_discovery_pcb) {
+        return true;
+    }
+
+    struct udp_pcb* pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!pcb) {
+        return false;
+    }
+
+    if (udp_bind(pcb, IP_ADDR_ANY, OTA_DISCOVERY_PORT) != ERR_OK) {
+        udp_remove(pcb);
+        return false;
+    }
+
+    ip_set_option(pcb, SOF_BROADCAST);
+    udp_recv(pcb, on_ota_discovery_recv, NULL);
+    ota_discovery_pcb = pcb;
+    return true;
+}
+
+bool ota_discovery_start(uint16_t ota_port) {
+    cyw43_arch_lwip_check();
+
+    if (!ota_discovery_open()) {
+        printf("OTA discovery: failed to open UDP port\n");
+        return false;
+    }
+
+    async_context_t* context = cyw43_arch_async_context();
+    async_context_remove_at_time_worker(context, &ota_beacon_worker);
+    ota_beacon_port = ota_port;
+    ota_beacons_sent = 0;
+    ota_beacon_worker.do_work = ota_beacon_work;
+    return async_context_add_at_time_worker_in_ms(context, &ota_beacon_worker, 0);
+}
+#else
+bool ota_discovery_start(uint16_t ota_port) {
+    return false;
+}
+#endif
@@ -0,0 +1,50 @@
+#include "pico_wifi_boot/ota_journal.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/sniffer_crc32.h"
+
+uint32_t ota_journal_record_crc(struct OtaJournalRecord* record) {
+    return sniffer_crc32_update(0, (uint8_t*)record, offsetof(struct OtaJournalRecord, record_crc));
+}
+
+uint32_t ota_journal_find(uint32_t flash_offset, uint32_t image_size, uint32_t image_checksum) {
+    uint32_t count = flash_log_count(OTA_JOURNAL_FLASH_OFFSET, sizeof(struct OtaJournalRecord));
+    if (!count) {
+        return 0;
+    }
+
+    // Read through the non-caching XIP alias, so that freshly programmed records are seen
+    struct OtaJournalRecord record;
+    memcpy(
+        &record,
+        (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + OTA_JOURNAL_FLASH_OFFSET + (count - 1) * sizeof(record),
+        sizeof(record));
+
+    if (record.record_crc != ota_journal_record_crc(&record)
+        || record.flash_offset != flash_offset
+        || record.image_size != image_size
+        || record.image_checksum != image_checksum) {
+        return 0;
+    }
+
+    return record.bytes_committed;
+}
+
+bool ota_journal_append(uint32_t flash_offset, uint32_t image_size, uint32_t image_checksum, uint32_t bytes_committed) {
+    struct OtaJournalRecord record = {
+        .image_size = image_size,
+        .image_checksum = image_checksum,
+        .bytes_committed = bytes_committed,
+        .flash_offset = flash_offset,
+    };
+    record.record_crc = ota_journal_record_crc(&record);
+
+    return flash_log_append(OTA_JOURNAL_FLASH_OFFSET, &record, sizeof(record));
+}
+
+void ota_journal_clear() {
+    flash_log_clear(OTA_JOURNAL_FLASH_OFFSET, sizeof(struct OtaJournalRecord));
+}
@@ -0,0 +1,378 @@
+#include "pico_wifi_boot/ota_multicast.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/opt.h"
+
+#if LWIP_IGMP
+#include "cyw43_config.h"
+#include "lwip/igmp.h"
+#include "lwip/netif.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "pico/async_context.h"
+#include "pico/stdlib.h"
+
+#include "pico_wifi_boot/boot_image.h"
+#include "pico_wifi_boot/boot_slots.h"
+#include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/image_writer.h"
+#include "pico_wifi_boot/ota_journal.h"
+#include "pico_wifi_boot/reboot.h"
+#include "pico_wifi_boot/sniffer_crc32.h"
+
+#define OTA_MULTICAST_MAGIC_PREFIX "OTM"
+#define OTA_MULTICAST_MAGIC_PREFIX_LEN 3
+
+#define OTA_MULTICAST_CHUNKS_PER_SECTOR (FLASH_SECTOR_SIZE / OTA_MULTICAST_CHUNK_SIZE)
+#define OTA_MULTICAST_BITMAP_SIZE ((IMAGE_WRITER_MAX_SECTORS + 7) / 8)
+
+_Static_assert(FLASH_SECTOR_SIZE % OTA_MULTICAST_CHUNK_SIZE == 0, "chunks must divide sectors");
+_Static_assert(OTA_MULTICAST_CHUNKS_PER_SECTOR <= 8, "chunk mask must fit in a byte");
+
+// Forward-declare from pico_cyw43_arch, since we do not know the required arch type to include pico/cyw43_arch.h
+async_context_t* cyw43_arch_async_context(void);
+
+enum OtaMulticastPacketType {
+    OTA_MULTICAST_DATA = 'D',
+    OTA_MULTICAST_QUERY = 'Q',
+    OTA_MULTICAST_STATUS = 'S',
+    OTA_MULTICAST_FINISH = 'F',
+};
+
+enum OtaMulticastStatus {
+    OTA_MULTICAST_RECEIVING = 0,
+    OTA_MULTICAST_COMPLETE = 1,
+    OTA_MULTICAST_WRITE_FAILED = 2,
+    OTA_MULTICAST_WRONG_SLOT = 3,
+};
+
+struct __attribute__((__packed__)) OtaMulticastHeader {
+    uint8_t magic_code[4]; // "OTM" followed by the packet type
+    // Identifies the session, since only one image is sent at a time
+    uint32_t image_checksum;
+};
+
+// Followed by the chunk's data, which is short only at the end of the image
+struct __attribute__((__packed__)) OtaMulticastData {
+    struct OtaMulticastHeader header;
+    uint16_t sector;
+    uint8_t chunk;
+    uint8_t reserved;
+};
+
+// Followed by a bitmap of missing sectors (least significant bit first), covering the whole image
+struct __attribute__((__packed__)) OtaMulticastStatusPacket {
+    struct OtaMulticastHeader header;
+    uint8_t status;
+    uint16_t missing_count;
+};
+
+struct OtaMulticastSession {
+    uint32_t image_size;
+    uint32_t image_checksum;
+    uint32_t flash_offset;
+    uint32_t sector_count;
+    uint32_t missing_count;
+    uint8_t missing[OTA_MULTICAST_BITMAP_SIZE];
+    uint8_t status;
+    // When the uploader was last heard from, by a packet of this session or a join over TCP
+    uint32_t last_packet_ms;
+    // Sector being assembled from its chunks. Receiving a chunk of another sector abandons it, and it
+    // is left for a later round
+    int32_t assembling_sector;
+    uint8_t assembled_chunks;
+    uint8_t assembly[FLASH_SECTOR_SIZE];
+    // A full sector waiting to be committed by the deferred worker. While it waits, other sectors
+    // which complete are dropped and left for a later round
+    bool commit_pending;
+    uint32_t commit_sector;
+    uint8_t commit[FLASH_SECTOR_SIZE];
+};
+
+struct udp_pcb* ota_multicast_pcb = NULL;
+struct OtaMulticastSession* ota_multicast_session = NULL;
+
+void ota_multicast_commit_work(async_context_t* context, async_when_pending_worker_t* worker);
+
+async_when_pending_worker_t ota_multicast_commit_worker = {
+    .do_work = ota_multicast_commit_work,
+};
+
+bool ota_multicast_is_missing(struct OtaMulticastSession* session, uint32_t sector) {
+    return session->missing[sector / 8] & (1 << (sector % 8));
+}
+
+void ota_multicast_set_missing(struct OtaMulticastSession* session, uint32_t sector, bool missing) {
+    if (ota_multicast_is_missing(session, sector) == missing) {
+        return;
+    }
+
+    session->missing[sector / 8] ^= 1 << (sector % 8);
+    if (missing) {
+        session->missing_count++;
+    } else {
+        session->missing_count--;
+    }
+}
+
+void ota_multicast_reset(struct OtaMulticastSession* session) {
+    session->missing_count = 0;
+    memset(session->missing, 0, sizeof(session->missing));
+    for (uint32_t sector = 0; sector < session->sector_count; sector++) {
+        ota_multicast_set_missing(session, sector, true);
+    }
+
+    session->status = OTA_MULTICAST_RECEIVING;
+    session->assembling_sector = -1;
+    session->assembled_chunks = 0;
+}
+
+uint32_t ota_multicast_sector_len(struct OtaMulticastSession* session, uint32_t sector) {
+    return MIN(FLASH_SECTOR_SIZE, session->image_size - sector * FLASH_SECTOR_SIZE);
+}
+
+// Checks the whole image once every sector is in, activating it if it is good
+void ota_multicast_finish_image(struct OtaMulticastSession* session) {
+    uint32_t crc = sniffer_crc32_update(
+        0, (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + session->flash_offset, session->image_size);
+
+    if (crc != session->image_checksum) {
+        // There is no telling which sector is bad, so fetch them all again. Sectors which are
+        // actually fine are recognized as up to date, and not written again
+        printf("OTA multicast: checksum failed, receiving again\n");
+        ota_multicast_reset(session);
+    } else if (!boot_slots_image_valid(boot_slots_target())) {
+        printf("OTA multicast: image was not built for slot %"PRIu8"\n", boot_slots_target());
+        session->status = OTA_MULTICAST_WRONG_SLOT;
+    } else if (!boot_image_commit(boot_slots_target(), session->image_size, session->image_checksum)
+        || !boot_slots_activate(boot_slots_target())) {
+        session->status = OTA_MULTICAST_WRITE_FAILED;
+    } else {
+        printf("OTA multicast: image complete, waiting to finish\n");
+        session->status = OTA_MULTICAST_COMPLETE;
+    }
+}
+
+void ota_multicast_commit_work(async_context_t* context, async_when_pending_worker_t* worker) {
+    cyw43_arch_lwip_check();
+
+    struct OtaMulticastSession* session = ota_multicast_session;
+    if (!session || !session->commit_pending) {
+        return;
+    }
+
+    bool written;
+    if (!write_flash_sector_if_changed(
+            session->flash_offset + session->commit_sector * FLASH_SECTOR_SIZE, session->commit, &written)) {
+        printf("OTA multicast: sector %"PRIu32" could not be written\n", session->commit_sector);
+        session->status = OTA_MULTICAST_WRITE_FAILED;
+    } else {
+        ota_multicast_set_missing(session, session->commit_sector, false);
+    }
+    session->commit_pending = false;
+
+    if (session->status == OTA_MULTICAST_RECEIVING && !session->missing_count) {
+        ota_multicast_finish_image(session);
+    }
+}
+
+void ota_multicast_receive_data(struct OtaMulticastSession* session, struct OtaMulticastData* data, struct pbuf* pb) {
+    uint32_t sector = data->sector;
+    uint32_t chunk_pos = data->chunk * OTA_MULTICAST_CHUNK_SIZE;
+    if (sector >= session->sector_count || chunk_pos >= ota_multicast_sector_len(session, sector)) {
+        return;
+    }
+
+    uint32_t chunk_len = MIN(OTA_MULTICAST_CHUNK_SIZE, ota_multicast_sector_len(session, sector) - chunk_pos);
+    if (pb->tot_len != sizeof(*data) + chunk_len
+        || session->status != OTA_MULTICAST_RECEIVING
+        || !ota_multicast_is_missing(session, sector)
+        || (session->commit_pending && session->commit_sector == sector)) {
+        return;
+    }
+
+    if (session->assembling_sector != (int32_t)sector) {
+        session->assembling_sector = sector;
+        session->assembled_chunks = 0;
+        // Pad to match erased flash, so an unchanged partial sector is recognized as such
+        memset(session->assembly, 0xFF, FLASH_SECTOR_SIZE);
+    }
+
+    pbuf_copy_partial(pb, session->assembly + chunk_pos, chunk_len, sizeof(*data));
+    session->assembled_chunks |= 1 << data->chunk;
+
+    uint32_t chunk_count = (ota_multicast_sector_len(session, sector) + OTA_MULTICAST_CHUNK_SIZE - 1)
+        / OTA_MULTICAST_CHUNK_SIZE;
+    if (session->assembled_chunks != (1 << chunk_count) - 1 || session->commit_pending) {
+        return;
+    }
+
+    memcpy(session->commit, session->assembly, FLASH_SECTOR_SIZE);
+    session->commit_sector = sector;
+    session->commit_pending = true;
+    session->assembling_sector = -1;
+    async_context_set_work_pending(cyw43_arch_async_context(), &ota_multicast_commit_worker);
+}
+
+void ota_multicast_send_status(
+    struct OtaMulticastSession* session, const ip_addr_t* addr, uint16_t port) {
+    uint32_t bitmap_size = (session->sector_count + 7) / 8;
+
+    struct pbuf* pb = pbuf_alloc(PBUF_TRANSPORT, sizeof(struct OtaMulticastStatusPacket) + bitmap_size, PBUF_RAM);
+    if (!pb) {
+        printf("OTA multicast: failed to allocate status\n");
+        return;
+    }
+
+    struct OtaMulticastStatusPacket* packet = pb->payload;
+    memcpy(packet->header.magic_code, OTA_MULTICAST_MAGIC_PREFIX, OTA_MULTICAST_MAGIC_PREFIX_LEN);
+    packet->header.magic_code[OTA_MULTICAST_MAGIC_PREFIX_LEN] = OTA_MULTICAST_STATUS;
+    packet->header.image_checksum = session->image_checksum;
+    packet->status = session->status;
+    packet->missing_count = session->missing_count;
+    memcpy(packet + 1, session->missing, bitmap_size);
+
+    if (udp_sendto(ota_multicast_pcb, pb, addr, port) != ERR_OK) {
+        printf("OTA multicast: failed to send status\n");
+    }
+    pbuf_free(pb);
+}
+
+void on_ota_multicast_recv(void* arg, struct udp_pcb* pcb, struct pbuf* pb, const ip_addr_t* addr, uint16_t port) {
+    struct OtaMulticastSession* session = ota_multicast_session;
+
+    struct OtaMulticastData data;
+    if (!session
+        || pb->tot_len < sizeof(struct OtaMulticastHeader)
+        || pbuf_copy_partial(pb, &data, MIN(pb->tot_len, sizeof(data)), 0) < sizeof(struct OtaMulticastHeader)
+        || memcmp(data.header.magic_code, OTA_MULTICAST_MAGIC_PREFIX, OTA_MULTICAST_MAGIC_PREFIX_LEN) != 0
+        || data.header.image_checksum != session->image_checksum) {
+        pbuf_free(pb);
+        return;
+    }
+    session->last_packet_ms = to_ms_since_boot(get_absolute_time());
+
+    switch (data.header.magic_code[OTA_MULTICAST_MAGIC_PREFIX_LEN]) {
+    case OTA_MULTICAST_DATA:
+        if (pb->tot_len >= sizeof(data)) {
+            ota_multicast_receive_data(session, &data, pb);
+        }
+        break;
+    case OTA_MULTICAST_QUERY:
+        ota_multicast_send_status(session, addr, port);
+        break;
+    case OTA_MULTICAST_FINISH:
+        if (session->status == OTA_MULTICAST_COMPLETE) {
+            printf("OTA multicast: finished, rebooting\n");
+            pbuf_free(pb);
+
+            // Give peripherals some time to process output
+            sleep_ms(100);
+            reboot();
+            return;
+        }
+        break;
+    }
+
+    pbuf_free(pb);
+}
+
+bool ota_multicast_open() {
+    if (ota_multicast_pcb) {
+        return true;
+    }
+
+    ip_addr_t group;
+    if (!ipaddr_aton(OTA_MULTICAST_GROUP, &group)) {
+        return false;
+    }
+
+    struct udp_pcb* pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!pcb) {
+        return false;
+    }
+
+    if (udp_bind(pcb, IP_ADDR_ANY, OTA_MULTICAST_PORT) != ERR_OK
+        || igmp_joingroup_netif(netif_default, ip_2_ip4(&group)) != ERR_OK) {
+        udp_remove(pcb);
+        return false;
+    }
+
+    // Leave the group again, so that a later attempt does not join it twice
+    if (!async_context_add_when_pending_worker(cyw43_arch_async_context(), &ota_multicast_commit_worker)) {
+        igmp_leavegroup_netif(netif_default, ip_2_ip4(&group));
+        udp_remove(pcb);
+        return false;
+    }
+
+    udp_recv(pcb, on_ota_multicast_recv, NULL);
+    ota_multicast_pcb = pcb;
+    return true;
+}
+
+bool ota_multicast_join(uint32_t image_size, uint32_t image_checksum) {
+    cyw43_arch_lwip_check();
+
+    if (image_size > USER_PROGRAM_MAX_SIZE || !ota_multicast_open()) {
+        printf("OTA multicast: failed to join %s\n", OTA_MULTICAST_GROUP);
+        return false;
+    }
+
+    struct OtaMulticastSession* session = ota_multicast_session;
+    if (session && session->image_size == image_size && session->image_checksum == image_checksum) {
+        session->last_packet_ms = to_ms_since_boot(get_absolute_time());
+        return true;
+    }
+
+    // The program being overwritten must not be booted until the new one is complete
+    if (!boot_image_begin(boot_slots_target(), image_size)) {
+        printf("OTA multicast: failed to record image upload\n");
+        return false;
+    }
+
+    // Anything else about to be written invalidates the journaled upload
+    ota_journal_clear();
+
+    if (!session) {
+        // Get space on the heap, since the session is only needed while fleet flashing
+        session = calloc(1, sizeof(struct OtaMulticastSession));
+        if (!session) {
+            printf("OTA multicast: failed to allocate session\n");
+            return false;
+        }
+    }
+
+    // A sector of the previous image which is still waiting is dropped
+    session->commit_pending = false;
+
+    session->image_size = image_size;
+    session->image_checksum = image_checksum;
+    session->flash_offset = USER_SLOT_OFFSET(boot_slots_target());
+    session->sector_count = (image_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE;
+    session->last_packet_ms = to_ms_since_boot(get_absolute_time());
+    ota_multicast_reset(session);
+    ota_multicast_session = session;
+
+    printf("OTA multicast: joined session for %"PRIu32" bytes\n", image_size);
+    return true;
+}
+
+bool ota_multicast_in_progress() {
+    struct OtaMulticastSession* session = ota_multicast_session;
+    return session
+        && (session->status == OTA_MULTICAST_RECEIVING || session->status == OTA_MULTICAST_COMPLETE)
+        && to_ms_since_boot(get_absolute_time()) - session->last_packet_ms < OTA_MULTICAST_IDLE_TIMEOUT_MS;
+}
+#else
+bool ota_multicast_join(uint32_t image_size, uint32_t image_checksum) {
+    printf("OTA multicast: not available without LWIP_IGMP\n");
+    return false;
+}
+
+bool ota_multicast_in_progress() {
+    return false;
+}
+#endif
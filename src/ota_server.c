@@ -1,5 +1,6 @@
 #include "pico_wifi_boot/ota_server.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -7,55 +8,575 @@
 #include "hardware/flash.h"
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
+#include "pico/async_context.h"
 
+#include "pico_wifi_boot/boot_image.h"
+#include "pico_wifi_boot/boot_slots.h"
+#include "pico_wifi_boot/delta_patch.h"
 #include "pico_wifi_boot/flash.h"
+#include "pico_wifi_boot/image_writer.h"
+#include "pico_wifi_boot/lzss.h"
+#include "pico_wifi_boot/ota_discovery.h"
+#include "pico_wifi_boot/ota_journal.h"
+#include "pico_wifi_boot/ota_multicast.h"
+#include "pico_wifi_boot/ota_stats.h"
 #include "pico_wifi_boot/reboot.h"
 #include "pico_wifi_boot/sniffer_crc32.h"
 
 #define OTA_MAGIC_CODE "OTA\n"
 #define OTA_MAGIC_CODE_LEN 4
+// Requests other than a full image replace the final magic code character with the request type
+#define OTA_MAGIC_PREFIX_LEN 3
+
+// Forward-declare from pico_cyw43_arch, since we do not know the required arch type to include pico/cyw43_arch.h
+async_context_t* cyw43_arch_async_context(void);
+
+enum OtaRequestType {
+    // Full image (the original protocol)
+    OTA_REQUEST_IMAGE = '\n',
+    // Checksum of the first payload_size bytes of the installed image, answered with OtaInfoResponse.
+    // No payload follows, and the client may send another request afterwards
+    OTA_REQUEST_INFO = 'I',
+    // Patch against the installed image (see delta_patch.h), producing image_size bytes
+    OTA_REQUEST_DELTA = 'D',
+    // Compressed full image (see lzss.h), decompressing to image_size bytes
+    OTA_REQUEST_COMPRESSED = 'Z',
+    // Full image, answered with OtaResumeResponse. If an earlier upload of the same image was cut off,
+    // the payload continues from the reported offset instead of the start
+    OTA_REQUEST_RESUME = 'R',
+    // Full image, sent to the fleet over multicast (see ota_multicast.h) rather than as a payload.
+    // The client may send another request afterwards
+    OTA_REQUEST_MULTICAST = 'M',
+    // Full image split into chunks (protocol v2), each framed by an OtaChunkHeader. Answered with
+    // OtaResumeResponse like OTA_REQUEST_RESUME, after which each committed chunk is acknowledged with
+    // another, and a chunk which fails its checksum is rejected so that only it needs to be sent again
+    OTA_REQUEST_CHUNKED = 'C',
+    // Performance counters of the latest upload (see ota_stats.h), answered with OtaStatsResponse.
+    // No payload follows, and the client may send another request afterwards
+    OTA_REQUEST_STATS = 'S',
+};
 
 enum OtaErrorCode {
     SUCCESS = 0,
     STORAGE_FULL = 1,
     CHECKSUM_FAILED = 2,
     REBOOTING = 3,
+    BASE_MISMATCH = 4,
+    WRITE_FAILED = 5,
+    // The image was not built to run from the slot it was written to (see wifi_boot_user_program_bin)
+    WRONG_SLOT = 6,
+    // Multicast could not be joined, so the image must be sent over TCP
+    MULTICAST_UNAVAILABLE = 7,
+    // Another upload or multicast session is writing the image, so the client should retry later
+    BUSY = 8,
 };
 
 struct __attribute__((__packed__)) OtaRequest {
-    uint8_t magic_code[OTA_MAGIC_CODE_LEN]; // "OTA\n"
+    uint8_t magic_code[OTA_MAGIC_CODE_LEN]; // "OTA" followed by the request type
     uint32_t payload_size;
     uint32_t checksum;
+    // Only sent with OTA_REQUEST_DELTA and OTA_REQUEST_COMPRESSED
+    uint32_t image_size;
+    // Only sent with OTA_REQUEST_DELTA
+    uint32_t base_size;
+    uint32_t base_checksum;
 };
 
+#define OTA_REQUEST_BASE_SIZE offsetof(struct OtaRequest, image_size)
+#define OTA_REQUEST_COMPRESSED_SIZE offsetof(struct OtaRequest, base_size)
+
 struct __attribute__((__packed__)) OtaResponse {
     uint8_t magic_code[OTA_MAGIC_CODE_LEN]; // "OTA\n"
     uint8_t error_code;
 };
 
+struct __attribute__((__packed__)) OtaInfoResponse {
+    uint8_t magic_code[OTA_MAGIC_CODE_LEN]; // "OTA\n"
+    uint8_t error_code;
+    uint32_t image_size;
+    uint32_t checksum;
+    // Slot which the next image will be written to, and so must be built for
+    uint8_t target_slot;
+};
+
+struct __attribute__((__packed__)) OtaStatsResponse {
+    uint8_t magic_code[OTA_MAGIC_CODE_LEN]; // "OTA\n"
+    uint8_t error_code;
+    struct OtaStats stats;
+};
+
+struct __attribute__((__packed__)) OtaResumeResponse {
+    uint8_t magic_code[OTA_MAGIC_CODE_LEN]; // "OTA\n"
+    uint8_t error_code;
+    uint32_t resume_offset;
+};
+
+// Precedes each chunk of an OTA_REQUEST_CHUNKED payload. A chunk is one sector of the image, so offset
+// is a multiple of FLASH_SECTOR_SIZE, and length is FLASH_SECTOR_SIZE except for the final chunk
+struct __attribute__((__packed__)) OtaChunkHeader {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t checksum;
+};
+
 struct OtaConnectionState {
+    bool in_use;
+    struct tcp_pcb* pcb;
+    uint32_t last_recv_ms;
     uint32_t partial_bytes;
     struct OtaRequest request;
     bool request_filled;
     struct OtaResponse response;
-    uint8_t data[FLASH_SECTOR_SIZE];
-    uint32_t bytes_written;
+    // Set once the payload of an accepted flash request is expected. The connection then owns
+    // ota_upload, and no other upload writes the same slot, journal and boot record meanwhile
+    bool uploading;
     bool ready_to_reboot;
 };
 
+// The upload being received, by the connection with uploading set. Only one upload runs at a time, so
+// this is kept once rather than in every connection state
+struct OtaUpload {
+    uint32_t payload_received;
+    // Payload bytes skipped because they were already in flash
+    uint32_t payload_resumed;
+    // Full sectors are committed by a deferred worker, so that the receive callback returns before
+    // flash is written rather than stalling in it
+    struct ImageWriter writer;
+    // Received bytes not yet acknowledged to TCP, because the sectors they filled are still waiting
+    // to be committed. This keeps the advertised window in step with how fast flash can be written
+    uint32_t recv_withheld;
+    // Decoder of the request type, only one of which is in use
+    union {
+        struct {
+            struct DeltaPatch delta;
+            // Original contents of overwritten sectors, for patches applied to the installed image
+            uint8_t delta_history[DELTA_PATCH_HISTORY_SECTORS * FLASH_SECTOR_SIZE];
+        };
+        struct LzssDecoder lzss;
+    };
+    // Chunk of an OTA_REQUEST_CHUNKED payload being received. Chunks sent after a rejected one are
+    // skipped, until the client goes back to the rejected chunk
+    struct OtaChunkHeader chunk;
+    uint32_t chunk_header_bytes;
+    uint32_t chunk_data_bytes;
+    bool chunk_skipped;
+    uint32_t payload_start_ms;
+    // When the previous payload segment was done with, so that the wait for the next can be counted
+    uint32_t payload_idle_us;
+    // Sectors written (see ImageWriter) as of the last journal record
+    uint32_t journaled_written;
+};
+
+// All connection states, so that the commit worker can find those with sectors waiting to be written
+struct OtaConnectionState ota_connections[OTA_MAX_CONNECTIONS];
+
+struct OtaUpload ota_upload;
+
+// lwIP polls connections every 500 ms per interval unit
+#define OTA_POLL_INTERVAL 2
+
+void ota_commit_work(async_context_t* context, async_when_pending_worker_t* worker);
+
+void ota_recved(struct tcp_pcb* pcb, uint32_t len) {
+    while (len) {
+        uint16_t chunk = MIN(len, UINT16_MAX);
+        tcp_recved(pcb, chunk);
+        len -= chunk;
+    }
+}
+
+async_when_pending_worker_t ota_commit_worker = {
+    .do_work = ota_commit_work,
+};
+bool ota_commit_worker_added = false;
+
+struct OtaConnectionState* ota_alloc_state() {
+    for (uint32_t i = 0; i < OTA_MAX_CONNECTIONS; i++) {
+        struct OtaConnectionState* state = &ota_connections[i];
+        if (!state->in_use) {
+            memset(state, 0, sizeof(*state));
+            state->in_use = true;
+            return state;
+        }
+    }
+    return NULL;
+}
+
+void ota_free_state(struct OtaConnectionState* state) {
+    state->in_use = false;
+}
+
+void ota_close(struct tcp_pcb* pcb, struct OtaConnectionState* state) {
+    tcp_arg(pcb, NULL);
+    ota_free_state(state);
+
+    tcp_abort(pcb);
+}
+
+// Returns the connection other than the given one which is receiving an upload (and so owns
+// ota_upload), or NULL
+struct OtaConnectionState* ota_find_upload(struct OtaConnectionState* other_than) {
+    for (uint32_t i = 0; i < OTA_MAX_CONNECTIONS; i++) {
+        struct OtaConnectionState* state = &ota_connections[i];
+        if (state->in_use && state->uploading && state != other_than) {
+            return state;
+        }
+    }
+    return NULL;
+}
+
+// Set once an image has been flashed, so that the reboot starts it rather than the bootloader
+bool ota_image_activated = false;
+
 void reboot_after_disconnect() {
     printf("OTA server: disconnect triggered reboot\n");
 
     // Give peripherals some time to process output
     sleep_ms(100);
 
-    if (running_in_bootloader()) {
+    if (running_in_bootloader() || ota_image_activated) {
         reboot();
     } else {
         reboot_into_bootloader();
     }
 }
 
+uint8_t ota_request_type(struct OtaRequest* request) {
+    return request->magic_code[OTA_MAGIC_PREFIX_LEN];
+}
+
+// Returns the size of the request structure sent for the given type, or 0 if the type is unknown
+uint32_t ota_request_size(uint8_t type) {
+    switch (type) {
+    case OTA_REQUEST_IMAGE:
+    case OTA_REQUEST_INFO:
+    case OTA_REQUEST_RESUME:
+    case OTA_REQUEST_MULTICAST:
+    case OTA_REQUEST_CHUNKED:
+    case OTA_REQUEST_STATS:
+        return OTA_REQUEST_BASE_SIZE;
+    case OTA_REQUEST_COMPRESSED:
+        return OTA_REQUEST_COMPRESSED_SIZE;
+    case OTA_REQUEST_DELTA:
+        return sizeof(struct OtaRequest);
+    default:
+        return 0;
+    }
+}
+
+bool ota_send_response(struct tcp_pcb* pcb, struct OtaConnectionState* state, uint8_t error_code) {
+    memcpy(state->response.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN);
+    state->response.error_code = error_code;
+
+    if (tcp_write(pcb, &state->response, sizeof(state->response), TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        printf("OTA server: TCP send failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool ota_send_resume_response(
+    struct tcp_pcb* pcb, struct OtaConnectionState* state, uint8_t error_code, uint32_t resume_offset) {
+    memcpy(state->response.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN);
+    state->response.error_code = error_code;
+
+    struct OtaResumeResponse response;
+    memcpy(response.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN);
+    response.error_code = error_code;
+    response.resume_offset = resume_offset;
+
+    if (tcp_write(pcb, &response, sizeof(response), TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        printf("OTA server: TCP send failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Acknowledges (SUCCESS) or rejects (CHECKSUM_FAILED) part of an OTA_REQUEST_CHUNKED payload. Unlike
+// other responses, a rejection does not end the upload
+bool ota_send_chunk_response(struct tcp_pcb* pcb, uint8_t error_code, uint32_t offset) {
+    struct OtaResumeResponse response;
+    memcpy(response.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN);
+    response.error_code = error_code;
+    response.resume_offset = offset;
+
+    if (tcp_write(pcb, &response, sizeof(response), TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        printf("OTA server: TCP send failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool ota_process_info_request(struct tcp_pcb* pcb, struct OtaConnectionState* state) {
+    struct OtaInfoResponse response;
+    memcpy(response.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN);
+    response.image_size = state->request.payload_size;
+    response.checksum = 0;
+    response.target_slot = boot_slots_target_link();
+
+    if (state->request.payload_size <= USER_PROGRAM_MAX_SIZE) {
+        response.error_code = SUCCESS;
+        response.checksum = sniffer_crc32_update(
+            0, (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + USER_SLOT_OFFSET(boot_slots_active()),
+            state->request.payload_size);
+    } else {
+        response.error_code = STORAGE_FULL;
+    }
+
+    if (tcp_write(pcb, &response, sizeof(response), TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        printf("OTA server: TCP send failed\n");
+        return false;
+    }
+
+    printf(
+        "OTA server: client queried checksum of %"PRIu32" installed bytes\n",
+        state->request.payload_size);
+
+    // The client may follow up with another request
+    state->request_filled = false;
+    return true;
+}
+
+bool ota_process_stats_request(struct tcp_pcb* pcb, struct OtaConnectionState* state) {
+    struct OtaStatsResponse response;
+    memcpy(response.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN);
+    response.error_code = SUCCESS;
+    memcpy(&response.stats, ota_stats_get(), sizeof(response.stats));
+
+    if (tcp_write(pcb, &response, sizeof(response), TCP_WRITE_FLAG_COPY) != ERR_OK) {
+        printf("OTA server: TCP send failed\n");
+        return false;
+    }
+
+    printf("OTA server: client queried upload stats\n");
+
+    // The client may follow up with another request
+    state->request_filled = false;
+    return true;
+}
+
+bool ota_process_multicast_request(struct tcp_pcb* pcb, struct OtaConnectionState* state) {
+    uint8_t error_code;
+    if (state->request.payload_size > USER_PROGRAM_MAX_SIZE) {
+        error_code = STORAGE_FULL;
+    } else if (running_from_slot(boot_slots_target())) {
+        error_code = REBOOTING;
+    } else if (ota_find_upload(state)) {
+        error_code = BUSY;
+    } else {
+        error_code = ota_multicast_join(state->request.payload_size, state->request.checksum)
+            ? SUCCESS : MULTICAST_UNAVAILABLE;
+    }
+
+    if (!ota_send_response(pcb, state, error_code)) {
+        return false;
+    }
+
+    printf(
+        "OTA server: client requested %"PRIu32" bytes over multicast (%s)\n",
+        state->request.payload_size,
+        error_code == STORAGE_FULL ? "insufficient storage" : (error_code == MULTICAST_UNAVAILABLE ? "unavailable"
+            : (error_code == BUSY ? "busy" : "okay")));
+
+    if (error_code == REBOOTING) {
+        state->ready_to_reboot = true;
+        printf("OTA server: waiting to reboot into bootloader\n");
+    } else {
+        // The client may follow up with another request
+        state->request_filled = false;
+    }
+
+    return true;
+}
+
+// True for requests whose payload is the image itself, and so can be journaled and resumed
+bool ota_request_is_full_image(struct OtaRequest* request) {
+    uint8_t type = ota_request_type(request);
+    return type == OTA_REQUEST_IMAGE || type == OTA_REQUEST_RESUME || type == OTA_REQUEST_CHUNKED;
+}
+
+uint32_t ota_request_image_size(struct OtaRequest* request) {
+    return ota_request_is_full_image(request) ? request->payload_size : request->image_size;
+}
+
+// Returns the offset an interrupted upload of the requested image can continue from, or 0
+uint32_t ota_find_resume_offset(struct OtaRequest* request) {
+    uint32_t offset = ota_journal_find(USER_SLOT_OFFSET(boot_slots_target()), request->payload_size, request->checksum);
+
+    // Only whole sectors are journaled, and an upload which committed everything has nothing to resume
+    if (offset % FLASH_SECTOR_SIZE != 0 || offset >= request->payload_size) {
+        return 0;
+    }
+    return offset;
+}
+
+// True if the request continues the upload of the given connection, whose client has evidently given
+// up on it and reconnected, even though it has not timed out yet
+bool ota_request_resumes_upload(struct OtaRequest* request, struct OtaConnectionState* upload) {
+    uint8_t type = ota_request_type(request);
+    return (type == OTA_REQUEST_RESUME || type == OTA_REQUEST_CHUNKED)
+        && ota_request_is_full_image(&upload->request)
+        && upload->request.payload_size == request->payload_size
+        && upload->request.checksum == request->checksum;
+}
+
+// Journals progress, so that the upload can be resumed if the connection drops. Only sectors which
+// were written need a record: unchanged sectors after the last one are cheap to receive again
+void ota_journal_progress(struct OtaConnectionState* state) {
+    if (!ota_request_is_full_image(&state->request)
+        || ota_upload.writer.write_failed
+        || image_writer_is_complete(&ota_upload.writer)
+        || ota_upload.writer.sectors_written == ota_upload.journaled_written) {
+        return;
+    }
+
+    ota_upload.journaled_written = ota_upload.writer.sectors_written;
+    if (!ota_journal_append(
+            ota_upload.writer.flash_offset, ota_upload.writer.image_size, state->request.checksum,
+            ota_upload.writer.bytes_committed)) {
+        printf("OTA server: failed to journal upload progress\n");
+    }
+}
+
+// Passes the upload on from a stale connection to the request resuming it. What the stale connection
+// left waiting is committed and journaled first, so that the resume continues after it
+void ota_hand_over_upload(struct OtaConnectionState* stale) {
+    while (image_writer_commit_next(&ota_upload.writer)) {
+    }
+    ota_journal_progress(stale);
+    ota_close(stale->pcb, stale);
+}
+
+// Prepares to receive the payload of an accepted request, skipping the first resume_offset bytes
+// of a full image which are already in flash
+bool ota_begin_payload(struct OtaConnectionState* state, uint32_t resume_offset) {
+    uint32_t target_offset = USER_SLOT_OFFSET(boot_slots_target());
+    uint32_t installed_offset = USER_SLOT_OFFSET(boot_slots_active());
+    image_writer_init(&ota_upload.writer, target_offset, ota_request_image_size(&state->request));
+    if (!state->uploading) {
+        // Taking over from whichever connection had the upload before. A retry over the same
+        // connection carries on with its window and chunk framing as they are
+        ota_upload.recv_withheld = 0;
+        ota_upload.chunk_header_bytes = 0;
+    }
+    ota_upload.payload_received = resume_offset;
+    ota_upload.payload_resumed = resume_offset;
+    ota_upload.payload_start_ms = to_ms_since_boot(get_absolute_time());
+    ota_upload.payload_idle_us = ota_stats_now();
+    ota_upload.journaled_written = 0;
+    state->uploading = true;
+    ota_stats_reset();
+
+    // The program being overwritten must not be booted until the new one is complete
+    if (!boot_image_begin(boot_slots_target(), ota_request_image_size(&state->request))) {
+        printf("OTA server: failed to record image upload\n");
+        return false;
+    }
+
+    // Anything else about to be written invalidates the journaled upload
+    if (resume_offset) {
+        image_writer_resume(&ota_upload.writer, resume_offset);
+    } else {
+        ota_journal_clear();
+    }
+
+    switch (ota_request_type(&state->request)) {
+    case OTA_REQUEST_DELTA:
+        delta_patch_init(&ota_upload.delta, state->request.base_size);
+
+        // The installed image is left intact when the patched image goes to the other slot
+        if (installed_offset != target_offset) {
+            image_writer_set_base(&ota_upload.writer, installed_offset);
+            break;
+        }
+
+        image_writer_set_history(&ota_upload.writer, ota_upload.delta_history, DELTA_PATCH_HISTORY_SECTORS);
+        break;
+    case OTA_REQUEST_COMPRESSED:
+        lzss_init(&ota_upload.lzss);
+        break;
+    }
+
+    return true;
+}
+
+bool ota_process_flash_request(struct tcp_pcb* pcb, struct OtaConnectionState* state) {
+    uint8_t type = ota_request_type(&state->request);
+    bool is_delta = type == OTA_REQUEST_DELTA;
+    uint32_t image_size = ota_request_image_size(&state->request);
+
+    bool is_flashable = image_size <= USER_PROGRAM_MAX_SIZE;
+    if (is_delta) {
+        is_flashable = is_flashable && state->request.base_size <= USER_PROGRAM_MAX_SIZE;
+    }
+
+    // A patch can only be applied to the exact image it was generated from
+    bool base_matches = !is_delta || (is_flashable && sniffer_crc32_update(
+        0, (uint8_t*)XIP_NOCACHE_NOALLOC_BASE + USER_SLOT_OFFSET(boot_slots_active()),
+        state->request.base_size) == state->request.base_checksum);
+
+    // Only one upload at a time, except that a resume takes over the upload it continues. Its sectors
+    // committed so far are journaled, so it is found again below
+    struct OtaConnectionState* upload = ota_find_upload(state);
+    if (upload && ota_request_resumes_upload(&state->request, upload)) {
+        printf("OTA server: aborting stale connection of resumed upload\n");
+        ota_hand_over_upload(upload);
+        upload = NULL;
+    }
+    bool is_busy = upload || ota_multicast_in_progress();
+
+    uint8_t error_code;
+    if (!is_flashable) {
+        error_code = STORAGE_FULL;
+    } else if (!base_matches) {
+        error_code = BASE_MISMATCH;
+    } else if (is_busy) {
+        error_code = BUSY;
+    } else {
+        // User programs receive the image themselves unless it would overwrite them
+        error_code = running_from_slot(boot_slots_target()) ? REBOOTING : SUCCESS;
+    }
+
+    uint32_t resume_offset = 0;
+    bool sent;
+    if (type == OTA_REQUEST_RESUME || type == OTA_REQUEST_CHUNKED) {
+        if (error_code == SUCCESS) {
+            resume_offset = ota_find_resume_offset(&state->request);
+        }
+        sent = ota_send_resume_response(pcb, state, error_code, resume_offset);
+    } else {
+        sent = ota_send_response(pcb, state, error_code);
+    }
+    if (!sent) {
+        return false;
+    }
+
+    printf(
+        "OTA server: client requested %"PRIu32" bytes%s (%s)\n",
+        image_size,
+        is_delta ? " as a patch" : (type == OTA_REQUEST_COMPRESSED ? " compressed"
+            : (type == OTA_REQUEST_CHUNKED ? " in chunks" : "")),
+        !is_flashable ? "insufficient storage" : (!base_matches ? "patch base mismatch" : (is_busy ? "busy" : "okay")));
+
+    if (error_code == REBOOTING) {
+        state->ready_to_reboot = true;
+        printf("OTA server: waiting to reboot into bootloader\n");
+    }
+
+    if (resume_offset) {
+        printf("OTA server: resuming interrupted upload at byte %"PRIu32"\n", resume_offset);
+    }
+
+    if (error_code == SUCCESS) {
+        return ota_begin_payload(state, resume_offset);
+    }
+
+    return true;
+}
+
 bool ota_process_request(struct tcp_pcb* pcb, struct OtaConnectionState* state, struct pbuf* pb) {
     cyw43_arch_lwip_check();
 
@@ -70,68 +591,166 @@ bool ota_process_request(struct tcp_pcb* pcb, struct OtaConnectionState* state,
     }
     state->partial_bytes += pb->tot_len;
 
-    if (state->partial_bytes == sizeof(state->request)) {
+    if (state->partial_bytes < OTA_MAGIC_CODE_LEN) {
+        return true;
+    }
+
+    uint8_t type = ota_request_type(&state->request);
+    uint32_t request_size = ota_request_size(type);
+    if (memcmp(state->request.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_PREFIX_LEN) != 0 || !request_size) {
+        printf("OTA server: received bad header\n");
+        return false;
+    }
+
+    if (state->partial_bytes > request_size) {
+        printf("OTA server: too many bytes for request structure\n");
+        return false;
+    }
+
+    if (state->partial_bytes == request_size) {
         state->request_filled = true;
         state->partial_bytes = 0;
 
-        if (memcmp(state->request.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN) != 0) {
-            printf("OTA server: received bad header\n");
-            return false;
+        if (type == OTA_REQUEST_INFO) {
+            return ota_process_info_request(pcb, state);
+        }
+        if (type == OTA_REQUEST_MULTICAST) {
+            return ota_process_multicast_request(pcb, state);
+        }
+        if (type == OTA_REQUEST_STATS) {
+            return ota_process_stats_request(pcb, state);
         }
 
-        bool is_flashable = state->request.payload_size <= USER_PROGRAM_MAX_SIZE;
-        bool in_bootloader = running_in_bootloader();
+        return ota_process_flash_request(pcb, state);
+    }
 
-        memcpy(state->response.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN);
-        state->response.error_code = is_flashable ? (in_bootloader ? SUCCESS : REBOOTING) : STORAGE_FULL;
+    return true;
+}
 
-        if (tcp_write(pcb, &state->response, sizeof(state->response), TCP_WRITE_FLAG_COPY) != ERR_OK) {
-            printf("OTA server: TCP send failed\n");
-            return false;
+// Receives chunks into the image writer, only advancing it past a chunk once its checksum is verified
+bool ota_process_chunks(struct OtaConnectionState* state, struct pbuf* pb) {
+    struct OtaChunkHeader* chunk = &ota_upload.chunk;
+    uint32_t processed = 0;
+    while (processed < pb->tot_len) {
+        if (ota_upload.chunk_header_bytes < sizeof(*chunk)) {
+            uint32_t len = MIN(sizeof(*chunk) - ota_upload.chunk_header_bytes, pb->tot_len - processed);
+            if (pbuf_copy_partial(pb, (uint8_t*)chunk + ota_upload.chunk_header_bytes, len, processed) != len) {
+                printf("OTA server: pbuf copy failed\n");
+                return false;
+            }
+            processed += len;
+            ota_upload.chunk_header_bytes += len;
+            if (ota_upload.chunk_header_bytes < sizeof(*chunk)) {
+                break;
+            }
+
+            if (chunk->offset % FLASH_SECTOR_SIZE != 0 || chunk->offset >= ota_upload.writer.image_size
+                || chunk->length != MIN(FLASH_SECTOR_SIZE, ota_upload.writer.image_size - chunk->offset)) {
+                printf("OTA server: received bad chunk header\n");
+                return false;
+            }
+            ota_upload.chunk_data_bytes = 0;
+            ota_upload.chunk_skipped = chunk->offset != ota_upload.writer.bytes_received;
+            continue;
+        }
+
+        uint32_t len = MIN(chunk->length - ota_upload.chunk_data_bytes, pb->tot_len - processed);
+        if (!ota_upload.chunk_skipped) {
+            // The buffer being filled only moves on once the chunk is accepted
+            uint32_t available;
+            uint8_t* dest = image_writer_reserve(&ota_upload.writer, &available);
+            if (pbuf_copy_partial(pb, dest + ota_upload.chunk_data_bytes, len, processed) != len) {
+                printf("OTA server: pbuf copy failed\n");
+                return false;
+            }
+        }
+        processed += len;
+        ota_upload.chunk_data_bytes += len;
+        if (ota_upload.chunk_data_bytes < chunk->length) {
+            continue;
         }
 
-        printf(
-            "OTA server: client requested %"PRIu32" bytes (%s)\n",
-            state->request.payload_size,
-            is_flashable ? "okay" : "insufficient storage");
+        ota_upload.chunk_header_bytes = 0;
+        if (ota_upload.chunk_skipped) {
+            continue;
+        }
 
-        if (state->response.error_code == REBOOTING) {
-            state->ready_to_reboot = true;
-            printf("OTA server: waiting to reboot into bootloader\n");
+        uint32_t available;
+        uint8_t* dest = image_writer_reserve(&ota_upload.writer, &available);
+        if (sniffer_crc32_update(0, dest, chunk->length) == chunk->checksum) {
+            image_writer_advance(&ota_upload.writer, chunk->length);
+        } else {
+            printf("OTA server: chunk at byte %"PRIu32" failed checksum\n", chunk->offset);
+            if (!ota_send_chunk_response(state->pcb, CHECKSUM_FAILED, chunk->offset)) {
+                return false;
+            }
+            tcp_output(state->pcb);
         }
     }
 
+    if (image_writer_has_pending(&ota_upload.writer)) {
+        async_context_set_work_pending(cyw43_arch_async_context(), &ota_commit_worker);
+    }
+
     return true;
 }
 
 bool ota_process_payload(struct OtaConnectionState* state, struct pbuf* pb) {
     cyw43_arch_lwip_check();
 
-    uint32_t processed = 0;
-    do {
-        uint32_t available = MIN(pb->tot_len - processed, FLASH_SECTOR_SIZE - state->partial_bytes);
+    // Chunks may be sent more than once, so the payload has no fixed size
+    if (ota_request_type(&state->request) == OTA_REQUEST_CHUNKED) {
+        return ota_process_chunks(state, pb);
+    }
 
-        if (pbuf_copy_partial(pb, state->data + state->partial_bytes, available, processed) != available) {
-            printf("OTA server: pbuf copy failed\n");
-            return false;
-        }
-        processed += available;
-        state->partial_bytes += available;
+    if (ota_upload.payload_received + pb->tot_len > state->request.payload_size) {
+        printf("OTA server: too many bytes received for payload\n");
+        return false;
+    }
 
-        if (state->bytes_written + state->partial_bytes > state->request.payload_size) {
-            printf("OTA server: too many bytes received for payload\n");
-            return false;
+    uint8_t type = ota_request_type(&state->request);
+    if (type == OTA_REQUEST_DELTA) {
+        for (struct pbuf* q = pb; q; q = q->next) {
+            if (!delta_patch_apply(&ota_upload.delta, &ota_upload.writer, q->payload, q->len)) {
+                printf("OTA server: patch is malformed or does not fit the installed image\n");
+                return false;
+            }
+        }
+    } else if (type == OTA_REQUEST_COMPRESSED) {
+        for (struct pbuf* q = pb; q; q = q->next) {
+            if (!lzss_decode(&ota_upload.lzss, &ota_upload.writer, q->payload, q->len)) {
+                printf("OTA server: compressed payload is malformed\n");
+                return false;
+            }
         }
+    } else {
+        uint32_t processed = 0;
+        while (processed < pb->tot_len) {
+            uint32_t available;
+            uint8_t* dest = image_writer_reserve(&ota_upload.writer, &available);
+            available = MIN(available, pb->tot_len - processed);
+
+            if (pbuf_copy_partial(pb, dest, available, processed) != available) {
+                printf("OTA server: pbuf copy failed\n");
+                return false;
+            }
+            processed += available;
+            image_writer_advance(&ota_upload.writer, available);
+        }
+    }
+    ota_upload.payload_received += pb->tot_len;
 
-        if (state->partial_bytes == FLASH_SECTOR_SIZE
-            || state->bytes_written + state->partial_bytes == state->request.payload_size) {
-            // Always write a full sector for simplicity, since we erase one anyway
-            write_flash_sector(USER_PROGRAM_OFFSET + state->bytes_written, state->data);
+    bool decoder_idle = type == OTA_REQUEST_DELTA ? delta_patch_is_idle(&ota_upload.delta)
+        : (type == OTA_REQUEST_COMPRESSED ? lzss_is_idle(&ota_upload.lzss) : true);
+    if (ota_upload.payload_received == state->request.payload_size
+        && (ota_upload.writer.bytes_received != ota_upload.writer.image_size || !decoder_idle)) {
+        printf("OTA server: payload ended before the image was complete\n");
+        return false;
+    }
 
-            state->bytes_written += state->partial_bytes;
-            state->partial_bytes = 0;
-        }
-    } while (processed < pb->tot_len);
+    if (image_writer_has_pending(&ota_upload.writer)) {
+        async_context_set_work_pending(cyw43_arch_async_context(), &ota_commit_worker);
+    }
 
     return true;
 }
@@ -139,29 +758,87 @@ bool ota_process_payload(struct OtaConnectionState* state, struct pbuf* pb) {
 bool ota_process_staged(struct tcp_pcb* pcb, struct OtaConnectionState* state) {
     cyw43_arch_lwip_check();
 
-    if (state->request.payload_size != state->bytes_written) {
+    if (!image_writer_is_complete(&ota_upload.writer)) {
         return false;
     }
 
-    printf("OTA server: payload received, verifying..\n");
+    uint32_t elapsed_ms = to_ms_since_boot(get_absolute_time()) - ota_upload.payload_start_ms;
+    printf(
+        "OTA server: payload received in %"PRIu32" ms (%"PRIu32" bytes/s)\n",
+        elapsed_ms,
+        (uint32_t)((uint64_t)(state->request.payload_size - ota_upload.payload_resumed) * 1000 / MAX(elapsed_ms, 1)));
+
+    // The checksum was accumulated as each sector was committed
+    bool checksum_ok = !ota_upload.writer.write_failed && ota_upload.writer.image_crc == state->request.checksum;
+    if (ota_upload.writer.write_failed) {
+        printf("OTA server: sector %"PRIu32" could not be written\n", ota_upload.writer.failed_sector);
+    } else if (!checksum_ok) {
+        int32_t corrupt_sector = image_writer_find_corrupt_sector(&ota_upload.writer);
+        if (corrupt_sector >= 0) {
+            printf("OTA server: sector %"PRId32" does not match the data received for it\n", corrupt_sector);
+        } else {
+            printf("OTA server: flash matches the data received, so it was corrupted before arrival\n");
+        }
+    }
 
-    bool checksum_ok =
-        sniffer_crc32((uint8_t*)XIP_BASE + USER_PROGRAM_OFFSET, state->request.payload_size) == state->request.checksum;
+    // The new image only runs from the slot it was linked for, so it is not activated otherwise
+    bool slot_ok = checksum_ok && boot_slots_image_valid(boot_slots_target());
+    bool activated = slot_ok
+        && boot_image_commit(boot_slots_target(), ota_upload.writer.image_size, ota_upload.writer.image_crc)
+        && boot_slots_activate(boot_slots_target());
+    if (checksum_ok && !slot_ok) {
+        printf("OTA server: image was not built for slot %"PRIu8"\n", boot_slots_target());
+    }
 
     struct OtaResponse response;
     memcpy(response.magic_code, OTA_MAGIC_CODE, OTA_MAGIC_CODE_LEN);
-    response.error_code = checksum_ok ? SUCCESS : CHECKSUM_FAILED;
+    if (ota_upload.writer.write_failed || (slot_ok && !activated)) {
+        response.error_code = WRITE_FAILED;
+    } else if (checksum_ok) {
+        response.error_code = slot_ok ? SUCCESS : WRONG_SLOT;
+    } else {
+        response.error_code = CHECKSUM_FAILED;
+    }
 
-    if (tcp_write(pcb, &response, sizeof(response), TCP_WRITE_FLAG_COPY) != ERR_OK) {
+    // Chunked uploads get the result as the acknowledgement of the whole image
+    bool sent = ota_request_type(&state->request) == OTA_REQUEST_CHUNKED
+        ? ota_send_chunk_response(pcb, response.error_code, ota_upload.writer.image_size)
+        : tcp_write(pcb, &response, sizeof(response), TCP_WRITE_FLAG_COPY) == ERR_OK;
+    if (!sent) {
         printf("OTA server: failed to write response\n");
         return false;
     }
 
-    if (checksum_ok) {
+    printf(
+        "OTA server: %"PRIu32" sectors written (%"PRIu32" blocks erased ahead), %"PRIu32" already up to date\n",
+        ota_upload.writer.sectors_written,
+        ota_upload.writer.blocks_erased,
+        ota_upload.writer.sectors_skipped);
+
+    if (activated) {
+        ota_journal_clear();
+        ota_image_activated = true;
         state->ready_to_reboot = true;
+        // The client may query stats before disconnecting
+        state->request_filled = false;
         printf("OTA server: flashing succeeded, waiting to reboot\n");
+    } else if (checksum_ok) {
+        // Retrying the same image would not help
+        ota_journal_clear();
+        state->response.error_code = response.error_code;
+        printf("OTA server: flashed image cannot be booted!\n");
+    } else if (ota_upload.writer.write_failed) {
+        // Flash is likely worn, so a retry would not fare any better
+        state->response.error_code = WRITE_FAILED;
+        printf("OTA server: flash write failed!\n");
+    } else if (ota_request_type(&state->request) == OTA_REQUEST_DELTA) {
+        // The original image has been overwritten, so the patch cannot be applied again
+        state->response.error_code = CHECKSUM_FAILED;
+        printf("OTA server: checksum failed! Client must send a full image\n");
     } else {
-        state->bytes_written = 0;
+        if (!ota_begin_payload(state, 0)) {
+            return false;
+        }
         printf("OTA server: checksum failed! Client may retry\n");
     }
 
@@ -178,17 +855,61 @@ bool ota_process(struct tcp_pcb* pcb, struct OtaConnectionState* state, struct p
         return false;
     }
 
-    if (!ota_process_payload(state, pb)) {
-        return false;
+    uint32_t start_us = ota_stats_now();
+    ota_stats_add(OTA_STATS_NETWORK_WAIT, ota_upload.payload_idle_us);
+    ota_stats_segment(pb->tot_len);
+
+    bool ok = ota_process_payload(state, pb);
+
+    // Sectors are committed in-line when every buffer is full
+    if (ok) {
+        ota_journal_progress(state);
     }
 
-    if (state->bytes_written == state->request.payload_size) {
-        if (!ota_process_staged(pcb, state)) {
-            return false;
-        }
+    ota_stats_add(OTA_STATS_RECEIVE, start_us);
+    ota_upload.payload_idle_us = ota_stats_now();
+    return ok;
+}
+
+void ota_commit_work(async_context_t* context, async_when_pending_worker_t* worker) {
+    cyw43_arch_lwip_check();
+
+    // Commit one sector per pass, so that networking is serviced between sectors
+    struct OtaConnectionState* state = ota_find_upload(NULL);
+    if (!state || !image_writer_commit_next(&ota_upload.writer)) {
+        return;
     }
 
-    return true;
+    ota_journal_progress(state);
+
+    // Open the window by about as much as was just written, or fully once nothing is waiting
+    uint32_t release = image_writer_has_pending(&ota_upload.writer)
+        ? MIN(ota_upload.recv_withheld, FLASH_SECTOR_SIZE) : ota_upload.recv_withheld;
+    if (release) {
+        ota_recved(state->pcb, release);
+        ota_upload.recv_withheld -= release;
+    }
+
+    // Chunks up to here are safely in flash, and need not be kept by the client
+    if (ota_request_type(&state->request) == OTA_REQUEST_CHUNKED
+        && !ota_upload.writer.write_failed
+        && !image_writer_is_complete(&ota_upload.writer)) {
+        ota_send_chunk_response(state->pcb, SUCCESS, ota_upload.writer.bytes_committed);
+        tcp_output(state->pcb);
+    }
+
+    // Time spent committing is not time spent waiting for the next segment
+    ota_upload.payload_idle_us = ota_stats_now();
+
+    if (image_writer_has_pending(&ota_upload.writer)) {
+        async_context_set_work_pending(context, worker);
+    } else if (image_writer_is_complete(&ota_upload.writer)) {
+        if (!ota_process_staged(state->pcb, state)) {
+            ota_close(state->pcb, state);
+            return;
+        }
+        tcp_output(state->pcb);
+    }
 }
 
 err_t on_ota_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* pb, err_t err) {
@@ -208,27 +929,32 @@ err_t on_ota_recv(void* arg, struct tcp_pcb* pcb, struct pbuf* pb, err_t err) {
     bool keep_connection = true;
 
     if (pb) {
+        state->last_recv_ms = to_ms_since_boot(get_absolute_time());
         if (pb->tot_len) {
             keep_connection = ota_process(pcb, state, pb);
-            tcp_recved(pcb, pb->tot_len);
+
+            // While sectors wait for flash, the sender is held back rather than left to fill the
+            // PBUF_POOL with segments that cannot be processed yet
+            if (keep_connection && state->uploading && image_writer_has_pending(&ota_upload.writer)) {
+                ota_upload.recv_withheld += pb->tot_len;
+            } else {
+                ota_recved(pcb, pb->tot_len);
+            }
         }
 
         pbuf_free(pb);
     } else {
         printf("OTA server: connection closed by client\n");
-
-        if (state->ready_to_reboot) {
-            reboot_after_disconnect();
-        }
-
         keep_connection = false;
     }
 
     if (!keep_connection) {
-        tcp_arg(pcb, NULL);
-        free(state);
-
-        tcp_abort(pcb);
+        // Whether the client disconnected or sent something unexpected after its result, it is done
+        bool ready_to_reboot = state->ready_to_reboot;
+        ota_close(pcb, state);
+        if (ready_to_reboot) {
+            reboot_after_disconnect();
+        }
         return ERR_ABRT;
     }
 
@@ -244,15 +970,36 @@ void on_ota_error(void* arg, err_t err) {
         if (state->ready_to_reboot) {
             reboot_after_disconnect();
         } else {
-            free(state);
+            ota_free_state(state);
         }
     }
 }
 
-err_t on_ota_connect(void* arg, struct tcp_pcb* new_pcb, err_t err) {
+err_t on_ota_poll(void* arg, struct tcp_pcb* pcb) {
+    struct OtaConnectionState* state = arg;
+
     cyw43_arch_lwip_check();
 
-    // TODO: don't allow concurrent connections
+    // Sectors still being committed count as activity, since the client is waiting on them
+    if (!state || (state->uploading && image_writer_has_pending(&ota_upload.writer))
+        || to_ms_since_boot(get_absolute_time()) - state->last_recv_ms < OTA_IDLE_TIMEOUT_MS) {
+        return ERR_OK;
+    }
+
+    printf("OTA server: dropping idle connection\n");
+    bool ready_to_reboot = state->ready_to_reboot;
+    ota_close(pcb, state);
+
+    // The client already got its response, and is not going to disconnect itself
+    if (ready_to_reboot) {
+        reboot_after_disconnect();
+    }
+
+    return ERR_ABRT;
+}
+
+err_t on_ota_connect(void* arg, struct tcp_pcb* new_pcb, err_t err) {
+    cyw43_arch_lwip_check();
 
     if (new_pcb == NULL) {
         printf("OTA server: error accepting connection\n");
@@ -265,10 +1012,19 @@ err_t on_ota_connect(void* arg, struct tcp_pcb* new_pcb, err_t err) {
         printf("OTA server: connect error %d, proceeding anyway\n", (int)err);
     }
 
-    // TODO: clean up inactive connections on tcp_poll
-    tcp_arg(new_pcb, calloc(1, sizeof(struct OtaConnectionState)));
+    struct OtaConnectionState* state = ota_alloc_state();
+    if (!state) {
+        printf("OTA server: all %d connections in use, rejecting\n", OTA_MAX_CONNECTIONS);
+        tcp_abort(new_pcb);
+        return ERR_ABRT;
+    }
+    state->pcb = new_pcb;
+    state->last_recv_ms = to_ms_since_boot(get_absolute_time());
+
+    tcp_arg(new_pcb, state);
     tcp_err(new_pcb, on_ota_error);
     tcp_recv(new_pcb, on_ota_recv);
+    tcp_poll(new_pcb, on_ota_poll, OTA_POLL_INTERVAL);
 
     return ERR_OK;
 }
@@ -299,10 +1055,21 @@ struct tcp_pcb* ota_init(uint16_t port) {
     cyw43_thread_enter();
 
     struct tcp_pcb* listen_pcb = init_listen_pcb(port);
+    if (listen_pcb && !ota_commit_worker_added) {
+        ota_commit_worker_added = async_context_add_when_pending_worker(cyw43_arch_async_context(), &ota_commit_worker);
+        if (!ota_commit_worker_added) {
+            tcp_close(listen_pcb);
+            listen_pcb = NULL;
+        }
+    }
+
     if (listen_pcb) {
         tcp_accept(listen_pcb, on_ota_connect);
 
         printf("OTA server listening on port %d\n", port);
+
+        // Uploads work without the beacons, which only save clients from polling for the server
+        ota_discovery_start(port);
     } else {
         printf("OTA server failed to listen on port %d\n", port);
     }
@@ -0,0 +1,66 @@
+#include "pico_wifi_boot/ota_stats.h"
+
+#include <string.h>
+
+#include "hardware/timer.h"
+#include "pico.h"
+
+struct OtaStats ota_stats;
+
+void ota_stats_reset() {
+    memset(&ota_stats, 0, sizeof(ota_stats));
+}
+
+#if OTA_STATS
+
+uint32_t ota_stats_now() {
+    return time_us_32();
+}
+
+void ota_stats_add(enum OtaStatsPhase phase, uint32_t start_us) {
+    ota_stats.phase_us[phase] += time_us_32() - start_us;
+}
+
+void ota_stats_commit(uint32_t start_us) {
+    uint32_t elapsed_ms = (time_us_32() - start_us) / 1000;
+
+    // Bucket 0 is under 1 ms, and bucket n from 2^(n-1) ms
+    uint32_t bucket = 0;
+    while (elapsed_ms && bucket < OTA_STATS_LATENCY_BUCKETS - 1) {
+        elapsed_ms >>= 1;
+        bucket++;
+    }
+    ota_stats.commit_latency[bucket]++;
+}
+
+void ota_stats_segment(uint32_t len) {
+    ota_stats.segment_sizes[MIN(len / OTA_STATS_SEGMENT_BUCKET_SIZE, OTA_STATS_SEGMENT_BUCKETS - 1)]++;
+}
+
+void ota_stats_verify_retry() {
+    ota_stats.verify_retries++;
+}
+
+#else
+
+uint32_t ota_stats_now() {
+    return 0;
+}
+
+void ota_stats_add(enum OtaStatsPhase phase, uint32_t start_us) {
+}
+
+void ota_stats_commit(uint32_t start_us) {
+}
+
+void ota_stats_segment(uint32_t len) {
+}
+
+void ota_stats_verify_retry() {
+}
+
+#endif
+
+const struct OtaStats* ota_stats_get() {
+    return &ota_stats;
+}
@@ -5,6 +5,8 @@
 #include "hardware/structs/scb.h"
 #include "pico/stdlib.h"
 
+#include "pico_wifi_boot/boot_image.h"
+#include "pico_wifi_boot/boot_slots.h"
 #include "pico_wifi_boot/flash.h"
 
 extern char __flash_binary_end;
@@ -38,12 +40,32 @@ bool running_in_bootloader() {
     return (uint32_t)&__flash_binary_end <= XIP_BASE + USER_PROGRAM_OFFSET;
 }
 
+bool running_from_slot(uint8_t slot) {
+    uint32_t slot_start = XIP_BASE + USER_SLOT_OFFSET(slot);
+    uint32_t binary_end = (uint32_t)&__flash_binary_end;
+    return binary_end > slot_start && binary_end <= slot_start + USER_PROGRAM_MAX_SIZE;
+}
+
 bool validate_bootloader_size() {
     return (uint32_t)&__flash_binary_end - XIP_BASE <= USER_PROGRAM_OFFSET;
 }
 
 void load_user_program() {
-    uint32_t* vt = (uint32_t*)(XIP_BASE + USER_PROGRAM_OFFSET);
+    // An interrupted copy leaves slot 0 incomplete, which boot_image_check() catches below
+    boot_image_install_staged();
+
+    uint8_t slot;
+    if (!boot_slots_select(&slot)) {
+        return;
+    }
+
+    // A program which was not completely written would crash. A new one on trial is rolled back from,
+    // otherwise stay in the bootloader to reflash it
+    if (!boot_image_check(slot) && !(boot_slots_fall_back(&slot) && boot_image_check(slot))) {
+        return;
+    }
+
+    uint32_t* vt = (uint32_t*)(XIP_BASE + USER_SLOT_OFFSET(slot));
     uint32_t stack_end = vt[0];
     uint32_t reset_handler = vt[1];
 
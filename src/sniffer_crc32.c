@@ -44,3 +44,41 @@ uint32_t sniffer_crc32(uint8_t* aligned_addr, uint32_t len) {
     // Flip and reverse bits to match common implementations
     return reverse_uint32(dma_hw->sniff_data ^ 0xFFFFFFFF);
 }
+
+uint32_t sniffer_crc32_update(uint32_t crc, const uint8_t* addr, uint32_t len) {
+    int channel = dma_claim_unused_channel(true);
+    dma_channel_config config = dma_channel_get_default_config(channel);
+    dma_channel_set_config(channel, &config, false);
+
+    // DMA does not increment writes by default, simply dump data into a placeholder
+    uint32_t write_placeholder;
+    dma_channel_set_write_addr(channel, &write_placeholder, false);
+
+    // Resume the sniffer from the state which produced the previous checksum
+    dma_sniffer_enable(channel, 0x1, true);
+    dma_hw->sniff_data = reverse_uint32(crc) ^ 0xFFFFFFFF;
+
+    // Transfer whole words where possible, then any remaining bytes individually
+    uint32_t words = (uintptr_t)addr % 4 == 0 ? len / 4 : 0;
+    if (words) {
+        dma_channel_transfer_from_buffer_now(channel, addr, words);
+        dma_channel_wait_for_finish_blocking(channel);
+    }
+
+    uint32_t spare_bytes = len - words * 4;
+    if (spare_bytes) {
+        // Reconfiguring the channel must keep it connected to the sniffer
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+        channel_config_set_sniff_enable(&config, true);
+        dma_channel_set_config(channel, &config, false);
+
+        dma_channel_transfer_from_buffer_now(channel, addr + words * 4, spare_bytes);
+        dma_channel_wait_for_finish_blocking(channel);
+    }
+
+    dma_sniffer_disable();
+    dma_channel_unclaim(channel);
+
+    // Flip and reverse bits to match common implementations
+    return reverse_uint32(dma_hw->sniff_data ^ 0xFFFFFFFF);
+}
@@ -1,27 +1,92 @@
 #include "pico_wifi_boot/wifi_manager.h"
 
+#include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "pico/async_context.h"
 #include "pico/stdio.h"
+#include "pico/time.h"
 
 #include "cyw43.h"
 #include "cyw43_config.h"
 #include "cyw43_ll.h"
+#include "lwip/dhcp.h"
+#include "lwip/etharp.h"
 #include "lwip/netif.h"
 
+#include "pico_wifi_boot/config_store.h"
 #include "pico_wifi_boot/flash.h"
 
 #define SERIAL_INPUT_TIMEOUT_US (30 * 1000 * 1000)
 #define SERIAL_INPUT_END '\r'
 
+// How often, and how many times, to check for a DHCP address to record after connecting
+#define WIFI_LINK_CHECK_INTERVAL_MS 500
+#define WIFI_LINK_CHECKS 60
+
+#define WIFI_SCAN_TIMEOUT_MS 10000
+
+// How many ARP probes to send for the address from the last lease before using it, and how long to
+// wait for a reply to each
+#define WIFI_LEASE_PROBES 2
+#define WIFI_LEASE_PROBE_INTERVAL_MS 100
+
 // Forward-declare some functions we depend on from pico_cyw43_arch, since we do not know the required
 // arch type to include pico/cyw43_arch.h
 void cyw43_arch_enable_sta_mode(void);
-int cyw43_arch_wifi_connect_timeout_ms(const char *ssid, const char *pw, uint32_t auth, uint32_t timeout);
 int cyw43_arch_wifi_connect_async(const char *ssid, const char *pw, uint32_t auth);
+void cyw43_arch_poll(void);
+void cyw43_arch_wait_for_work_until(absolute_time_t until);
+async_context_t* cyw43_arch_async_context(void);
 
 bool wifi_manager_config_stale = false;
 
+struct WifiConnectStats wifi_connect_stats;
+
+// A configured network, and the strongest AP seen for it by the last scan
+struct WifiCandidate {
+    uint8_t profile;
+    bool seen;
+    int16_t rssi;
+    uint8_t bssid[6];
+    uint16_t channel;
+};
+
+// Configured networks, in the order to try them once the scan completes
+struct WifiScan {
+    // Indexed by profile, since the candidates are reordered
+    char ssid[WIFI_PROFILE_COUNT][WIFI_CONFIG_SSID_SIZE + 1];
+    struct WifiCandidate candidates[WIFI_PROFILE_COUNT];
+    uint32_t count;
+};
+
+enum WifiConnectStep {
+    WIFI_STEP_IDLE,
+    // Joining the AP last connected to directly, with its lease
+    WIFI_STEP_FAST,
+    WIFI_STEP_SCANNING,
+    // Joining the next of the scanned candidates
+    WIFI_STEP_JOINING,
+    WIFI_STEP_CONNECTED,
+};
+
+// Progress of wifi_manager_connect_async between calls
+struct WifiConnectState {
+    enum WifiConnectStep step;
+    uint32_t wait_until_ms;
+    uint32_t step_start_ms;
+    uint32_t connect_start_ms;
+    uint32_t retry_ms;
+    uint32_t candidate;
+    struct WifiScan scan;
+    struct WifiLinkRecord link;
+    // A fast connect is not tried again until a connection succeeds
+    bool fast_failed;
+};
+
+struct WifiConnectState wifi_connect_state = {.retry_ms = WIFI_RETRY_MIN_MS};
+
 void print_current_ipv4() {
     cyw43_thread_enter();
 
@@ -30,6 +95,26 @@ void print_current_ipv4() {
     cyw43_thread_exit();
 }
 
+void wifi_connect_record(bool fast, uint32_t start_ms) {
+    uint32_t elapsed_ms = to_ms_since_boot(get_absolute_time()) - start_ms;
+
+    uint32_t bucket = 0;
+    while (bucket < WIFI_CONNECT_BUCKETS - 1 && elapsed_ms >= (250u << bucket)) {
+        bucket++;
+    }
+    if (fast) {
+        wifi_connect_stats.fast_time[bucket]++;
+    } else {
+        wifi_connect_stats.full_time[bucket]++;
+    }
+
+    printf("Connected in %"PRIu32" ms%s\n", elapsed_ms, fast ? " (fast)" : "");
+}
+
+const struct WifiConnectStats* wifi_manager_connect_stats() {
+    return &wifi_connect_stats;
+}
+
 bool wifi_manager_init(bool enable_powersave) {
     cyw43_arch_enable_sta_mode();
 
@@ -42,69 +127,443 @@ bool wifi_manager_init(bool enable_powersave) {
     return true;
 }
 
-void wifi_manager_connect_async() {
-    static uint32_t wait_until_ms = 0;
-    static bool is_connecting = false;
+bool wifi_profiles_configured() {
+    char ssid[WIFI_CONFIG_SSID_SIZE + 1] = {0};
+    char pass[WIFI_CONFIG_PASS_SIZE + 1] = {0};
+    for (uint32_t i = 0; i < WIFI_PROFILE_COUNT; i++) {
+        if (read_wifi_profile(i, ssid, pass) && ssid[0]) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    uint32_t now_ms = to_ms_since_boot(get_absolute_time());
-    if (wait_until_ms > now_ms) {
+// Joins the AP directly, skipping the scan for the SSID
+int wifi_join_bssid(const char* ssid, const char* pass, const uint8_t* bssid, uint16_t channel) {
+    return cyw43_wifi_join(
+        &cyw43_state, strlen(ssid), (const uint8_t*)ssid, strlen(pass), (const uint8_t*)pass,
+        CYW43_AUTH_WPA2_AES_PSK, bssid, channel);
+}
+
+#if WIFI_FAST_CONNECT
+async_at_time_worker_t wifi_link_worker;
+uint32_t wifi_link_checks;
+uint8_t wifi_link_profile;
+uint32_t wifi_lease_probes;
+uint32_t wifi_lease_probe_ms;
+// Set once another host has answered for the address from the last lease
+bool wifi_lease_in_use;
+
+bool read_wifi_link(struct WifiLinkRecord* link) {
+    uint16_t length;
+    return config_store_read(CONFIG_KEY_WIFI_LINK, link, sizeof(*link), &length) && length == sizeof(*link);
+}
+
+// Records the AP and lease once DHCP has supplied an address, which comes after the connection when
+// a lease was reused
+void wifi_link_work(async_context_t* context, async_at_time_worker_t* worker) {
+    struct netif* netif = &cyw43_state.netif[CYW43_ITF_STA];
+    if (!dhcp_supplied_address(netif)) {
+        if (++wifi_link_checks < WIFI_LINK_CHECKS) {
+            async_context_add_at_time_worker_in_ms(context, worker, WIFI_LINK_CHECK_INTERVAL_MS);
+        }
+        return;
+    }
+
+    struct WifiLinkRecord link;
+    memset(&link, 0, sizeof(link));
+
+    // Channel info starts with the channel in use
+    uint32_t channel_info[3] = {0};
+    if (cyw43_wifi_get_bssid(&cyw43_state, link.bssid) != 0
+        || cyw43_ioctl(&cyw43_state, CYW43_IOCTL_GET_CHANNEL, sizeof(channel_info), (uint8_t*)channel_info, CYW43_ITF_STA) != 0) {
         return;
     }
+    link.channel = channel_info[0];
+    link.ip = ip4_addr_get_u32(netif_ip4_addr(netif));
+    link.netmask = ip4_addr_get_u32(netif_ip4_netmask(netif));
+    link.gateway = ip4_addr_get_u32(netif_ip4_gw(netif));
+    link.profile = wifi_link_profile;
+
+    // Nothing is written if the link is the same as last time
+    if (!config_store_write(CONFIG_KEY_WIFI_LINK, &link, sizeof(link))) {
+        printf("Failed to record WiFi link\n");
+    }
+}
+
+void wifi_link_record_start(uint8_t profile) {
+    async_context_t* context = cyw43_arch_async_context();
+    async_context_remove_at_time_worker(context, &wifi_link_worker);
+    wifi_link_checks = 0;
+    wifi_link_profile = profile;
+    wifi_link_worker.do_work = wifi_link_work;
+    async_context_add_at_time_worker_in_ms(context, &wifi_link_worker, 0);
+}
+
+// Assigns the address from the last lease once joined, rather than waiting for DHCP, unless another
+// host answers the ARP probes sent for it first. DHCP carries on, and replaces the address if the
+// server assigns a different one
+void wifi_reuse_lease(struct WifiLinkRecord* link) {
+    if (!link->ip || wifi_lease_in_use) {
+        return;
+    }
+
+    ip4_addr_t ip, netmask, gateway;
+    ip4_addr_set_u32(&ip, link->ip);
+    ip4_addr_set_u32(&netmask, link->netmask);
+    ip4_addr_set_u32(&gateway, link->gateway);
+
+    struct netif* netif = &cyw43_state.netif[CYW43_ITF_STA];
+    uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    struct eth_addr* reply_mac;
+    const ip4_addr_t* reply_ip;
+
+    cyw43_thread_enter();
+    if (etharp_find_addr(netif, &ip, &reply_mac, &reply_ip) >= 0) {
+        // A reply completed the ARP entry which the probes left pending
+        wifi_lease_in_use = true;
+        printf("Address from the last lease is in use, waiting for DHCP\n");
+    } else if (!wifi_lease_probes || now_ms - wifi_lease_probe_ms >= WIFI_LEASE_PROBE_INTERVAL_MS) {
+        if (wifi_lease_probes == WIFI_LEASE_PROBES) {
+            netif_set_addr(netif, &ip, &netmask, &gateway);
+        } else if (etharp_query(netif, &ip, NULL) == ERR_OK) {
+            // With no address assigned yet, the request is sent from 0.0.0.0, which makes it a probe
+            wifi_lease_probes++;
+            wifi_lease_probe_ms = now_ms;
+        } else {
+            // Without a probe, the address cannot be known to be free
+            wifi_lease_in_use = true;
+        }
+    }
+    cyw43_thread_exit();
+}
+
+// Starts joining the AP last connected to. Returns false if there is none, or joining it could not
+// be started
+bool wifi_fast_connect_start(struct WifiLinkRecord* link) {
+    char ssid[WIFI_CONFIG_SSID_SIZE + 1] = {0};
+    char pass[WIFI_CONFIG_PASS_SIZE + 1] = {0};
+    if (!read_wifi_link(link) || !read_wifi_profile(link->profile, ssid, pass) || !ssid[0]) {
+        return false;
+    }
+
+    wifi_lease_probes = 0;
+    wifi_lease_in_use = false;
 
+    printf("Connecting to %s on channel %u\n", ssid, link->channel);
+    return wifi_join_bssid(ssid, pass, link->bssid, link->channel) == 0;
+}
+#endif
+
+// Link status, assigning the address from lease (if given) once joined
+int wifi_link_status(struct WifiLinkRecord* lease) {
     int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
-    if (status == CYW43_LINK_UP && !wifi_manager_config_stale) {
-        if (is_connecting) {
-            is_connecting = false;
-            print_current_ipv4();
+#if WIFI_FAST_CONNECT
+    if (status == CYW43_LINK_NOIP && lease) {
+        wifi_reuse_lease(lease);
+        status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+    }
+#endif
+    return status;
+}
+
+void wifi_connected(uint8_t profile, bool fast, uint32_t start_ms) {
+    wifi_connect_record(fast, start_ms);
+    print_current_ipv4();
+#if WIFI_FAST_CONNECT
+    wifi_link_record_start(profile);
+#endif
+}
+
+int wifi_scan_result(void* env, const cyw43_ev_scan_result_t* result) {
+    struct WifiScan* scan = env;
+    for (uint32_t i = 0; i < scan->count; i++) {
+        struct WifiCandidate* candidate = &scan->candidates[i];
+        const char* ssid = scan->ssid[candidate->profile];
+        if (result->ssid_len == strlen(ssid)
+            && memcmp(result->ssid, ssid, result->ssid_len) == 0
+            && (!candidate->seen || result->rssi > candidate->rssi)) {
+            candidate->seen = true;
+            candidate->rssi = result->rssi;
+            memcpy(candidate->bssid, result->bssid, sizeof(candidate->bssid));
+            candidate->channel = result->channel;
+        }
+    }
+    return 0;
+}
+
+// Lists the configured networks and starts a scan for them. Returns false if none are configured.
+// If the scan cannot be started, the networks are still tried, in the order configured
+bool wifi_scan_start(struct WifiScan* scan) {
+    memset(scan, 0, sizeof(*scan));
+
+    char pass[WIFI_CONFIG_PASS_SIZE + 1] = {0};
+    for (uint32_t i = 0; i < WIFI_PROFILE_COUNT; i++) {
+        if (read_wifi_profile(i, scan->ssid[i], pass) && scan->ssid[i][0]) {
+            scan->candidates[scan->count].profile = i;
+            scan->count++;
+        }
+    }
+    if (!scan->count) {
+        return false;
+    }
+
+    cyw43_wifi_scan_options_t options;
+    memset(&options, 0, sizeof(options));
+    int err = cyw43_wifi_scan(&cyw43_state, &options, scan, wifi_scan_result);
+    if (err != 0) {
+        printf("cyw43_wifi_scan failed (%d)\n", err);
+    }
+    return true;
+}
+
+int wifi_candidate_compare(const void* a, const void* b) {
+    const struct WifiCandidate* first = a;
+    const struct WifiCandidate* second = b;
+    if (first->seen != second->seen) {
+        return first->seen ? -1 : 1;
+    }
+    if (first->seen && first->rssi != second->rssi) {
+        return second->rssi - first->rssi;
+    }
+    return first->profile - second->profile;
+}
+
+// Orders the networks seen by the scan from the strongest signal down, followed by those not seen,
+// which may be hidden
+void wifi_scan_rank(struct WifiScan* scan) {
+    qsort(scan->candidates, scan->count, sizeof(scan->candidates[0]), wifi_candidate_compare);
+
+    for (uint32_t i = 0; i < scan->count; i++) {
+        struct WifiCandidate* candidate = &scan->candidates[i];
+        if (candidate->seen) {
+            printf("Found network %d (%d dBm, channel %u)\n", candidate->profile + 1, candidate->rssi, candidate->channel);
         }
-        wait_until_ms = now_ms + 1000;
+    }
+}
+
+// Starts joining a configured network, directly if the scan saw it. Returns false if joining could
+// not be started
+bool wifi_candidate_start(struct WifiCandidate* candidate) {
+    char ssid[WIFI_CONFIG_SSID_SIZE + 1] = {0};
+    char pass[WIFI_CONFIG_PASS_SIZE + 1] = {0};
+    if (!read_wifi_profile(candidate->profile, ssid, pass)) {
+        return false;
+    }
+
+    printf("Connecting to %s\n", ssid);
+    int err = candidate->seen
+        ? wifi_join_bssid(ssid, pass, candidate->bssid, candidate->channel)
+        : cyw43_arch_wifi_connect_async(ssid, pass, CYW43_AUTH_WPA2_AES_PSK);
+    if (err != 0) {
+        printf("Failed to start connecting (%d)\n", err);
+    }
+    return err == 0;
+}
+
+void wifi_connect_step(struct WifiConnectState* state, enum WifiConnectStep step, uint32_t now_ms) {
+    state->step = step;
+    state->step_start_ms = now_ms;
+}
+
+// Starts joining the next candidate which can be started, or backs off before the next round once
+// all have been tried
+void wifi_connect_next(struct WifiConnectState* state, uint32_t now_ms) {
+    while (state->candidate < state->scan.count) {
+        if (wifi_candidate_start(&state->scan.candidates[state->candidate])) {
+            wifi_connect_step(state, WIFI_STEP_JOINING, now_ms);
+            return;
+        }
+        state->candidate++;
+    }
+
+    printf("No network connected, trying again in %"PRIu32" ms\n", state->retry_ms);
+    state->wait_until_ms = now_ms + state->retry_ms;
+    state->retry_ms = MIN(state->retry_ms * 2, WIFI_RETRY_MAX_MS);
+    wifi_connect_step(state, WIFI_STEP_IDLE, now_ms);
+}
+
+void wifi_scan_begin(struct WifiConnectState* state, uint32_t now_ms) {
+    if (!wifi_scan_start(&state->scan)) {
+        printf("WiFi is not configured\n");
+        state->wait_until_ms = now_ms + 5000;
+        wifi_connect_step(state, WIFI_STEP_IDLE, now_ms);
         return;
     }
+    wifi_connect_step(state, WIFI_STEP_SCANNING, now_ms);
+}
 
-    if (status < 0 && is_connecting) {
-        printf("Failed to connect (%d)\n", status);
-        is_connecting = false;
-        wait_until_ms = now_ms + 5000;
+void wifi_manager_connect_async() {
+    struct WifiConnectState* state = &wifi_connect_state;
+
+    uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    if (state->wait_until_ms > now_ms) {
         return;
     }
 
-    if (!is_connecting || wifi_manager_config_stale) {
-        char ssid[WIFI_CONFIG_SSID_SIZE + 1] = {0};
-        char pass[WIFI_CONFIG_PASS_SIZE + 1] = {0};
-        if (!read_wifi_config(ssid, pass) || !ssid[0]) {
-            printf("WiFi is not configured\n");
-            wait_until_ms = now_ms + 5000;
+    int status = wifi_link_status(state->step == WIFI_STEP_FAST ? &state->link : NULL);
+
+    switch (state->step) {
+    case WIFI_STEP_CONNECTED:
+        if (status == CYW43_LINK_UP && !wifi_manager_config_stale) {
+            state->wait_until_ms = now_ms + 1000;
+            return;
+        }
+        wifi_connect_step(state, WIFI_STEP_IDLE, now_ms);
+        break;
+
+    case WIFI_STEP_FAST:
+    case WIFI_STEP_JOINING: {
+        bool fast = state->step == WIFI_STEP_FAST;
+        uint8_t profile = fast ? state->link.profile : state->scan.candidates[state->candidate].profile;
+        if (status == CYW43_LINK_UP && !wifi_manager_config_stale) {
+            wifi_connected(profile, fast, state->connect_start_ms);
+            state->retry_ms = WIFI_RETRY_MIN_MS;
+            state->fast_failed = false;
+            wifi_connect_step(state, WIFI_STEP_CONNECTED, now_ms);
+            state->wait_until_ms = now_ms + 1000;
+            return;
+        }
+
+        uint32_t timeout_ms = fast ? WIFI_FAST_CONNECT_TIMEOUT_MS : WIFI_CONNECT_TIMEOUT_MS;
+        if (status >= 0 && !wifi_manager_config_stale && now_ms - state->step_start_ms < timeout_ms) {
             return;
         }
 
-        if (cyw43_arch_wifi_connect_async(ssid, pass, CYW43_AUTH_WPA2_AES_PSK) != 0) {
-            printf("cyw43_arch_wifi_connect_async failed\n");
-            wait_until_ms = now_ms + 5000;
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+        if (wifi_manager_config_stale) {
+            wifi_connect_step(state, WIFI_STEP_IDLE, now_ms);
+            break;
+        }
+
+        printf("Failed to connect (%d)\n", status);
+        if (fast) {
+            // Carry on with a full connect, timed from the start of the fast one
+            wifi_connect_stats.fast_failures++;
+            state->fast_failed = true;
+            wifi_scan_begin(state, now_ms);
             return;
         }
 
-        printf("Connecting to %s\n", ssid);
-        is_connecting = true;
-        wifi_manager_config_stale = false;
+        wifi_connect_stats.network_failures++;
+        state->candidate++;
+        wifi_connect_next(state, now_ms);
+        return;
     }
+
+    case WIFI_STEP_SCANNING:
+        if (cyw43_wifi_scan_active(&cyw43_state) && now_ms - state->step_start_ms < WIFI_SCAN_TIMEOUT_MS) {
+            return;
+        }
+        wifi_scan_rank(&state->scan);
+        state->candidate = 0;
+        wifi_connect_next(state, now_ms);
+        return;
+
+    case WIFI_STEP_IDLE:
+        break;
+    }
+
+    // Starting a new round, after the link was lost or config changed
+    if (wifi_manager_config_stale && status >= CYW43_LINK_JOIN) {
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+    }
+    wifi_manager_config_stale = false;
+    state->connect_start_ms = now_ms;
+
+#if WIFI_FAST_CONNECT
+    if (!state->fast_failed && wifi_fast_connect_start(&state->link)) {
+        wifi_connect_step(state, WIFI_STEP_FAST, now_ms);
+        return;
+    }
+#endif
+
+    wifi_scan_begin(state, now_ms);
 }
 
-bool wifi_manager_connect(int attempts) {
-    char ssid[WIFI_CONFIG_SSID_SIZE + 1] = {0};
-    char pass[WIFI_CONFIG_PASS_SIZE + 1] = {0};
+// Polls until the link is up, fails, or timeout_ms passes, returning the last link status
+int wifi_wait_for_link(uint32_t timeout_ms, struct WifiLinkRecord* lease) {
+    absolute_time_t until = make_timeout_time_ms(timeout_ms);
+    while (true) {
+        int status = wifi_link_status(lease);
+        if (status == CYW43_LINK_UP || status < 0 || time_reached(until)) {
+            return status;
+        }
+
+        cyw43_arch_poll();
+#if WIFI_FAST_CONNECT
+        // Wake up in time to send the next ARP probe for the lease, or to use it
+        if (lease) {
+            cyw43_arch_wait_for_work_until(
+                absolute_time_min(until, make_timeout_time_ms(WIFI_LEASE_PROBE_INTERVAL_MS)));
+            continue;
+        }
+#endif
+        cyw43_arch_wait_for_work_until(until);
+    }
+}
 
-    if (!read_wifi_config(ssid, pass) || !ssid[0]) {
+bool wifi_manager_connect(int attempts) {
+    if (!wifi_profiles_configured()) {
         printf("WiFi is not configured\n");
         return false;
     }
 
-    for (int attempt = 0; attempt < attempts; attempt++) {
-        printf("Connecting to %s\n", ssid);
-        if (cyw43_arch_wifi_connect_timeout_ms(ssid, pass, CYW43_AUTH_WPA2_AES_PSK, 30000) == 0) {
-            print_current_ipv4();
+    uint32_t start_ms = to_ms_since_boot(get_absolute_time());
+    int status;
+
+#if WIFI_FAST_CONNECT
+    struct WifiLinkRecord link;
+    if (wifi_fast_connect_start(&link)) {
+        status = wifi_wait_for_link(WIFI_FAST_CONNECT_TIMEOUT_MS, &link);
+        if (status == CYW43_LINK_UP) {
+            wifi_connected(link.profile, true, start_ms);
             return true;
         }
-        printf("Failed to connect\n");
+
+        printf("Failed to connect (%d)\n", status);
+        wifi_connect_stats.fast_failures++;
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+    }
+#endif
+
+    // A scan which timed out may still report results into this, so it is not on the stack
+    struct WifiScan* scan = &wifi_connect_state.scan;
+
+    uint32_t retry_ms = WIFI_RETRY_MIN_MS;
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        if (attempt) {
+            printf("No network connected, trying again in %"PRIu32" ms\n", retry_ms);
+            sleep_ms(retry_ms);
+            retry_ms = MIN(retry_ms * 2, WIFI_RETRY_MAX_MS);
+        }
+
+        if (!wifi_scan_start(scan)) {
+            break;
+        }
+
+        absolute_time_t until = make_timeout_time_ms(WIFI_SCAN_TIMEOUT_MS);
+        while (cyw43_wifi_scan_active(&cyw43_state) && !time_reached(until)) {
+            cyw43_arch_poll();
+            cyw43_arch_wait_for_work_until(until);
+        }
+        wifi_scan_rank(scan);
+
+        for (uint32_t i = 0; i < scan->count; i++) {
+            if (!wifi_candidate_start(&scan->candidates[i])) {
+                continue;
+            }
+
+            status = wifi_wait_for_link(WIFI_CONNECT_TIMEOUT_MS, NULL);
+            if (status == CYW43_LINK_UP) {
+                wifi_connected(scan->candidates[i].profile, false, start_ms);
+                return true;
+            }
+
+            printf("Failed to connect (%d)\n", status);
+            wifi_connect_stats.network_failures++;
+            cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+        }
     }
 
     return false;
@@ -150,9 +609,24 @@ bool wifi_manager_is_connected() {
 }
 
 bool wifi_manager_attempt_configure() {
+    char profile[4] = {0};
     char ssid[WIFI_CONFIG_SSID_SIZE + 1] = {0};
     char pass[WIFI_CONFIG_PASS_SIZE + 1] = {0};
-    
+
+    // Networks other than the first are only set up when asked for
+    uint32_t index = 0;
+    if (WIFI_PROFILE_COUNT > 1) {
+        printf("WiFi network 1-%d (default 1, empty SSID removes it)\n", WIFI_PROFILE_COUNT);
+        if (!prompt("WiFi network: ", profile, sizeof(profile))) {
+            return false;
+        }
+        index = profile[0] ? strtoul(profile, NULL, 10) - 1 : 0;
+        if (index >= WIFI_PROFILE_COUNT) {
+            printf("No such network\n");
+            return false;
+        }
+    }
+
     if (!prompt("WiFi SSID: ", ssid, sizeof(ssid))) {
         return false;
     }
@@ -160,11 +634,16 @@ bool wifi_manager_attempt_configure() {
         return false;
     }
 
-    if (!write_wifi_config(ssid, pass)) {
+    if (!write_wifi_profile(index, ssid, pass)) {
         printf("Failed to write config to flash\n");
         return false;
     }
 
+#if WIFI_FAST_CONNECT
+    // The recorded link may be for the previous network
+    config_store_write(CONFIG_KEY_WIFI_LINK, "", 0);
+#endif
+
     wifi_manager_config_stale = true;
 
     return true;
@@ -0,0 +1,156 @@
+# generates patches for the ota server's delta request (see include/pico_wifi_boot/delta_patch.h)
+
+SECTOR_SIZE = 4096
+
+# must match DELTA_PATCH_HISTORY_SECTORS in the bootloader
+HISTORY_SECTORS = 4
+
+OP_COPY = 0
+OP_INSERT = 1
+
+# bytes used to find candidate matches in the base image
+ANCHOR_SIZE = 16
+ANCHOR_STRIDE = 4
+MAX_CANDIDATES = 8
+
+# shorter matches are cheaper to send as literals
+MIN_COPY_SIZE = 8
+
+
+def encode_varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return out
+
+
+def zigzag(value):
+    return (value << 1) if value >= 0 else ((-value << 1) - 1)
+
+
+# the patch is applied in-place, so a copy may only read sectors which have not been
+# overwritten yet, or are still held in the bootloader's history of overwritten sectors
+def can_copy(src, dest):
+    return dest - src <= HISTORY_SECTORS * SECTOR_SIZE
+
+
+def build_index(base):
+    index = {}
+    for pos in range(0, len(base) - ANCHOR_SIZE + 1, ANCHOR_STRIDE):
+        key = base[pos:pos + ANCHOR_SIZE]
+        candidates = index.setdefault(key, [])
+        if len(candidates) == MAX_CANDIDATES:
+            # keep the most recent positions, which are most likely to satisfy can_copy
+            candidates.pop(0)
+        candidates.append(pos)
+    return index
+
+
+def match_length(base, src, image, dest, limit):
+    length = 0
+    while length < limit and base[src + length] == image[dest + length]:
+        length += 1
+    return length
+
+
+def find_match(base, image, index, dest, cursor):
+    best_src, best_len = 0, 0
+
+    # continuing from where the last copy left off is the most common case
+    candidates = [cursor] if 0 <= cursor < len(base) else []
+    candidates += index.get(image[dest:dest + ANCHOR_SIZE], [])
+
+    for src in candidates:
+        if not can_copy(src, dest):
+            continue
+        limit = min(len(base) - src, len(image) - dest)
+        length = match_length(base, src, image, dest, limit)
+        if length > best_len:
+            best_src, best_len = src, length
+
+    return best_src, best_len
+
+
+class PatchWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.cursor = 0
+
+    def copy(self, src, length):
+        self.out.append(OP_COPY)
+        self.out += encode_varint(zigzag(src - self.cursor))
+        self.out += encode_varint(length)
+        self.cursor = src + length
+
+    def insert(self, data):
+        if not data:
+            return
+        self.out.append(OP_INSERT)
+        self.out += encode_varint(len(data))
+        self.out += data
+        self.cursor += len(data)
+
+
+def make_patch(base, image):
+    index = build_index(base)
+    patch = PatchWriter()
+
+    literal_start = 0
+    dest = 0
+    while dest < len(image):
+        src, length = find_match(base, image, index, dest, patch.cursor + (dest - literal_start))
+        if length < MIN_COPY_SIZE:
+            dest += 1
+            continue
+
+        patch.insert(image[literal_start:dest])
+        patch.copy(src, length)
+        dest += length
+        literal_start = dest
+
+    patch.insert(image[literal_start:])
+    return bytes(patch.out)
+
+
+# reference implementation of the bootloader's patch application, for checking generated patches
+def apply_patch(base, patch):
+    image = bytearray()
+    cursor = 0
+    pos = 0
+
+    def read_varint():
+        nonlocal pos
+        value, shift = 0, 0
+        while True:
+            byte = patch[pos]
+            pos += 1
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    while pos < len(patch):
+        op = patch[pos]
+        pos += 1
+        if op == OP_COPY:
+            field = read_varint()
+            cursor += (field >> 1) ^ -(field & 1)
+            length = read_varint()
+            if cursor < 0 or cursor + length > len(base) or not can_copy(cursor, len(image)):
+                raise ValueError("copy reads overwritten data")
+            image += base[cursor:cursor + length]
+            cursor += length
+        elif op == OP_INSERT:
+            length = read_varint()
+            image += patch[pos:pos + length]
+            pos += length
+            cursor += length
+        else:
+            raise ValueError(f"unknown op {op}")
+
+    return bytes(image)
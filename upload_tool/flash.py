@@ -1,15 +1,78 @@
 from crc import Calculator, Crc32
 from enum import IntEnum
+import argparse
+import collections
+import ipaddress
 import selectors
 import socket
+import struct
+import time
 import types
 import os
 import errno
-import sys
+
+import delta
+import lzss
 
 
 OTA_PORT = 2222
 
+# times to reconnect and resume after a connection drops mid-transfer
+RECONNECT_ATTEMPTS = 3
+# times to reconnect after a device answers that it is rebooting into the bootloader, so that one
+# which keeps rebooting is given up on
+MAX_REBOOTS = 2
+
+# multicast fleet flashing, which must match ota_multicast.h on the device
+MULTICAST_GROUP = "239.255.22.22"
+MULTICAST_PORT = 2223
+MULTICAST_CHUNK_SIZE = 1024
+FLASH_SECTOR_SIZE = 4096
+# rounds of sending missing sectors before giving up on devices which are still missing some
+MULTICAST_MAX_ROUNDS = 10
+# times to ask for status before giving up on a device which has not answered
+MULTICAST_QUERY_ATTEMPTS = 3
+MULTICAST_QUERY_TIMEOUT = 1.0
+# ready beacons broadcast by devices once their ota server listens, which must match ota_discovery.h
+DISCOVERY_PORT = 2224
+# seconds to wait for a rebooting device's beacon before connecting anyway, for bootloaders which do
+# not send one
+BEACON_TIMEOUT = 15.0
+# seconds to wait for a device to reboot into the bootloader when beacons cannot be listened for
+REBOOT_DELAY = 3.0
+# answers to inventory queries, which must match OtaDiscoveryInfo in ota_discovery.c
+DISCOVERY_INFO_FORMAT = "<4s8sHBBBbxxIII"
+# times to query devices which have not answered, and seconds to wait for answers each time
+DISCOVERY_ATTEMPTS = 2
+DISCOVERY_TIMEOUT = 0.5
+
+# rollout scheduling: devices in a group share airtime, so only a few of them are sent to at once
+# and the number is adjusted to whatever gets the most bytes through the group
+ROLLOUT_START_CONCURRENCY = 2
+ROLLOUT_ADAPT_INTERVAL = 2.0
+# relative change in group throughput which counts as better or worse
+ROLLOUT_ADAPT_THRESHOLD = 0.1
+# largest single send, so that a bandwidth cap is applied smoothly
+SEND_CHUNK_SIZE = 16 * 1024
+
+# upload stats, which must match ota_stats.h on the device
+STATS_PHASES = ["network wait", "receive", "erase", "program", "verify", "checksum"]
+STATS_LATENCY_BUCKETS = 8
+STATS_SEGMENT_BUCKETS = 8
+STATS_SEGMENT_BUCKET_SIZE = 256
+STATS_RESPONSE_SIZE = 5 + 4 * (len(STATS_PHASES) + STATS_LATENCY_BUCKETS + STATS_SEGMENT_BUCKETS + 1)
+
+
+# last byte of the request magic code
+class OtaRequestType(IntEnum):
+    IMAGE = ord('\n')
+    INFO = ord('I')
+    DELTA = ord('D')
+    COMPRESSED = ord('Z')
+    RESUME = ord('R')
+    MULTICAST = ord('M')
+    STATS = ord('S')
+
 
 # to be sent back by ota server
 class OtaResponseCode(IntEnum):
@@ -17,6 +80,27 @@ class OtaResponseCode(IntEnum):
     STORAGE_FULL = 1
     CHECKSUM_FAILED = 2
     REBOOTING = 3
+    BASE_MISMATCH = 4
+    WRITE_FAILED = 5
+    WRONG_SLOT = 6
+    MULTICAST_UNAVAILABLE = 7
+    BUSY = 8
+
+
+# multicast packet types, after the "OTM" prefix
+class MulticastPacketType(IntEnum):
+    DATA = ord('D')
+    QUERY = ord('Q')
+    STATUS = ord('S')
+    FINISH = ord('F')
+
+
+# device progress, as reported in multicast status packets
+class MulticastStatus(IntEnum):
+    RECEIVING = 0
+    COMPLETE = 1
+    WRITE_FAILED = 2
+    WRONG_SLOT = 3
 
 
 # socket lifecycle for the write handler
@@ -25,6 +109,8 @@ class WriteStatusCode(IntEnum):
     AWAIT_RESPONSE = 1
     PAYLOAD_READY = 2
     PAYLOAD_SENT = 3
+    AWAIT_INFO = 4
+    AWAIT_STATS = 5
 
 
 # to signify result to main program
@@ -45,33 +131,112 @@ def read_bin(path):
     return contents
 
 
+def pack_uint32(value):
+    return value.to_bytes(length=4, byteorder="little", signed=False)
+
+
 # ask ota server if bytes are availabe with checksum for later verification
-def pack_request(payload_size, checksum):
+def pack_request(payload_size, checksum, request_type=OtaRequestType.IMAGE):
     buf = bytearray(12)
-    buf[0:4] = b'OTA\n'
-    buf[4:8] = payload_size.to_bytes(
-        length=4, byteorder="little", signed=False)
-    buf[8:12] = checksum.to_bytes(
-        length=4, byteorder="little", signed=False)
+    buf[0:3] = b'OTA'
+    buf[3] = request_type
+    buf[4:8] = pack_uint32(payload_size)
+    buf[8:12] = pack_uint32(checksum)
+    return buf
+
+
+# ask ota server to decompress the payload into an image of image_size bytes
+def pack_compressed_request(payload_size, checksum, image_size):
+    buf = pack_request(payload_size, checksum, OtaRequestType.COMPRESSED)
+    buf += pack_uint32(image_size)
+    return buf
+
+
+# ask ota server to apply a patch against the image it is running
+def pack_delta_request(patch_size, checksum, image_size, base_size, base_checksum):
+    buf = pack_request(patch_size, checksum, OtaRequestType.DELTA)
+    buf += pack_uint32(image_size)
+    buf += pack_uint32(base_size)
+    buf += pack_uint32(base_checksum)
     return buf
 
 
 def get_response_status(buf):
-    if buf[0:4].decode("utf-8") != "OTA\n":
+    if buf[0:4] != b"OTA\n":
         return -1
     return int.from_bytes(buf[4:5], byteorder="little",  signed=False)
 
 
+# checksum of the installed image, as reported in response to an info request
+def get_info_checksum(buf):
+    return int.from_bytes(buf[9:13], byteorder="little", signed=False)
+
+
+# slot the device will write the next image to, as reported in response to an info request
+# (devices without A/B slots only have slot 0)
+def get_info_target_slot(buf):
+    return buf[13] if len(buf) > 13 else 0
+
+
+# offset to continue a full image from, as reported in response to a resume request
+def get_resume_offset(buf):
+    return int.from_bytes(buf[5:9], byteorder="little", signed=False)
+
+
+# bucket 0 is under 1 ms, and bucket n from 2^(n-1) ms up to double that
+def latency_bucket_name(i):
+    if i == 0:
+        return "<1"
+    if i == STATS_LATENCY_BUCKETS - 1:
+        return f">={1 << (i - 1)}"
+    return f"{1 << (i - 1)}-{1 << i}"
+
+
+# breakdown of where the device spent the upload, as reported in response to a stats request
+def format_stats(buf):
+    values = struct.unpack_from(f"<{(STATS_RESPONSE_SIZE - 5) // 4}I", buf, 5)
+    phases = values[:len(STATS_PHASES)]
+    latency = values[len(STATS_PHASES):len(STATS_PHASES) + STATS_LATENCY_BUCKETS]
+    segments = values[len(STATS_PHASES) + STATS_LATENCY_BUCKETS:-1]
+    lines = ["  time: " + ", ".join(f"{name} {us / 1000:.0f} ms" for name, us in zip(STATS_PHASES, phases))]
+    lines.append("  sector commits: " + ", ".join(
+        f"{latency_bucket_name(i)} ms: {count}" for i, count in enumerate(latency) if count))
+    lines.append("  segments: " + ", ".join(
+        f"{'>=' if i == STATS_SEGMENT_BUCKETS - 1 else ''}{i * STATS_SEGMENT_BUCKET_SIZE} bytes: {count}"
+        for i, count in enumerate(segments) if count))
+    lines.append(f"  verify retries: {values[-1]}")
+    return "\n".join(lines)
+
+
 def delete_socket(select, sock):
     select.unregister(sock)
-    sock.shutdown(socket.SHUT_RDWR)
+    try:
+        sock.shutdown(socket.SHUT_RDWR)
+    except OSError:
+        pass  # already disconnected
     sock.close()
 
 
+# full images are requested with resume, so that a dropped upload continues where it left off
+def is_resumable(data):
+    return not data.use_patch and data.job.compressed is None
+
+
+# the payload is either the full image (possibly compressed), or a patch once the device has
+# confirmed it runs the base image
+def get_payload(data):
+    if data.use_patch:
+        return data.job.patch
+    if data.job.compressed is not None:
+        return data.job.compressed
+    return data.job.image
+
+
 # create socket and connect it to ota server
 # also provide some instance-specific data for the read and write callbacks
 # finally register the created socket with the event queue
-def add_socket(ip, payload, checksum, select):
+# with a job per slot, the one to send is only known once the device reports its target slot
+def add_socket(ip, jobs, select, scheduler, use_patch=None, reconnects=RECONNECT_ATTEMPTS, reboots=MAX_REBOOTS):
     sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     sock.setblocking(False)
     err = sock.connect_ex((ip, OTA_PORT))
@@ -81,39 +246,107 @@ def add_socket(ip, payload, checksum, select):
     events = selectors.EVENT_READ | selectors.EVENT_WRITE
     data = types.SimpleNamespace(
         addr=ip,
-        payload=payload,
+        jobs=jobs,
+        job=jobs[0] if len(jobs) == 1 else None,
+        scheduler=scheduler,
         bytes_sent=0,
-        checksum=checksum,
-        status=WriteStatusCode.INIT
+        # unknown until the device reports its installed image checksum
+        use_patch=use_patch if jobs[0].patch is not None else False,
+        reconnects=reconnects,
+        reboots=reboots,
+        status=WriteStatusCode.INIT,
+        stats=b''
     )
     select.register(sock, events, data=data)
 
 
+# reconnect if the connection dropped while sending a resumable payload, which the device
+# will continue from its last committed sector
+def handle_disconnect(select, sock, data):
+    print(f'unexpected disconnect from client: {data.addr}')
+    delete_socket(select, sock)
+    sending = data.status in (WriteStatusCode.PAYLOAD_READY, WriteStatusCode.PAYLOAD_SENT)
+    if sending and is_resumable(data) and data.reconnects > 0:
+        print(f"ota server @ {data.addr}: reconnecting to resume upload")
+        add_socket(data.addr, data.jobs, select, data.scheduler, data.use_patch, data.reconnects - 1,
+                   data.reboots)
+        return FlashResultCode.LOADING
+    return FlashResultCode.FAILURE
+
+
 # TODO: properly handle different results instead of just printing
 def handle_read_event(select, sock, data):
-    response = sock.recv(8)  # response should never be more than 5 bytes
-    if (len(response) == 0):  # not sure if this can happen through select
-        print(f'unexpected disconnect from client: {data.addr}')
+    try:
+        buf = sock.recv(STATS_RESPONSE_SIZE)  # the largest response
+    except OSError:
+        buf = b''
+    if (len(buf) == 0):  # not sure if this can happen through select
+        if data.status == WriteStatusCode.AWAIT_STATS:
+            # the upload succeeded, but the device is too old to report stats
+            delete_socket(select, sock)
+            return FlashResultCode.SUCCESS
+        return handle_disconnect(select, sock, data)
+
+    # the upload already succeeded; the stats may take more than one read, and only the first starts
+    # with a status
+    if data.status == WriteStatusCode.AWAIT_STATS:
+        data.stats += buf
+        if len(data.stats) < STATS_RESPONSE_SIZE:
+            return FlashResultCode.LOADING
+        print(f"ota server @ {data.addr}: upload stats\n{format_stats(data.stats)}")
         delete_socket(select, sock)
-        return FlashResultCode.FAILURE
-    else:
-        response = get_response_status(response)
+        return FlashResultCode.SUCCESS
+
+    response = get_response_status(buf)
+
+    # device reported its installed image - patch it if it is the base we diffed against
+    if data.status == WriteStatusCode.AWAIT_INFO:
+        if data.job is None:
+            slot = get_info_target_slot(buf)
+            if slot >= len(data.jobs):
+                print(f"ota server @ {data.addr}: no binary given for slot {slot}")
+                delete_socket(select, sock)
+                return FlashResultCode.FAILURE
+            data.job = data.jobs[slot]
+        if data.use_patch is None:
+            data.use_patch = response == OtaResponseCode.SUCCESS and \
+                get_info_checksum(buf) == data.job.base_checksum
+            if not data.use_patch:
+                print(f"ota server @ {data.addr}: not running the base image, sending full image")
+        data.status = WriteStatusCode.INIT
+        return FlashResultCode.LOADING
 
     # no errors yet - continue
     if response == OtaResponseCode.SUCCESS:
         if data.status == WriteStatusCode.AWAIT_RESPONSE:
             data.status = WriteStatusCode.PAYLOAD_READY
-            data.bytes_sent = 0
+            data.bytes_sent = get_resume_offset(buf) if is_resumable(data) else 0
+            if data.bytes_sent:
+                print(f"ota server @ {data.addr}: resuming upload at byte {data.bytes_sent}")
         elif data.status == WriteStatusCode.PAYLOAD_SENT:
             print(f"payload sent successfully! closing connection with {
                   data.addr}")
-            delete_socket(select, sock)
-            return FlashResultCode.SUCCESS
+            # the device reboots once the connection closes, so ask where the time went first
+            sock.send(pack_request(0, 0, OtaRequestType.STATS))
+            data.status = WriteStatusCode.AWAIT_STATS
+            return FlashResultCode.LOADING
 
-    # ota server is rebooting into wifi bootloader - we must reconnect
+    # ota server is rebooting into wifi bootloader - reconnect once it says it is ready
     elif response == OtaResponseCode.REBOOTING:
         delete_socket(select, sock)
-        add_socket(data.addr, data.payload, data.checksum, select)
+        if data.reboots == 0:
+            print(f"ota server @ {data.addr}: rebooted {MAX_REBOOTS} times without reaching the bootloader")
+            return FlashResultCode.FAILURE
+        print(f"ota server @ {data.addr}: rebooting into bootloader")
+        data.scheduler.beacons.wait(data.addr, (data.use_patch, data.reboots - 1))
+        return FlashResultCode.LOADING
+
+    # installed image changed since it was queried - fall back to the full image
+    elif response == OtaResponseCode.BASE_MISMATCH:
+        print(f"ota server @ {data.addr}: base image mismatch, sending full image")
+        data.use_patch = False
+        data.status = WriteStatusCode.INIT
+        return FlashResultCode.LOADING
 
     # fatal error
     elif response == OtaResponseCode.STORAGE_FULL:
@@ -122,6 +355,15 @@ def handle_read_event(select, sock, data):
     elif response == OtaResponseCode.CHECKSUM_FAILED:
         print(f"ota server @ {data.addr}: checksum failed")
         delete_socket(select, sock)
+    elif response == OtaResponseCode.WRITE_FAILED:
+        print(f"ota server @ {data.addr}: flash write failed")
+        delete_socket(select, sock)
+    elif response == OtaResponseCode.WRONG_SLOT:
+        print(f"ota server @ {data.addr}: binary was not built for the slot being written")
+        delete_socket(select, sock)
+    elif response == OtaResponseCode.BUSY:
+        print(f"ota server @ {data.addr}: busy with another upload")
+        delete_socket(select, sock)
 
     return FlashResultCode.FAILURE
 
@@ -129,55 +371,539 @@ def handle_read_event(select, sock, data):
 # there are two types of write events
 # we either request to send the data or we actually send the data
 def handle_write_event(select, sock, data):
-    if data.status == WriteStatusCode.INIT:
-        sent = sock.send(pack_request(
-            len(data.payload[data.bytes_sent:]), data.checksum))
-        data.bytes_sent += sent
+    job = data.job
+    if data.status == WriteStatusCode.INIT and (job is None or data.use_patch is None):
+        base = data.jobs[0].base
+        sock.send(pack_request(len(base) if base is not None else 0, 0, OtaRequestType.INFO))
+        data.status = WriteStatusCode.AWAIT_INFO
+
+    elif data.status == WriteStatusCode.INIT:
+        if data.use_patch:
+            request = pack_delta_request(
+                len(job.patch), job.checksum, len(job.image), len(job.base), job.base_checksum)
+        elif job.compressed is not None:
+            request = pack_compressed_request(len(job.compressed), job.checksum, len(job.image))
+        else:
+            request = pack_request(len(job.image), job.checksum, OtaRequestType.RESUME)
+        sock.send(request)
         # sent error check?
         data.status = WriteStatusCode.AWAIT_RESPONSE
 
     elif data.status == WriteStatusCode.PAYLOAD_READY:
-        sent = sock.send(data.payload[data.bytes_sent:])
+        payload = get_payload(data)
+        size = data.scheduler.take_budget(min(len(payload) - data.bytes_sent, SEND_CHUNK_SIZE))
+        if not size:
+            return
+        try:
+            sent = sock.send(payload[data.bytes_sent:data.bytes_sent + size])
+        except OSError:
+            return handle_disconnect(select, sock, data)
         data.bytes_sent += sent
-        if data.bytes_sent == len(data.payload):
+        data.scheduler.record_sent(data.addr, sent)
+        if data.bytes_sent == len(payload):
             data.status = WriteStatusCode.PAYLOAD_SENT
 
 
-def event_loop(select, result_map):
-    while len(select.get_map()):  # exit when all sockets are closed
-        events = select.select(20)
-        if not events:
+# addresses of the devices with a connection, leaving out the beacon listener
+def connected_addrs(select):
+    return {key.data.addr for key in select.get_map().values() if key.data is not None}
+
+
+def event_loop(select, result_map, scheduler):
+    while True:
+        scheduler.update(select, connected_addrs(select))
+        # exit when all sockets are closed and nothing is waiting
+        if not connected_addrs(select) and not scheduler.beacons.waiting:
+            if scheduler.has_waiting():
+                continue
+            break
+        if scheduler.throttled():
+            time.sleep(scheduler.budget_wait())
+        events = select.select(scheduler.beacons.timeout(20))
+        if not events and not scheduler.beacons.waiting:
             print("event queue reached timeout - check your connection")
             break
         for key, mask in events:
             sock = key.fileobj
             data = key.data
+            if data is None:  # beacons are collected by the scheduler
+                continue
             if mask & selectors.EVENT_READ:
                 result_map[data.addr] = handle_read_event(select, sock, data)
-            if mask & selectors.EVENT_WRITE:
-                handle_write_event(select, sock, data)
+            if mask & selectors.EVENT_WRITE and sock.fileno() != -1:
+                result = handle_write_event(select, sock, data)
+                if result is not None:
+                    result_map[data.addr] = result
     print("exiting event loop")
 
 
-def flash_to_all(firmware_path, ip_addresses):
-    payload = read_bin(firmware_path)
-    checksum = make_checksum(payload)
-    select = selectors.DefaultSelector()
+# asks the devices at the listed addresses, and with broadcast any others on the local network, what
+# they are running; returns the answers by address, as listed where the device was
+def discover(ip_addresses, broadcast=False):
+    listed = {}
+    for addr in ip_addresses:
+        try:
+            listed[socket.gethostbyname(addr)] = addr
+        except OSError as e:
+            print(f"ota server @ {addr}: {e}")
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    sock.bind(('', 0))
+    fleet = {}
+    for _ in range(DISCOVERY_ATTEMPTS):
+        targets = [ip for ip, addr in listed.items() if addr not in fleet]
+        if broadcast:
+            targets.append("255.255.255.255")
+        elif not targets:
+            break
+        for target in targets:
+            try:
+                sock.sendto(b'OTDQ', (target, DISCOVERY_PORT))
+            except OSError as e:
+                print(f"cannot query {target}: {e}")
+        deadline = time.monotonic() + DISCOVERY_TIMEOUT
+        while time.monotonic() < deadline:
+            sock.settimeout(max(deadline - time.monotonic(), 0.001))
+            try:
+                buf, (ip, _) = sock.recvfrom(64)
+            except socket.timeout:
+                break
+            if len(buf) < struct.calcsize(DISCOVERY_INFO_FORMAT) or buf[0:4] != b'OTDI':
+                continue
+            fields = struct.unpack_from(DISCOVERY_INFO_FORMAT, buf)
+            fleet[listed.get(ip, ip)] = types.SimpleNamespace(
+                board_id=fields[1].hex(),
+                ota_port=fields[2],
+                in_bootloader=bool(fields[3]),
+                active_slot=fields[4],
+                target_slot=fields[5],
+                rssi=fields[6],
+                # both 0 if the device does not know what it is running
+                image_size=fields[7],
+                image_checksum=fields[8],
+                max_image_size=fields[9]
+            )
+    sock.close()
+    return fleet
+
+
+def print_inventory(fleet):
+    for addr, info in sorted(fleet.items()):
+        image = f"{info.image_size} bytes, crc {info.image_checksum:08x}" if info.image_size else "unknown image"
+        print(f"ota server @ {addr}: board {info.board_id}, "
+              f"{'bootloader' if info.in_bootloader else 'user program'}, {image} in slot {info.active_slot}, "
+              f"takes up to {info.max_image_size} bytes, {info.rssi} dBm")
+
+
+# a device is up to date if it runs the binary built for the slot it runs from
+def is_up_to_date(info, jobs):
+    if not info.image_size or info.active_slot >= len(jobs):
+        return False
+    job = jobs[info.active_slot]
+    return info.image_size == len(job.image) and info.image_checksum == job.checksum
+
+
+# takes inventory of the fleet, adding devices which answer a broadcast query with discover_all,
+# and leaves out those already up to date unless forced; returns the devices to send to
+def choose_devices(jobs, ip_addresses, result_map, discover_all=False, force=False):
+    fleet = discover(ip_addresses, broadcast=discover_all)
+    print_inventory(fleet)
+    chosen = list(ip_addresses)
+    if discover_all:
+        chosen += sorted(addr for addr in fleet if addr not in ip_addresses)
+    for addr in list(chosen):
+        # devices which do not answer, such as those with older firmware, are sent to anyway
+        if not force and addr in fleet and is_up_to_date(fleet[addr], jobs):
+            print(f"ota server @ {addr}: already running this binary, skipping")
+            chosen.remove(addr)
+            result_map[addr] = FlashResultCode.SUCCESS
+        else:
+            result_map[addr] = FlashResultCode.FAILURE
+    return chosen
+
+
+# image to send, plus an optional patch against a base image which devices may already be running
+def make_job(firmware_path, base_path=None, compress=False):
+    image = read_bin(firmware_path)
+    job = types.SimpleNamespace(
+        image=image,
+        checksum=make_checksum(image),
+        compressed=None,
+        base=None,
+        base_checksum=None,
+        patch=None
+    )
+    if compress:
+        job.compressed = lzss.compress(image)
+        print(f"compressed to {len(job.compressed)} bytes ({len(image)} bytes full image)")
+    if base_path:
+        job.base = read_bin(base_path)
+        job.base_checksum = make_checksum(job.base)
+        job.patch = delta.make_patch(job.base, image)
+        print(f"patch is {len(job.patch)} bytes ({len(image)} bytes full image)")
+    return job
+
+
+# listens for the ready beacons devices broadcast once their ota server listens, so that a device
+# rebooting into the bootloader is reconnected to as soon as it is back, rather than by retrying
+class BeaconListener:
+    def __init__(self):
+        # devices waiting for their beacon, with the time to give up and what to reconnect with
+        self.waiting = {}
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        try:
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            self.sock.bind(('', DISCOVERY_PORT))
+        except OSError as e:
+            print(f"cannot listen for ready beacons, waiting {REBOOT_DELAY} s for reboots instead: {e}")
+            self.sock.close()
+            self.sock = None
+            return
+        self.sock.setblocking(False)
+
+    def register(self, select):
+        if self.sock:
+            select.register(self.sock, selectors.EVENT_READ, data=None)
+
+    def close(self):
+        if self.sock:
+            self.sock.close()
+
+    def wait(self, ip, reconnect_with):
+        self.waiting[ip] = (time.monotonic() + (BEACON_TIMEOUT if self.sock else REBOOT_DELAY), reconnect_with)
+
+    # seconds until the next device runs out of time, for the event loop to wake up by
+    def timeout(self, default):
+        if not self.waiting:
+            return default
+        deadline = min(deadline for deadline, _ in self.waiting.values())
+        return min(max(deadline - time.monotonic(), 0), default)
+
+    # returns the devices to reconnect to now, with what to reconnect with: those whose bootloader
+    # sent its beacon, and those out of time
+    def take_ready(self):
+        ready = {}
+        while self.sock:
+            try:
+                buf, (ip, _) = self.sock.recvfrom(64)
+            except BlockingIOError:
+                break
+            # user programs send beacons too, but only the bootloader's means the reboot is done
+            if ip in self.waiting and len(buf) >= 7 and buf[0:4] == b'OTDR' and buf[6]:
+                ready[ip] = self.waiting.pop(ip)[1]
+        now = time.monotonic()
+        for ip, (deadline, reconnect_with) in list(self.waiting.items()):
+            if deadline <= now:
+                if self.sock:
+                    print(f"ota server @ {ip}: no ready beacon, connecting anyway")
+                ready[ip] = reconnect_with
+                del self.waiting[ip]
+        return ready
+
+    # blocks until the device is ready to be reconnected to
+    def wait_for(self, ip):
+        self.wait(ip, None)
+        with selectors.DefaultSelector() as select:
+            self.register(select)
+            while ip not in self.take_ready():
+                if self.sock:
+                    select.select(self.timeout(1.0))
+                else:
+                    time.sleep(self.timeout(1.0))
+
+
+# starts devices group by group, keeping each group's concurrency at the level which gets the most
+# bytes through it, within an optional aggregate bandwidth cap (bytes per second)
+class RolloutScheduler:
+    def __init__(self, jobs, ip_addresses, max_concurrency, bandwidth_cap=None, subnet_prefix=None):
+        if bandwidth_cap is not None and bandwidth_cap < SEND_CHUNK_SIZE:
+            raise ValueError(f"bandwidth cap must be at least {SEND_CHUNK_SIZE} bytes per second")
+        self.jobs = jobs
+        self.max_concurrency = max_concurrency
+        self.bandwidth_cap = bandwidth_cap
+        self.beacons = BeaconListener()
+        self.tokens = 0.0
+        self.last_refill = time.monotonic()
+        self.groups = {}
+        self.group_of = {}
+        for ip in ip_addresses:
+            key = self.group_key(ip, subnet_prefix)
+            group = self.groups.setdefault(key, types.SimpleNamespace(
+                waiting=collections.deque(),
+                active=set(),
+                limit=min(ROLLOUT_START_CONCURRENCY, max_concurrency),
+                bytes_sent=0,
+                window_start=time.monotonic(),
+                last_rate=None,
+                direction=1
+            ))
+            group.waiting.append(ip)
+            self.group_of[ip] = group
+
+    # devices in the same subnet are assumed to share an AP, and so its airtime
+    @staticmethod
+    def group_key(ip, subnet_prefix):
+        if subnet_prefix is None:
+            return None
+        try:
+            return ipaddress.ip_network(f"{ip}/{subnet_prefix}", strict=False)
+        except ValueError:
+            return ip  # hostnames get a group each
+
+    def has_waiting(self):
+        return any(group.waiting for group in self.groups.values())
+
+    def record_sent(self, ip, size):
+        self.group_of[ip].bytes_sent += size
+
+    # returns how many of the wanted bytes may be sent now
+    def take_budget(self, wanted):
+        if self.bandwidth_cap is None:
+            return wanted
+        now = time.monotonic()
+        # allow a short burst, but do not let unused budget pile up
+        self.tokens = min(self.tokens + (now - self.last_refill) * self.bandwidth_cap,
+                          max(self.bandwidth_cap / 10, 1))
+        self.last_refill = now
+        size = int(min(wanted, self.tokens))
+        self.tokens -= size
+        return size
+
+    def throttled(self):
+        return self.bandwidth_cap is not None and self.tokens < 1
+
+    def budget_wait(self):
+        return min(SEND_CHUNK_SIZE / self.bandwidth_cap, 0.05)
+
+    # hill-climb each group's concurrency: keep moving while throughput improves, turn back when
+    # it gets worse
+    def adapt(self, group, now):
+        elapsed = now - group.window_start
+        if elapsed < ROLLOUT_ADAPT_INTERVAL or not group.active:
+            return
+        rate = group.bytes_sent / elapsed
+        group.bytes_sent = 0
+        group.window_start = now
+
+        if group.last_rate is not None:
+            if rate < group.last_rate * (1 - ROLLOUT_ADAPT_THRESHOLD):
+                group.direction = -group.direction
+            elif rate < group.last_rate * (1 + ROLLOUT_ADAPT_THRESHOLD):
+                group.direction = 1  # no real change, so probe for more
+        group.last_rate = rate
+        group.limit = max(1, min(self.max_concurrency, group.limit + group.direction))
+
+    # called each time around the event loop with the devices which still have a connection;
+    # reconnects rebooted devices, frees up slots of finished devices and starts waiting ones
+    def update(self, select, connected):
+        now = time.monotonic()
+        for ip, (use_patch, reboots) in self.beacons.take_ready().items():
+            add_socket(ip, self.jobs, select, self, use_patch, reboots=reboots)
+            connected.add(ip)
+        # devices rebooting into the bootloader keep their slot
+        connected |= self.beacons.waiting.keys()
+        for group in self.groups.values():
+            group.active &= connected
+            self.adapt(group, now)
+            while group.waiting and len(group.active) < group.limit:
+                ip = group.waiting.popleft()
+                group.active.add(ip)
+                add_socket(ip, self.jobs, select, self)
+
+
+def flash_to_all(firmware_path, ip_addresses, base_path=None, compress=False, slot_b_path=None,
+                 max_concurrency=4, bandwidth_cap=None, subnet_prefix=None, discover_all=False, force=False):
+    jobs = [make_job(firmware_path, base_path, compress)]
+    if slot_b_path:
+        jobs.append(make_job(slot_b_path, base_path, compress))
+    start = time.monotonic()
     result_map = {}
+    ip_addresses = choose_devices(jobs, ip_addresses, result_map, discover_all, force)
+    select = selectors.DefaultSelector()
+    scheduler = RolloutScheduler(jobs, ip_addresses, max_concurrency, bandwidth_cap, subnet_prefix)
+    scheduler.beacons.register(select)
+    event_loop(select, result_map, scheduler)
+    scheduler.beacons.close()
+    succeeded = sum(result_map[ip] == FlashResultCode.SUCCESS for ip in ip_addresses)
+    skipped = len(result_map) - len(ip_addresses)
+    print(f"{succeeded} of {len(ip_addresses)} devices updated, {skipped} already up to date, "
+          f"in {time.monotonic() - start:.1f} s")
+    return result_map
+
+
+# ask each device over TCP to join the multicast session for the binary built for its target slot,
+# waiting for devices running a user program to reboot into the bootloader first
+# returns the devices which joined, grouped by the index of the job they joined for
+def join_multicast(jobs, ip_addresses):
+    joined = {}
+    beacons = BeaconListener()
     for ip in ip_addresses:
-        add_socket(ip, payload, checksum, select)
-        result_map[ip] = FlashResultCode.FAILURE
-    event_loop(select, result_map)
+        for attempt in range(RECONNECT_ATTEMPTS + 1):
+            try:
+                with socket.create_connection((ip, OTA_PORT), timeout=10) as sock:
+                    sock.sendall(pack_request(0, 0, OtaRequestType.INFO))
+                    slot = get_info_target_slot(sock.recv(16))
+                    if slot >= len(jobs):
+                        print(f"ota server @ {ip}: no binary given for slot {slot}")
+                        break
+                    job = jobs[slot]
+                    sock.sendall(pack_request(len(job.image), job.checksum, OtaRequestType.MULTICAST))
+                    response = get_response_status(sock.recv(16))
+            except OSError as e:
+                print(f"ota server @ {ip}: {e}")
+                response = None
+
+            if response == OtaResponseCode.SUCCESS:
+                joined.setdefault(slot, []).append(ip)
+                break
+            elif response == OtaResponseCode.REBOOTING:
+                print(f"ota server @ {ip}: rebooting into bootloader")
+                beacons.wait_for(ip)
+            elif response is not None:
+                print(f"ota server @ {ip}: could not join multicast ({response})")
+                break
+    beacons.close()
+    return joined
+
+
+def pack_multicast_header(packet_type, checksum):
+    return b'OTM' + bytes([packet_type]) + pack_uint32(checksum)
+
+
+def send_multicast_sectors(sock, job, sectors, interval):
+    for sector in sorted(sectors):
+        start = sector * FLASH_SECTOR_SIZE
+        end = min(start + FLASH_SECTOR_SIZE, len(job.image))
+        for chunk, pos in enumerate(range(start, end, MULTICAST_CHUNK_SIZE)):
+            packet = pack_multicast_header(MulticastPacketType.DATA, job.checksum)
+            packet += struct.pack("<HBB", sector, chunk, 0)
+            packet += job.image[pos:min(pos + MULTICAST_CHUNK_SIZE, end)]
+            sock.sendto(packet, (MULTICAST_GROUP, MULTICAST_PORT))
+            # multicast is not flow controlled, so leave time for devices to keep up
+            time.sleep(interval)
+
+
+# returns the status and missing sectors reported by each device which answered
+def query_multicast(sock, job, ip_addresses):
+    statuses = {}
+    for _ in range(MULTICAST_QUERY_ATTEMPTS):
+        sock.sendto(pack_multicast_header(MulticastPacketType.QUERY, job.checksum),
+                    (MULTICAST_GROUP, MULTICAST_PORT))
+        deadline = time.monotonic() + MULTICAST_QUERY_TIMEOUT
+        while len(statuses) < len(ip_addresses) and time.monotonic() < deadline:
+            sock.settimeout(max(deadline - time.monotonic(), 0.001))
+            try:
+                buf, (ip, _) = sock.recvfrom(2048)
+            except socket.timeout:
+                break
+            if ip not in ip_addresses or len(buf) < 11 or buf[0:4] != b'OTMS' or \
+                    int.from_bytes(buf[4:8], byteorder="little") != job.checksum:
+                continue
+            status = buf[8]
+            bitmap = buf[11:]
+            missing = {sector for sector in range(len(bitmap) * 8)
+                       if bitmap[sector // 8] & (1 << (sector % 8))}
+            statuses[ip] = (status, missing)
+        if len(statuses) == len(ip_addresses):
+            break
+    return statuses
+
+
+# sends the image to every joined device at once, then only the sectors they report missing, until
+# all are complete or the rounds run out
+def flash_multicast_session(job, ip_addresses, interval, result_map):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, 1)
+    sock.bind(('', 0))
+
+    sector_count = (len(job.image) + FLASH_SECTOR_SIZE - 1) // FLASH_SECTOR_SIZE
+    missing = set(range(sector_count))
+    pending = set(ip_addresses)
+    for round_index in range(MULTICAST_MAX_ROUNDS):
+        print(f"multicast round {round_index + 1}: sending {len(missing)} sectors to {len(pending)} devices")
+        send_multicast_sectors(sock, job, missing, interval)
+
+        statuses = query_multicast(sock, job, pending)
+        missing = set()
+        for ip in list(pending):
+            if ip not in statuses:
+                print(f"ota server @ {ip}: no status reported")
+                continue
+            status, device_missing = statuses[ip]
+            if status == MulticastStatus.RECEIVING:
+                missing |= device_missing
+                continue
+            pending.discard(ip)
+            if status == MulticastStatus.COMPLETE:
+                result_map[ip] = FlashResultCode.SUCCESS
+            else:
+                print(f"ota server @ {ip}: multicast failed ({MulticastStatus(status).name})")
+
+        # devices which have not answered are sent everything again
+        if any(ip not in statuses for ip in pending):
+            missing = set(range(sector_count))
+        if not pending:
+            break
+
+    # complete devices reboot into the new image, and are not expected to answer
+    for _ in range(MULTICAST_QUERY_ATTEMPTS):
+        sock.sendto(pack_multicast_header(MulticastPacketType.FINISH, job.checksum),
+                    (MULTICAST_GROUP, MULTICAST_PORT))
+    sock.close()
+
+
+def flash_multicast(firmware_path, ip_addresses, slot_b_path=None, interval=0.005, discover_all=False,
+                    force=False):
+    jobs = [make_job(firmware_path)]
+    if slot_b_path:
+        jobs.append(make_job(slot_b_path))
+    result_map = {}
+    ip_addresses = choose_devices(jobs, ip_addresses, result_map, discover_all, force)
+    for slot, joined in join_multicast(jobs, ip_addresses).items():
+        flash_multicast_session(jobs[slot], joined, interval, result_map)
     return result_map
 
 
 def main():
-    if len(sys.argv) < 3:
-        print("usage: python flash.py addr1 [.. addrN] binary")
-        return
-    addreses = sys.argv[1:-1]
-    path = sys.argv[-1:][0]
-    results = flash_to_all(path, addreses)
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--base", help="binary the devices are expected to be running; "
+                        "if they are, only a patch against it is sent")
+    parser.add_argument("--compress", action="store_true",
+                        help="compress the binary when sending it in full")
+    parser.add_argument("--slot-b", help="binary built for slot B, sent instead to devices with "
+                        "A/B slots which are running slot A")
+    parser.add_argument("--multicast", action="store_true",
+                        help="send the binary once to all devices over multicast, rather than to each "
+                        "over TCP (--base and --compress do not apply)")
+    parser.add_argument("--multicast-interval", type=float, default=0.005,
+                        help="seconds between multicast packets, so that devices keep up")
+    parser.add_argument("--concurrency", type=int, default=4,
+                        help="most devices in a group to send to at once; the number actually used "
+                        "adapts to the throughput observed")
+    parser.add_argument("--bandwidth-cap", type=int,
+                        help="most bytes per second to send across all devices")
+    parser.add_argument("--subnet-prefix", type=int,
+                        help="group devices by subnet of this prefix length, assuming each subnet is "
+                        "a separate AP, so that concurrency is limited per group")
+    parser.add_argument("--all", action="store_true",
+                        help="also send to every device on the local network which answers a broadcast "
+                        "inventory query")
+    parser.add_argument("--force", action="store_true",
+                        help="send even to devices which report that they already run the binary")
+    parser.add_argument("addresses", nargs="*")
+    parser.add_argument("binary")
+    args = parser.parse_args()
+    if not args.addresses and not args.all:
+        parser.error("give the addresses of the devices to send to, or --all")
+    if args.bandwidth_cap is not None and args.bandwidth_cap < SEND_CHUNK_SIZE:
+        parser.error(f"--bandwidth-cap must be at least {SEND_CHUNK_SIZE} bytes per second")
+    if args.multicast:
+        results = flash_multicast(args.binary, args.addresses, args.slot_b, args.multicast_interval,
+                                  args.all, args.force)
+    else:
+        results = flash_to_all(args.binary, args.addresses, args.base, args.compress, args.slot_b,
+                               args.concurrency, args.bandwidth_cap, args.subnet_prefix, args.all,
+                               args.force)
     print(results)
 
 
@@ -0,0 +1,107 @@
+// Compresses payloads for the OTA server's compressed request (see include/pico_wifi_boot/lzss.h)
+
+// Must match the bootloader's decoder
+const DISTANCE_BITS = 11;
+const WINDOW_SIZE = 1 << DISTANCE_BITS;
+const MIN_MATCH = 3;
+const LENGTH_FIELD_MAX = (1 << (16 - DISTANCE_BITS)) - 1;
+
+// Previous positions remembered per 3-byte prefix
+const MAX_CANDIDATES = 8;
+
+function prefixKey(data, pos) {
+  return (data[pos] << 16) | (data[pos + 1] << 8) | data[pos + 2];
+}
+
+function matchLength(data, src, pos) {
+  let length = 0;
+  const limit = data.length - pos;
+  while (length < limit && data[src + length] == data[pos + length]) {
+    length++;
+  }
+  return length;
+}
+
+function compress(data) {
+  const out = [];
+  const chains = new Map();
+  let flagsPos = 0;
+  let items = 8;
+
+  function remember(pos) {
+    if (pos + MIN_MATCH > data.length) {
+      return;
+    }
+    const key = prefixKey(data, pos);
+    let chain = chains.get(key);
+    if (!chain) {
+      chain = [];
+      chains.set(key, chain);
+    }
+    if (chain.length == MAX_CANDIDATES) {
+      chain.shift();
+    }
+    chain.push(pos);
+  }
+
+  function findMatch(pos) {
+    let best = {distance: 0, length: 0};
+    const candidates = [];
+    if (pos + MIN_MATCH <= data.length) {
+      candidates.push(...(chains.get(prefixKey(data, pos)) || []));
+    }
+    // Distance 1 covers runs of a repeated byte
+    if (pos > 0) {
+      candidates.push(pos - 1);
+    }
+    for (const src of candidates) {
+      if (pos - src > WINDOW_SIZE) {
+        continue;
+      }
+      const length = matchLength(data, src, pos);
+      if (length > best.length) {
+        best = {distance: pos - src, length};
+      }
+    }
+    return best;
+  }
+
+  let pos = 0;
+  while (pos < data.length) {
+    if (items == 8) {
+      flagsPos = out.length;
+      out.push(0);
+      items = 0;
+    }
+
+    const match = findMatch(pos);
+    if (match.length < MIN_MATCH) {
+      out[flagsPos] |= 1 << items;
+      out.push(data[pos]);
+      remember(pos);
+      pos++;
+    } else {
+      const lengthField = Math.min(match.length - MIN_MATCH, LENGTH_FIELD_MAX);
+      const token = (match.distance - 1) | (lengthField << DISTANCE_BITS);
+      out.push(token & 0xFF, token >> 8);
+      if (lengthField == LENGTH_FIELD_MAX) {
+        let extra = match.length - MIN_MATCH - LENGTH_FIELD_MAX;
+        while (extra >= 255) {
+          out.push(255);
+          extra -= 255;
+        }
+        out.push(extra);
+      }
+      // Only index the tail of long matches, which is all the window can reach
+      for (let matchPos = Math.max(pos, pos + match.length - WINDOW_SIZE); matchPos < pos + match.length; matchPos++) {
+        remember(matchPos);
+      }
+      pos += match.length;
+    }
+    items++;
+  }
+
+  return Buffer.from(out);
+}
+
+module.exports = { compress };
@@ -0,0 +1,115 @@
+# compresses payloads for the ota server's compressed request (see include/pico_wifi_boot/lzss.h)
+
+# must match the bootloader's decoder
+DISTANCE_BITS = 11
+WINDOW_SIZE = 1 << DISTANCE_BITS
+MIN_MATCH = 3
+LENGTH_FIELD_MAX = (1 << (16 - DISTANCE_BITS)) - 1
+
+# previous positions remembered per 3-byte prefix
+MAX_CANDIDATES = 8
+
+
+def match_length(data, src, pos):
+    length = 0
+    limit = len(data) - pos
+    # compare in blocks first, since long runs of padding are common
+    while length + 64 <= limit and data[src + length:src + length + 64] == data[pos + length:pos + length + 64]:
+        length += 64
+    while length < limit and data[src + length] == data[pos + length]:
+        length += 1
+    return length
+
+
+def find_match(data, pos, chains):
+    best_distance, best_len = 0, 0
+
+    # distance 1 covers runs of a repeated byte
+    candidates = chains.get(data[pos:pos + MIN_MATCH], [])
+    if pos > 0:
+        candidates = [pos - 1] + candidates
+
+    for src in reversed(candidates):
+        if pos - src > WINDOW_SIZE:
+            continue
+        length = match_length(data, src, pos)
+        if length > best_len:
+            best_distance, best_len = pos - src, length
+
+    return best_distance, best_len
+
+
+def remember(data, pos, chains):
+    chain = chains.setdefault(data[pos:pos + MIN_MATCH], [])
+    if len(chain) == MAX_CANDIDATES:
+        chain.pop(0)
+    chain.append(pos)
+
+
+def compress(data):
+    out = bytearray()
+    chains = {}
+    flags_pos = 0
+    items = 8
+
+    pos = 0
+    while pos < len(data):
+        if items == 8:
+            flags_pos = len(out)
+            out.append(0)
+            items = 0
+
+        distance, length = find_match(data, pos, chains)
+        if length < MIN_MATCH:
+            out[flags_pos] |= 1 << items
+            out.append(data[pos])
+            remember(data, pos, chains)
+            pos += 1
+        else:
+            length_field = min(length - MIN_MATCH, LENGTH_FIELD_MAX)
+            token = (distance - 1) | (length_field << DISTANCE_BITS)
+            out += token.to_bytes(length=2, byteorder="little")
+            if length_field == LENGTH_FIELD_MAX:
+                extra = length - MIN_MATCH - LENGTH_FIELD_MAX
+                while extra >= 255:
+                    out.append(255)
+                    extra -= 255
+                out.append(extra)
+            # only index the tail of long matches, which is all the window can reach
+            for match_pos in range(max(pos, pos + length - WINDOW_SIZE), pos + length):
+                remember(data, match_pos, chains)
+            pos += length
+        items += 1
+
+    return bytes(out)
+
+
+# reference implementation of the bootloader's decoder, for checking compressed payloads
+def decompress(data):
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        flags = data[pos]
+        pos += 1
+        for item in range(8):
+            if pos >= len(data):
+                break
+            if flags & (1 << item):
+                out.append(data[pos])
+                pos += 1
+                continue
+            token = int.from_bytes(data[pos:pos + 2], byteorder="little")
+            pos += 2
+            distance = (token & (WINDOW_SIZE - 1)) + 1
+            length_field = token >> DISTANCE_BITS
+            length = length_field + MIN_MATCH
+            if length_field == LENGTH_FIELD_MAX:
+                while True:
+                    extra = data[pos]
+                    pos += 1
+                    length += extra
+                    if extra != 255:
+                        break
+            for _ in range(length):
+                out.append(out[-distance])
+    return bytes(out)
@@ -0,0 +1,636 @@
+// Native fleet uploader for pico-wifi-boot. Streams one binary to many devices at once from a
+// single epoll loop, sending straight from the page cache with sendfile. Devices already running the
+// binary are skipped, unless --force is given.
+//
+// Usage: ota_upload [--force] <user_program_name>.bin <addr1> [.. <addrN>]
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t OTA_PORT = 2222;
+// Times to reconnect after a device reboots or a connection drops
+constexpr int RECONNECT_ATTEMPTS = 10;
+// Devices broadcast ready beacons and answer inventory queries on this port (see ota_discovery.h)
+constexpr uint16_t DISCOVERY_PORT = 2224;
+// A rebooting device is reconnected to as soon as its bootloader's ready beacon arrives. Bootloaders
+// too old to send one are connected to anyway after BEACON_TIMEOUT
+constexpr auto BEACON_TIMEOUT = std::chrono::milliseconds(15000);
+// Devices take a few seconds to reboot into the bootloader and rejoin the network, which is waited
+// for when beacons cannot be listened for
+constexpr auto REBOOT_DELAY = std::chrono::milliseconds(3000);
+constexpr auto RETRY_DELAY = std::chrono::milliseconds(1000);
+// Devices which go quiet for this long are reconnected
+constexpr auto IDLE_TIMEOUT = std::chrono::milliseconds(20000);
+// Times to send the payload again after a checksum failure
+constexpr int CHECKSUM_RETRIES = 3;
+// Times to query devices which have not answered, and how long to wait for answers each time
+constexpr int DISCOVERY_ATTEMPTS = 2;
+constexpr auto DISCOVERY_TIMEOUT = std::chrono::milliseconds(500);
+
+// Beacons are the magic code ("OTDR"), the OTA port and whether the bootloader sent it
+constexpr size_t BEACON_SIZE = 7;
+constexpr size_t BEACON_IN_BOOTLOADER_POS = 6;
+// Answers to queries ("OTDI"), which must match OtaDiscoveryInfo in ota_discovery.c
+constexpr size_t DISCOVERY_INFO_SIZE = 32;
+constexpr size_t DISCOVERY_INFO_IMAGE_SIZE_POS = 20;
+constexpr size_t DISCOVERY_INFO_IMAGE_CHECKSUM_POS = 24;
+// Marks epoll events for the beacon listener rather than a device
+constexpr uint32_t BEACON_EVENT = UINT32_MAX;
+
+// Requests are the magic code ("OTA" followed by the request type), payload size and checksum
+constexpr size_t REQUEST_SIZE = 12;
+constexpr char REQUEST_RESUME = 'R';
+// Resume responses add the offset to continue from to the basic response
+constexpr size_t RESPONSE_SIZE = 5;
+constexpr size_t RESUME_RESPONSE_SIZE = 9;
+
+enum ErrorCode : uint8_t {
+    SUCCESS = 0,
+    STORAGE_FULL = 1,
+    CHECKSUM_FAILED = 2,
+    REBOOTING = 3,
+    BASE_MISMATCH = 4,
+    WRITE_FAILED = 5,
+    WRONG_SLOT = 6,
+    MULTICAST_UNAVAILABLE = 7,
+    BUSY = 8,
+};
+
+const char* error_name(int code) {
+    switch (code) {
+    case SUCCESS: return "success";
+    case STORAGE_FULL: return "storage full";
+    case CHECKSUM_FAILED: return "checksum failed";
+    case REBOOTING: return "rebooting";
+    case BASE_MISMATCH: return "base mismatch";
+    case WRITE_FAILED: return "flash write failed";
+    case WRONG_SLOT: return "binary not built for the target slot";
+    case MULTICAST_UNAVAILABLE: return "multicast unavailable";
+    case BUSY: return "busy with another upload";
+    default: return "unknown error";
+    }
+}
+
+// Standard CRC-32, eight bytes at a time (slicing-by-8)
+class Crc32 {
+public:
+    Crc32() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; bit++) {
+                c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            }
+            tables_[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int t = 1; t < 8; t++) {
+                tables_[t][i] = (tables_[t - 1][i] >> 8) ^ tables_[0][tables_[t - 1][i] & 0xFF];
+            }
+        }
+    }
+
+    uint32_t checksum(const uint8_t* data, size_t len) const {
+        uint32_t crc = 0xFFFFFFFF;
+
+        while (len >= 8) {
+            uint32_t low;
+            uint32_t high;
+            memcpy(&low, data, 4);
+            memcpy(&high, data + 4, 4);
+            low ^= crc;
+            crc = tables_[7][low & 0xFF] ^ tables_[6][(low >> 8) & 0xFF]
+                ^ tables_[5][(low >> 16) & 0xFF] ^ tables_[4][low >> 24]
+                ^ tables_[3][high & 0xFF] ^ tables_[2][(high >> 8) & 0xFF]
+                ^ tables_[1][(high >> 16) & 0xFF] ^ tables_[0][high >> 24];
+            data += 8;
+            len -= 8;
+        }
+
+        while (len--) {
+            crc = tables_[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFF;
+    }
+
+private:
+    uint32_t tables_[8][256];
+};
+
+struct Image {
+    int fd = -1;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    uint32_t checksum = 0;
+};
+
+enum class State {
+    WAITING,
+    CONNECTING,
+    AWAIT_RESUME,
+    SENDING,
+    AWAIT_RESULT,
+    DONE,
+    FAILED,
+};
+
+struct Device {
+    std::string host;
+    sockaddr_in addr = {};
+    int fd = -1;
+    State state = State::WAITING;
+    int reconnects_left = RECONNECT_ATTEMPTS;
+    int checksum_retries_left = CHECKSUM_RETRIES;
+    // Set while rebooting into the bootloader, until its ready beacon arrives or connect_at passes
+    bool awaiting_beacon = false;
+    // Already running the binary, so left alone
+    bool up_to_date = false;
+    // Next payload byte to send, and where the device said an interrupted upload continues from
+    off_t sent = 0;
+    uint32_t resumed = 0;
+    uint8_t response[RESUME_RESPONSE_SIZE];
+    size_t response_len = 0;
+    Clock::time_point connect_at;
+    Clock::time_point last_activity;
+    Clock::time_point payload_start;
+};
+
+bool map_image(const char* path, Image* image) {
+    image->fd = open(path, O_RDONLY);
+    if (image->fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(image->fd, &st) != 0 || st.st_size == 0) {
+        return false;
+    }
+    image->size = st.st_size;
+
+    void* map = mmap(nullptr, image->size, PROT_READ, MAP_PRIVATE, image->fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    madvise(map, image->size, MADV_SEQUENTIAL);
+    image->data = static_cast<const uint8_t*>(map);
+
+    image->checksum = Crc32().checksum(image->data, image->size);
+    return true;
+}
+
+bool resolve(const std::string& host, sockaddr_in* addr) {
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* result;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0) {
+        return false;
+    }
+    *addr = *reinterpret_cast<sockaddr_in*>(result->ai_addr);
+    addr->sin_port = htons(OTA_PORT);
+    freeaddrinfo(result);
+    return true;
+}
+
+// Asks devices over UDP which image they are running, and marks those already running this one as
+// done. Devices which do not answer, such as those with older firmware, are sent to anyway
+void skip_up_to_date(const Image& image, std::vector<Device>& devices) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("query socket");
+        return;
+    }
+
+    std::vector<bool> answered(devices.size());
+    for (int attempt = 0; attempt < DISCOVERY_ATTEMPTS; attempt++) {
+        bool asked = false;
+        for (size_t i = 0; i < devices.size(); i++) {
+            if (!answered[i]) {
+                sockaddr_in addr = devices[i].addr;
+                addr.sin_port = htons(DISCOVERY_PORT);
+                sendto(fd, "OTDQ", 4, 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+                asked = true;
+            }
+        }
+        if (!asked) {
+            break;
+        }
+
+        auto deadline = Clock::now() + DISCOVERY_TIMEOUT;
+        while (true) {
+            int timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+            pollfd readable = {fd, POLLIN, 0};
+            if (timeout_ms <= 0 || poll(&readable, 1, timeout_ms) <= 0) {
+                break;
+            }
+
+            uint8_t info[64];
+            sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t len = recvfrom(fd, info, sizeof(info), 0, reinterpret_cast<sockaddr*>(&from), &from_len);
+            if (len < static_cast<ssize_t>(DISCOVERY_INFO_SIZE) || memcmp(info, "OTDI", 4) != 0) {
+                continue;
+            }
+
+            uint32_t image_size;
+            uint32_t image_checksum;
+            memcpy(&image_size, info + DISCOVERY_INFO_IMAGE_SIZE_POS, 4);
+            memcpy(&image_checksum, info + DISCOVERY_INFO_IMAGE_CHECKSUM_POS, 4);
+            for (size_t i = 0; i < devices.size(); i++) {
+                if (answered[i] || devices[i].addr.sin_addr.s_addr != from.sin_addr.s_addr) {
+                    continue;
+                }
+                answered[i] = true;
+                if (image_size == image.size && image_checksum == image.checksum) {
+                    printf("%s: already running this binary, skipping\n", devices[i].host.c_str());
+                    devices[i].up_to_date = true;
+                    devices[i].state = State::DONE;
+                }
+            }
+        }
+    }
+
+    close(fd);
+}
+
+class Uploader {
+public:
+    Uploader(const Image& image, std::vector<Device>& devices) : image_(image), devices_(devices) {
+        epoll_fd_ = epoll_create1(0);
+        open_beacon_listener();
+    }
+
+    ~Uploader() {
+        if (beacon_fd_ >= 0) {
+            close(beacon_fd_);
+        }
+        close(epoll_fd_);
+    }
+
+    // Runs until every device has finished or failed. Returns the number of devices which failed
+    int run() {
+        std::vector<epoll_event> events(devices_.size() + 1);
+
+        while (true) {
+            auto now = Clock::now();
+            auto next_wake = now + IDLE_TIMEOUT;
+            bool active = false;
+
+            for (auto& device : devices_) {
+                if (device.state == State::WAITING && device.connect_at <= now) {
+                    if (device.awaiting_beacon) {
+                        printf("%s: no ready beacon, connecting anyway\n", device.host.c_str());
+                        device.awaiting_beacon = false;
+                    }
+                    start_connect(device);
+                }
+                if (device.state == State::WAITING) {
+                    next_wake = std::min(next_wake, device.connect_at);
+                } else if (device.state != State::DONE && device.state != State::FAILED) {
+                    if (now - device.last_activity > IDLE_TIMEOUT) {
+                        printf("%s: no response, reconnecting\n", device.host.c_str());
+                        reconnect(device, RETRY_DELAY);
+                    }
+                    next_wake = std::min(next_wake, device.last_activity + IDLE_TIMEOUT);
+                }
+                active = active || (device.state != State::DONE && device.state != State::FAILED);
+            }
+
+            if (!active) {
+                break;
+            }
+
+            int timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(next_wake - now).count();
+            int count = epoll_wait(epoll_fd_, events.data(), events.size(), std::max(timeout_ms, 0) + 1);
+            if (count < 0 && errno != EINTR) {
+                perror("epoll_wait");
+                return devices_.size();
+            }
+
+            for (int i = 0; i < count; i++) {
+                if (events[i].data.u32 == BEACON_EVENT) {
+                    receive_beacons();
+                } else {
+                    handle_event(devices_[events[i].data.u32], events[i].events);
+                }
+            }
+        }
+
+        return std::count_if(devices_.begin(), devices_.end(), [](const Device& device) {
+            return device.state == State::FAILED;
+        });
+    }
+
+private:
+    // Listens for the ready beacons devices broadcast once their OTA server listens, so that a device
+    // rebooting into the bootloader is reconnected to as soon as it is back
+    void open_beacon_listener() {
+        beacon_fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (beacon_fd_ < 0) {
+            return;
+        }
+
+        int reuse = 1;
+        setsockopt(beacon_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(DISCOVERY_PORT);
+        if (bind(beacon_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            printf(
+                "cannot listen for ready beacons, waiting %lld ms for reboots instead: %s\n",
+                static_cast<long long>(REBOOT_DELAY.count()), strerror(errno));
+            close(beacon_fd_);
+            beacon_fd_ = -1;
+            return;
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u32 = BEACON_EVENT;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, beacon_fd_, &event);
+    }
+
+    void receive_beacons() {
+        uint8_t beacon[64];
+        sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t len;
+        while ((len = recvfrom(beacon_fd_, beacon, sizeof(beacon), 0, reinterpret_cast<sockaddr*>(&from), &from_len)) >= 0) {
+            from_len = sizeof(from);
+
+            // User programs send beacons too, but only the bootloader's means the reboot is done
+            if (len < static_cast<ssize_t>(BEACON_SIZE) || memcmp(beacon, "OTDR", 4) != 0
+                || !beacon[BEACON_IN_BOOTLOADER_POS]) {
+                continue;
+            }
+            for (auto& device : devices_) {
+                if (device.awaiting_beacon && device.addr.sin_addr.s_addr == from.sin_addr.s_addr) {
+                    device.awaiting_beacon = false;
+                    device.connect_at = Clock::now();
+                }
+            }
+        }
+    }
+
+    void watch(Device& device, uint32_t events, int op = EPOLL_CTL_MOD) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.u32 = &device - devices_.data();
+        epoll_ctl(epoll_fd_, op, device.fd, &event);
+    }
+
+    void close_connection(Device& device) {
+        if (device.fd >= 0) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, device.fd, nullptr);
+            close(device.fd);
+            device.fd = -1;
+        }
+    }
+
+    void fail(Device& device, const char* reason) {
+        printf("%s: failed (%s)\n", device.host.c_str(), reason);
+        close_connection(device);
+        device.state = State::FAILED;
+    }
+
+    // A full image is requested with resume, so a dropped upload continues where it left off
+    void reconnect(Device& device, Clock::duration delay) {
+        close_connection(device);
+        device.awaiting_beacon = false;
+        if (device.reconnects_left-- <= 0) {
+            fail(device, "out of reconnect attempts");
+            return;
+        }
+        device.state = State::WAITING;
+        device.connect_at = Clock::now() + delay;
+    }
+
+    void start_connect(Device& device) {
+        device.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (device.fd < 0) {
+            fail(device, strerror(errno));
+            return;
+        }
+
+        int err = connect(device.fd, reinterpret_cast<sockaddr*>(&device.addr), sizeof(device.addr));
+        if (err != 0 && errno != EINPROGRESS) {
+            reconnect(device, RETRY_DELAY);
+            return;
+        }
+
+        device.state = State::CONNECTING;
+        device.last_activity = Clock::now();
+        watch(device, EPOLLOUT | EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    void send_request(Device& device) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(device.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            reconnect(device, RETRY_DELAY);
+            return;
+        }
+
+        uint8_t request[REQUEST_SIZE];
+        uint32_t payload_size = image_.size;
+        memcpy(request, "OTA", 3);
+        request[3] = REQUEST_RESUME;
+        memcpy(request + 4, &payload_size, 4);
+        memcpy(request + 8, &image_.checksum, 4);
+
+        if (send(device.fd, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+            reconnect(device, RETRY_DELAY);
+            return;
+        }
+
+        device.state = State::AWAIT_RESUME;
+        device.response_len = 0;
+        watch(device, EPOLLIN);
+    }
+
+    void send_payload(Device& device) {
+        while (device.sent < static_cast<off_t>(image_.size)) {
+            ssize_t sent = sendfile(device.fd, image_.fd, &device.sent, image_.size - device.sent);
+            if (sent < 0) {
+                if (errno != EAGAIN) {
+                    printf("%s: send failed, reconnecting to resume\n", device.host.c_str());
+                    reconnect(device, RETRY_DELAY);
+                }
+                return;
+            }
+        }
+
+        device.state = State::AWAIT_RESULT;
+        device.response_len = 0;
+        watch(device, EPOLLIN);
+    }
+
+    void handle_response(Device& device, int code) {
+        if (device.state == State::AWAIT_RESUME) {
+            if (code == SUCCESS) {
+                memcpy(&device.resumed, device.response + RESPONSE_SIZE, 4);
+                device.sent = device.resumed;
+                device.payload_start = Clock::now();
+                device.state = State::SENDING;
+                device.response_len = 0;
+                if (device.resumed) {
+                    printf("%s: resuming at byte %u\n", device.host.c_str(), device.resumed);
+                }
+                watch(device, EPOLLIN | EPOLLOUT);
+            } else if (code == REBOOTING) {
+                printf("%s: rebooting into bootloader\n", device.host.c_str());
+                reconnect(device, beacon_fd_ >= 0 ? BEACON_TIMEOUT : REBOOT_DELAY);
+                device.awaiting_beacon = beacon_fd_ >= 0 && device.state == State::WAITING;
+            } else {
+                fail(device, error_name(code));
+            }
+            return;
+        }
+
+        if (code == SUCCESS) {
+            double seconds = std::chrono::duration<double>(Clock::now() - device.payload_start).count();
+            size_t bytes = image_.size - device.resumed;
+            printf(
+                "%s: flashed %zu bytes in %.2f s (%.1f KB/s)\n",
+                device.host.c_str(), bytes, seconds, bytes / std::max(seconds, 1e-6) / 1024);
+            close_connection(device);
+            device.state = State::DONE;
+        } else if (code == CHECKSUM_FAILED && device.checksum_retries_left-- > 0) {
+            // The device is ready for the whole payload again on the same connection
+            printf("%s: checksum failed, retrying\n", device.host.c_str());
+            device.sent = 0;
+            device.resumed = 0;
+            device.payload_start = Clock::now();
+            device.state = State::SENDING;
+            device.response_len = 0;
+            watch(device, EPOLLIN | EPOLLOUT);
+        } else {
+            fail(device, error_name(code));
+        }
+    }
+
+    void receive(Device& device) {
+        size_t expected = device.state == State::AWAIT_RESUME ? RESUME_RESPONSE_SIZE : RESPONSE_SIZE;
+        ssize_t received = recv(device.fd, device.response + device.response_len, expected - device.response_len, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EAGAIN) {
+                return;
+            }
+            printf("%s: disconnected, reconnecting\n", device.host.c_str());
+            reconnect(device, RETRY_DELAY);
+            return;
+        }
+
+        device.response_len += received;
+        if (device.response_len < expected) {
+            return;
+        }
+
+        if (memcmp(device.response, "OTA\n", 4) != 0) {
+            fail(device, "bad response");
+            return;
+        }
+        handle_response(device, device.response[4]);
+    }
+
+    void handle_event(Device& device, uint32_t events) {
+        device.last_activity = Clock::now();
+
+        if (device.state == State::CONNECTING) {
+            send_request(device);
+            return;
+        }
+
+        // A response while sending means the device gave up on the payload
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            receive(device);
+        }
+        if (device.state == State::SENDING && (events & EPOLLOUT)) {
+            send_payload(device);
+        }
+    }
+
+    const Image& image_;
+    std::vector<Device>& devices_;
+    int epoll_fd_;
+    int beacon_fd_ = -1;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bool force = false;
+    std::vector<const char*> args;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--force") == 0) {
+            force = true;
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (args.size() < 2) {
+        fprintf(stderr, "usage: %s [--force] <user_program_name>.bin <addr1> [.. <addrN>]\n", argv[0]);
+        return 2;
+    }
+
+    Image image;
+    if (!map_image(args[0], &image)) {
+        fprintf(stderr, "failed to map %s: %s\n", args[0], strerror(errno));
+        return 1;
+    }
+    printf("%s: %zu bytes, checksum %08x\n", args[0], image.size, image.checksum);
+
+    std::vector<Device> devices;
+    for (size_t i = 1; i < args.size(); i++) {
+        Device device;
+        device.host = args[i];
+        if (!resolve(device.host, &device.addr)) {
+            fprintf(stderr, "%s: could not resolve\n", args[i]);
+            continue;
+        }
+        device.connect_at = Clock::now();
+        devices.push_back(device);
+    }
+
+    if (!force) {
+        skip_up_to_date(image, devices);
+    }
+
+    auto start = Clock::now();
+    int failed = Uploader(image, devices).run();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    size_t requested = args.size() - 1;
+    size_t up_to_date = std::count_if(devices.begin(), devices.end(), [](const Device& device) {
+        return device.up_to_date;
+    });
+    printf(
+        "%zu of %zu devices flashed, %zu already up to date, in %.2f s\n",
+        devices.size() - failed - up_to_date, requested, up_to_date, seconds);
+    return failed || devices.size() != requested ? 1 : 0;
+}
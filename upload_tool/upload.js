@@ -1,3 +1,4 @@
+const dgram = require('dgram');
 const net = require('net');
 const { Buffer } = require('buffer');
 const { readFileSync } = require('fs');
@@ -5,6 +6,8 @@ const { argv } = require('process');
 
 const crc32 = require('buffer-crc32');
 
+const lzss = require('./lzss');
+
 // TODO: organize/clean up..
 
 const ErrorCode = {
@@ -12,13 +15,56 @@ const ErrorCode = {
   STORAGE_FULL: 1,
   CHECKSUM_FAILED: 2,
   REBOOTING: 3,
+  BASE_MISMATCH: 4,
+  WRITE_FAILED: 5,
+  WRONG_SLOT: 6,
+  MULTICAST_UNAVAILABLE: 7,
+  BUSY: 8,
 };
 
+const OTA_PORT = 2222;
+// Ready beacons broadcast by the device once its OTA server listens (see ota_discovery.h)
+const DISCOVERY_PORT = 2224;
+// Time to wait for a rebooting device's beacon before connecting anyway, for bootloaders which do
+// not send one
+const BEACON_TIMEOUT_MS = 15000;
+// Reconnects after the device answers that it is rebooting into the bootloader
+const MAX_REBOOTS = 2;
+// Time to wait for the device to say what it is running, before sending the binary anyway
+const DISCOVERY_TIMEOUT_MS = 1000;
+
+// Final character of the request magic code
+const RequestType = {
+  IMAGE: '\n',
+  COMPRESSED: 'Z',
+  CHUNKED: 'C',
+};
+
+// Chunks are one flash sector, each preceded by its offset, length and checksum
+const CHUNK_SIZE = 4096;
+const CHUNK_RESPONSE_SIZE = 9;
+// Chunks sent ahead of the device's acknowledgements. After a rejected chunk, the device skips those
+// already in flight, so this bounds what the rejection costs
+const CHUNK_WINDOW = 4;
+
+function packChunk(buf, offset) {
+  const data = buf.subarray(offset, offset + CHUNK_SIZE);
+  const header = Buffer.alloc(12);
+  header.writeUInt32LE(offset, 0);
+  header.writeUInt32LE(data.length, 4);
+  header.writeUInt32LE(crc32.unsigned(data), 8);
+  return Buffer.concat([header, data]);
+}
+
 function packRequest(request) {
-  const buf = Buffer.alloc(12);
-  buf.write('OTA\n');
+  const compressed = request.type == RequestType.COMPRESSED;
+  const buf = Buffer.alloc(compressed ? 16 : 12);
+  buf.write('OTA' + (request.type || RequestType.IMAGE));
   buf.writeUInt32LE(request.payloadSize, 4);
   buf.writeUInt32LE(request.checksum || 0, 8);
+  if (compressed) {
+    buf.writeUInt32LE(request.imageSize, 12);
+  }
   return buf;
 }
 
@@ -32,23 +78,186 @@ function getResponseStatus(buf) {
   return error;
 }
 
+// User programs send beacons too, but only the bootloader's means the reboot is done
+function isBootloaderBeacon(buf) {
+  return buf.length >= 7 && buf.toString('latin1', 0, 4) == 'OTDR' && buf.readUInt8(6) != 0;
+}
+
+// Calls back once the device at address has rebooted into the bootloader and is listening again
+function waitForBeacon(address, callback) {
+  const beacons = dgram.createSocket({ type: 'udp4', reuseAddr: true });
+  let listening = true;
+  let done = false;
+
+  function finish(message) {
+    if (done) {
+      return;
+    }
+    done = true;
+    clearTimeout(timer);
+    if (listening) {
+      beacons.close();
+    }
+    console.log(message);
+    callback();
+  }
+
+  const timer = setTimeout(() => finish('No ready beacon, connecting anyway'), BEACON_TIMEOUT_MS);
+  beacons.on('message', function(msg, rinfo) {
+    if (rinfo.address == address && isBootloaderBeacon(msg)) {
+      finish('Bootloader is ready');
+    }
+  });
+  beacons.on('error', function(err) {
+    console.log('Cannot listen for ready beacons:', err.message);
+    listening = false;
+    beacons.close();
+  });
+  beacons.bind(DISCOVERY_PORT);
+}
+
+// Calls back with the size and checksum of the image the device is running, or null if it did not
+// answer (see ota_discovery.h)
+function queryDevice(address, callback) {
+  const query = dgram.createSocket('udp4');
+  let done = false;
+
+  function finish(info) {
+    if (done) {
+      return;
+    }
+    done = true;
+    clearTimeout(timer);
+    query.close();
+    callback(info);
+  }
+
+  const timer = setTimeout(() => finish(null), DISCOVERY_TIMEOUT_MS);
+  query.on('message', function(msg) {
+    if (msg.length >= 32 && msg.toString('latin1', 0, 4) == 'OTDI') {
+      finish({ imageSize: msg.readUInt32LE(20), checksum: msg.readUInt32LE(24) });
+    }
+  });
+  query.on('error', () => finish(null));
+  query.send('OTDQ', DISCOVERY_PORT, address);
+}
+
 // TODO: check argv length, print usage
 
-const fileBuffer = readFileSync(argv[3]);
+const compress = argv.includes('--compress');
+const chunked = argv.includes('--chunked');
+const force = argv.includes('--force');
+const [host, binPath] = argv.slice(2).filter((arg) => !arg.startsWith('--'));
+
+const fileBuffer = readFileSync(binPath);
 const checksum = crc32.unsigned(fileBuffer);
+const payload = compress ? lzss.compress(fileBuffer) : fileBuffer;
 let allowedRetries = 3;
+let allowedReboots = MAX_REBOOTS;
 let payloadSent = false;
 
-console.log('Connecting to', argv[2]);
-const socket = new net.Socket();
-socket.connect(2222, argv[2], function() {
-  console.log('Connected');
-  socket.write(packRequest({payloadSize: fileBuffer.length, checksum}));
-});
+if (compress) {
+  console.log('Compressed', fileBuffer.length, 'bytes to', payload.length);
+}
+
+// Chunk responses carry an offset: how far the image has been committed, where a rejected chunk
+// starts, or the image size for the result of the whole upload
+let pending = Buffer.alloc(0);
+let committed = 0;
+let nextChunk = 0;
+
+let socket;
+
+function connect() {
+  payloadSent = false;
+  pending = Buffer.alloc(0);
+  committed = 0;
+  nextChunk = 0;
+
+  console.log('Connecting to', host);
+  socket = new net.Socket();
+  socket.connect(OTA_PORT, host, function() {
+    console.log('Connected');
+    socket.write(packRequest({
+      type: compress ? RequestType.COMPRESSED : (chunked ? RequestType.CHUNKED : RequestType.IMAGE),
+      payloadSize: payload.length,
+      checksum,
+      imageSize: fileBuffer.length,
+    }));
+  });
+  socket.on('data', onData);
+  socket.on('close', function() {
+    console.log('Connection closed');
+  });
+}
+
+function sendChunks() {
+  while (nextChunk < fileBuffer.length && nextChunk < committed + CHUNK_WINDOW * CHUNK_SIZE) {
+    socket.write(packChunk(fileBuffer, nextChunk));
+    nextChunk += CHUNK_SIZE;
+  }
+}
+
+function sendChunksFrom(offset) {
+  committed = offset;
+  nextChunk = offset;
+  sendChunks();
+}
 
-socket.on('data', function(data) {
+function onChunkResponse(data) {
   const status = getResponseStatus(data);
+  const offset = data.readUInt32LE(5);
+
+  if (!payloadSent) {
+    if (status == ErrorCode.SUCCESS) {
+      console.log(offset ? `Request approved, resuming at byte ${offset}` : 'Request approved, sending chunks');
+      payloadSent = true;
+      sendChunksFrom(offset);
+      return;
+    }
+  } else if (offset < fileBuffer.length) {
+    if (status == ErrorCode.SUCCESS) {
+      committed = Math.max(committed, offset);
+      sendChunks();
+    } else if (status == ErrorCode.CHECKSUM_FAILED) {
+      // The device skips the chunks already in flight until this one arrives again
+      console.log(`Chunk at byte ${offset} failed checksum, sending again from there`);
+      sendChunksFrom(offset);
+    } else {
+      console.log(`Unknown error code for chunk at byte ${offset}: ${status}`);
+      socket.destroy();
+    }
+    return;
+  } else if (status == ErrorCode.CHECKSUM_FAILED) {
+    // Only a whole-image mismatch gets here, after which the device starts over
+    console.log('Checksum failed');
+    if (allowedRetries > 0) {
+      allowedRetries--;
+      console.log('Retrying');
+      sendChunksFrom(0);
+    } else {
+      socket.destroy();
+    }
+    return;
+  }
 
+  onResponse(status);
+}
+
+function onData(data) {
+  if (!chunked) {
+    onResponse(getResponseStatus(data));
+    return;
+  }
+
+  pending = Buffer.concat([pending, data]);
+  while (pending.length >= CHUNK_RESPONSE_SIZE) {
+    onChunkResponse(pending.subarray(0, CHUNK_RESPONSE_SIZE));
+    pending = pending.subarray(CHUNK_RESPONSE_SIZE);
+  }
+}
+
+function onResponse(status) {
   switch (status) {
   case ErrorCode.SUCCESS:
     if (payloadSent) {
@@ -56,7 +265,7 @@ socket.on('data', function(data) {
       socket.destroy();
     } else {
       console.log('Request approved, sending payload');
-      socket.write(fileBuffer);
+      socket.write(payload);
       payloadSent = true;
     }
     break;
@@ -69,14 +278,33 @@ socket.on('data', function(data) {
     if (allowedRetries > 0) {
       allowedRetries--;
       console.log('Retrying');
-      socket.write(fileBuffer);
+      socket.write(payload);
     } else {
       socket.destroy();
     }
     break;
+  case ErrorCode.WRITE_FAILED:
+    console.log('Failed: flash could not be written');
+    socket.destroy();
+    break;
+  case ErrorCode.WRONG_SLOT:
+    console.log('Failed: binary was not built for the slot being written (see flash.py --slot-b)');
+    socket.destroy();
+    break;
+  case ErrorCode.BUSY:
+    console.log('Failed: target is busy with another upload');
+    socket.destroy();
+    break;
   case ErrorCode.REBOOTING:
-    // TODO: automatic reconnect
-    console.log('Target needs to reboot');
+    if (allowedReboots > 0) {
+      allowedReboots--;
+      console.log('Target is rebooting into the bootloader, waiting for it to be ready');
+      // Listen before the device disconnects and reboots, so that its beacon cannot be missed
+      const address = socket.remoteAddress;
+      waitForBeacon(address, connect);
+    } else {
+      console.log('Failed: target keeps rebooting');
+    }
     socket.destroy();
     break;
   default:
@@ -84,8 +312,12 @@ socket.on('data', function(data) {
     socket.destroy();
     break;
   }
-});
+}
 
-socket.on('close', function() {
-  console.log('Connection closed');
+queryDevice(host, function(info) {
+  if (info && !force && info.imageSize == fileBuffer.length && info.checksum == checksum) {
+    console.log('Target is already running this binary (see --force)');
+    return;
+  }
+  connect();
 });